@@ -42,6 +42,7 @@ Example:
 This will launch QEMU with:
   - 32-bit OVMF UEFI firmware
   - 512MB RAM
+  - \$SMP processors (default 1; e.g. SMP=4 for the multi-core donut)
   - Serial console output
   - Graphics console
 
@@ -53,6 +54,7 @@ EOF
 
 # Parse arguments
 ISO_FILE="${1:-out/ascii-os.iso}"
+SMP="${SMP:-1}"
 
 if [ "$1" == "--help" ] || [ "$1" == "-h" ]; then
     usage
@@ -128,6 +130,7 @@ qemu-system-i386 \
     -bios "$OVMF_CODE" \
     -cdrom "$ISO_FILE" \
     -m 512M \
+    -smp "$SMP" \
     -serial stdio \
     -display gtk \
     -vga std \
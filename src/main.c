@@ -40,544 +40,11292 @@ UINTN notepad_lines = 0;
 UINTN notepad_cursor_line = 0;
 UINTN notepad_cursor_col = 0;
 
-/* Simple math expression evaluator */
-INTN evaluate_expression(CHAR16 *expr) {
-    INTN result = 0;
-    INTN current_num = 0;
-    CHAR16 op = L'+';
+/*
+ * Calculator expression engine
+ *
+ * Expressions are compiled by a Pratt (precedence climbing) parser into a
+ * compact bytecode for a small stack machine, then executed. Compiled
+ * programs are kept in a small cache keyed by the expression text, so
+ * re-evaluating an entry from the history skips parsing entirely.
+ *
+ * Values are 64-bit even on IA32, where INTN is only 32 bits wide. Add,
+ * subtract and multiply use the compiler's overflow builtins, which lower
+ * to add/adc or mul followed by a carry/overflow flag test, so overflow is
+ * reported instead of silently wrapping.
+ *
+ * In decimal mode the same bytecode operates on fixed-point values (see
+ * calc_run_decimal). The scale is fixed when an expression is compiled, so
+ * the cache is keyed by the number of digits as well as the text.
+ *
+ * Names live in an open-addressing symbol table. Variables are read and
+ * written by slot index at run time, and a user function's body is
+ * compiled once into its own program, so calling it pushes a frame and
+ * jumps into that bytecode instead of parsing the body again.
+ */
+#define CALC_MAX_INPUT   128
+#define CALC_MAX_CODE    128
+#define CALC_MAX_CONSTS  32
+#define CALC_MAX_STACK   32
+#define CALC_MAX_NESTING 24
+#define CALC_CACHE_SIZE  8
+#define CALC_HISTORY_SIZE 16
+#define CALC_MAX_DIGITS  15       /* Fraction digits in decimal mode */
+#define CALC_DEFAULT_DIGITS 6
+#define CALC_MAX_NAME    8
+#define CALC_MAX_PARAMS  8
+#define CALC_MAX_FRAMES  16       /* Nested user function calls */
+#define CALC_VM_STACK    128      /* Stack slots shared by all frames */
+#define CALC_SYMBOL_SLOTS 64      /* Power of two */
+#define CALC_MAX_SYMBOLS 48       /* Keep the table at most 3/4 full */
+
+/* Binding powers for the Pratt parser (higher binds tighter) */
+#define CALC_BP_NONE    0
+#define CALC_BP_SUM     10
+#define CALC_BP_PRODUCT 20
+#define CALC_BP_UNARY   30
+#define CALC_BP_POWER   40
+#define CALC_BP_POSTFIX 50
+
+typedef enum {
+    CALC_OK = 0,
+    CALC_ERR_SYNTAX,
+    CALC_ERR_DIV_ZERO,
+    CALC_ERR_TOO_LONG,
+    CALC_ERR_OVERFLOW,
+    CALC_ERR_DOMAIN,
+    CALC_ERR_TOO_LARGE,
+    CALC_ERR_DECIMAL_ONLY,
+    CALC_ERR_UNKNOWN_NAME,
+    CALC_ERR_RESERVED,
+    CALC_ERR_TOO_MANY_NAMES,
+    CALC_ERR_SHAPE,
+    CALC_ERR_SINGULAR,
+    CALC_DEFINED              /* Not an error: the input defined a function */
+} CALC_ERROR;
+
+/*
+ * Stack machine opcodes. OP_PUSH and OP_PUSH_BIG take a one-byte constant
+ * pool index; for OP_PUSH_BIG the constant packs the offset and length of
+ * a literal too wide for 64 bits inside the program's digit pool. OP_CALL
+ * takes a one-byte CALC_FUNCTION_ID and is only emitted in decimal mode.
+ * OP_LOAD and OP_STORE take a symbol slot, OP_ARG a parameter index, and
+ * OP_CALL_USER a symbol slot and an argument count; OP_RET ends a
+ * function body as OP_END ends an expression.
+ */
+typedef enum {
+    OP_END = 0,
+    OP_PUSH,
+    OP_PUSH_BIG,
+    OP_NEG,
+    OP_FACT,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_MOD,
+    OP_POW,
+    OP_CALL,
+    OP_LOAD,
+    OP_STORE,
+    OP_ARG,
+    OP_CALL_USER,
+    OP_RET
+} CALC_OPCODE;
+
+/* Built-in functions and constants, indexing calc_functions */
+typedef enum {
+    CALC_FN_PI = 0,
+    CALC_FN_E,
+    CALC_FN_SQRT,
+    CALC_FN_EXP,
+    CALC_FN_LN,
+    CALC_FN_LOG,
+    CALC_FN_SIN,
+    CALC_FN_COS,
+    CALC_FN_TAN,
+    CALC_FN_COUNT
+} CALC_FUNCTION_ID;
+
+typedef struct {
+    CHAR16 *name;
+    UINTN arity;      /* 0 for constants, 1 for functions */
+} CALC_FUNCTION;
+
+CALC_FUNCTION calc_functions[CALC_FN_COUNT] = {
+    { L"pi", 0 }, { L"e", 0 }, { L"sqrt", 1 }, { L"exp", 1 }, { L"ln", 1 },
+    { L"log", 1 }, { L"sin", 1 }, { L"cos", 1 }, { L"tan", 1 }
+};
+
+/* Powers of ten up to 10^18, the largest that fits in INT64 */
+CONST UINT64 calc_pow10[19] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+    100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL,
+    10000000000000ULL, 100000000000000ULL, 1000000000000000ULL,
+    10000000000000000ULL, 100000000000000000ULL, 1000000000000000000ULL
+};
+
+/* Native translation of a program: fills *result or returns the error */
+typedef CALC_ERROR (*CALC_JIT_FN)(INT64 *result);
+
+typedef struct {
+    UINT8 code[CALC_MAX_CODE];
+    UINTN code_len;
+    INT64 consts[CALC_MAX_CONSTS];
+    UINTN const_count;
+    CHAR8 digits[CALC_MAX_INPUT];
+    UINTN digit_count;
+    UINTN max_depth;  /* Deepest stack use, checked on function entry */
+    CALC_JIT_FN jit;  /* Native code for the program, or NULL to interpret it */
+} CALC_PROGRAM;
+
+typedef enum {
+    CALC_SYM_EMPTY = 0,
+    CALC_SYM_UNSET,       /* Named by an assignment that has not run yet */
+    CALC_SYM_BUILTIN,
+    CALC_SYM_VARIABLE,
+    CALC_SYM_FUNCTION
+} CALC_SYMBOL_KIND;
+
+typedef struct {
+    CALC_SYMBOL_KIND kind;
+    UINT32 hash;
+    CHAR16 name[CALC_MAX_NAME + 1];
+    UINTN builtin;                /* CALC_FUNCTION_ID of a built-in */
+    INT64 value;                  /* Variable value, scaled by 10^digits */
+    UINTN digits;
+    UINTN arity;
+    CHAR16 params[CALC_MAX_PARAMS][CALC_MAX_NAME + 1];
+    CHAR16 body_text[CALC_MAX_INPUT];
+    CALC_ERROR body_error;        /* Result of compiling the body */
+    CALC_PROGRAM body;
+} CALC_SYMBOL;
+
+CALC_SYMBOL calc_symbols[CALC_SYMBOL_SLOTS];
+UINTN calc_symbol_count = 0;
+UINTN calc_body_digits = 0;       /* Scale the function bodies are compiled for */
+
+/* Saved caller state for a user function call */
+typedef struct {
+    CALC_PROGRAM *prog;
+    UINT8 *pc;
+    UINTN base;
+} CALC_FRAME;
+
+typedef struct {
+    CHAR16 *src;
+    UINTN pos;
+    UINTN depth;      /* Current simulated stack depth */
+    UINTN nesting;    /* Recursion depth of parse_expr */
+    UINTN digits;     /* Fraction digits; 0 compiles integer code */
+    CHAR16 (*params)[CALC_MAX_NAME + 1];  /* Parameters of the body being compiled */
+    UINTN param_count;
+    CALC_ERROR error;
+    CALC_PROGRAM *prog;
+} CALC_PARSER;
+
+typedef struct {
+    BOOLEAN valid;
+    UINT32 hash;
+    UINTN last_used;
+    UINTN digits;
+    CHAR16 text[CALC_MAX_INPUT];
+    CALC_PROGRAM prog;
+} CALC_CACHE_ENTRY;
+
+CALC_CACHE_ENTRY calc_cache[CALC_CACHE_SIZE];
+UINTN calc_cache_clock = 0;
+
+/* Human readable text for a calculator error */
+CHAR16 *calc_error_text(CALC_ERROR error) {
+    switch (error) {
+    case CALC_ERR_SYNTAX:   return L"Syntax error";
+    case CALC_ERR_DIV_ZERO: return L"Division by zero";
+    case CALC_ERR_TOO_LONG: return L"Expression too complex";
+    case CALC_ERR_OVERFLOW: return L"Overflow (exceeds 64 bits)";
+    case CALC_ERR_DOMAIN:   return L"Invalid argument";
+    case CALC_ERR_TOO_LARGE: return L"Result too large";
+    case CALC_ERR_DECIMAL_ONLY: return L"Needs decimal mode (F2)";
+    case CALC_ERR_UNKNOWN_NAME: return L"Unknown name";
+    case CALC_ERR_RESERVED: return L"Cannot redefine a built-in";
+    case CALC_ERR_TOO_MANY_NAMES: return L"Too many names";
+    case CALC_ERR_SHAPE:    return L"Matrix sizes do not match";
+    case CALC_ERR_SINGULAR: return L"Matrix is singular";
+    case CALC_DEFINED:      return L"Function defined";
+    default:                return L"OK";
+    }
+}
+
+/* FNV-1a hash of len characters, for symbol names and cache keys */
+UINT32 calc_hash_n(CHAR16 *text, UINTN len) {
+    UINT32 hash = 2166136261u;
+    for (UINTN i = 0; i < len; i++) {
+        hash ^= text[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Length of the name starting at text: a letter or '_', then alphanumerics */
+UINTN calc_name_length(CHAR16 *text) {
+    UINTN len = 0;
+
+    while ((text[len] >= L'a' && text[len] <= L'z') ||
+           (text[len] >= L'A' && text[len] <= L'Z') || text[len] == L'_' ||
+           (len > 0 && text[len] >= L'0' && text[len] <= L'9')) {
+        len++;
+    }
+    return len;
+}
+
+BOOLEAN calc_symbols_ready = FALSE;
+CALC_SYMBOL *calc_symbol_find(CHAR16 *name, UINTN len, UINT32 hash, BOOLEAN create);
+
+/* Enter the built-in functions and constants on first use */
+VOID calc_symbols_init(VOID) {
+    calc_symbols_ready = TRUE;
+    for (UINTN fn = 0; fn < CALC_FN_COUNT; fn++) {
+        CHAR16 *name = calc_functions[fn].name;
+        UINTN len = StrLen(name);
+        CALC_SYMBOL *sym = calc_symbol_find(name, len, calc_hash_n(name, len), TRUE);
+        sym->kind = CALC_SYM_BUILTIN;
+        sym->builtin = fn;
+    }
+}
+
+/*
+ * Look a name up by linear probing from its hash. With create set, a
+ * missing name claims the empty slot that ended the probe; the table never
+ * deletes, so an empty slot always ends a search. Returns NULL if the name
+ * is absent, or when creating and the table is full.
+ */
+CALC_SYMBOL *calc_symbol_find(CHAR16 *name, UINTN len, UINT32 hash, BOOLEAN create) {
+    UINTN slot = hash & (CALC_SYMBOL_SLOTS - 1);
+
+    if (!calc_symbols_ready) calc_symbols_init();
+
+    for (;;) {
+        CALC_SYMBOL *sym = &calc_symbols[slot];
+        if (sym->kind == CALC_SYM_EMPTY) {
+            if (!create || calc_symbol_count >= CALC_MAX_SYMBOLS) return NULL;
+            sym->kind = CALC_SYM_UNSET;
+            sym->hash = hash;
+            for (UINTN i = 0; i < len; i++) sym->name[i] = name[i];
+            sym->name[len] = 0;
+            calc_symbol_count++;
+            return sym;
+        }
+        if (sym->hash == hash && StrLen(sym->name) == len && StrnCmp(sym->name, name, len) == 0) {
+            return sym;
+        }
+        slot = (slot + 1) & (CALC_SYMBOL_SLOTS - 1);
+    }
+}
+
+/* Skip whitespace and return the next significant character */
+CHAR16 calc_peek(CALC_PARSER *p) {
+    while (p->src[p->pos] == L' ') p->pos++;
+    return p->src[p->pos];
+}
+
+/* Append one byte of bytecode */
+VOID calc_emit(CALC_PARSER *p, UINT8 byte) {
+    if (p->prog->code_len >= CALC_MAX_CODE - 1) {
+        p->error = CALC_ERR_TOO_LONG;
+        return;
+    }
+    p->prog->code[p->prog->code_len++] = byte;
+}
+
+/* Account for one more value on the simulated stack */
+VOID calc_grow_stack(CALC_PARSER *p) {
+    if (++p->depth > CALC_MAX_STACK) p->error = CALC_ERR_TOO_LONG;
+    if (p->depth > p->prog->max_depth) p->prog->max_depth = p->depth;
+}
+
+/* Emit an opcode and track the resulting stack depth */
+VOID calc_emit_op(CALC_PARSER *p, UINT8 op) {
+    calc_emit(p, op);
+    if (op == OP_PUSH || op == OP_PUSH_BIG || op == OP_LOAD || op == OP_ARG) {
+        calc_grow_stack(p);
+    } else if (op != OP_NEG && op != OP_FACT && op != OP_CALL && op != OP_STORE) {
+        p->depth--;
+    }
+}
+
+VOID calc_emit_const(CALC_PARSER *p, UINT8 op, INT64 value) {
+    if (p->prog->const_count >= CALC_MAX_CONSTS) {
+        p->error = CALC_ERR_TOO_LONG;
+        return;
+    }
+    calc_emit_op(p, op);
+    calc_emit(p, (UINT8)p->prog->const_count);
+    p->prog->consts[p->prog->const_count++] = value;
+}
+
+/* Infix binding power and opcode for an operator character */
+UINTN calc_infix_bp(CHAR16 c, UINT8 *op) {
+    switch (c) {
+    case L'+': *op = OP_ADD; return CALC_BP_SUM;
+    case L'-': *op = OP_SUB; return CALC_BP_SUM;
+    case L'*': *op = OP_MUL; return CALC_BP_PRODUCT;
+    case L'/': *op = OP_DIV; return CALC_BP_PRODUCT;
+    case L'%': *op = OP_MOD; return CALC_BP_PRODUCT;
+    case L'^': *op = OP_POW; return CALC_BP_POWER;
+    default:   return CALC_BP_NONE;
+    }
+}
+
+/*
+ * Parse a numeric literal. Integer literals too wide for 64 bits go to the
+ * digit pool; in decimal mode literals are scaled by 10^digits here, with
+ * excess fraction digits rounded, so the VM never parses text.
+ */
+VOID calc_parse_number(CALC_PARSER *p) {
+    UINTN start = p->pos;
+    INT64 value = 0;
+    INT64 frac = 0;
+    UINTN frac_digits = 0;
+    BOOLEAN round_up = FALSE;
+    BOOLEAN wide = FALSE;
+
+    while (p->src[p->pos] >= L'0' && p->src[p->pos] <= L'9') {
+        if (__builtin_mul_overflow(value, 10, &value) ||
+            __builtin_add_overflow(value, p->src[p->pos] - L'0', &value)) {
+            wide = TRUE;
+        }
+        p->pos++;
+    }
+
+    if (p->src[p->pos] == L'.') {
+        if (p->digits == 0) {
+            p->error = CALC_ERR_DECIMAL_ONLY;
+            return;
+        }
+        p->pos++;
+        while (p->src[p->pos] >= L'0' && p->src[p->pos] <= L'9') {
+            if (frac_digits < p->digits) {
+                frac = frac * 10 + (p->src[p->pos] - L'0');
+            } else if (frac_digits == p->digits) {
+                round_up = p->src[p->pos] >= L'5';
+            }
+            frac_digits++;
+            p->pos++;
+        }
+        if (p->pos == start + 1) {
+            /* A lone '.' */
+            p->error = CALC_ERR_SYNTAX;
+            return;
+        }
+        if (frac_digits < p->digits) frac *= (INT64)calc_pow10[p->digits - frac_digits];
+    }
+
+    if (p->digits != 0) {
+        if (wide ||
+            __builtin_mul_overflow(value, (INT64)calc_pow10[p->digits], &value) ||
+            __builtin_add_overflow(value, frac + round_up, &value)) {
+            p->error = CALC_ERR_OVERFLOW;
+            return;
+        }
+        calc_emit_const(p, OP_PUSH, value);
+    } else if (wide) {
+        /* Keep the digits for the arbitrary-precision evaluator */
+        UINTN len = p->pos - start;
+        CALC_PROGRAM *prog = p->prog;
+        if (prog->digit_count + len > CALC_MAX_INPUT) {
+            p->error = CALC_ERR_TOO_LONG;
+            return;
+        }
+        for (UINTN i = 0; i < len; i++) {
+            prog->digits[prog->digit_count + i] = (CHAR8)p->src[start + i];
+        }
+        calc_emit_const(p, OP_PUSH_BIG, ((INT64)prog->digit_count << 16) | len);
+        prog->digit_count += len;
+    } else {
+        calc_emit_const(p, OP_PUSH, value);
+    }
+}
+
+VOID calc_parse_expr(CALC_PARSER *p, UINTN min_bp);
+
+/* Parse a parameter, variable, constant, or a call such as sqrt(x) or f(a, b) */
+VOID calc_parse_name(CALC_PARSER *p) {
+    CHAR16 *name = p->src + p->pos;
+    UINTN len = calc_name_length(name);
+    CALC_SYMBOL *sym;
+    UINTN argc = 0;
+
+    p->pos += len;
+    if (len > CALC_MAX_NAME) {
+        p->error = CALC_ERR_UNKNOWN_NAME;
+        return;
+    }
+
+    /* Parameters shadow global names inside a function body */
+    for (UINTN i = 0; i < p->param_count; i++) {
+        if (StrLen(p->params[i]) == len && StrnCmp(p->params[i], name, len) == 0) {
+            calc_emit_op(p, OP_ARG);
+            calc_emit(p, (UINT8)i);
+            return;
+        }
+    }
+
+    sym = calc_symbol_find(name, len, calc_hash_n(name, len), FALSE);
+    if (sym == NULL || sym->kind == CALC_SYM_UNSET) {
+        p->error = CALC_ERR_UNKNOWN_NAME;
+        return;
+    }
+    if (sym->kind == CALC_SYM_VARIABLE) {
+        calc_emit_op(p, OP_LOAD);
+        calc_emit(p, (UINT8)(sym - calc_symbols));
+        return;
+    }
+    if (sym->kind == CALC_SYM_BUILTIN) {
+        if (p->digits == 0) {
+            p->error = CALC_ERR_DECIMAL_ONLY;
+            return;
+        }
+        if (calc_functions[sym->builtin].arity == 0) {
+            calc_grow_stack(p);
+            calc_emit_op(p, OP_CALL);
+            calc_emit(p, (UINT8)sym->builtin);
+            return;
+        }
+    }
+
+    /* Argument list */
+    if (calc_peek(p) != L'(') {
+        p->error = CALC_ERR_SYNTAX;
+        return;
+    }
+    p->pos++;
+    if (calc_peek(p) != L')') {
+        for (;;) {
+            calc_parse_expr(p, CALC_BP_NONE);
+            if (p->error != CALC_OK) return;
+            argc++;
+            if (calc_peek(p) != L',') break;
+            p->pos++;
+        }
+    }
+    if (calc_peek(p) != L')') {
+        p->error = CALC_ERR_SYNTAX;
+        return;
+    }
+    p->pos++;
+
+    if (sym->kind == CALC_SYM_BUILTIN) {
+        if (argc != 1) {
+            p->error = CALC_ERR_SYNTAX;
+            return;
+        }
+        calc_emit_op(p, OP_CALL);
+        calc_emit(p, (UINT8)sym->builtin);
+    } else {
+        if (argc != sym->arity) {
+            p->error = CALC_ERR_SYNTAX;
+            return;
+        }
+        /* The arguments become the callee's frame; one result replaces them */
+        calc_emit(p, OP_CALL_USER);
+        calc_emit(p, (UINT8)(sym - calc_symbols));
+        calc_emit(p, (UINT8)argc);
+        p->depth -= argc;
+        calc_grow_stack(p);
+    }
+}
+
+/* Parse an expression whose operators bind tighter than min_bp */
+VOID calc_parse_expr(CALC_PARSER *p, UINTN min_bp) {
+    CHAR16 c;
+    UINT8 op;
+    UINTN bp;
+
+    if (++p->nesting > CALC_MAX_NESTING) {
+        p->error = CALC_ERR_TOO_LONG;
+        return;
+    }
+
+    /* Prefix position: number, name, parenthesised group or unary sign */
+    c = calc_peek(p);
+    if ((c >= L'0' && c <= L'9') || c == L'.') {
+        calc_parse_number(p);
+    } else if (calc_name_length(p->src + p->pos) > 0) {
+        calc_parse_name(p);
+    } else if (c == L'(') {
+        p->pos++;
+        calc_parse_expr(p, CALC_BP_NONE);
+        if (p->error != CALC_OK) return;
+        if (calc_peek(p) != L')') {
+            p->error = CALC_ERR_SYNTAX;
+            return;
+        }
+        p->pos++;
+    } else if (c == L'-') {
+        p->pos++;
+        calc_parse_expr(p, CALC_BP_UNARY);
+        calc_emit_op(p, OP_NEG);
+    } else if (c == L'+') {
+        p->pos++;
+        calc_parse_expr(p, CALC_BP_UNARY);
+    } else {
+        p->error = CALC_ERR_SYNTAX;
+        return;
+    }
+
+    /* Infix loop: '^' is right associative, the others left associative */
+    while (p->error == CALC_OK) {
+        c = calc_peek(p);
+        if (c == L'!') {
+            if (CALC_BP_POSTFIX <= min_bp) break;
+            p->pos++;
+            calc_emit_op(p, OP_FACT);
+            continue;
+        }
+        bp = calc_infix_bp(c, &op);
+        if (bp <= min_bp) break;
+        p->pos++;
+        calc_parse_expr(p, op == OP_POW ? bp - 1 : bp);
+        calc_emit_op(p, op);
+    }
+
+    p->nesting--;
+}
+
+/*
+ * Compile an expression into bytecode; digits > 0 selects decimal mode.
+ * With params set this compiles a function body ending in OP_RET;
+ * otherwise the input may be an assignment, name = expression.
+ */
+CALC_ERROR calc_compile(CHAR16 *expr, UINTN digits, CHAR16 (*params)[CALC_MAX_NAME + 1],
+                        UINTN param_count, CALC_PROGRAM *prog) {
+    CALC_PARSER parser;
+    CHAR16 *target = NULL;
+    UINTN target_len = 0;
+
+    prog->code_len = 0;
+    prog->const_count = 0;
+    prog->digit_count = 0;
+    prog->max_depth = 0;
+    prog->jit = NULL;
+
+    parser.src = expr;
+    parser.pos = 0;
+    parser.depth = 0;
+    parser.nesting = 0;
+    parser.digits = digits;
+    parser.params = params;
+    parser.param_count = param_count;
+    parser.error = CALC_OK;
+    parser.prog = prog;
+
+    if (params == NULL) {
+        UINTN after;
+        calc_peek(&parser);
+        target_len = calc_name_length(expr + parser.pos);
+        after = parser.pos + target_len;
+        while (expr[after] == L' ') after++;
+        if (target_len > 0 && expr[after] == L'=') {
+            target = expr + parser.pos;
+            parser.pos = after + 1;
+        }
+    }
+
+    calc_parse_expr(&parser, CALC_BP_NONE);
+    if (parser.error == CALC_OK && calc_peek(&parser) != 0) {
+        parser.error = CALC_ERR_SYNTAX;
+    }
+
+    if (parser.error == CALC_OK && target != NULL && target_len > CALC_MAX_NAME) {
+        parser.error = CALC_ERR_SYNTAX;
+    }
+    if (parser.error == CALC_OK && target != NULL) {
+        /* The slot is claimed now; the variable is only set when this runs */
+        CALC_SYMBOL *sym = calc_symbol_find(target, target_len, calc_hash_n(target, target_len), TRUE);
+        if (sym == NULL) {
+            parser.error = CALC_ERR_TOO_MANY_NAMES;
+        } else if (sym->kind == CALC_SYM_BUILTIN) {
+            parser.error = CALC_ERR_RESERVED;
+        } else {
+            calc_emit_op(&parser, OP_STORE);
+            calc_emit(&parser, (UINT8)(sym - calc_symbols));
+        }
+    }
+
+    prog->code[prog->code_len++] = params != NULL ? OP_RET : OP_END;
+    return parser.error;
+}
+
+/* Recompile every function body when the decimal scale in use changes */
+VOID calc_compile_bodies(UINTN digits) {
+    if (digits == calc_body_digits) return;
+    calc_body_digits = digits;
+    for (UINTN i = 0; i < CALC_SYMBOL_SLOTS; i++) {
+        CALC_SYMBOL *sym = &calc_symbols[i];
+        if (sym->kind == CALC_SYM_FUNCTION) {
+            sym->body_error = calc_compile(sym->body_text, digits, sym->params, sym->arity, &sym->body);
+        }
+    }
+}
+
+/*
+ * Define a function if the input has the form name(a, b) = body. Returns
+ * FALSE for anything else, which the caller then evaluates as an
+ * expression; on TRUE, *error is CALC_DEFINED or the reason it failed.
+ */
+BOOLEAN calc_define(CHAR16 *expr, UINTN digits, CALC_ERROR *error) {
+    CHAR16 params[CALC_MAX_PARAMS][CALC_MAX_NAME + 1];
+    CALC_PROGRAM body;
+    UINTN pos = 0;
+    UINTN name_pos, name_len, len;
+    UINTN count = 0;
+    BOOLEAN too_long = FALSE;
+    BOOLEAN repeated = FALSE;
+    CALC_SYMBOL *sym;
+
+    while (expr[pos] == L' ') pos++;
+    name_pos = pos;
+    name_len = calc_name_length(expr + pos);
+    if (name_len == 0) return FALSE;
+    pos += name_len;
+    while (expr[pos] == L' ') pos++;
+    if (expr[pos] != L'(') return FALSE;
+    pos++;
+
+    /* Parameter list: names only, otherwise this is a call */
+    for (;;) {
+        while (expr[pos] == L' ') pos++;
+        if (expr[pos] == L')' && count == 0) break;
+        len = calc_name_length(expr + pos);
+        if (len == 0) return FALSE;
+        if (count < CALC_MAX_PARAMS && len <= CALC_MAX_NAME) {
+            for (UINTN i = 0; i < len; i++) params[count][i] = expr[pos + i];
+            params[count][len] = 0;
+            /* A second a in k(a, a) would silently shadow the first */
+            for (UINTN i = 0; i < count; i++) {
+                if (StrCmp(params[i], params[count]) == 0) repeated = TRUE;
+            }
+        } else {
+            too_long = TRUE;
+        }
+        count++;
+        pos += len;
+        while (expr[pos] == L' ') pos++;
+        if (expr[pos] != L',') break;
+        pos++;
+    }
+    if (expr[pos] != L')') return FALSE;
+    pos++;
+    while (expr[pos] == L' ') pos++;
+    if (expr[pos] != L'=') return FALSE;
+    pos++;
+
+    if (too_long || name_len > CALC_MAX_NAME || StrLen(expr) >= CALC_MAX_INPUT) {
+        *error = CALC_ERR_TOO_LONG;
+        return TRUE;
+    }
+    if (repeated) {
+        *error = CALC_ERR_SYNTAX;
+        return TRUE;
+    }
+    sym = calc_symbol_find(expr + name_pos, name_len, calc_hash_n(expr + name_pos, name_len), TRUE);
+    if (sym == NULL) {
+        *error = CALC_ERR_TOO_MANY_NAMES;
+        return TRUE;
+    }
+    if (sym->kind == CALC_SYM_BUILTIN) {
+        *error = CALC_ERR_RESERVED;
+        return TRUE;
+    }
+
+    /* Compile aside so a bad body leaves any previous definition intact */
+    calc_compile_bodies(digits);
+    *error = calc_compile(expr + pos, digits, params, count, &body);
+    if (*error != CALC_OK) return TRUE;
+
+    sym->kind = CALC_SYM_FUNCTION;
+    sym->arity = count;
+    CopyMem(sym->params, params, sizeof(params));
+    StrCpy(sym->body_text, expr + pos);
+    CopyMem(&sym->body, &body, sizeof(body));
+    sym->body_error = CALC_OK;
+    *error = CALC_DEFINED;
+    return TRUE;
+}
+
+/* Divide the two-limb value hi:lo by d; requires hi < d so the quotient fits */
+UINT32 calc_udiv_2by1(UINT32 hi, UINT32 lo, UINT32 d, UINT32 *rem) {
+#if defined(__i386__)
+    UINT32 q, r;
+    __asm__("divl %4" : "=a"(q), "=d"(r) : "a"(lo), "d"(hi), "rm"(d));
+    *rem = r;
+    return q;
+#else
+    UINT64 n = ((UINT64)hi << 32) | lo;
+    *rem = (UINT32)(n % d);
+    return (UINT32)(n / d);
+#endif
+}
+
+/*
+ * Unsigned 64-bit division. On IA32 a plain '/' on UINT64 becomes a call to
+ * libgcc's __udivdi3, which is not linked into the EFI image, so divide in
+ * 32-bit steps with divl when the divisor fits in 32 bits and fall back to
+ * shift-subtract otherwise (the quotient then fits in 32 bits).
+ */
+UINT64 calc_udiv64(UINT64 n, UINT64 d, UINT64 *rem) {
+#if defined(__i386__)
+    UINT32 q_hi, q_lo, r;
+    UINT64 q = 0;
+    UINT64 acc = 0;
+
+    if ((d >> 32) == 0) {
+        q_hi = (UINT32)(n >> 32) / (UINT32)d;
+        r = (UINT32)(n >> 32) % (UINT32)d;
+        q_lo = calc_udiv_2by1(r, (UINT32)n, (UINT32)d, &r);
+        if (rem) *rem = r;
+        return ((UINT64)q_hi << 32) | q_lo;
+    }
+
+    for (INTN i = 63; i >= 0; i--) {
+        UINT64 carry = acc >> 63;
+        acc = (acc << 1) | ((n >> i) & 1);
+        if (carry || acc >= d) {
+            acc -= d;
+            q |= (UINT64)1 << i;
+        }
+    }
+    if (rem) *rem = acc;
+    return q;
+#else
+    if (rem) *rem = n % d;
+    return n / d;
+#endif
+}
+
+/* Signed 64-bit division truncating toward zero, like C's '/' and '%' */
+CALC_ERROR calc_div64(INT64 a, INT64 b, INT64 *quot, INT64 *rem) {
+    UINT64 ua, ub, uq, ur;
+
+    if (b == 0) return CALC_ERR_DIV_ZERO;
+    if (b == -1) {
+        /* INT64_MIN / -1 is the only quotient that does not fit */
+        *rem = 0;
+        if (__builtin_sub_overflow((INT64)0, a, quot)) return CALC_ERR_OVERFLOW;
+        return CALC_OK;
+    }
+
+    ua = a < 0 ? (UINT64)0 - (UINT64)a : (UINT64)a;
+    ub = b < 0 ? (UINT64)0 - (UINT64)b : (UINT64)b;
+    uq = calc_udiv64(ua, ub, &ur);
+    *quot = ((a < 0) != (b < 0)) ? -(INT64)uq : (INT64)uq;
+    *rem = a < 0 ? -(INT64)ur : (INT64)ur;
+    return CALC_OK;
+}
+
+/* Integer power by repeated squaring; negative exponents are rejected */
+CALC_ERROR calc_pow64(INT64 base, INT64 exp, INT64 *result) {
+    INT64 acc = 1;
+
+    if (exp < 0) return CALC_ERR_DOMAIN;
+    while (exp != 0) {
+        if ((exp & 1) && __builtin_mul_overflow(acc, base, &acc)) return CALC_ERR_OVERFLOW;
+        exp >>= 1;
+        if (exp != 0 && __builtin_mul_overflow(base, base, &base)) return CALC_ERR_OVERFLOW;
+    }
+    *result = acc;
+    return CALC_OK;
+}
+
+/* Factorial; 20! is the largest that fits in 64 bits */
+CALC_ERROR calc_fact64(INT64 n, INT64 *result) {
+    INT64 acc = 1;
+
+    if (n < 0) return CALC_ERR_DOMAIN;
+    if (n > 20) return CALC_ERR_OVERFLOW;
+    for (INT64 i = 2; i <= n; i++) acc *= i;
+    *result = acc;
+    return CALC_OK;
+}
+
+/* Convert between 10^from and 10^to scales, rounding half away from zero */
+CALC_ERROR calc_rescale(INT64 value, UINTN from, UINTN to, INT64 *result) {
+    INT64 quot, rem, half;
+
+    if (to >= from) {
+        if (__builtin_mul_overflow(value, (INT64)calc_pow10[to - from], result)) return CALC_ERR_OVERFLOW;
+        return CALC_OK;
+    }
+    calc_div64(value, (INT64)calc_pow10[from - to], &quot, &rem);
+    half = (INT64)(calc_pow10[from - to] >> 1);
+    if (rem >= half) quot++;
+    else if (rem <= -half) quot--;
+    *result = quot;
+    return CALC_OK;
+}
+
+/* OP_LOAD: read a variable at the running program's scale */
+CALC_ERROR calc_load(UINT8 slot, UINTN digits, INT64 *value) {
+    CALC_SYMBOL *sym = &calc_symbols[slot];
+
+    if (sym->kind != CALC_SYM_VARIABLE) return CALC_ERR_UNKNOWN_NAME;
+    return calc_rescale(sym->value, sym->digits, digits, value);
+}
+
+/* OP_STORE: assign a variable, replacing a function of the same name */
+VOID calc_store(UINT8 slot, INT64 value, UINTN digits) {
+    CALC_SYMBOL *sym = &calc_symbols[slot];
+
+    sym->kind = CALC_SYM_VARIABLE;
+    sym->value = value;
+    sym->digits = digits;
+}
+
+/*
+ * OP_CALL_USER: check that the callee still matches the call site (names
+ * can be redefined after a caller was cached), save the caller's position
+ * and switch to the body. The arguments already on the stack become the
+ * callee's parameters.
+ */
+CALC_ERROR calc_enter(CALC_PROGRAM **prog, UINT8 **pc, UINTN *base, UINTN sp,
+                      CALC_FRAME *frames, UINTN *frame_count) {
+    CALC_SYMBOL *fn = &calc_symbols[(*pc)[0]];
+    UINTN argc = (*pc)[1];
+    CALC_FRAME *frame;
+
+    if (fn->kind != CALC_SYM_FUNCTION || fn->arity != argc) return CALC_ERR_UNKNOWN_NAME;
+    if (fn->body_error != CALC_OK) return fn->body_error;
+    if (*frame_count == CALC_MAX_FRAMES || sp + fn->body.max_depth > CALC_VM_STACK) {
+        return CALC_ERR_TOO_LONG;
+    }
+
+    frame = &frames[(*frame_count)++];
+    frame->prog = *prog;
+    frame->pc = *pc + 2;
+    frame->base = *base;
+    *prog = &fn->body;
+    *pc = fn->body.code;
+    *base = sp - argc;
+    return CALC_OK;
+}
+
+/*
+ * Execute compiled bytecode on the stack machine. CALC_ERR_OVERFLOW means
+ * the result needs more than 64 bits; the caller may re-run the program
+ * with calc_run_big. An assignment's OP_STORE is the last instruction, so
+ * a run that overflows has not assigned anything yet.
+ */
+CALC_ERROR calc_run(CALC_PROGRAM *prog, INT64 *result) {
+    INT64 stack[CALC_VM_STACK];
+    CALC_FRAME frames[CALC_MAX_FRAMES];
+    UINTN frame_count = 0;
+    UINTN sp = 0;
+    UINTN base = 0;
+    UINT8 *pc = prog->code;
+    INT64 quot, rem;
+    CALC_ERROR error;
+
+    for (;;) {
+        switch (*pc++) {
+        case OP_PUSH:
+            stack[sp++] = prog->consts[*pc++];
+            break;
+        case OP_PUSH_BIG:
+            return CALC_ERR_OVERFLOW;
+        case OP_NEG:
+            if (__builtin_sub_overflow((INT64)0, stack[sp - 1], &stack[sp - 1])) {
+                return CALC_ERR_OVERFLOW;
+            }
+            break;
+        case OP_FACT:
+            error = calc_fact64(stack[sp - 1], &stack[sp - 1]);
+            if (error != CALC_OK) return error;
+            break;
+        case OP_POW:
+            sp--;
+            error = calc_pow64(stack[sp - 1], stack[sp], &stack[sp - 1]);
+            if (error != CALC_OK) return error;
+            break;
+        case OP_ADD:
+            sp--;
+            if (__builtin_add_overflow(stack[sp - 1], stack[sp], &stack[sp - 1])) {
+                return CALC_ERR_OVERFLOW;
+            }
+            break;
+        case OP_SUB:
+            sp--;
+            if (__builtin_sub_overflow(stack[sp - 1], stack[sp], &stack[sp - 1])) {
+                return CALC_ERR_OVERFLOW;
+            }
+            break;
+        case OP_MUL:
+            sp--;
+            if (__builtin_mul_overflow(stack[sp - 1], stack[sp], &stack[sp - 1])) {
+                return CALC_ERR_OVERFLOW;
+            }
+            break;
+        case OP_DIV:
+        case OP_MOD:
+            sp--;
+            error = calc_div64(stack[sp - 1], stack[sp], &quot, &rem);
+            if (error == CALC_ERR_OVERFLOW && pc[-1] == OP_MOD) error = CALC_OK;
+            if (error != CALC_OK) return error;
+            stack[sp - 1] = (pc[-1] == OP_DIV) ? quot : rem;
+            break;
+        case OP_LOAD:
+            error = calc_load(*pc++, 0, &stack[sp++]);
+            if (error != CALC_OK) return error;
+            break;
+        case OP_STORE:
+            calc_store(*pc++, stack[sp - 1], 0);
+            break;
+        case OP_ARG:
+            stack[sp] = stack[base + *pc++];
+            sp++;
+            break;
+        case OP_CALL_USER:
+            error = calc_enter(&prog, &pc, &base, sp, frames, &frame_count);
+            if (error != CALC_OK) return error;
+            break;
+        case OP_RET:
+            stack[base] = stack[sp - 1];
+            sp = base + 1;
+            frame_count--;
+            prog = frames[frame_count].prog;
+            pc = frames[frame_count].pc;
+            base = frames[frame_count].base;
+            break;
+        default:
+            *result = stack[0];
+            return CALC_OK;
+        }
+    }
+}
+
+/*
+ * Expression JIT
+ *
+ * Integer-mode programs made only of constants, variables and operators
+ * are translated into IA32 machine code when they enter the cache, into
+ * a fixed slot of an EfiLoaderCode page block (one slot per cache entry).
+ * The two stack entries nearest the bottom live in the callee-saved
+ * register pairs EBX:ESI and EDI:EBP, deeper ones in a stack frame, so a
+ * typical expression runs entirely in registers. Addition, subtraction and
+ * negation are inline with a JO to the overflow exit; multiplication is
+ * inline when both operands fit in 32 bits; variable reads are inline for
+ * plain integer variables. Everything else calls calc_jit_slow_path with
+ * the operands spilled to their frame slots. A result of CALC_ERR_OVERFLOW
+ * is handled exactly like the interpreter's, by re-running in arbitrary
+ * precision. Programs that do not qualify, or do not fit in their slot,
+ * are interpreted.
+ */
+#define CALC_JIT_SLOT_SIZE 4096   /* Code bytes per cache entry */
+#if defined(__i386__)
+#define CALC_JIT_SUPPORTED TRUE
+#else
+#define CALC_JIT_SUPPORTED FALSE  /* The emitter only produces IA32 code */
+#endif
+#define CALC_JIT_ARGS      12     /* Outgoing argument area at the bottom of the frame */
+
+/* IA32 register numbers */
+#define CALC_JIT_EAX 0
+#define CALC_JIT_ECX 1
+#define CALC_JIT_EDX 2
+#define CALC_JIT_EBX 3
+#define CALC_JIT_ESP 4
+#define CALC_JIT_EBP 5
+#define CALC_JIT_ESI 6
+#define CALC_JIT_EDI 7
+
+/* ALU opcodes in their "r/m32, r32" form; adding 2 gives "r32, r/m32" */
+#define CALC_JIT_ADD 0x01
+#define CALC_JIT_ADC 0x11
+#define CALC_JIT_SUB 0x29
+#define CALC_JIT_SBB 0x19
+#define CALC_JIT_MOV 0x89
+#define CALC_JIT_CMP 0x39
+
+/* Condition codes for Jcc */
+#define CALC_JIT_JO  0x0
+#define CALC_JIT_JNE 0x5
+#define CALC_JIT_JMP 0xFF
+
+typedef struct {
+    BOOLEAN mem;      /* Memory at [reg + disp], otherwise register reg */
+    UINT8 reg;
+    INT32 disp;
+} CALC_JIT_OPERAND;
+
+typedef struct {
+    UINT8 *code;
+    UINTN len;
+    BOOLEAN full;
+    UINTN frame;      /* Bytes below the four saved registers */
+    UINTN exit;       /* Epilogue, entered with the error code in EAX */
+    UINTN overflow;   /* Loads CALC_ERR_OVERFLOW and falls into the epilogue */
+} CALC_JIT;
+
+BOOLEAN calc_jit_enabled = TRUE;
+UINT8 *calc_jit_pages = NULL;
+BOOLEAN calc_jit_unavailable = FALSE;
+
+VOID calc_jit_byte(CALC_JIT *j, UINT8 b) {
+    if (j->len < CALC_JIT_SLOT_SIZE) {
+        j->code[j->len++] = b;
+    } else {
+        j->full = TRUE;
+    }
+}
+
+VOID calc_jit_dword(CALC_JIT *j, UINT32 v) {
+    for (UINTN i = 0; i < 4; i++) calc_jit_byte(j, (UINT8)(v >> (8 * i)));
+}
+
+/* ModRM (plus SIB and disp32 for memory) with the given reg field */
+VOID calc_jit_modrm(CALC_JIT *j, UINT8 field, CALC_JIT_OPERAND *op) {
+    if (!op->mem) {
+        calc_jit_byte(j, 0xC0 | (field << 3) | op->reg);
+        return;
+    }
+    calc_jit_byte(j, 0x80 | (field << 3) | op->reg);
+    if (op->reg == CALC_JIT_ESP) calc_jit_byte(j, 0x24);
+    calc_jit_dword(j, (UINT32)op->disp);
+}
+
+VOID calc_jit_rm(CALC_JIT *j, UINT8 opcode, UINT8 field, CALC_JIT_OPERAND *op) {
+    calc_jit_byte(j, opcode);
+    calc_jit_modrm(j, field, op);
+}
+
+/* Operand for one half (0 = low, 1 = high) of a register or memory location */
+CALC_JIT_OPERAND calc_jit_reg(UINT8 reg) {
+    CALC_JIT_OPERAND op = { FALSE, reg, 0 };
+    return op;
+}
+
+CALC_JIT_OPERAND calc_jit_mem(UINT8 base, INT32 disp) {
+    CALC_JIT_OPERAND op = { TRUE, base, disp };
+    return op;
+}
+
+/* Frame slot backing expression stack entry i */
+CALC_JIT_OPERAND calc_jit_home(UINTN i, UINTN half) {
+    return calc_jit_mem(CALC_JIT_ESP, (INT32)(CALC_JIT_ARGS + 8 * i + 4 * half));
+}
+
+/* Where expression stack entry i lives while the program runs */
+CALC_JIT_OPERAND calc_jit_slot(UINTN i, UINTN half) {
+    static CONST UINT8 regs[2][2] = {
+        { CALC_JIT_EBX, CALC_JIT_ESI }, { CALC_JIT_EDI, CALC_JIT_EBP }
+    };
+    if (i < 2) return calc_jit_reg(regs[i][half]);
+    return calc_jit_home(i, half);
+}
+
+/* dst op= src; one of the two must be a register */
+VOID calc_jit_alu(CALC_JIT *j, UINT8 opcode, CALC_JIT_OPERAND dst, CALC_JIT_OPERAND src) {
+    if (!dst.mem) {
+        calc_jit_rm(j, opcode + 2, dst.reg, &src);
+    } else {
+        calc_jit_rm(j, opcode, src.reg, &dst);
+    }
+}
+
+VOID calc_jit_mov_imm(CALC_JIT *j, CALC_JIT_OPERAND dst, UINT32 imm) {
+    if (!dst.mem) {
+        calc_jit_byte(j, 0xB8 + dst.reg);
+    } else {
+        calc_jit_rm(j, 0xC7, 0, &dst);
+    }
+    calc_jit_dword(j, imm);
+}
+
+/* Copy a 64-bit value; memory to memory goes through EAX */
+VOID calc_jit_move64(CALC_JIT *j, CALC_JIT_OPERAND dst_lo, CALC_JIT_OPERAND dst_hi,
+                     CALC_JIT_OPERAND src_lo, CALC_JIT_OPERAND src_hi) {
+    CALC_JIT_OPERAND eax = calc_jit_reg(CALC_JIT_EAX);
+
+    if (dst_lo.mem && src_lo.mem) {
+        calc_jit_alu(j, CALC_JIT_MOV, eax, src_lo);
+        calc_jit_alu(j, CALC_JIT_MOV, dst_lo, eax);
+        calc_jit_alu(j, CALC_JIT_MOV, eax, src_hi);
+        calc_jit_alu(j, CALC_JIT_MOV, dst_hi, eax);
+    } else {
+        calc_jit_alu(j, CALC_JIT_MOV, dst_lo, src_lo);
+        calc_jit_alu(j, CALC_JIT_MOV, dst_hi, src_hi);
+    }
+}
+
+/* Jcc/JMP rel32 to target; returns the offset of the displacement for later patching */
+UINTN calc_jit_jump(CALC_JIT *j, UINT8 cc, UINTN target) {
+    UINTN at;
+
+    if (cc == CALC_JIT_JMP) {
+        calc_jit_byte(j, 0xE9);
+    } else {
+        calc_jit_byte(j, 0x0F);
+        calc_jit_byte(j, 0x80 | cc);
+    }
+    at = j->len;
+    calc_jit_dword(j, (UINT32)(target - (at + 4)));
+    return at;
+}
+
+VOID calc_jit_patch(CALC_JIT *j, UINTN at, UINTN target) {
+    UINT32 rel = (UINT32)(target - (at + 4));
+
+    for (UINTN i = 0; i < 4 && at + i < CALC_JIT_SLOT_SIZE; i++) j->code[at + i] = (UINT8)(rel >> (8 * i));
+}
+
+/* Operations the native code hands back to C; the result replaces *a */
+CALC_ERROR calc_jit_slow_path(INT64 *a, INT64 *b, UINTN op) {
+    INT64 quot, rem;
+    CALC_ERROR error;
+
+    switch (op & 0xFF) {
+    case OP_MUL:
+        return __builtin_mul_overflow(*a, *b, a) ? CALC_ERR_OVERFLOW : CALC_OK;
+    case OP_DIV:
+    case OP_MOD:
+        error = calc_div64(*a, *b, &quot, &rem);
+        if (error == CALC_ERR_OVERFLOW && op == OP_MOD) error = CALC_OK;
+        *a = op == OP_DIV ? quot : rem;
+        return error;
+    case OP_POW:
+        return calc_pow64(*a, *b, a);
+    case OP_FACT:
+        return calc_fact64(*a, a);
+    default:
+        /* OP_LOAD, with the symbol slot in the upper bits */
+        return calc_load((UINT8)(op >> 8), 0, a);
+    }
+}
+
+/* Spill entries a and b (b may equal a), call calc_jit_slow_path, reload a */
+VOID calc_jit_call_slow(CALC_JIT *j, UINTN a, UINTN b, UINTN op) {
+    CALC_JIT_OPERAND eax = calc_jit_reg(CALC_JIT_EAX);
+
+    if (a < 2) calc_jit_move64(j, calc_jit_home(a, 0), calc_jit_home(a, 1), calc_jit_slot(a, 0), calc_jit_slot(a, 1));
+    if (b != a && b < 2) calc_jit_move64(j, calc_jit_home(b, 0), calc_jit_home(b, 1), calc_jit_slot(b, 0), calc_jit_slot(b, 1));
+
+    /* lea eax, [esp + home]; mov [esp], eax; same for b; mov dword [esp + 8], op */
+    for (UINTN i = 0; i < 2; i++) {
+        CALC_JIT_OPERAND home = calc_jit_home(i == 0 ? a : b, 0);
+        CALC_JIT_OPERAND arg = calc_jit_mem(CALC_JIT_ESP, (INT32)(4 * i));
+        calc_jit_rm(j, 0x8D, CALC_JIT_EAX, &home);
+        calc_jit_alu(j, CALC_JIT_MOV, arg, eax);
+    }
+    calc_jit_mov_imm(j, calc_jit_mem(CALC_JIT_ESP, 8), (UINT32)op);
+    calc_jit_mov_imm(j, eax, (UINT32)(UINTN)calc_jit_slow_path);
+    calc_jit_byte(j, 0xFF);             /* call eax */
+    calc_jit_byte(j, 0xD0);
+    calc_jit_rm(j, 0x85, CALC_JIT_EAX, &eax);  /* test eax, eax */
+    calc_jit_jump(j, CALC_JIT_JNE, j->exit);
+
+    if (a < 2) calc_jit_move64(j, calc_jit_slot(a, 0), calc_jit_slot(a, 1), calc_jit_home(a, 0), calc_jit_home(a, 1));
+}
+
+/* Inline 64-bit add or subtract of entry d into entry d - 1, exiting on overflow */
+VOID calc_jit_add_sub(CALC_JIT *j, UINTN d, BOOLEAN subtract) {
+    CALC_JIT_OPERAND src_lo = calc_jit_slot(d, 0);
+    CALC_JIT_OPERAND src_hi = calc_jit_slot(d, 1);
+
+    if (src_lo.mem && calc_jit_slot(d - 1, 0).mem) {
+        calc_jit_alu(j, CALC_JIT_MOV, calc_jit_reg(CALC_JIT_EAX), src_lo);
+        calc_jit_alu(j, CALC_JIT_MOV, calc_jit_reg(CALC_JIT_EDX), src_hi);
+        src_lo = calc_jit_reg(CALC_JIT_EAX);
+        src_hi = calc_jit_reg(CALC_JIT_EDX);
+    }
+    calc_jit_alu(j, subtract ? CALC_JIT_SUB : CALC_JIT_ADD, calc_jit_slot(d - 1, 0), src_lo);
+    calc_jit_alu(j, subtract ? CALC_JIT_SBB : CALC_JIT_ADC, calc_jit_slot(d - 1, 1), src_hi);
+    calc_jit_jump(j, CALC_JIT_JO, j->overflow);
+}
+
+/* Jump to the returned fixup unless entry i is a sign-extended 32-bit value */
+UINTN calc_jit_unless_small(CALC_JIT *j, UINTN i) {
+    calc_jit_alu(j, CALC_JIT_MOV, calc_jit_reg(CALC_JIT_EAX), calc_jit_slot(i, 0));
+    calc_jit_byte(j, 0x99);             /* cdq */
+    calc_jit_alu(j, CALC_JIT_CMP, calc_jit_reg(CALC_JIT_EDX), calc_jit_slot(i, 1));
+    return calc_jit_jump(j, CALC_JIT_JNE, 0);
+}
+
+/* Check that a program only uses opcodes the JIT handles; returns its stack depth or 0 */
+UINTN calc_jit_depth(CALC_PROGRAM *prog) {
+    UINTN depth = 0;
+    UINTN max = 0;
+
+    for (UINTN pc = 0; pc < prog->code_len; pc++) {
+        switch (prog->code[pc]) {
+        case OP_END:
+            return depth == 1 ? max : 0;
+        case OP_PUSH:
+        case OP_LOAD:
+            pc++;
+            if (++depth > max) max = depth;
+            break;
+        case OP_STORE:
+            pc++;
+            break;
+        case OP_NEG:
+        case OP_FACT:
+            break;
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD: case OP_POW:
+            if (depth < 2) return 0;
+            depth--;
+            break;
+        default:
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Translate an integer program into the code slot; prog->jit is left NULL
+ * when the program does not qualify. The generated function is
+ * CALC_ERROR fn(INT64 *result) with the cdecl convention.
+ */
+VOID calc_jit_compile(CALC_PROGRAM *prog, UINTN slot) {
+    CALC_JIT jit;
+    CALC_JIT *j = &jit;
+    CALC_JIT_OPERAND eax = calc_jit_reg(CALC_JIT_EAX);
+    CALC_JIT_OPERAND ecx = calc_jit_reg(CALC_JIT_ECX);
+    CALC_JIT_OPERAND edx = calc_jit_reg(CALC_JIT_EDX);
+    UINTN max = calc_jit_depth(prog);
+    UINTN entry;
+    UINTN d = 0;
+
+    prog->jit = NULL;
+    if (!CALC_JIT_SUPPORTED || max == 0 || calc_jit_unavailable) return;
+    if (calc_jit_pages == NULL) {
+        EFI_PHYSICAL_ADDRESS pages;
+        if (EFI_ERROR(BS->AllocatePages(AllocateAnyPages, EfiLoaderCode,
+                                        EFI_SIZE_TO_PAGES(CALC_CACHE_SIZE * CALC_JIT_SLOT_SIZE), &pages))) {
+            calc_jit_unavailable = TRUE;
+            return;
+        }
+        calc_jit_pages = (UINT8 *)(UINTN)pages;
+    }
+
+    j->code = calc_jit_pages + slot * CALC_JIT_SLOT_SIZE;
+    j->len = 0;
+    j->full = FALSE;
+    j->frame = CALC_JIT_ARGS + 8 * max;
+
+    /* Shared exits come first so every jump to them is backwards */
+    j->overflow = j->len;
+    calc_jit_mov_imm(j, eax, CALC_ERR_OVERFLOW);
+    j->exit = j->len;
+    calc_jit_byte(j, 0x81);             /* add esp, frame */
+    calc_jit_byte(j, 0xC4);
+    calc_jit_dword(j, (UINT32)j->frame);
+    calc_jit_byte(j, 0x5F);             /* pop edi, esi, ebx, ebp */
+    calc_jit_byte(j, 0x5E);
+    calc_jit_byte(j, 0x5B);
+    calc_jit_byte(j, 0x5D);
+    calc_jit_byte(j, 0xC3);             /* ret */
+
+    entry = j->len;
+    calc_jit_byte(j, 0x55);             /* push ebp, ebx, esi, edi */
+    calc_jit_byte(j, 0x53);
+    calc_jit_byte(j, 0x56);
+    calc_jit_byte(j, 0x57);
+    calc_jit_byte(j, 0x81);             /* sub esp, frame */
+    calc_jit_byte(j, 0xEC);
+    calc_jit_dword(j, (UINT32)j->frame);
+
+    for (UINT8 *pc = prog->code; *pc != OP_END && !j->full; ) {
+        UINT8 op = *pc++;
+        UINTN skip, slow, done;
+
+        switch (op) {
+        case OP_PUSH: {
+            UINT64 value = (UINT64)prog->consts[*pc++];
+            calc_jit_mov_imm(j, calc_jit_slot(d, 0), (UINT32)value);
+            calc_jit_mov_imm(j, calc_jit_slot(d, 1), (UINT32)(value >> 32));
+            d++;
+            break;
+        }
+        case OP_LOAD: {
+            /* Plain integer variables inline; anything else through calc_load */
+            CALC_SYMBOL *sym = &calc_symbols[*pc];
+            CALC_JIT_OPERAND kind = calc_jit_mem(CALC_JIT_ECX, (INT32)__builtin_offsetof(CALC_SYMBOL, kind));
+            CALC_JIT_OPERAND digits = calc_jit_mem(CALC_JIT_ECX, (INT32)__builtin_offsetof(CALC_SYMBOL, digits));
+            CALC_JIT_OPERAND value = calc_jit_mem(CALC_JIT_ECX, (INT32)__builtin_offsetof(CALC_SYMBOL, value));
+            CALC_JIT_OPERAND value_hi = calc_jit_mem(CALC_JIT_ECX, value.disp + 4);
+
+            calc_jit_mov_imm(j, ecx, (UINT32)(UINTN)sym);
+            calc_jit_rm(j, 0x81, 7, &kind);   /* cmp dword [ecx + kind], VARIABLE */
+            calc_jit_dword(j, CALC_SYM_VARIABLE);
+            skip = calc_jit_jump(j, CALC_JIT_JNE, 0);
+            calc_jit_rm(j, 0x81, 7, &digits); /* cmp dword [ecx + digits], 0 */
+            calc_jit_dword(j, 0);
+            slow = calc_jit_jump(j, CALC_JIT_JNE, 0);
+            calc_jit_move64(j, calc_jit_slot(d, 0), calc_jit_slot(d, 1), value, value_hi);
+            done = calc_jit_jump(j, CALC_JIT_JMP, 0);
+            calc_jit_patch(j, skip, j->len);
+            calc_jit_patch(j, slow, j->len);
+            calc_jit_call_slow(j, d, d, OP_LOAD | ((UINTN)*pc << 8));
+            calc_jit_patch(j, done, j->len);
+            pc++;
+            d++;
+            break;
+        }
+        case OP_STORE: {
+            CALC_SYMBOL *sym = &calc_symbols[*pc++];
+            CALC_JIT_OPERAND kind = calc_jit_mem(CALC_JIT_ECX, (INT32)__builtin_offsetof(CALC_SYMBOL, kind));
+            CALC_JIT_OPERAND digits = calc_jit_mem(CALC_JIT_ECX, (INT32)__builtin_offsetof(CALC_SYMBOL, digits));
+            CALC_JIT_OPERAND value = calc_jit_mem(CALC_JIT_ECX, (INT32)__builtin_offsetof(CALC_SYMBOL, value));
+            CALC_JIT_OPERAND value_hi = calc_jit_mem(CALC_JIT_ECX, value.disp + 4);
+
+            calc_jit_mov_imm(j, ecx, (UINT32)(UINTN)sym);
+            calc_jit_mov_imm(j, kind, CALC_SYM_VARIABLE);
+            calc_jit_mov_imm(j, digits, 0);
+            calc_jit_move64(j, value, value_hi, calc_jit_slot(d - 1, 0), calc_jit_slot(d - 1, 1));
+            break;
+        }
+        case OP_NEG:
+            /* 0 - x in EDX:EAX */
+            calc_jit_alu(j, 0x31, eax, eax);  /* xor */
+            calc_jit_alu(j, 0x31, edx, edx);
+            calc_jit_alu(j, CALC_JIT_SUB, eax, calc_jit_slot(d - 1, 0));
+            calc_jit_alu(j, CALC_JIT_SBB, edx, calc_jit_slot(d - 1, 1));
+            calc_jit_jump(j, CALC_JIT_JO, j->overflow);
+            calc_jit_alu(j, CALC_JIT_MOV, calc_jit_slot(d - 1, 0), eax);
+            calc_jit_alu(j, CALC_JIT_MOV, calc_jit_slot(d - 1, 1), edx);
+            break;
+        case OP_ADD:
+        case OP_SUB:
+            d--;
+            calc_jit_add_sub(j, d, op == OP_SUB);
+            break;
+        case OP_MUL: {
+            /* Two 32-bit operands give an exact 64-bit product with one IMUL */
+            CALC_JIT_OPERAND b_lo = calc_jit_slot(d - 1, 0);
+
+            d--;
+            skip = calc_jit_unless_small(j, d - 1);
+            slow = calc_jit_unless_small(j, d);
+            calc_jit_alu(j, CALC_JIT_MOV, eax, calc_jit_slot(d - 1, 0));
+            calc_jit_rm(j, 0xF7, 5, &b_lo);   /* imul dword b_lo */
+            calc_jit_alu(j, CALC_JIT_MOV, calc_jit_slot(d - 1, 0), eax);
+            calc_jit_alu(j, CALC_JIT_MOV, calc_jit_slot(d - 1, 1), edx);
+            done = calc_jit_jump(j, CALC_JIT_JMP, 0);
+            calc_jit_patch(j, skip, j->len);
+            calc_jit_patch(j, slow, j->len);
+            calc_jit_call_slow(j, d - 1, d, OP_MUL);
+            calc_jit_patch(j, done, j->len);
+            break;
+        }
+        case OP_DIV:
+        case OP_MOD:
+        case OP_POW:
+            d--;
+            calc_jit_call_slow(j, d - 1, d, op);
+            break;
+        case OP_FACT:
+            calc_jit_call_slow(j, d - 1, d - 1, op);
+            break;
+        }
+    }
+
+    /* OP_END: *result = entry 0, return CALC_OK */
+    calc_jit_alu(j, CALC_JIT_MOV, ecx, calc_jit_mem(CALC_JIT_ESP, (INT32)(j->frame + 20)));
+    calc_jit_alu(j, CALC_JIT_MOV, calc_jit_mem(CALC_JIT_ECX, 0), calc_jit_slot(0, 0));
+    calc_jit_alu(j, CALC_JIT_MOV, calc_jit_mem(CALC_JIT_ECX, 4), calc_jit_slot(0, 1));
+    calc_jit_alu(j, 0x31, eax, eax);
+    calc_jit_jump(j, CALC_JIT_JMP, j->exit);
+
+    if (!j->full) prog->jit = (CALC_JIT_FN)(UINTN)(j->code + entry);
+}
+
+/* Run an integer program, as native code when it has been translated */
+CALC_ERROR calc_execute(CALC_PROGRAM *prog, INT64 *result) {
+    if (calc_jit_enabled && prog->jit != NULL) return prog->jit(result);
+    return calc_run(prog, result);
+}
+
+/*
+ * Format a signed 64-bit value in decimal. The value is split into base
+ * 10^9 chunks (at most two 64-bit divisions), and each chunk is converted
+ * two digits at a time with 32-bit arithmetic and a digit-pair table.
+ * Returns the number of characters written, excluding the terminator.
+ */
+UINTN calc_format_int64(INT64 value, CHAR16 *buf) {
+    static CONST CHAR8 digit_pairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    UINT32 chunks[3];
+    UINTN chunk_count = 0;
+    CHAR16 tmp[24];
+    UINTN pos = sizeof(tmp) / sizeof(tmp[0]);
+    UINT64 mag = value < 0 ? (UINT64)0 - (UINT64)value : (UINT64)value;
+    UINTN len = 0;
+
+    do {
+        UINT64 rem;
+        mag = calc_udiv64(mag, 1000000000, &rem);
+        chunks[chunk_count++] = (UINT32)rem;
+    } while (mag != 0);
+
+    for (UINTN c = 0; c < chunk_count; c++) {
+        UINT32 chunk = chunks[c];
+        UINTN start = pos;
+
+        while (chunk >= 100) {
+            UINT32 pair = chunk % 100;
+            chunk /= 100;
+            tmp[--pos] = digit_pairs[pair * 2 + 1];
+            tmp[--pos] = digit_pairs[pair * 2];
+        }
+        if (chunk >= 10) {
+            tmp[--pos] = digit_pairs[chunk * 2 + 1];
+            tmp[--pos] = digit_pairs[chunk * 2];
+        } else {
+            tmp[--pos] = (CHAR16)(L'0' + chunk);
+        }
+
+        /* Every chunk below the most significant one is nine digits wide */
+        if (c + 1 < chunk_count) {
+            while (start - pos < 9) tmp[--pos] = L'0';
+        }
+    }
+
+    if (value < 0) buf[len++] = L'-';
+    while (pos < sizeof(tmp) / sizeof(tmp[0])) buf[len++] = tmp[pos++];
+    buf[len] = 0;
+    return len;
+}
+
+/*
+ * Decimal mode
+ *
+ * Values are INT64 fixed point scaled by 10^digits, computed entirely with
+ * integer instructions so results never depend on the firmware having
+ * initialised the x87/SSE state. Products and quotients are formed exactly
+ * in 128 bits and rounded once. The transcendental functions reduce their
+ * argument to a small interval and evaluate a polynomial in Q61 binary
+ * fixed point (61 fraction bits), which leaves guard digits even at
+ * CALC_MAX_DIGITS.
+ */
+#define Q61_ONE          ((INT64)1 << 61)
+#define Q61_SQRT2        0x2d413cccfe779921LL
+#define Q61_PI           0x6487ed5110b4611aLL
+#define Q61_PI_2         0x3243f6a8885a308dLL
+#define Q61_E            0x56fc2a2c515da54dLL
+#define Q64_INV_LN10     0x6f2dec549b9438cbULL
+#define Q56_LN2          0x00b17217f7d1cf7aLL
+#define Q128_LN2_HI      0xb17217f7d1cf79abULL
+#define Q128_LN2_LO      0xc9e3b39803f2f6afULL
+#define Q128_LN10_HI     0x4d763776aaa2b05bULL   /* Fraction of ln 10, which is 2.30... */
+#define Q128_LN10_LO     0xa95b58ae0b4c28a3ULL
+#define Q128_2_OVER_PI_HI 0xa2f9836e4e441529ULL
+#define Q128_2_OVER_PI_LO 0xfc2757d1f534ddc0ULL
+
+/* Taylor coefficients in Q61: 1/n!, and the odd/even terms of sin/cos */
+CONST INT64 calc_exp_coef[] = {
+    0x2000000000000000LL, 0x2000000000000000LL, 0x1000000000000000LL, 0x0555555555555555LL,
+    0x0155555555555555LL, 0x0044444444444444LL, 0x000b60b60b60b60bLL, 0x0001a01a01a01a02LL,
+    0x0000340340340340LL, 0x000005c778e955b2LL, 0x00000093f27dbbc5LL, 0x0000000d7322b3fbLL,
+    0x000000011eed8f00LL, 0x0000000016124614LL, 0x000000000193974bLL, 0x00000000001ae7f4LL
+};
+CONST INT64 calc_sin_coef[] = {
+    2305843009213693952LL, -384307168202282325LL, 19215358410114116LL, -457508533574146LL,
+    6354285188530LL, -57766228987LL, 370296340LL, -1763316LL, 6483LL, -19LL
+};
+CONST INT64 calc_cos_coef[] = {
+    2305843009213693952LL, -1152921504606846976LL, 96076792050570581LL, -3202559735019019LL,
+    57188566696768LL, -635428518853LL, 4813852416LL, -26449739LL, 110207LL, -360LL, 1LL
+};
+/* 1/(2n+1) in Q61 for the atanh series used by ln */
+CONST INT64 calc_atanh_coef[] = {
+    0x2000000000000000LL, 0x0aaaaaaaaaaaaaabLL, 0x0666666666666666LL, 0x0492492492492492LL,
+    0x038e38e38e38e38eLL, 0x02e8ba2e8ba2e8baLL, 0x0276276276276276LL, 0x0222222222222222LL,
+    0x01e1e1e1e1e1e1e2LL, 0x01af286bca1af287LL, 0x0186186186186186LL, 0x01642c8590b21643LL,
+    0x0147ae147ae147aeLL, 0x012f684bda12f685LL
+};
+
+typedef struct {
+    UINT64 lo;
+    UINT64 hi;
+} CALC_U128;
+
+/* 64x64 -> 128-bit unsigned product from four 32x32 partial products */
+VOID calc_mul_u128(UINT64 a, UINT64 b, CALC_U128 *r) {
+    UINT64 a_lo = (UINT32)a, a_hi = a >> 32;
+    UINT64 b_lo = (UINT32)b, b_hi = b >> 32;
+    UINT64 p0 = a_lo * b_lo;
+    UINT64 p1 = a_lo * b_hi;
+    UINT64 p2 = a_hi * b_lo;
+    UINT64 mid = (p0 >> 32) + (UINT32)p1 + (UINT32)p2;
+
+    r->lo = (mid << 32) | (UINT32)p0;
+    r->hi = a_hi * b_hi + (p1 >> 32) + (p2 >> 32) + (mid >> 32);
+}
+
+/* Divide hi:lo by d where hi < d, so the quotient fits in 64 bits */
+UINT64 calc_udiv_128by64(UINT64 hi, UINT64 lo, UINT64 d, UINT64 *rem) {
+    if ((d >> 32) == 0) {
+        /* Two 96/32-bit steps, each a pair of divl on IA32 */
+        UINT64 r;
+        UINT64 q_hi = calc_udiv64((hi << 32) | (lo >> 32), d, &r);
+        UINT64 q_lo = calc_udiv64((r << 32) | (UINT32)lo, d, rem);
+        return (q_hi << 32) | q_lo;
+    }
+    for (UINTN i = 0; i < 64; i++) {
+        UINT64 carry = hi >> 63;
+        hi = (hi << 1) | (lo >> 63);
+        lo <<= 1;
+        if (carry || hi >= d) {
+            hi -= d;
+            lo |= 1;
+        }
+    }
+    *rem = hi;
+    return lo;
+}
+
+/* r = round(a * b / c), rounding halves away from zero */
+CALC_ERROR calc_muldiv(INT64 a, INT64 b, INT64 c, INT64 *r) {
+    BOOLEAN neg = (a < 0) != (b < 0);
+    UINT64 ua = a < 0 ? (UINT64)0 - (UINT64)a : (UINT64)a;
+    UINT64 ub = b < 0 ? (UINT64)0 - (UINT64)b : (UINT64)b;
+    UINT64 uc, q, rem;
+    CALC_U128 p;
+
+    if (c == 0) return CALC_ERR_DIV_ZERO;
+    if (c < 0) neg = !neg;
+    uc = c < 0 ? (UINT64)0 - (UINT64)c : (UINT64)c;
+
+    calc_mul_u128(ua, ub, &p);
+    if (p.hi >= uc) return CALC_ERR_OVERFLOW;
+    q = calc_udiv_128by64(p.hi, p.lo, uc, &rem);
+    if (rem >= uc - rem) q++;
+    if (q > (UINT64)1 << 63 || (q == (UINT64)1 << 63 && !neg)) return CALC_ERR_OVERFLOW;
+    *r = neg ? (INT64)((UINT64)0 - q) : (INT64)q;
+    return CALC_OK;
+}
+
+/* Round the 128-bit value p right by s bits; FALSE if the result exceeds 63 bits */
+BOOLEAN calc_u128_shr_round(CALC_U128 *p, UINTN s, UINT64 *r) {
+    UINT64 q, round;
+
+    if (s == 0) {
+        q = p->lo;
+        if (p->hi != 0) return FALSE;
+        round = 0;
+    } else if (s < 64) {
+        if ((p->hi >> s) != 0) return FALSE;
+        q = (p->hi << (64 - s)) | (p->lo >> s);
+        round = (p->lo >> (s - 1)) & 1;
+    } else if (s < 128) {
+        q = p->hi >> (s - 64);
+        round = s == 64 ? p->lo >> 63 : (p->hi >> (s - 65)) & 1;
+    } else {
+        q = 0;
+        round = 0;
+    }
+    q += round;
+    if (q >> 63) return FALSE;
+    *r = q;
+    return TRUE;
+}
+
+/* Signed fixed-point multiply: round(a * b / 2^frac) */
+INT64 calc_mul_q(INT64 a, INT64 b, UINTN frac) {
+    BOOLEAN neg = (a < 0) != (b < 0);
+    UINT64 q = 0;
+    CALC_U128 p;
+
+    calc_mul_u128(a < 0 ? (UINT64)0 - (UINT64)a : (UINT64)a,
+                  b < 0 ? (UINT64)0 - (UINT64)b : (UINT64)b, &p);
+    calc_u128_shr_round(&p, frac, &q);
+    return neg ? -(INT64)q : (INT64)q;
+}
+
+/* Convert binary fixed point with frac fraction bits to 10^digits scale */
+CALC_ERROR calc_q_to_dec(INT64 v, UINTN frac, UINTN digits, INT64 *r) {
+    UINT64 q;
+    CALC_U128 p;
+
+    calc_mul_u128(v < 0 ? (UINT64)0 - (UINT64)v : (UINT64)v, calc_pow10[digits], &p);
+    if (!calc_u128_shr_round(&p, frac, &q)) return CALC_ERR_OVERFLOW;
+    *r = v < 0 ? -(INT64)q : (INT64)q;
+    return CALC_OK;
+}
+
+/* Evaluate sum(coef[i] * x^i) in Q61 by Horner's rule */
+INT64 calc_poly_q61(CONST INT64 *coef, UINTN count, INT64 x) {
+    INT64 acc = coef[count - 1];
+    for (UINTN i = count - 1; i-- > 0; ) {
+        acc = coef[i] + calc_mul_q(acc, x, 61);
+    }
+    return acc;
+}
+
+/* Count leading zero bits of a non-zero 64-bit value with 32-bit bsr */
+UINTN calc_clz64(UINT64 v) {
+    if ((v >> 32) != 0) return __builtin_clz((UINT32)(v >> 32));
+    return 32 + __builtin_clz((UINT32)v);
+}
+
+/* Split a non-negative 10^digits value into its integer part and a Q64 fraction */
+UINT64 calc_dec_split(UINT64 mag, UINTN digits, UINT64 *frac) {
+    UINT64 rem;
+    UINT64 whole = calc_udiv64(mag, calc_pow10[digits], &rem);
+    *frac = calc_udiv_128by64(rem, 0, calc_pow10[digits], &rem);
+    return whole;
+}
+
+/* round(m * 10^digits / 2^s), where s may be negative */
+CALC_ERROR calc_scale_pow2(UINT64 m, INTN s, UINTN digits, INT64 *r) {
+    CALC_U128 prod;
+    UINT64 q;
+
+    calc_mul_u128(m, calc_pow10[digits], &prod);
+    if (s >= 0) {
+        if (!calc_u128_shr_round(&prod, (UINTN)s, &q)) return CALC_ERR_OVERFLOW;
+    } else {
+        if (s <= -63 || prod.hi != 0 || (prod.lo >> (63 + s)) != 0) return CALC_ERR_OVERFLOW;
+        q = prod.lo << -s;
+    }
+    *r = (INT64)q;
+    return CALC_OK;
+}
+
+/*
+ * exp(X) for X = +/-(whole + frac / 2^64), at 10^digits scale. The
+ * reduction X = k ln2 + red uses a 128-bit ln 2, so red keeps a full
+ * 64-bit fraction however large k is.
+ */
+CALC_ERROR calc_exp_q64(BOOLEAN neg, UINT64 whole, UINT64 frac, UINTN digits, INT64 *r) {
+    UINT64 k, rem, t;
+    INT64 red, p;
+    CALC_U128 a, b;
+
+    /* e^64 exceeds every scale; e^-64 rounds to zero at CALC_MAX_DIGITS */
+    if (whole >= 64) {
+        if (!neg) return CALC_ERR_OVERFLOW;
+        *r = 0;
+        return CALC_OK;
+    }
+
+    k = calc_udiv64(((whole << 56) | (frac >> 8)) + Q56_LN2 / 2, Q56_LN2, &rem);
+    calc_mul_u128(k, Q128_LN2_HI, &b);
+    calc_mul_u128(k, Q128_LN2_LO, &a);
+    t = b.lo + a.hi;
+
+    /* |red| < 0.35, so the low word of X - k ln2 holds it as signed Q64 */
+    red = (INT64)(frac - t);
+    if (neg) red = -red;
+    p = calc_poly_q61(calc_exp_coef, sizeof(calc_exp_coef) / sizeof(calc_exp_coef[0]),
+                      (red + 4) >> 3);
+
+    /* Scale by 2^(+/-k) while converting to decimal */
+    return calc_scale_pow2((UINT64)p, neg ? 61 + (INTN)k : 61 - (INTN)k, digits, r);
+}
+
+/* Natural log of a positive value at 10^digits scale, as +/-(whole + frac / 2^64) */
+CALC_ERROR calc_ln_q64(INT64 x, UINTN digits, BOOLEAN *neg, UINT64 *whole, UINT64 *frac) {
+    INTN e;
+    INT64 m, z, z2, series;
+    UINT64 lo, hi, carry;
+    CALC_U128 a, b;
+
+    if (x <= 0) return CALC_ERR_DOMAIN;
+
+    /* x = m * 2^e with m in [sqrt(2)/2, sqrt(2)) as Q61 */
+    if ((x >> 32) != 0) {
+        e = 63 - __builtin_clz((UINT32)(x >> 32));
+    } else {
+        e = 31 - __builtin_clz((UINT32)x);
+    }
+    m = e <= 61 ? x << (61 - e) : x >> 1;
+    if (m > Q61_SQRT2) {
+        m = (m + 1) >> 1;
+        e++;
+    }
+
+    /* ln m = 2 atanh(z), z = (m - 1) / (m + 1), |z| < 0.172 */
+    calc_muldiv(m - Q61_ONE, Q61_ONE, m + Q61_ONE, &z);
+    z2 = calc_mul_q(z, z, 61);
+    series = calc_poly_q61(calc_atanh_coef, sizeof(calc_atanh_coef) / sizeof(calc_atanh_coef[0]), z2);
+    series = calc_mul_q(z, series, 61);
+
+    /*
+     * ln x = e ln2 - digits ln10 + ln m. A Q56 ln 2 times e would be off
+     * by up to 31 Q56 units, almost half a unit in the 15th digit, so the
+     * sum is formed in Q64 from the 128-bit constants.
+     */
+    calc_mul_u128((UINT64)e, Q128_LN2_HI, &a);
+    calc_mul_u128((UINT64)e, Q128_LN2_LO, &b);
+    lo = a.lo + b.hi;
+    hi = a.hi + (lo < b.hi);
+    calc_mul_u128(digits, Q128_LN10_HI, &a);
+    calc_mul_u128(digits, Q128_LN10_LO, &b);
+    a.lo += b.hi;
+    a.hi += (a.lo < b.hi) + 2 * digits;
+    carry = lo < a.lo;
+    lo -= a.lo;
+    hi -= a.hi + carry;
+    /* series is atanh z in Q61, so ln m = 2 series is series in Q60; |ln m| < 0.35 */
+    lo += (UINT64)series << 4;
+    hi += (lo < ((UINT64)series << 4)) + (series < 0 ? ~(UINT64)0 : 0);
+
+    *neg = (hi >> 63) != 0;
+    if (*neg) {
+        lo = (UINT64)0 - lo;
+        hi = ~hi + (lo == 0);
+    }
+    *whole = hi;
+    *frac = lo;
+    return CALC_OK;
+}
+
+/* Natural log of a positive value at 10^digits scale, returned in Q56 */
+CALC_ERROR calc_ln_q56(INT64 x, UINTN digits, INT64 *r) {
+    BOOLEAN neg;
+    UINT64 whole, frac, q;
+    CALC_ERROR error = calc_ln_q64(x, digits, &neg, &whole, &frac);
+
+    if (error != CALC_OK) return error;
+    /* |ln x| < 44, so Q56 has room */
+    q = (whole << 56) + (frac >> 8) + ((frac >> 7) & 1);
+    *r = neg ? -(INT64)q : (INT64)q;
+    return CALC_OK;
+}
+
+/* ln or log at 10^digits scale, rounded once from the Q64 logarithm */
+CALC_ERROR calc_log_dec(INT64 x, UINTN digits, UINTN fn, INT64 *r) {
+    BOOLEAN neg;
+    UINT64 whole, frac, q;
+    CALC_U128 a, b;
+    CALC_ERROR error = calc_ln_q64(x, digits, &neg, &whole, &frac);
+
+    if (error != CALC_OK) return error;
+    if (fn == CALC_FN_LOG) {
+        calc_mul_u128(whole, Q64_INV_LN10, &a);
+        calc_mul_u128(frac, Q64_INV_LN10, &b);
+        frac = a.lo + b.hi;
+        whole = a.hi + (frac < b.hi);
+    }
+    calc_mul_u128(frac, calc_pow10[digits], &a);
+    q = whole * calc_pow10[digits] + a.hi + (a.lo >> 63);
+    *r = neg ? -(INT64)q : (INT64)q;
+    return CALC_OK;
+}
+
+/*
+ * sin, cos or tan of x at 10^digits scale. The argument is reduced by
+ * multiplying with a 128-bit 2/pi, so even large angles keep a full
+ * 64-bit fraction of the quarter turn.
+ */
+CALC_ERROR calc_trig(INT64 x, UINTN digits, UINTN fn, INT64 *r) {
+    UINT64 ux = x < 0 ? (UINT64)0 - (UINT64)x : (UINT64)x;
+    UINT64 xh, xl, frac, carry, w1, w2;
+    UINTN quadrant;
+    INT64 half, red, red2, s, c, sin_v, cos_v;
+    CALC_U128 a, b, cc, d;
+
+    /* X = |x| as Q64 (integer part xh, fraction xl) */
+    xh = calc_dec_split(ux, digits, &xl);
+
+    /* Words 2 and 3 of the 256-bit product X * (2/pi) */
+    calc_mul_u128(xl, Q128_2_OVER_PI_LO, &a);
+    calc_mul_u128(xh, Q128_2_OVER_PI_LO, &b);
+    calc_mul_u128(xl, Q128_2_OVER_PI_HI, &cc);
+    calc_mul_u128(xh, Q128_2_OVER_PI_HI, &d);
+    w1 = a.hi + b.lo;
+    carry = w1 < b.lo;
+    w1 += cc.lo;
+    carry += w1 < cc.lo;
+    w2 = b.hi + carry;
+    carry = w2 < carry;
+    w2 += cc.hi;
+    carry += w2 < cc.hi;
+    w2 += d.lo;
+    carry += w2 < d.lo;
+    quadrant = (UINTN)((d.hi + carry) & 3);
+    frac = w2;
+
+    /* Centre the fraction on the nearest quarter turn: red in [-pi/4, pi/4] */
+    if (frac >> 63) {
+        quadrant = (quadrant + 1) & 3;
+        half = -(INT64)((((UINT64)0 - frac) >> 1));
+    } else {
+        half = (INT64)(frac >> 1);
+    }
+    red = calc_mul_q(half, Q61_PI_2, 63);
+    red2 = calc_mul_q(red, red, 61);
+
+    s = calc_mul_q(red, calc_poly_q61(calc_sin_coef, sizeof(calc_sin_coef) / sizeof(calc_sin_coef[0]), red2), 61);
+    c = calc_poly_q61(calc_cos_coef, sizeof(calc_cos_coef) / sizeof(calc_cos_coef[0]), red2);
+    switch (quadrant) {
+    case 0:  sin_v = s;  cos_v = c;  break;
+    case 1:  sin_v = c;  cos_v = -s; break;
+    case 2:  sin_v = -s; cos_v = -c; break;
+    default: sin_v = -c; cos_v = s;  break;
+    }
+    if (x < 0) sin_v = -sin_v;
+
+    if (fn == CALC_FN_SIN) return calc_q_to_dec(sin_v, 61, digits, r);
+    if (fn == CALC_FN_COS) return calc_q_to_dec(cos_v, 61, digits, r);
+    return calc_muldiv(sin_v, (INT64)calc_pow10[digits], cos_v, r);
+}
+
+/* Square root at 10^digits scale: isqrt(x * 10^digits), rounded */
+CALC_ERROR calc_sqrt_dec(INT64 x, UINTN digits, INT64 *r) {
+    CALC_U128 n, sq;
+    UINT64 guess, next, rem;
+
+    if (x < 0) return CALC_ERR_DOMAIN;
+    if (x == 0) {
+        *r = 0;
+        return CALC_OK;
+    }
+    calc_mul_u128((UINT64)x, calc_pow10[digits], &n);
+
+    /*
+     * Newton's method from above converges monotonically. n < 2^113, so
+     * 2^57 is a safe start, and every iterate stays above n >> 64 as the
+     * 128/64 division requires.
+     */
+    guess = n.hi != 0 ? (UINT64)1 << 57 : (UINT64)1 << 32;
+    for (;;) {
+        next = (guess + calc_udiv_128by64(n.hi, n.lo, guess, &rem)) >> 1;
+        if (next >= guess) break;
+        guess = next;
+    }
+
+    /* Round to nearest: bump when n - g^2 > g */
+    calc_mul_u128(guess, guess, &sq);
+    if (n.hi > sq.hi || (n.hi == sq.hi && n.lo > sq.lo)) {
+        UINT64 diff_lo = n.lo - sq.lo;
+        UINT64 diff_hi = n.hi - sq.hi - (n.lo < sq.lo);
+        if (diff_hi != 0 || diff_lo > guess) guess++;
+    }
+    *r = (INT64)guess;
+    return CALC_OK;
+}
+
+/*
+ * Integer powers of a 10^digits value by repeated squaring in a small soft
+ * float: a 64-bit mantissa with its top bit set and a binary exponent.
+ * Each product is rounded once to 64 bits, so even x^65536 keeps about
+ * 59 significant bits, where squaring at the output scale would round away
+ * a digit per step.
+ */
+typedef struct {
+    UINT64 m;
+    INTN e;           /* Value is m * 2^e */
+} CALC_SOFT_FLOAT;
+
+#define CALC_POWI_MAX 65536
+
+VOID calc_sf_mul(CALC_SOFT_FLOAT *r, CALC_SOFT_FLOAT *a, CALC_SOFT_FLOAT *b) {
+    CALC_U128 p;
+    INTN e = a->e + b->e + 64;
+
+    calc_mul_u128(a->m, b->m, &p);
+    if ((p.hi >> 63) == 0) {
+        p.hi = (p.hi << 1) | (p.lo >> 63);
+        p.lo <<= 1;
+        e--;
+    }
+    if ((p.lo >> 63) != 0 && ++p.hi == 0) {
+        p.hi = (UINT64)1 << 63;
+        e++;
+    }
+    r->m = p.hi;
+    r->e = e;
+}
+
+CALC_ERROR calc_powi_dec(INT64 x, UINT64 n, BOOLEAN recip, UINTN digits, INT64 *r) {
+    UINT64 mag = x < 0 ? (UINT64)0 - (UINT64)x : (UINT64)x;
+    UINT64 whole, frac, rem;
+    CALC_SOFT_FLOAT base, acc;
+    UINTN z;
+    CALC_ERROR error;
+
+    if (mag == 0) {
+        if (n == 0) {
+            *r = (INT64)calc_pow10[digits];
+            return CALC_OK;
+        }
+        if (recip) return CALC_ERR_DIV_ZERO;
+        *r = 0;
+        return CALC_OK;
+    }
+
+    /* base = whole:frac normalised to a 64-bit mantissa */
+    whole = calc_dec_split(mag, digits, &frac);
+    if (whole != 0) {
+        z = calc_clz64(whole);
+        base.m = z == 0 ? whole : (whole << z) | (frac >> (64 - z));
+        base.e = -(INTN)z;
+    } else {
+        z = calc_clz64(frac);
+        base.m = frac << z;
+        base.e = -64 - (INTN)z;
+    }
+    acc.m = (UINT64)1 << 63;
+    acc.e = -63;
+
+    for (UINT64 bits = n; bits != 0; bits >>= 1) {
+        if (bits & 1) calc_sf_mul(&acc, &acc, &base);
+        if (bits > 1) calc_sf_mul(&base, &base, &base);
+    }
+
+    if (recip) {
+        /* 1 / (m 2^e) = (2^126 / m) 2^(-126 - e) */
+        acc.m = calc_udiv_128by64((UINT64)1 << 62, 0, acc.m, &rem);
+        acc.e = -126 - acc.e;
+    }
+    error = calc_scale_pow2(acc.m, -acc.e, digits, r);
+    if (error != CALC_OK) return error;
+    if (x < 0 && (n & 1)) *r = -*r;
+    return CALC_OK;
+}
+
+/* Decimal-mode power: soft-float squaring for integer exponents, else exp(y ln x) */
+CALC_ERROR calc_pow_dec(INT64 x, INT64 y, UINTN digits, INT64 *r) {
+    INT64 one = (INT64)calc_pow10[digits];
+    INT64 whole, frac, ln_x, prod;
+    UINT64 n, ip, fp;
+    CALC_ERROR error;
+
+    calc_div64(y, one, &whole, &frac);
+    n = whole < 0 ? (UINT64)0 - (UINT64)whole : (UINT64)whole;
+    if (frac == 0 && (n <= CALC_POWI_MAX || x == 0)) {
+        return calc_powi_dec(x, n, whole < 0, digits, r);
+    }
+
+    if (x <= 0) return CALC_ERR_DOMAIN;
+    error = calc_ln_q56(x, digits, &ln_x);
+    if (error != CALC_OK) return error;
+    error = calc_muldiv(y, ln_x, one, &prod);
+    if (error != CALC_OK) {
+        if ((y < 0) == (ln_x < 0)) return CALC_ERR_OVERFLOW;
+        *r = 0;
+        return CALC_OK;
+    }
+    ip = (prod < 0 ? (UINT64)0 - (UINT64)prod : (UINT64)prod);
+    fp = ip << 8;
+    ip >>= 56;
+    return calc_exp_q64(prod < 0, ip, fp, digits, r);
+}
+
+/* Built-in functions and constants in decimal mode */
+CALC_ERROR calc_call_dec(UINTN fn, INT64 x, UINTN digits, INT64 *r) {
+    UINT64 whole, frac;
+
+    switch (fn) {
+    case CALC_FN_PI:
+        return calc_q_to_dec(Q61_PI, 61, digits, r);
+    case CALC_FN_E:
+        return calc_q_to_dec(Q61_E, 61, digits, r);
+    case CALC_FN_SQRT:
+        return calc_sqrt_dec(x, digits, r);
+    case CALC_FN_EXP:
+        whole = calc_dec_split(x < 0 ? (UINT64)0 - (UINT64)x : (UINT64)x, digits, &frac);
+        return calc_exp_q64(x < 0, whole, frac, digits, r);
+    case CALC_FN_LN:
+    case CALC_FN_LOG:
+        return calc_log_dec(x, digits, fn, r);
+    case CALC_FN_SIN:
+    case CALC_FN_COS:
+    case CALC_FN_TAN:
+        return calc_trig(x, digits, fn, r);
+    default:
+        return CALC_ERR_SYNTAX;
+    }
+}
+
+/* Factorial of an integral decimal-mode value */
+CALC_ERROR calc_fact_dec(INT64 x, UINTN digits, INT64 *r) {
+    INT64 one = (INT64)calc_pow10[digits];
+    INT64 whole, frac, v;
+    CALC_ERROR error;
+
+    calc_div64(x, one, &whole, &frac);
+    if (frac != 0) return CALC_ERR_DOMAIN;
+    error = calc_fact64(whole, &v);
+    if (error != CALC_OK) return error;
+    if (__builtin_mul_overflow(v, one, r)) return CALC_ERR_OVERFLOW;
+    return CALC_OK;
+}
+
+/* Execute a program compiled in decimal mode */
+CALC_ERROR calc_run_decimal(CALC_PROGRAM *prog, UINTN digits, INT64 *result) {
+    INT64 stack[CALC_VM_STACK];
+    CALC_FRAME frames[CALC_MAX_FRAMES];
+    UINTN frame_count = 0;
+    INT64 one = (INT64)calc_pow10[digits];
+    UINTN sp = 0;
+    UINTN base = 0;
+    UINT8 *pc = prog->code;
+    INT64 quot, rem;
+    CALC_ERROR error = CALC_OK;
+
+    for (;;) {
+        switch (*pc++) {
+        case OP_PUSH:
+            stack[sp++] = prog->consts[*pc++];
+            break;
+        case OP_NEG:
+            if (__builtin_sub_overflow((INT64)0, stack[sp - 1], &stack[sp - 1])) {
+                return CALC_ERR_OVERFLOW;
+            }
+            break;
+        case OP_FACT:
+            error = calc_fact_dec(stack[sp - 1], digits, &stack[sp - 1]);
+            break;
+        case OP_CALL:
+            if (calc_functions[*pc].arity == 0) stack[sp++] = 0;
+            error = calc_call_dec(*pc, stack[sp - 1], digits, &stack[sp - 1]);
+            pc++;
+            break;
+        case OP_ADD:
+            sp--;
+            if (__builtin_add_overflow(stack[sp - 1], stack[sp], &stack[sp - 1])) {
+                return CALC_ERR_OVERFLOW;
+            }
+            break;
+        case OP_SUB:
+            sp--;
+            if (__builtin_sub_overflow(stack[sp - 1], stack[sp], &stack[sp - 1])) {
+                return CALC_ERR_OVERFLOW;
+            }
+            break;
+        case OP_MUL:
+            sp--;
+            error = calc_muldiv(stack[sp - 1], stack[sp], one, &stack[sp - 1]);
+            break;
+        case OP_DIV:
+            sp--;
+            error = calc_muldiv(stack[sp - 1], one, stack[sp], &stack[sp - 1]);
+            break;
+        case OP_MOD:
+            sp--;
+            error = calc_div64(stack[sp - 1], stack[sp], &quot, &rem);
+            if (error == CALC_ERR_OVERFLOW) error = CALC_OK;
+            stack[sp - 1] = rem;
+            break;
+        case OP_POW:
+            sp--;
+            error = calc_pow_dec(stack[sp - 1], stack[sp], digits, &stack[sp - 1]);
+            break;
+        case OP_LOAD:
+            error = calc_load(*pc++, digits, &stack[sp++]);
+            break;
+        case OP_STORE:
+            calc_store(*pc++, stack[sp - 1], digits);
+            break;
+        case OP_ARG:
+            stack[sp] = stack[base + *pc++];
+            sp++;
+            break;
+        case OP_CALL_USER:
+            error = calc_enter(&prog, &pc, &base, sp, frames, &frame_count);
+            break;
+        case OP_RET:
+            stack[base] = stack[sp - 1];
+            sp = base + 1;
+            frame_count--;
+            prog = frames[frame_count].prog;
+            pc = frames[frame_count].pc;
+            base = frames[frame_count].base;
+            break;
+        case OP_END:
+            *result = stack[0];
+            return CALC_OK;
+        default:
+            return CALC_ERR_SYNTAX;
+        }
+        if (error != CALC_OK) return error;
+    }
+}
+
+/*
+ * Column-batched evaluation for the plotter. Calculator programs have no
+ * branches, so every sample of a graph takes the same path through the
+ * bytecode: each instruction is decoded once per batch and applied to all
+ * of its lanes in a tight loop, instead of being dispatched again for
+ * every sample. A lane whose arithmetic fails (overflow, a domain error,
+ * division by zero) is marked invalid and the others carry on.
+ */
+#define CALC_LANES 32
+
+INT64 calc_lane_stack[CALC_VM_STACK][CALC_LANES];
+
+/* Run a one-parameter function body for count (at most CALC_LANES) arguments */
+CALC_ERROR calc_run_lanes(CALC_PROGRAM *prog, UINTN digits, INT64 *xs, INT64 *ys,
+                          BOOLEAN *valid, UINTN count) {
+    INT64 (*stack)[CALC_LANES] = calc_lane_stack;
+    CALC_FRAME frames[CALC_MAX_FRAMES];
+    UINTN frame_count = 0;
+    INT64 one = (INT64)calc_pow10[digits];
+    UINTN sp = 1;
+    UINTN base = 0;
+    UINT8 *pc = prog->code;
+    INT64 value, quot, rem;
+    INT64 *a, *b;
+    CALC_ERROR error;
+    UINTN i;
+
+    if (prog->max_depth + 1 > CALC_VM_STACK) return CALC_ERR_TOO_LONG;
+    for (i = 0; i < count; i++) {
+        stack[0][i] = xs[i];
+        valid[i] = TRUE;
+    }
+
+    for (;;) {
+        UINT8 op = *pc++;
+
+        /* Binary operators pop b and replace a */
+        if (op >= OP_ADD && op <= OP_POW) sp--;
+        a = stack[sp - 1];
+        b = stack[sp];
+
+        switch (op) {
+        case OP_PUSH:
+            value = prog->consts[*pc++];
+            for (i = 0; i < count; i++) b[i] = value;
+            sp++;
+            break;
+        case OP_LOAD:
+            error = calc_load(*pc++, digits, &value);
+            if (error != CALC_OK) return error;
+            for (i = 0; i < count; i++) b[i] = value;
+            sp++;
+            break;
+        case OP_ARG:
+            CopyMem(b, stack[base + *pc++], count * sizeof(INT64));
+            sp++;
+            break;
+        case OP_STORE:
+            return CALC_ERR_SYNTAX;
+        case OP_NEG:
+            for (i = 0; i < count; i++) {
+                if (__builtin_sub_overflow((INT64)0, a[i], &a[i])) valid[i] = FALSE;
+            }
+            break;
+        case OP_ADD:
+            for (i = 0; i < count; i++) {
+                if (__builtin_add_overflow(a[i], b[i], &a[i])) valid[i] = FALSE;
+            }
+            break;
+        case OP_SUB:
+            for (i = 0; i < count; i++) {
+                if (__builtin_sub_overflow(a[i], b[i], &a[i])) valid[i] = FALSE;
+            }
+            break;
+        case OP_MUL:
+            for (i = 0; i < count; i++) {
+                if (valid[i] && calc_muldiv(a[i], b[i], one, &a[i]) != CALC_OK) valid[i] = FALSE;
+            }
+            break;
+        case OP_DIV:
+            for (i = 0; i < count; i++) {
+                if (valid[i] && calc_muldiv(a[i], one, b[i], &a[i]) != CALC_OK) valid[i] = FALSE;
+            }
+            break;
+        case OP_MOD:
+            for (i = 0; i < count; i++) {
+                if (!valid[i]) continue;
+                if (calc_div64(a[i], b[i], &quot, &rem) == CALC_ERR_DIV_ZERO) {
+                    valid[i] = FALSE;
+                } else {
+                    a[i] = rem;
+                }
+            }
+            break;
+        case OP_POW:
+            for (i = 0; i < count; i++) {
+                if (valid[i] && calc_pow_dec(a[i], b[i], digits, &a[i]) != CALC_OK) valid[i] = FALSE;
+            }
+            break;
+        case OP_FACT:
+            for (i = 0; i < count; i++) {
+                if (valid[i] && calc_fact_dec(a[i], digits, &a[i]) != CALC_OK) valid[i] = FALSE;
+            }
+            break;
+        case OP_CALL:
+            if (calc_functions[*pc].arity == 0) {
+                /* A constant: computed once for all lanes */
+                error = calc_call_dec(*pc, 0, digits, &value);
+                if (error != CALC_OK) return error;
+                for (i = 0; i < count; i++) b[i] = value;
+                sp++;
+            } else {
+                for (i = 0; i < count; i++) {
+                    if (valid[i] && calc_call_dec(*pc, a[i], digits, &a[i]) != CALC_OK) valid[i] = FALSE;
+                }
+            }
+            pc++;
+            break;
+        case OP_CALL_USER:
+            error = calc_enter(&prog, &pc, &base, sp, frames, &frame_count);
+            if (error != CALC_OK) return error;
+            break;
+        case OP_RET:
+            if (frame_count == 0) {
+                CopyMem(ys, a, count * sizeof(INT64));
+                return CALC_OK;
+            }
+            CopyMem(stack[base], a, count * sizeof(INT64));
+            sp = base + 1;
+            frame_count--;
+            prog = frames[frame_count].prog;
+            pc = frames[frame_count].pc;
+            base = frames[frame_count].base;
+            break;
+        default:
+            return CALC_ERR_SYNTAX;
+        }
+    }
+}
+
+/* Format a 10^digits scaled value, trimming trailing fraction zeros */
+UINTN calc_format_decimal(INT64 value, UINTN digits, CHAR16 *buf) {
+    UINT64 mag = value < 0 ? (UINT64)0 - (UINT64)value : (UINT64)value;
+    UINT64 frac;
+    UINT64 whole = calc_udiv64(mag, calc_pow10[digits], &frac);
+    UINTN len = 0;
+
+    if (value < 0) buf[len++] = L'-';
+    len += calc_format_int64((INT64)whole, buf + len);
+    if (frac != 0) {
+        UINTN last;
+        buf[len++] = L'.';
+        for (UINTN i = digits; i-- > 0; ) {
+            UINT64 digit;
+            frac = calc_udiv64(frac, 10, &digit);
+            buf[len + i] = (CHAR16)(L'0' + digit);
+        }
+        last = len + digits;
+        while (buf[last - 1] == L'0') last--;
+        len = last;
+    }
+    buf[len] = 0;
+    return len;
+}
+
+/*
+ * Arbitrary-precision integers
+ *
+ * When a 64-bit evaluation overflows, the same bytecode is re-run on
+ * BIGNUM values. Magnitudes are little-endian arrays of 32-bit limbs carved
+ * from a bump arena that is reset before every evaluation, so temporaries
+ * are released by rolling the arena back to a mark rather than freed one
+ * by one. Multiplication is schoolbook below BN_KARATSUBA_THRESHOLD limbs
+ * and Karatsuba above it; division is Knuth's algorithm D; decimal output
+ * splits the number recursively by precomputed powers 10^(9*2^k), so most
+ * of the work is multiply-subtract instead of one divl per limb per chunk.
+ */
+#define BN_ARENA_SIZE          (4 * 1024 * 1024)
+#define BN_MAX_LIMBS           8192      /* About 79,000 decimal digits */
+#define BN_MAX_FACTORIAL       20000
+#define BN_KARATSUBA_THRESHOLD 32
+#define BN_DC_THRESHOLD        24        /* Limbs; below this use 10^9 chunks */
+#define BN_MAX_POWERS          16
+#define BN_CHUNK_BASE          1000000000u
+#define BN_CHUNK_DIGITS        9
+
+/* Output buffer size for a len-limb value: digits, chunk slack, sign, NUL */
+#define BN_DECIMAL_CHARS(len)  ((len) * 10 + 20)
+
+typedef struct {
+    UINT32 *d;      /* Little-endian limbs */
+    UINTN len;      /* Significant limbs; zero has len 0 */
+    BOOLEAN neg;
+} BIGNUM;
+
+UINT8 *bn_arena = NULL;
+UINTN bn_arena_used = 0;
+
+/* Carve limbs from the arena; returns NULL when it is exhausted */
+UINT32 *bn_alloc(UINTN limbs) {
+    UINTN bytes = (limbs * sizeof(UINT32) + 7) & ~(UINTN)7;
+    UINT32 *ptr;
+
+    if (bn_arena == NULL) {
+        if (EFI_ERROR(BS->AllocatePool(EfiLoaderData, BN_ARENA_SIZE, (VOID **)&bn_arena))) {
+            bn_arena = NULL;
+            return NULL;
+        }
+    }
+    if (limbs > BN_ARENA_SIZE / sizeof(UINT32) || bytes > BN_ARENA_SIZE - bn_arena_used) {
+        return NULL;
+    }
+    ptr = (UINT32 *)(bn_arena + bn_arena_used);
+    bn_arena_used += bytes;
+    return ptr;
+}
+
+UINTN bn_normalize(CONST UINT32 *d, UINTN n) {
+    while (n > 0 && d[n - 1] == 0) n--;
+    return n;
+}
+
+VOID bn_copy(UINT32 *r, CONST UINT32 *a, UINTN n) {
+    for (UINTN i = 0; i < n; i++) r[i] = a[i];
+}
+
+VOID bn_zero(UINT32 *r, UINTN n) {
+    for (UINTN i = 0; i < n; i++) r[i] = 0;
+}
+
+/* Compare equal-length magnitudes */
+INTN bn_cmp_n(CONST UINT32 *a, CONST UINT32 *b, UINTN n) {
+    while (n-- > 0) {
+        if (a[n] != b[n]) return a[n] > b[n] ? 1 : -1;
+    }
+    return 0;
+}
+
+/* Compare normalized magnitudes */
+INTN bn_cmp(CONST UINT32 *a, UINTN an, CONST UINT32 *b, UINTN bn) {
+    if (an != bn) return an > bn ? 1 : -1;
+    return bn_cmp_n(a, b, an);
+}
+
+/* r = a + b over n limbs, returns the carry out */
+UINT32 bn_add_n(UINT32 *r, CONST UINT32 *a, CONST UINT32 *b, UINTN n) {
+    UINT32 carry = 0;
+    for (UINTN i = 0; i < n; i++) {
+        UINT64 t = (UINT64)a[i] + b[i] + carry;
+        r[i] = (UINT32)t;
+        carry = (UINT32)(t >> 32);
+    }
+    return carry;
+}
+
+/* r = a - b over n limbs, returns the borrow out */
+UINT32 bn_sub_n(UINT32 *r, CONST UINT32 *a, CONST UINT32 *b, UINTN n) {
+    UINT32 borrow = 0;
+    for (UINTN i = 0; i < n; i++) {
+        UINT64 t = (UINT64)a[i] - b[i] - borrow;
+        r[i] = (UINT32)t;
+        borrow = (UINT32)(t >> 32) & 1;
+    }
+    return borrow;
+}
+
+/* r = a + c over n limbs, returns the carry out */
+UINT32 bn_add_1(UINT32 *r, CONST UINT32 *a, UINTN n, UINT32 c) {
+    for (UINTN i = 0; i < n; i++) {
+        UINT32 t = a[i] + c;
+        c = t < c;
+        r[i] = t;
+    }
+    return c;
+}
+
+/* r = a - c over n limbs, returns the borrow out */
+UINT32 bn_sub_1(UINT32 *r, CONST UINT32 *a, UINTN n, UINT32 c) {
+    for (UINTN i = 0; i < n; i++) {
+        UINT32 t = a[i] - c;
+        c = a[i] < c;
+        r[i] = t;
+    }
+    return c;
+}
+
+/* r[0..an) = a + b with an >= bn, returns the carry out */
+UINT32 bn_add(UINT32 *r, CONST UINT32 *a, UINTN an, CONST UINT32 *b, UINTN bn) {
+    UINT32 carry = bn_add_n(r, a, b, bn);
+    return bn_add_1(r + bn, a + bn, an - bn, carry);
+}
+
+/* r[0..an) = a - b with an >= bn, returns the borrow out */
+UINT32 bn_sub(UINT32 *r, CONST UINT32 *a, UINTN an, CONST UINT32 *b, UINTN bn) {
+    UINT32 borrow = bn_sub_n(r, a, b, bn);
+    return bn_sub_1(r + bn, a + bn, an - bn, borrow);
+}
+
+/* r = a * m over n limbs, returns the high limb */
+UINT32 bn_mul_1(UINT32 *r, CONST UINT32 *a, UINTN n, UINT32 m) {
+    UINT32 carry = 0;
+    for (UINTN i = 0; i < n; i++) {
+        UINT64 t = (UINT64)a[i] * m + carry;
+        r[i] = (UINT32)t;
+        carry = (UINT32)(t >> 32);
+    }
+    return carry;
+}
+
+/* r += a * m over n limbs, returns the carry limb */
+UINT32 bn_addmul_1(UINT32 *r, CONST UINT32 *a, UINTN n, UINT32 m) {
+    UINT32 carry = 0;
+    for (UINTN i = 0; i < n; i++) {
+        UINT64 t = (UINT64)a[i] * m + r[i] + carry;
+        r[i] = (UINT32)t;
+        carry = (UINT32)(t >> 32);
+    }
+    return carry;
+}
+
+/* r -= a * m over n limbs, returns the borrow limb */
+UINT32 bn_submul_1(UINT32 *r, CONST UINT32 *a, UINTN n, UINT32 m) {
+    UINT32 borrow = 0;
+    for (UINTN i = 0; i < n; i++) {
+        UINT64 t = (UINT64)a[i] * m + borrow;
+        UINT32 lo = (UINT32)t;
+        borrow = (UINT32)(t >> 32) + (r[i] < lo);
+        r[i] -= lo;
+    }
+    return borrow;
+}
+
+/* q = a / d over n limbs (q may alias a), returns the remainder */
+UINT32 bn_divmod_1(UINT32 *q, CONST UINT32 *a, UINTN n, UINT32 d) {
+    UINT32 rem = 0;
+    while (n-- > 0) {
+        q[n] = calc_udiv_2by1(rem, a[n], d, &rem);
+    }
+    return rem;
+}
+
+/* r = a << s for 0 <= s < 32, returns the bits shifted out */
+UINT32 bn_lshift(UINT32 *r, CONST UINT32 *a, UINTN n, UINTN s) {
+    UINT32 out = 0;
+    if (s == 0) {
+        bn_copy(r, a, n);
+        return 0;
+    }
+    for (UINTN i = 0; i < n; i++) {
+        UINT32 limb = a[i];
+        r[i] = (limb << s) | out;
+        out = limb >> (32 - s);
+    }
+    return out;
+}
+
+/* r = a >> s for 0 <= s < 32 */
+VOID bn_rshift(UINT32 *r, CONST UINT32 *a, UINTN n, UINTN s) {
+    if (s == 0) {
+        bn_copy(r, a, n);
+        return;
+    }
+    for (UINTN i = 0; i < n; i++) {
+        r[i] = (a[i] >> s) | (i + 1 < n ? a[i + 1] << (32 - s) : 0);
+    }
+}
+
+/* Schoolbook product r[0..an+bn) = a * b; r must not overlap a or b */
+VOID bn_mul_basecase(UINT32 *r, CONST UINT32 *a, UINTN an, CONST UINT32 *b, UINTN bn) {
+    r[an] = bn_mul_1(r, a, an, b[0]);
+    for (UINTN j = 1; j < bn; j++) {
+        r[an + j] = bn_addmul_1(r + j, a, an, b[j]);
+    }
+}
+
+/* Scratch limbs needed by bn_mul_kara for n-limb operands */
+UINTN bn_kara_scratch(UINTN n) {
+    UINTN total = 0;
+    while (n >= BN_KARATSUBA_THRESHOLD) {
+        UINTN k = n - n / 2;
+        total += 6 * k + 1;
+        n = k;
+    }
+    return total;
+}
+
+/* r = |x - y| where x has xn limbs and y has yn <= xn; returns TRUE if x < y */
+BOOLEAN bn_abs_diff(UINT32 *r, CONST UINT32 *x, UINTN xn, CONST UINT32 *y, UINTN yn) {
+    BOOLEAN x_bigger = bn_normalize(x + yn, xn - yn) != 0 || bn_cmp_n(x, y, yn) >= 0;
+
+    if (x_bigger) {
+        bn_sub(r, x, xn, y, yn);
+        return FALSE;
+    }
+    /* x < y implies the limbs of x above yn are zero */
+    bn_sub_n(r, y, x, yn);
+    bn_zero(r + yn, xn - yn);
+    return TRUE;
+}
+
+/*
+ * Karatsuba product of two n-limb operands into r[0..2n), using the
+ * subtractive form z1 = z0 + z2 - (a1 - a0)(b1 - b0) so the half sums
+ * never carry. Needs bn_kara_scratch(n) limbs of scratch.
+ */
+VOID bn_mul_kara(UINT32 *r, CONST UINT32 *a, CONST UINT32 *b, UINTN n, UINT32 *scratch) {
+    UINTN m, k;
+    UINT32 *da, *db, *t, *mid, *next;
+    BOOLEAN neg_a, neg_b;
+    UINT32 carry;
+
+    if (n < BN_KARATSUBA_THRESHOLD) {
+        bn_mul_basecase(r, a, n, b, n);
+        return;
+    }
+
+    m = n / 2;
+    k = n - m;
+    da = scratch;
+    db = da + k;
+    t = db + k;
+    mid = t + 2 * k;
+    next = mid + 2 * k + 1;
+
+    neg_a = bn_abs_diff(da, a + m, k, a, m);
+    neg_b = bn_abs_diff(db, b + m, k, b, m);
+    bn_mul_kara(t, da, db, k, next);
+    bn_mul_kara(r, a, b, m, next);
+    bn_mul_kara(r + 2 * m, a + m, b + m, k, next);
+
+    /* mid = z0 + z2 -/+ t */
+    mid[2 * k] = bn_add(mid, r + 2 * m, 2 * k, r, 2 * m);
+    if (neg_a == neg_b) {
+        mid[2 * k] -= bn_sub_n(mid, mid, t, 2 * k);
+    } else {
+        mid[2 * k] += bn_add_n(mid, mid, t, 2 * k);
+    }
+
+    carry = bn_add_n(r + m, r + m, mid, 2 * k + 1);
+    bn_add_1(r + m + 2 * k + 1, r + m + 2 * k + 1, m - 1, carry);
+}
+
+/*
+ * r[0..an+bn) = a * b with an >= bn >= 1; r must not overlap a or b.
+ * Unbalanced operands are cut into bn-limb slices of a. Returns FALSE if
+ * the arena cannot hold the scratch space.
+ */
+BOOLEAN bn_mul(UINT32 *r, CONST UINT32 *a, UINTN an, CONST UINT32 *b, UINTN bn) {
+    UINTN mark = bn_arena_used;
+    UINT32 *scratch, *tmp;
+    UINTN i;
+    BOOLEAN ok = TRUE;
+
+    if (bn < BN_KARATSUBA_THRESHOLD) {
+        bn_mul_basecase(r, a, an, b, bn);
+        return TRUE;
+    }
+
+    scratch = bn_alloc(bn_kara_scratch(bn));
+    if (scratch == NULL) return FALSE;
+    bn_mul_kara(r, a, b, bn, scratch);
+    if (an == bn) {
+        bn_arena_used = mark;
+        return TRUE;
+    }
+
+    tmp = bn_alloc(2 * bn);
+    if (tmp == NULL) {
+        bn_arena_used = mark;
+        return FALSE;
+    }
+    bn_zero(r + 2 * bn, an - bn);
+    for (i = bn; i + bn <= an; i += bn) {
+        UINT32 carry;
+        bn_mul_kara(tmp, a + i, b, bn, scratch);
+        carry = bn_add_n(r + i, r + i, tmp, 2 * bn);
+        bn_add_1(r + i + 2 * bn, r + i + 2 * bn, an - i - bn, carry);
+    }
+    if (i < an) {
+        UINTN rest = an - i;
+        ok = bn_mul(tmp, b, bn, a + i, rest);
+        if (ok) bn_add(r + i, r + i, an + bn - i, tmp, bn + rest);
+    }
+
+    bn_arena_used = mark;
+    return ok;
+}
+
+/*
+ * Long division (Knuth, TAOCP vol. 2, 4.3.1, algorithm D).
+ * q[0..an-bn] = a / b and r[0..bn) = a % b, where an >= bn >= 1 and
+ * b[bn-1] != 0. Returns FALSE if the arena is exhausted.
+ */
+BOOLEAN bn_divmod(UINT32 *q, UINT32 *r, CONST UINT32 *a, UINTN an, CONST UINT32 *b, UINTN bn) {
+    UINTN mark = bn_arena_used;
+    UINT32 *un, *vn;
+    UINTN shift;
+    UINT32 vtop, vnext;
+
+    if (bn == 1) {
+        r[0] = bn_divmod_1(q, a, an, b[0]);
+        return TRUE;
+    }
+
+    un = bn_alloc(an + 1);
+    vn = bn_alloc(bn);
+    if (un == NULL || vn == NULL) {
+        bn_arena_used = mark;
+        return FALSE;
+    }
+
+    /* Normalize so the top bit of the divisor is set */
+    shift = __builtin_clz(b[bn - 1]);
+    bn_lshift(vn, b, bn, shift);
+    un[an] = bn_lshift(un, a, an, shift);
+    vtop = vn[bn - 1];
+    vnext = vn[bn - 2];
+
+    for (UINTN j = an - bn + 1; j-- > 0; ) {
+        UINT32 u2 = un[j + bn];
+        UINT32 u1 = un[j + bn - 1];
+        UINT32 u0 = un[j + bn - 2];
+        UINT32 qhat, rhat, borrow;
+        BOOLEAN rhat_wide = FALSE;
+
+        /* Estimate the quotient digit from the top two limbs */
+        if (u2 >= vtop) {
+            UINT64 t = (UINT64)u1 + vtop;
+            qhat = 0xFFFFFFFF;
+            rhat = (UINT32)t;
+            rhat_wide = (t >> 32) != 0;
+        } else {
+            qhat = calc_udiv_2by1(u2, u1, vtop, &rhat);
+        }
+        while (!rhat_wide && (UINT64)qhat * vnext > (((UINT64)rhat << 32) | u0)) {
+            UINT64 t = (UINT64)rhat + vtop;
+            qhat--;
+            rhat = (UINT32)t;
+            rhat_wide = (t >> 32) != 0;
+        }
+
+        /* Multiply and subtract; add back on the rare over-estimate */
+        borrow = bn_submul_1(un + j, vn, bn, qhat);
+        if (u2 < borrow) {
+            qhat--;
+            un[j + bn] = u2 - borrow + bn_add_n(un + j, un + j, vn, bn);
+        } else {
+            un[j + bn] = u2 - borrow;
+        }
+        q[j] = qhat;
+    }
+
+    bn_rshift(r, un, bn, shift);
+    bn_arena_used = mark;
+    return TRUE;
+}
+
+/* Allocate a BIGNUM with room for limbs */
+BOOLEAN bn_init(BIGNUM *r, UINTN limbs) {
+    r->d = bn_alloc(limbs ? limbs : 1);
+    r->len = 0;
+    r->neg = FALSE;
+    return r->d != NULL;
+}
+
+BOOLEAN bn_set_int64(BIGNUM *r, INT64 value) {
+    UINT64 mag = value < 0 ? (UINT64)0 - (UINT64)value : (UINT64)value;
+
+    if (!bn_init(r, 2)) return FALSE;
+    r->d[0] = (UINT32)mag;
+    r->d[1] = (UINT32)(mag >> 32);
+    r->len = bn_normalize(r->d, 2);
+    r->neg = value < 0;
+    return TRUE;
+}
+
+/* Convert to INT64 if the value fits */
+BOOLEAN bn_to_int64(BIGNUM *a, INT64 *value) {
+    UINT64 mag;
+
+    if (a->len > 2) return FALSE;
+    mag = a->len == 0 ? 0 : a->d[0];
+    if (a->len == 2) mag |= (UINT64)a->d[1] << 32;
+    if (a->neg) {
+        if (mag > (UINT64)1 << 63) return FALSE;
+        *value = (INT64)((UINT64)0 - mag);
+    } else {
+        if (mag >= (UINT64)1 << 63) return FALSE;
+        *value = (INT64)mag;
+    }
+    return TRUE;
+}
+
+/* Parse a run of decimal digits, nine at a time */
+BOOLEAN bn_from_decimal(BIGNUM *r, CONST CHAR8 *digits, UINTN count) {
+    UINTN limbs = count / BN_CHUNK_DIGITS + 2;
     UINTN i = 0;
+
+    if (!bn_init(r, limbs)) return FALSE;
+    while (i < count) {
+        UINT32 chunk = 0;
+        UINT32 scale = 1;
+        for (UINTN k = 0; k < BN_CHUNK_DIGITS && i < count; k++, i++) {
+            chunk = chunk * 10 + (digits[i] - '0');
+            scale *= 10;
+        }
+        r->d[r->len] = bn_mul_1(r->d, r->d, r->len, scale);
+        r->len++;
+        r->d[r->len] = bn_add_1(r->d, r->d, r->len, chunk);
+        r->len = bn_normalize(r->d, r->len + 1);
+    }
+    return TRUE;
+}
+
+/* Signed addition; subtracts b when subtract is set */
+BOOLEAN bn_add_signed(BIGNUM *r, BIGNUM *a, BIGNUM *b, BOOLEAN subtract) {
+    BOOLEAN b_neg = subtract ? !b->neg : b->neg;
+    BIGNUM *big = a, *small = b;
+    BOOLEAN big_neg = a->neg;
+
+    if (bn_cmp(a->d, a->len, b->d, b->len) < 0) {
+        big = b;
+        small = a;
+        big_neg = b_neg;
+    }
+    if (!bn_init(r, big->len + 1)) return FALSE;
+
+    if (a->neg == b_neg) {
+        r->d[big->len] = bn_add(r->d, big->d, big->len, small->d, small->len);
+        r->len = bn_normalize(r->d, big->len + 1);
+    } else {
+        bn_sub(r->d, big->d, big->len, small->d, small->len);
+        r->len = bn_normalize(r->d, big->len);
+    }
+    r->neg = r->len != 0 && big_neg;
+    return TRUE;
+}
+
+BOOLEAN bn_mul_signed(BIGNUM *r, BIGNUM *a, BIGNUM *b) {
+    BIGNUM *big = a->len >= b->len ? a : b;
+    BIGNUM *small = a->len >= b->len ? b : a;
+
+    if (small->len == 0) return bn_set_int64(r, 0);
+    if (!bn_init(r, big->len + small->len)) return FALSE;
+    if (!bn_mul(r->d, big->d, big->len, small->d, small->len)) return FALSE;
+    r->len = bn_normalize(r->d, big->len + small->len);
+    r->neg = a->neg != b->neg;
+    return TRUE;
+}
+
+/* Truncating signed division, matching the 64-bit evaluator */
+CALC_ERROR bn_divmod_signed(BIGNUM *q, BIGNUM *r, BIGNUM *a, BIGNUM *b) {
+    if (b->len == 0) return CALC_ERR_DIV_ZERO;
+    if (bn_cmp(a->d, a->len, b->d, b->len) < 0) {
+        if (!bn_set_int64(q, 0)) return CALC_ERR_TOO_LARGE;
+        *r = *a;
+        return CALC_OK;
+    }
+    if (!bn_init(q, a->len - b->len + 1) || !bn_init(r, b->len)) return CALC_ERR_TOO_LARGE;
+    if (!bn_divmod(q->d, r->d, a->d, a->len, b->d, b->len)) return CALC_ERR_TOO_LARGE;
+    q->len = bn_normalize(q->d, a->len - b->len + 1);
+    r->len = bn_normalize(r->d, b->len);
+    q->neg = q->len != 0 && a->neg != b->neg;
+    r->neg = r->len != 0 && a->neg;
+    return CALC_OK;
+}
+
+/* Move a result down to mark and release every temporary above it */
+VOID bn_keep(BIGNUM *v, UINTN mark) {
+    UINT32 *dst = (UINT32 *)(bn_arena + mark);
+    UINTN limbs = v->len ? v->len : 1;
+
+    /* dst is never above v->d, so an ascending copy is overlap safe */
+    for (UINTN i = 0; i < v->len; i++) dst[i] = v->d[i];
+    v->d = dst;
+    bn_arena_used = mark + ((limbs * sizeof(UINT32) + 7) & ~(UINTN)7);
+}
+
+/* Number of significant bits in a magnitude */
+UINTN bn_bit_length(BIGNUM *a) {
+    if (a->len == 0) return 0;
+    return a->len * 32 - __builtin_clz(a->d[a->len - 1]);
+}
+
+/* base ^ exp by left-to-right binary exponentiation */
+CALC_ERROR bn_pow(BIGNUM *r, BIGNUM *base, BIGNUM *exp) {
+    UINTN mark = bn_arena_used;
+    INT64 e;
+    BIGNUM acc, tmp;
+
+    if (exp->neg) return CALC_ERR_DOMAIN;
+    /* 0, 1 and -1 stay small for any exponent */
+    if (base->len == 0 || (base->len == 1 && base->d[0] == 1)) {
+        if (!bn_set_int64(r, exp->len == 0 ? 1 : (base->len == 0 ? 0 : 1))) return CALC_ERR_TOO_LARGE;
+        r->neg = base->neg && exp->len != 0 && (exp->d[0] & 1);
+        return CALC_OK;
+    }
+    if (!bn_to_int64(exp, &e) || e > (INT64)BN_MAX_LIMBS * 32) return CALC_ERR_TOO_LARGE;
+    if ((UINT64)(bn_bit_length(base) - 1) * (UINT64)e >= (UINT64)BN_MAX_LIMBS * 32) {
+        return CALC_ERR_TOO_LARGE;
+    }
+    if (e == 0) return bn_set_int64(r, 1) ? CALC_OK : CALC_ERR_TOO_LARGE;
+
+    acc = *base;
+    acc.neg = FALSE;
+    for (INTN bit = 31 - __builtin_clz((UINT32)e); bit-- > 0; ) {
+        if (!bn_mul_signed(&tmp, &acc, &acc)) return CALC_ERR_TOO_LARGE;
+        if ((e >> bit) & 1) {
+            BIGNUM square = tmp;
+            if (!bn_mul_signed(&tmp, &square, base)) return CALC_ERR_TOO_LARGE;
+        }
+        /* Keep only the running power so the arena does not fill up */
+        bn_keep(&tmp, mark);
+        acc = tmp;
+    }
+    acc.neg = base->neg && (e & 1);
+    *r = acc;
+    return CALC_OK;
+}
+
+/* Product of the integers lo..hi, split as a balanced tree for Karatsuba */
+BOOLEAN bn_range_product(BIGNUM *r, UINT32 lo, UINT32 hi) {
+    UINTN mark = bn_arena_used;
+    BIGNUM left, right;
+
+    if (hi - lo < 16) {
+        if (!bn_init(r, hi - lo + 2)) return FALSE;
+        r->d[0] = 1;
+        r->len = 1;
+        for (UINT32 i = lo; i <= hi; i++) {
+            r->d[r->len] = bn_mul_1(r->d, r->d, r->len, i);
+            r->len = bn_normalize(r->d, r->len + 1);
+        }
+        return TRUE;
+    }
+
+    if (!bn_range_product(&left, lo, lo + (hi - lo) / 2) ||
+        !bn_range_product(&right, lo + (hi - lo) / 2 + 1, hi) ||
+        !bn_mul_signed(r, &left, &right)) {
+        return FALSE;
+    }
+    bn_keep(r, mark);
+    return TRUE;
+}
+
+CALC_ERROR bn_factorial(BIGNUM *r, BIGNUM *n) {
+    INT64 count;
+
+    if (n->neg) return CALC_ERR_DOMAIN;
+    if (!bn_to_int64(n, &count) || count > BN_MAX_FACTORIAL) return CALC_ERR_TOO_LARGE;
+    if (count < 2) return bn_set_int64(r, 1) ? CALC_OK : CALC_ERR_TOO_LARGE;
+    return bn_range_product(r, 2, (UINT32)count) ? CALC_OK : CALC_ERR_TOO_LARGE;
+}
+
+/*
+ * Write the digits of a[0..n) backwards ending at end, by repeated division
+ * by 10^9. With width set the output is zero padded to exactly width
+ * digits. Consumes a. Returns the first digit written.
+ */
+CHAR16 *bn_decimal_chunks(CHAR16 *end, UINT32 *a, UINTN n, UINTN width) {
+    CHAR16 *p = end;
+
+    while (n > 0) {
+        UINT32 chunk = bn_divmod_1(a, a, n, BN_CHUNK_BASE);
+        n = bn_normalize(a, n);
+        for (UINTN k = 0; k < BN_CHUNK_DIGITS; k++) {
+            *--p = (CHAR16)(L'0' + chunk % 10);
+            chunk /= 10;
+        }
+    }
+    while ((UINTN)(end - p) < width) *--p = L'0';
+    return p;
+}
+
+/* Powers (10^9)^(2^k), built on demand for the conversion in progress */
+BIGNUM bn_pow10[BN_MAX_POWERS];
+UINTN bn_pow10_count = 0;
+
+/*
+ * Divide-and-conquer decimal conversion: split a by the power 10^(9*2^k)
+ * closest to its square root, then convert quotient and remainder
+ * independently. Returns NULL if the arena is exhausted.
+ */
+CHAR16 *bn_decimal_rec(CHAR16 *end, CONST UINT32 *a, UINTN n, UINTN width) {
+    UINTN mark = bn_arena_used;
+    UINTN level;
+    UINTN low_digits;
+    BIGNUM *pw;
+    UINT32 *q, *r;
+    CHAR16 *p;
+
+    /* Pick the largest power with about half as many limbs as a */
+    level = bn_pow10_count;
+    while (level > 0 && 2 * bn_pow10[level - 1].len > n + 1) level--;
+
+    if (level == 0 || n < BN_DC_THRESHOLD) {
+        UINT32 *tmp = bn_alloc(n);
+        if (tmp == NULL) return NULL;
+        bn_copy(tmp, a, n);
+        p = bn_decimal_chunks(end, tmp, n, width);
+        bn_arena_used = mark;
+        return p;
+    }
+
+    pw = &bn_pow10[level - 1];
+    low_digits = (UINTN)BN_CHUNK_DIGITS << (level - 1);
+    q = bn_alloc(n - pw->len + 1);
+    r = bn_alloc(pw->len);
+    if (q == NULL || r == NULL || !bn_divmod(q, r, a, n, pw->d, pw->len)) {
+        bn_arena_used = mark;
+        return NULL;
+    }
+
+    p = bn_decimal_rec(end, r, bn_normalize(r, pw->len), low_digits);
+    if (p != NULL) {
+        p = bn_decimal_rec(p, q, bn_normalize(q, n - pw->len + 1),
+                           width > low_digits ? width - low_digits : 0);
+    }
+    bn_arena_used = mark;
+    return p;
+}
+
+/*
+ * Format a BIGNUM in decimal into out, which must hold BN_DECIMAL_CHARS(len)
+ * characters. Returns the number of characters written, or 0 if the arena
+ * ran out of space.
+ */
+UINTN bn_to_decimal(BIGNUM *a, CHAR16 *out) {
+    UINTN mark = bn_arena_used;
+    UINTN capacity = BN_DECIMAL_CHARS(a->len) - 1;
+    CHAR16 *end = out + capacity;
+    CHAR16 *p;
+    UINTN len = 0;
+
+    /* Square 10^9 until the next power would exceed half of a */
+    bn_pow10_count = 0;
+    if (a->len >= BN_DC_THRESHOLD) {
+        if (!bn_set_int64(&bn_pow10[0], BN_CHUNK_BASE)) return 0;
+        bn_pow10_count = 1;
+        while (bn_pow10_count < BN_MAX_POWERS &&
+               4 * bn_pow10[bn_pow10_count - 1].len <= a->len + 1) {
+            BIGNUM *prev = &bn_pow10[bn_pow10_count - 1];
+            if (!bn_mul_signed(&bn_pow10[bn_pow10_count], prev, prev)) {
+                bn_arena_used = mark;
+                return 0;
+            }
+            bn_pow10_count++;
+        }
+    }
+
+    p = bn_decimal_rec(end, a->d, a->len, 0);
+    bn_arena_used = mark;
+    if (p == NULL) return 0;
+
+    /* Padded sub-results leave leading zeros at the top */
+    while (p < end - 1 && *p == L'0') p++;
+    if (p == end) *--p = L'0';
+
+    if (a->neg && a->len != 0) out[len++] = L'-';
+    while (p < end) out[len++] = *p++;
+    out[len] = 0;
+    return len;
+}
+
+/* Re-run a compiled program on arbitrary-precision values */
+CALC_ERROR calc_run_big(CALC_PROGRAM *prog, BIGNUM *result) {
+    BIGNUM stack[CALC_VM_STACK];
+    CALC_FRAME frames[CALC_MAX_FRAMES];
+    UINTN frame_count = 0;
+    UINTN sp = 0;
+    UINTN base = 0;
+    UINT8 *pc = prog->code;
+    BIGNUM value, rem;
+    CALC_ERROR error;
+    INT64 packed, small;
+
+    bn_arena_used = 0;
+
+    for (;;) {
+        UINT8 op = *pc++;
+        error = CALC_OK;
+
+        switch (op) {
+        case OP_PUSH:
+            if (!bn_set_int64(&stack[sp++], prog->consts[*pc++])) return CALC_ERR_TOO_LARGE;
+            continue;
+        case OP_PUSH_BIG:
+            packed = prog->consts[*pc++];
+            if (!bn_from_decimal(&stack[sp++], prog->digits + (packed >> 16), (UINTN)(packed & 0xFFFF))) {
+                return CALC_ERR_TOO_LARGE;
+            }
+            continue;
+        case OP_NEG:
+            stack[sp - 1].neg = stack[sp - 1].len != 0 && !stack[sp - 1].neg;
+            continue;
+        case OP_FACT:
+            error = bn_factorial(&value, &stack[sp - 1]);
+            if (error != CALC_OK) return error;
+            stack[sp - 1] = value;
+            continue;
+        case OP_LOAD:
+            error = calc_load(*pc++, 0, &small);
+            if (error != CALC_OK) return error;
+            if (!bn_set_int64(&stack[sp++], small)) return CALC_ERR_TOO_LARGE;
+            continue;
+        case OP_STORE:
+            /* Variables hold 64-bit values only */
+            if (!bn_to_int64(&stack[sp - 1], &small)) return CALC_ERR_TOO_LARGE;
+            calc_store(*pc++, small, 0);
+            continue;
+        case OP_ARG:
+            stack[sp] = stack[base + *pc++];
+            sp++;
+            continue;
+        case OP_CALL_USER:
+            error = calc_enter(&prog, &pc, &base, sp, frames, &frame_count);
+            if (error != CALC_OK) return error;
+            continue;
+        case OP_RET:
+            stack[base] = stack[sp - 1];
+            sp = base + 1;
+            frame_count--;
+            prog = frames[frame_count].prog;
+            pc = frames[frame_count].pc;
+            base = frames[frame_count].base;
+            continue;
+        case OP_END:
+            *result = stack[0];
+            return CALC_OK;
+        default:
+            break;
+        }
+
+        /* Binary operators */
+        sp--;
+        switch (op) {
+        case OP_ADD:
+        case OP_SUB:
+            if (!bn_add_signed(&value, &stack[sp - 1], &stack[sp], op == OP_SUB)) error = CALC_ERR_TOO_LARGE;
+            break;
+        case OP_MUL:
+            if (stack[sp - 1].len + stack[sp].len > BN_MAX_LIMBS) error = CALC_ERR_TOO_LARGE;
+            else if (!bn_mul_signed(&value, &stack[sp - 1], &stack[sp])) error = CALC_ERR_TOO_LARGE;
+            break;
+        case OP_DIV:
+            error = bn_divmod_signed(&value, &rem, &stack[sp - 1], &stack[sp]);
+            break;
+        case OP_MOD:
+            error = bn_divmod_signed(&rem, &value, &stack[sp - 1], &stack[sp]);
+            break;
+        case OP_POW:
+            error = bn_pow(&value, &stack[sp - 1], &stack[sp]);
+            break;
+        }
+        if (error != CALC_OK) return error;
+        stack[sp - 1] = value;
+    }
+}
+
+/* Find the compiled program for an expression, compiling it on a miss */
+CALC_ERROR calc_lookup(CHAR16 *expr, UINTN digits, CALC_PROGRAM **prog) {
+    UINTN len = StrLen(expr);
+    UINT32 hash = calc_hash_n(expr, len);
+    CALC_CACHE_ENTRY *victim = &calc_cache[0];
+    CALC_PROGRAM compiled;
+    CALC_ERROR error;
+
+    if (len >= CALC_MAX_INPUT) return CALC_ERR_TOO_LONG;
+    calc_compile_bodies(digits);
+
+    for (UINTN i = 0; i < CALC_CACHE_SIZE; i++) {
+        CALC_CACHE_ENTRY *entry = &calc_cache[i];
+        if (entry->valid && entry->hash == hash && entry->digits == digits &&
+            StrCmp(entry->text, expr) == 0) {
+            entry->last_used = ++calc_cache_clock;
+            *prog = &entry->prog;
+            return CALC_OK;
+        }
+        /* Prefer an empty slot, otherwise the least recently used one */
+        if (victim->valid && (!entry->valid || entry->last_used < victim->last_used)) {
+            victim = entry;
+        }
+    }
+
+    /* Miss: compile aside, so a bad expression does not evict a good program */
+    error = calc_compile(expr, digits, NULL, 0, &compiled);
+    if (error != CALC_OK) return error;
+    victim->prog = compiled;
+    if (digits == 0) calc_jit_compile(&victim->prog, (UINTN)(victim - calc_cache));
+    victim->valid = TRUE;
+    victim->hash = hash;
+    victim->digits = digits;
+    victim->last_used = ++calc_cache_clock;
+    StrCpy(victim->text, expr);
+    *prog = &victim->prog;
+    return CALC_OK;
+}
+
+/* Evaluate an expression with correct precedence, parentheses and unary minus */
+CALC_ERROR evaluate_expression(CHAR16 *expr, INT64 *result) {
+    CALC_PROGRAM *prog;
+    CALC_ERROR error = calc_lookup(expr, 0, &prog);
+
+    if (error != CALC_OK) return error;
+    return calc_execute(prog, result);
+}
+
+/* Decimal text of the last result; big results live in pool memory */
+CHAR16 calc_small_text[24];
+CHAR16 *calc_big_text = NULL;
+
+/*
+ * Matrices
+ *
+ * Input that contains a matrix literal such as [1, 2; 3, 4], a matrix
+ * variable or a matrix function is evaluated here, directly from the
+ * text, rather than being compiled: matrix expressions are short, and
+ * their cost is in the kernels. Elements are fixed-point decimals at the
+ * decimal-mode scale; integer mode uses CALC_DEFAULT_DIGITS, since an
+ * inverse would be of no use rounded to integers. Numbers, scalar
+ * variables and user functions are evaluated by the scalar compiler, so
+ * elements of a literal may be any calculator expression.
+ *
+ * Multiplication accumulates exact 128-bit products and rounds once per
+ * element. It works on CALC_MAT_BLOCK square tiles, so a tile of the right
+ * operand and the tile of accumulators stay in the L1 cache while rows of
+ * the left operand stream past. det, inv and solve use fraction-free
+ * (Bareiss) Gauss-Jordan elimination of the scaled integers in BIGNUM
+ * arithmetic: every intermediate division is exact, so results are only
+ * rounded once, to the scale, at the end.
+ */
+#define CALC_MAT_MAX    32        /* Rows or columns */
+#define CALC_MAT_BLOCK  16        /* Tile edge of the multiplication kernel */
+#define CALC_MAT_VARS   8
+#define CALC_MAT_TEMPS  64        /* Matrices allocated during one evaluation */
+
+typedef enum {
+    CALC_MAT_DET = 0,
+    CALC_MAT_INV,
+    CALC_MAT_TRANS,
+    CALC_MAT_SOLVE,
+    CALC_MAT_EYE,
+    CALC_MAT_FN_COUNT
+} CALC_MAT_FUNCTION_ID;
+
+CALC_FUNCTION calc_mat_functions[CALC_MAT_FN_COUNT] = {
+    { L"det", 1 }, { L"inv", 1 }, { L"trans", 1 }, { L"solve", 2 }, { L"eye", 1 }
+};
+
+typedef struct {
+    UINTN rows;       /* 0 for a scalar */
+    UINTN cols;
+    INT64 *data;      /* Row-major elements */
+    INT64 scalar;
+} CALC_MATRIX;
+
+typedef struct {
+    CHAR16 name[CALC_MAX_NAME + 1];   /* Empty for an unused entry */
+    UINTN digits;
+    CALC_MATRIX value;
+} CALC_MAT_VAR;
+
+typedef struct {
+    CHAR16 *src;
+    UINTN pos;
+    UINTN nesting;
+    UINTN digits;
+    INT64 one;        /* 10^digits */
+    CALC_ERROR error;
+    INT64 *temps[CALC_MAT_TEMPS];
+    UINTN temp_count;
+} CALC_MAT_PARSER;
+
+CALC_MAT_VAR calc_mat_vars[CALC_MAT_VARS];
+
+/* Last matrix result, kept for the calculator's grid view */
+CALC_MATRIX calc_mat_result = { 0, 0, NULL, 0 };
+UINTN calc_mat_result_digits = 0;
+BOOLEAN calc_result_is_matrix = FALSE;
+
+/* Allocate a rows x cols temporary, released when the evaluation ends */
+BOOLEAN calc_mat_alloc(CALC_MAT_PARSER *p, CALC_MATRIX *m, UINTN rows, UINTN cols) {
+    if (rows == 0 || cols == 0 || rows > CALC_MAT_MAX || cols > CALC_MAT_MAX) {
+        p->error = CALC_ERR_TOO_LARGE;
+        return FALSE;
+    }
+    if (p->temp_count == CALC_MAT_TEMPS) {
+        p->error = CALC_ERR_TOO_LONG;
+        return FALSE;
+    }
+    if (EFI_ERROR(BS->AllocatePool(EfiLoaderData, rows * cols * sizeof(INT64), (VOID **)&m->data))) {
+        p->error = CALC_ERR_TOO_LARGE;
+        return FALSE;
+    }
+    p->temps[p->temp_count++] = m->data;
+    m->rows = rows;
+    m->cols = cols;
+    m->scalar = 0;
+    return TRUE;
+}
+
+/* Copy a matrix into pool memory owned by the caller; FALSE if out of memory */
+BOOLEAN calc_mat_keep(CALC_MATRIX *dst, CALC_MATRIX *src) {
+    UINTN size = src->rows * src->cols * sizeof(INT64);
+
+    if (dst->data != NULL) BS->FreePool(dst->data);
+    *dst = *src;
+    dst->data = NULL;
+    if (src->rows == 0) return TRUE;
+    if (EFI_ERROR(BS->AllocatePool(EfiLoaderData, size, (VOID **)&dst->data))) {
+        dst->data = NULL;
+        dst->rows = 0;
+        return FALSE;
+    }
+    CopyMem(dst->data, src->data, size);
+    return TRUE;
+}
+
+/* Matrix variable with the given name, or NULL */
+CALC_MAT_VAR *calc_mat_find(CHAR16 *name, UINTN len) {
+    if (len == 0 || len > CALC_MAX_NAME) return NULL;
+    for (UINTN i = 0; i < CALC_MAT_VARS; i++) {
+        CALC_MAT_VAR *var = &calc_mat_vars[i];
+        if (StrnCmp(var->name, name, len) == 0 && var->name[len] == 0) return var;
+    }
+    return NULL;
+}
+
+/* Index of a matrix function or a built-in scalar function in table, or -1 */
+INTN calc_mat_function(CALC_FUNCTION *table, UINTN count, CHAR16 *name, UINTN len) {
+    for (UINTN i = 0; i < count; i++) {
+        if (StrnCmp(table[i].name, name, len) == 0 && table[i].name[len] == 0) return (INTN)i;
+    }
+    return -1;
+}
+
+/* TRUE if the input needs the matrix evaluator: a literal, a matrix variable or a matrix function */
+BOOLEAN calc_mat_mentions(CHAR16 *expr) {
+    UINTN pos = 0;
+
+    while (expr[pos] != 0) {
+        UINTN len = calc_name_length(expr + pos);
+        if (len > 0) {
+            if (calc_mat_find(expr + pos, len) != NULL ||
+                calc_mat_function(calc_mat_functions, CALC_MAT_FN_COUNT, expr + pos, len) >= 0) {
+                return TRUE;
+            }
+            pos += len;
+        } else if (expr[pos] == L'[' || expr[pos] == L'\'') {
+            return TRUE;
+        } else if (expr[pos] >= L'0' && expr[pos] <= L'9') {
+            /* Skip the digits of a number so they are not read as the tail of a name */
+            while (expr[pos] >= L'0' && expr[pos] <= L'9') pos++;
+        } else {
+            pos++;
+        }
+    }
+    return FALSE;
+}
+
+/* acc += a * b on a two's complement 128-bit accumulator; FALSE on overflow */
+BOOLEAN calc_mat_mul_add(CALC_U128 *acc, INT64 a, INT64 b) {
+    UINT64 ua = a < 0 ? (UINT64)0 - (UINT64)a : (UINT64)a;
+    UINT64 ub = b < 0 ? (UINT64)0 - (UINT64)b : (UINT64)b;
+    UINT64 old_hi = acc->hi;
+    CALC_U128 p;
+
+    calc_mul_u128(ua, ub, &p);
+    if ((a < 0) != (b < 0)) {
+        p.hi = ~p.hi + (p.lo == 0);
+        p.lo = (UINT64)0 - p.lo;
+    }
+    acc->lo += p.lo;
+    acc->hi += p.hi + (acc->lo < p.lo);
+    /* Operands of one sign whose sum has the other */
+    return ((old_hi ^ p.hi) >> 63) != 0 || ((old_hi ^ acc->hi) >> 63) == 0;
+}
+
+/* Round an accumulated sum of products at scale one^2 back to scale one */
+CALC_ERROR calc_mat_round_acc(CALC_U128 *acc, INT64 one, INT64 *r) {
+    BOOLEAN neg = (acc->hi >> 63) != 0;
+    UINT64 hi = acc->hi, lo = acc->lo, q, rem;
+
+    if (neg) {
+        hi = ~hi + (lo == 0);
+        lo = (UINT64)0 - lo;
+    }
+    if (hi >= (UINT64)one) return CALC_ERR_OVERFLOW;
+    q = calc_udiv_128by64(hi, lo, (UINT64)one, &rem);
+    if (rem >= (UINT64)one - rem) q++;
+    if (q > (UINT64)1 << 63 || (q == (UINT64)1 << 63 && !neg)) return CALC_ERR_OVERFLOW;
+    *r = neg ? (INT64)((UINT64)0 - q) : (INT64)q;
+    return CALC_OK;
+}
+
+/* c = a * b, one CALC_MAT_BLOCK x CALC_MAT_BLOCK tile of c at a time */
+CALC_ERROR calc_mat_multiply(CALC_MATRIX *a, CALC_MATRIX *b, CALC_MATRIX *c, INT64 one) {
+    CALC_U128 acc[CALC_MAT_BLOCK][CALC_MAT_BLOCK];
+    UINTN n = a->rows, m = b->cols, inner = a->cols;
+
+    for (UINTN i0 = 0; i0 < n; i0 += CALC_MAT_BLOCK) {
+        UINTN i1 = i0 + CALC_MAT_BLOCK < n ? i0 + CALC_MAT_BLOCK : n;
+        for (UINTN j0 = 0; j0 < m; j0 += CALC_MAT_BLOCK) {
+            UINTN j1 = j0 + CALC_MAT_BLOCK < m ? j0 + CALC_MAT_BLOCK : m;
+
+            SetMem(acc, sizeof(acc), 0);
+            for (UINTN k0 = 0; k0 < inner; k0 += CALC_MAT_BLOCK) {
+                UINTN k1 = k0 + CALC_MAT_BLOCK < inner ? k0 + CALC_MAT_BLOCK : inner;
+                for (UINTN i = i0; i < i1; i++) {
+                    for (UINTN k = k0; k < k1; k++) {
+                        INT64 aik = a->data[i * inner + k];
+                        INT64 *brow = b->data + k * m;
+                        if (aik == 0) continue;
+                        for (UINTN j = j0; j < j1; j++) {
+                            if (!calc_mat_mul_add(&acc[i - i0][j - j0], aik, brow[j])) return CALC_ERR_OVERFLOW;
+                        }
+                    }
+                }
+            }
+            for (UINTN i = i0; i < i1; i++) {
+                for (UINTN j = j0; j < j1; j++) {
+                    CALC_ERROR error = calc_mat_round_acc(&acc[i - i0][j - j0], one, &c->data[i * m + j]);
+                    if (error != CALC_OK) return error;
+                }
+            }
+        }
+    }
+    return CALC_OK;
+}
+
+/* Set a BIGNUM whose limbs are already allocated to a 64-bit value */
+VOID calc_mat_big_set(BIGNUM *r, INT64 value) {
+    UINT64 mag = value < 0 ? (UINT64)0 - (UINT64)value : (UINT64)value;
+
+    r->d[0] = (UINT32)mag;
+    r->d[1] = (UINT32)(mag >> 32);
+    r->len = bn_normalize(r->d, 2);
+    r->neg = value < 0;
+}
+
+/* Copy v into r's preallocated limbs; FALSE if it needs more than limbs */
+BOOLEAN calc_mat_big_store(BIGNUM *r, BIGNUM *v, UINTN limbs) {
+    if (v->len > limbs) return FALSE;
+    bn_copy(r->d, v->d, v->len);
+    r->len = v->len;
+    r->neg = v->len != 0 && v->neg;
+    return TRUE;
+}
+
+/* Multiply v by 10^k, nine digits per step; FALSE if the arena is exhausted */
+BOOLEAN calc_mat_big_scale(BIGNUM *v, UINTN k) {
+    for (UINTN i = 0; i < k; i += 9) {
+        UINTN chunk = k - i < 9 ? k - i : 9;
+        BIGNUM t;
+        if (!bn_init(&t, v->len + 1)) return FALSE;
+        t.d[v->len] = bn_mul_1(t.d, v->d, v->len, (UINT32)calc_pow10[chunk]);
+        t.len = bn_normalize(t.d, v->len + 1);
+        t.neg = v->neg && t.len != 0;
+        *v = t;
+    }
+    return TRUE;
+}
+
+/* r = round(num * 10^shift / den), or CALC_ERR_OVERFLOW if it leaves 64 bits */
+CALC_ERROR calc_mat_round_div(BIGNUM *num, UINTN shift, BIGNUM *den, INT64 *r) {
+    BIGNUM n = *num, q, rem, twice, step;
+    CALC_ERROR error;
+
+    if (!calc_mat_big_scale(&n, shift)) return CALC_ERR_TOO_LARGE;
+    error = bn_divmod_signed(&q, &rem, &n, den);
+    if (error != CALC_OK) return error;
+
+    /* Round halves away from zero: compare twice the remainder with the divisor */
+    rem.neg = FALSE;
+    if (!bn_add_signed(&twice, &rem, &rem, FALSE)) return CALC_ERR_TOO_LARGE;
+    if (bn_cmp(twice.d, twice.len, den->d, den->len) >= 0) {
+        BIGNUM rounded;
+        if (!bn_set_int64(&step, n.neg != den->neg ? -1 : 1) ||
+            !bn_add_signed(&rounded, &q, &step, FALSE)) {
+            return CALC_ERR_TOO_LARGE;
+        }
+        q = rounded;
+    }
+    return bn_to_int64(&q, r) ? CALC_OK : CALC_ERR_OVERFLOW;
+}
+
+/*
+ * Fraction-free Gauss-Jordan elimination of [a | b] on the scaled integers.
+ * Each step replaces every entry off the pivot row by
+ * (pivot * entry - row factor * pivot row entry) / previous pivot, which
+ * divides exactly; at the end each pivot is +-det(a) (scaled by
+ * 10^(digits*n)) and the right-hand block is that pivot times a^-1 b.
+ * With b NULL only the determinant is computed; otherwise x (allocated by
+ * the caller) receives a^-1 b, or CALC_ERR_SINGULAR is returned.
+ */
+CALC_ERROR calc_mat_eliminate(CALC_MATRIX *a, CALC_MATRIX *b, CALC_MATRIX *x, UINTN digits, INT64 *det) {
+    UINTN n = a->rows;
+    UINTN m = b != NULL ? b->cols : 0;
+    UINTN w = n + m;
+    UINTN bits = 1, log_n = 0, limbs;
+    UINTN mark = bn_arena_used;
+    BIGNUM *e, prev;
+    UINT32 *limb_pool;
+    UINT8 *block;
+    BOOLEAN negate = FALSE;
+    CALC_ERROR error = CALC_OK;
+
+    /* Hadamard's bound on the minors: n * (bits per entry + log2(n) / 2) */
+    for (UINTN i = 0; i < n * n + n * m; i++) {
+        INT64 v = i < n * n ? a->data[i] : b->data[i - n * n];
+        UINT64 mag = v < 0 ? (UINT64)0 - (UINT64)v : (UINT64)v;
+        UINTN len = 64 - calc_clz64(mag | 1);
+        if (len > bits) bits = len;
+    }
+    while (((UINTN)1 << log_n) < n) log_n++;
+    limbs = (n * (bits + log_n) + 31) / 32 + 2;
+
+    if (EFI_ERROR(BS->AllocatePool(EfiLoaderData, (n * w + 1) * (sizeof(BIGNUM) + limbs * sizeof(UINT32)),
+                                   (VOID **)&block))) {
+        return CALC_ERR_TOO_LARGE;
+    }
+    e = (BIGNUM *)block;
+    limb_pool = (UINT32 *)(block + (n * w + 1) * sizeof(BIGNUM));
+    for (UINTN i = 0; i < n * w + 1; i++) e[i].d = limb_pool + i * limbs;
+    for (UINTN i = 0; i < n; i++) {
+        for (UINTN j = 0; j < w; j++) {
+            calc_mat_big_set(&e[i * w + j], j < n ? a->data[i * n + j] : b->data[i * m + j - n]);
+        }
+    }
+    prev = e[n * w];
+    calc_mat_big_set(&prev, 1);
+
+    for (UINTN k = 0; k < n && error == CALC_OK; k++) {
+        BIGNUM *pivot_row;
+        UINTN r = k;
+
+        while (r < n && e[r * w + k].len == 0) r++;
+        if (r == n) {
+            /* Singular: the determinant is zero and there is no inverse */
+            bn_arena_used = mark;
+            BS->FreePool(block);
+            if (det != NULL) *det = 0;
+            return b != NULL ? CALC_ERR_SINGULAR : CALC_OK;
+        }
+        if (r != k) {
+            for (UINTN j = 0; j < w; j++) {
+                BIGNUM t = e[r * w + j];
+                e[r * w + j] = e[k * w + j];
+                e[k * w + j] = t;
+            }
+            negate = !negate;
+        }
+
+        pivot_row = &e[k * w];
+        for (UINTN i = 0; i < n && error == CALC_OK; i++) {
+            BIGNUM *row = &e[i * w];
+            if (i == k) continue;
+            for (UINTN j = 0; j < w; j++) {
+                BIGNUM t1, t2, t3, q, rem;
+                if (j == k) continue;
+                if (!bn_mul_signed(&t1, &pivot_row[k], &row[j]) ||
+                    !bn_mul_signed(&t2, &row[k], &pivot_row[j]) ||
+                    !bn_add_signed(&t3, &t1, &t2, TRUE)) {
+                    error = CALC_ERR_TOO_LARGE;
+                    break;
+                }
+                error = bn_divmod_signed(&q, &rem, &t3, &prev);
+                if (error == CALC_OK && !calc_mat_big_store(&row[j], &q, limbs)) error = CALC_ERR_TOO_LARGE;
+                bn_arena_used = mark;
+                if (error != CALC_OK) break;
+            }
+            row[k].len = 0;
+        }
+        calc_mat_big_store(&prev, &pivot_row[k], limbs);
+    }
+
+    /* prev is now the last pivot, +-det(a) at scale 10^(digits*n); det(a) is wanted at 10^digits */
+    if (error == CALC_OK && det != NULL) {
+        BIGNUM scale;
+        prev.neg = prev.len != 0 && prev.neg != negate;
+        if (!bn_set_int64(&scale, 1) || !calc_mat_big_scale(&scale, digits * (n - 1))) {
+            error = CALC_ERR_TOO_LARGE;
+        } else {
+            error = calc_mat_round_div(&prev, 0, &scale, det);
+        }
+    }
+    if (error == CALC_OK && b != NULL) {
+        for (UINTN i = 0; i < n && error == CALC_OK; i++) {
+            for (UINTN j = 0; j < m && error == CALC_OK; j++) {
+                error = calc_mat_round_div(&e[i * w + n + j], digits, &e[i * w + i], &x->data[i * m + j]);
+            }
+        }
+    }
+    bn_arena_used = mark;
+    BS->FreePool(block);
+    return error;
+}
+
+/* Next non-space character */
+CHAR16 calc_mat_peek(CALC_MAT_PARSER *p) {
+    while (p->src[p->pos] == L' ') p->pos++;
+    return p->src[p->pos];
+}
+
+/* Consume an expected character, or record a syntax error */
+BOOLEAN calc_mat_expect(CALC_MAT_PARSER *p, CHAR16 c) {
+    if (calc_mat_peek(p) != c) {
+        p->error = CALC_ERR_SYNTAX;
+        return FALSE;
+    }
+    p->pos++;
+    return TRUE;
+}
+
+VOID calc_mat_expr(CALC_MAT_PARSER *p, UINTN min_bp, CALC_MATRIX *out);
+
+/* Evaluate a number, scalar variable or user function call with the scalar compiler */
+VOID calc_mat_scalar(CALC_MAT_PARSER *p, CALC_MATRIX *out) {
+    CHAR16 text[CALC_MAX_INPUT];
+    CALC_PROGRAM prog;
+    UINTN start = p->pos;
+    UINTN len;
+
+    if (p->src[p->pos] == L'.' || (p->src[p->pos] >= L'0' && p->src[p->pos] <= L'9')) {
+        while (p->src[p->pos] == L'.' || (p->src[p->pos] >= L'0' && p->src[p->pos] <= L'9')) p->pos++;
+    } else {
+        p->pos += calc_name_length(p->src + p->pos);
+        if (p->pos == start) {
+            p->error = CALC_ERR_SYNTAX;
+            return;
+        }
+        if (calc_mat_peek(p) == L'(') {
+            /* Take the whole argument list; the compiler checks it */
+            UINTN depth = 0;
+            do {
+                if (p->src[p->pos] == L'(') depth++;
+                if (p->src[p->pos] == L')') depth--;
+                if (p->src[p->pos] == 0) {
+                    p->error = CALC_ERR_SYNTAX;
+                    return;
+                }
+                p->pos++;
+            } while (depth > 0);
+        }
+    }
+
+    len = p->pos - start;
+    CopyMem(text, p->src + start, len * sizeof(CHAR16));
+    text[len] = 0;
+    out->rows = 0;
+    out->cols = 0;
+    out->data = NULL;
+    p->error = calc_compile(text, p->digits, NULL, 0, &prog);
+    if (p->error == CALC_OK) p->error = calc_run_decimal(&prog, p->digits, &out->scalar);
+}
+
+/* A literal: elements separated by ',' and rows by ';' */
+VOID calc_mat_literal(CALC_MAT_PARSER *p, CALC_MATRIX *out) {
+    INT64 values[CALC_MAX_INPUT / 2];
+    UINTN count = 0, rows = 0, cols = 0, row_len = 0;
+
+    p->pos++;
+    for (;;) {
+        CALC_MATRIX element;
+        CHAR16 c;
+
+        calc_mat_expr(p, CALC_BP_NONE, &element);
+        if (p->error != CALC_OK) return;
+        if (element.rows != 0) {
+            p->error = CALC_ERR_SHAPE;
+            return;
+        }
+        if (count == sizeof(values) / sizeof(values[0])) {
+            p->error = CALC_ERR_TOO_LONG;
+            return;
+        }
+        values[count++] = element.scalar;
+        row_len++;
+
+        c = calc_mat_peek(p);
+        p->pos++;
+        if (c == L',') continue;
+        if (c != L';' && c != L']') {
+            p->error = CALC_ERR_SYNTAX;
+            return;
+        }
+        if (rows > 0 && row_len != cols) {
+            p->error = CALC_ERR_SHAPE;
+            return;
+        }
+        cols = row_len;
+        row_len = 0;
+        rows++;
+        if (c == L']') break;
+    }
+    if (!calc_mat_alloc(p, out, rows, cols)) return;
+    CopyMem(out->data, values, count * sizeof(INT64));
+}
+
+/* Transpose into a new temporary; scalars are their own transpose */
+VOID calc_mat_transpose(CALC_MAT_PARSER *p, CALC_MATRIX *m) {
+    CALC_MATRIX t;
+
+    if (m->rows == 0) return;
+    if (!calc_mat_alloc(p, &t, m->cols, m->rows)) return;
+    for (UINTN i = 0; i < m->rows; i++) {
+        for (UINTN j = 0; j < m->cols; j++) t.data[j * m->rows + i] = m->data[i * m->cols + j];
+    }
+    *m = t;
+}
+
+/* Identity matrix of size n */
+VOID calc_mat_identity(CALC_MAT_PARSER *p, CALC_MATRIX *m, UINTN n) {
+    if (!calc_mat_alloc(p, m, n, n)) return;
+    SetMem(m->data, n * n * sizeof(INT64), 0);
+    for (UINTN i = 0; i < n; i++) m->data[i * n + i] = p->one;
+}
+
+/* Inverse of a square matrix, replacing m */
+VOID calc_mat_inverse(CALC_MAT_PARSER *p, CALC_MATRIX *m) {
+    CALC_MATRIX id, x;
+
+    if (m->rows == 0 || m->rows != m->cols) {
+        p->error = CALC_ERR_SHAPE;
+        return;
+    }
+    calc_mat_identity(p, &id, m->rows);
+    if (p->error != CALC_OK || !calc_mat_alloc(p, &x, m->rows, m->rows)) return;
+    p->error = calc_mat_eliminate(m, &id, &x, p->digits, NULL);
+    *m = x;
+}
+
+/* Integral value of a scalar operand, for sizes and exponents */
+BOOLEAN calc_mat_integer(CALC_MAT_PARSER *p, CALC_MATRIX *m, INT64 *value) {
+    INT64 rem;
+
+    if (m->rows != 0) {
+        p->error = CALC_ERR_SHAPE;
+        return FALSE;
+    }
+    calc_div64(m->scalar, p->one, value, &rem);
+    if (rem != 0) {
+        p->error = CALC_ERR_DOMAIN;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Apply a matrix function to its evaluated arguments; the result replaces args[0] */
+VOID calc_mat_apply(CALC_MAT_PARSER *p, UINTN fn, CALC_MATRIX *args) {
+    CALC_MATRIX *m = &args[0];
+    INT64 n;
+
+    switch (fn) {
+    case CALC_MAT_DET:
+        if (m->rows == 0 || m->rows != m->cols) {
+            p->error = CALC_ERR_SHAPE;
+            return;
+        }
+        p->error = calc_mat_eliminate(m, NULL, NULL, p->digits, &m->scalar);
+        m->rows = 0;
+        m->cols = 0;
+        break;
+    case CALC_MAT_INV:
+        calc_mat_inverse(p, m);
+        break;
+    case CALC_MAT_TRANS:
+        calc_mat_transpose(p, m);
+        break;
+    case CALC_MAT_SOLVE: {
+        CALC_MATRIX x;
+        if (m->rows == 0 || m->rows != m->cols || args[1].rows != m->rows) {
+            p->error = CALC_ERR_SHAPE;
+            return;
+        }
+        if (!calc_mat_alloc(p, &x, m->rows, args[1].cols)) return;
+        p->error = calc_mat_eliminate(m, &args[1], &x, p->digits, NULL);
+        *m = x;
+        break;
+    }
+    case CALC_MAT_EYE:
+        if (!calc_mat_integer(p, m, &n)) return;
+        if (n < 1 || n > CALC_MAT_MAX) {
+            p->error = CALC_ERR_DOMAIN;
+            return;
+        }
+        calc_mat_identity(p, m, (UINTN)n);
+        break;
+    }
+}
+
+/* A matrix variable, matrix function, built-in scalar function or scalar name */
+VOID calc_mat_name(CALC_MAT_PARSER *p, CALC_MATRIX *out) {
+    CHAR16 *name = p->src + p->pos;
+    UINTN len = calc_name_length(name);
+    CALC_MAT_VAR *var = calc_mat_find(name, len);
+    INTN fn = calc_mat_function(calc_mat_functions, CALC_MAT_FN_COUNT, name, len);
+    INTN builtin = calc_mat_function(calc_functions, CALC_FN_COUNT, name, len);
+    CALC_MATRIX args[2];
+    UINTN arity;
+
+    if (var != NULL) {
+        /* Work on a copy at this evaluation's scale */
+        p->pos += len;
+        if (!calc_mat_alloc(p, out, var->value.rows, var->value.cols)) return;
+        for (UINTN i = 0; i < out->rows * out->cols && p->error == CALC_OK; i++) {
+            p->error = calc_rescale(var->value.data[i], var->digits, p->digits, &out->data[i]);
+        }
+        return;
+    }
+    if (fn < 0 && builtin < 0) {
+        calc_mat_scalar(p, out);
+        return;
+    }
+
+    p->pos += len;
+    arity = fn >= 0 ? calc_mat_functions[fn].arity : calc_functions[builtin].arity;
+    if (arity > 0) {
+        if (!calc_mat_expect(p, L'(')) return;
+        for (UINTN i = 0; i < arity; i++) {
+            if (i > 0 && !calc_mat_expect(p, L',')) return;
+            calc_mat_expr(p, CALC_BP_NONE, &args[i]);
+            if (p->error != CALC_OK) return;
+        }
+        if (!calc_mat_expect(p, L')')) return;
+    }
+
+    if (fn >= 0) {
+        calc_mat_apply(p, (UINTN)fn, args);
+        *out = args[0];
+    } else {
+        /* sqrt(det(A)) and the like: built-ins applied to a scalar result */
+        if (arity > 0 && args[0].rows != 0) {
+            p->error = CALC_ERR_SHAPE;
+            return;
+        }
+        out->rows = 0;
+        out->cols = 0;
+        out->data = NULL;
+        p->error = calc_call_dec((UINTN)builtin, arity > 0 ? args[0].scalar : 0, p->digits, &out->scalar);
+    }
+}
+
+/* Scalar arithmetic in decimal fixed point */
+CALC_ERROR calc_mat_scalar_op(UINT8 op, INT64 a, INT64 b, UINTN digits, INT64 *r) {
+    INT64 one = (INT64)calc_pow10[digits];
+    INT64 quot;
+
+    switch (op) {
+    case OP_ADD: return __builtin_add_overflow(a, b, r) ? CALC_ERR_OVERFLOW : CALC_OK;
+    case OP_SUB: return __builtin_sub_overflow(a, b, r) ? CALC_ERR_OVERFLOW : CALC_OK;
+    case OP_MUL: return calc_muldiv(a, b, one, r);
+    case OP_DIV: return calc_muldiv(a, one, b, r);
+    case OP_MOD: return calc_div64(a, b, &quot, r);
+    default:     return calc_pow_dec(a, b, digits, r);
+    }
+}
+
+/* a op b for scalars and matrices; the result replaces a */
+VOID calc_mat_binary(CALC_MAT_PARSER *p, UINT8 op, CALC_MATRIX *a, CALC_MATRIX *b) {
+    CALC_MATRIX c;
+    INT64 k;
+
+    if (a->rows == 0 && b->rows == 0) {
+        p->error = calc_mat_scalar_op(op, a->scalar, b->scalar, p->digits, &a->scalar);
+        return;
+    }
+
+    switch (op) {
+    case OP_ADD:
+    case OP_SUB:
+        if (a->rows != b->rows || a->cols != b->cols) {
+            p->error = CALC_ERR_SHAPE;
+            return;
+        }
+        for (UINTN i = 0; i < a->rows * a->cols && p->error == CALC_OK; i++) {
+            p->error = calc_mat_scalar_op(op, a->data[i], b->data[i], p->digits, &a->data[i]);
+        }
+        break;
+    case OP_MUL:
+        if (a->rows != 0 && b->rows != 0) {
+            if (a->cols != b->rows) {
+                p->error = CALC_ERR_SHAPE;
+                return;
+            }
+            if (!calc_mat_alloc(p, &c, a->rows, b->cols)) return;
+            p->error = calc_mat_multiply(a, b, &c, p->one);
+            *a = c;
+            break;
+        }
+        /* Scalar times matrix, either way round */
+        if (a->rows == 0) {
+            c = *a;
+            *a = *b;
+            *b = c;
+        }
+        for (UINTN i = 0; i < a->rows * a->cols && p->error == CALC_OK; i++) {
+            p->error = calc_muldiv(a->data[i], b->scalar, p->one, &a->data[i]);
+        }
+        break;
+    case OP_DIV:
+        if (a->rows == 0 || b->rows != 0) {
+            p->error = CALC_ERR_DOMAIN;
+            return;
+        }
+        for (UINTN i = 0; i < a->rows * a->cols && p->error == CALC_OK; i++) {
+            p->error = calc_muldiv(a->data[i], p->one, b->scalar, &a->data[i]);
+        }
+        break;
+    case OP_POW:
+        /* Integral powers of a square matrix by repeated squaring; negative ones invert first */
+        if (a->rows == 0 || a->rows != a->cols) {
+            p->error = a->rows == 0 ? CALC_ERR_DOMAIN : CALC_ERR_SHAPE;
+            return;
+        }
+        if (!calc_mat_integer(p, b, &k)) return;
+        if (k < 0) {
+            calc_mat_inverse(p, a);
+            k = -k;
+        }
+        calc_mat_identity(p, &c, a->rows);
+        while (p->error == CALC_OK) {
+            if (k & 1) calc_mat_binary(p, OP_MUL, &c, a);
+            k >>= 1;
+            if (k == 0 || p->error != CALC_OK) break;
+            calc_mat_binary(p, OP_MUL, a, a);
+        }
+        *a = c;
+        break;
+    default:
+        p->error = CALC_ERR_DOMAIN;
+        break;
+    }
+}
+
+/* Pratt loop over the calculator's binding powers, plus postfix ' (transpose) */
+VOID calc_mat_expr(CALC_MAT_PARSER *p, UINTN min_bp, CALC_MATRIX *out) {
+    CHAR16 c;
+
+    if (++p->nesting > CALC_MAX_NESTING) {
+        p->error = CALC_ERR_TOO_LONG;
+        return;
+    }
+
+    c = calc_mat_peek(p);
+    if (c == L'(') {
+        p->pos++;
+        calc_mat_expr(p, CALC_BP_NONE, out);
+        if (p->error == CALC_OK) calc_mat_expect(p, L')');
+    } else if (c == L'-') {
+        CALC_MATRIX zero = { 0, 0, NULL, 0 };
+        p->pos++;
+        calc_mat_expr(p, CALC_BP_UNARY, out);
+        if (p->error == CALC_OK && out->rows == 0) {
+            calc_mat_binary(p, OP_SUB, &zero, out);
+            *out = zero;
+        } else if (p->error == CALC_OK) {
+            zero.scalar = -p->one;
+            calc_mat_binary(p, OP_MUL, out, &zero);
+        }
+    } else if (c == L'[') {
+        calc_mat_literal(p, out);
+    } else if (c == L'.' || (c >= L'0' && c <= L'9')) {
+        calc_mat_scalar(p, out);
+    } else if (calc_name_length(p->src + p->pos) > 0) {
+        calc_mat_name(p, out);
+    } else {
+        p->error = CALC_ERR_SYNTAX;
+    }
+
+    while (p->error == CALC_OK) {
+        CALC_MATRIX right;
+        UINT8 op;
+        UINTN bp;
+
+        c = calc_mat_peek(p);
+        if (c == L'\'' || c == L'!') {
+            p->pos++;
+            if (c == L'\'') {
+                calc_mat_transpose(p, out);
+            } else if (out->rows != 0) {
+                p->error = CALC_ERR_DOMAIN;
+            } else {
+                p->error = calc_fact_dec(out->scalar, p->digits, &out->scalar);
+            }
+            continue;
+        }
+        bp = calc_infix_bp(c, &op);
+        if (bp == CALC_BP_NONE || bp <= min_bp) break;
+        p->pos++;
+        /* '^' is right associative */
+        calc_mat_expr(p, op == OP_POW ? bp - 1 : bp, &right);
+        if (p->error == CALC_OK) calc_mat_binary(p, op, out, &right);
+    }
+    p->nesting--;
+}
+
+/*
+ * Evaluate the input with the matrix evaluator if it mentions a matrix.
+ * Returns FALSE for anything else. Otherwise *error is the outcome and
+ * *text the result: a scalar, or a matrix in literal syntax (which is
+ * also kept in calc_mat_result for the grid view). "name = ..." assigns
+ * a matrix variable, or a scalar variable if the value is a scalar.
+ */
+BOOLEAN calc_matrix_statement(CHAR16 *expr, UINTN digits, CALC_ERROR *error, CHAR16 **text) {
+    CALC_MAT_PARSER p;
+    CALC_MATRIX value;
+    UINTN name_pos, name_len, pos = 0;
+    BOOLEAN assign = FALSE;
+
+    calc_result_is_matrix = FALSE;
+    if (!calc_mat_mentions(expr)) return FALSE;
+
+    while (expr[pos] == L' ') pos++;
+    name_pos = pos;
+    name_len = calc_name_length(expr + pos);
+    pos += name_len;
+    while (expr[pos] == L' ') pos++;
+    if (name_len > 0 && expr[pos] == L'=') {
+        assign = TRUE;
+        pos++;
+    } else {
+        pos = 0;
+    }
+    if (assign && (name_len > CALC_MAX_NAME ||
+                   calc_mat_function(calc_mat_functions, CALC_MAT_FN_COUNT, expr + name_pos, name_len) >= 0 ||
+                   calc_mat_function(calc_functions, CALC_FN_COUNT, expr + name_pos, name_len) >= 0)) {
+        *error = name_len > CALC_MAX_NAME ? CALC_ERR_TOO_LONG : CALC_ERR_RESERVED;
+        return TRUE;
+    }
+
+    p.src = expr + pos;
+    p.pos = 0;
+    p.nesting = 0;
+    p.digits = digits != 0 ? digits : CALC_DEFAULT_DIGITS;
+    p.one = (INT64)calc_pow10[p.digits];
+    p.error = CALC_OK;
+    p.temp_count = 0;
+    calc_compile_bodies(p.digits);
+    calc_mat_expr(&p, CALC_BP_NONE, &value);
+    if (p.error == CALC_OK && calc_mat_peek(&p) != 0) p.error = CALC_ERR_SYNTAX;
+
+    if (p.error == CALC_OK && assign) {
+        CALC_MAT_VAR *var = calc_mat_find(expr + name_pos, name_len);
+        if (value.rows == 0) {
+            /* A scalar result becomes an ordinary variable */
+            CALC_SYMBOL *sym = calc_symbol_find(expr + name_pos, name_len,
+                                                calc_hash_n(expr + name_pos, name_len), TRUE);
+            if (sym == NULL) {
+                p.error = CALC_ERR_TOO_MANY_NAMES;
+            } else if (sym->kind == CALC_SYM_BUILTIN) {
+                p.error = CALC_ERR_RESERVED;
+            } else {
+                calc_store((UINT8)(sym - calc_symbols), value.scalar, p.digits);
+                if (var != NULL) {
+                    BS->FreePool(var->value.data);
+                    var->value.data = NULL;
+                    var->name[0] = 0;
+                }
+            }
+        } else {
+            for (UINTN i = 0; var == NULL && i < CALC_MAT_VARS; i++) {
+                if (calc_mat_vars[i].name[0] == 0) var = &calc_mat_vars[i];
+            }
+            if (var == NULL) {
+                p.error = CALC_ERR_TOO_MANY_NAMES;
+            } else if (!calc_mat_keep(&var->value, &value)) {
+                var->name[0] = 0;
+                p.error = CALC_ERR_TOO_LARGE;
+            } else {
+                CopyMem(var->name, expr + name_pos, name_len * sizeof(CHAR16));
+                var->name[name_len] = 0;
+                var->digits = p.digits;
+            }
+        }
+    }
+
+    if (p.error == CALC_OK && value.rows == 0) {
+        calc_format_decimal(value.scalar, p.digits, calc_small_text);
+        *text = calc_small_text;
+    } else if (p.error == CALC_OK) {
+        /* Literal syntax, so batch output can be read back in */
+        UINTN len = 0;
+        if (calc_big_text != NULL) BS->FreePool(calc_big_text);
+        if (!calc_mat_keep(&calc_mat_result, &value) ||
+            EFI_ERROR(BS->AllocatePool(EfiLoaderData, (value.rows * value.cols * 26 + 4) * sizeof(CHAR16),
+                                       (VOID **)&calc_big_text))) {
+            calc_big_text = NULL;
+            p.error = CALC_ERR_TOO_LARGE;
+        } else {
+            calc_mat_result_digits = p.digits;
+            calc_result_is_matrix = TRUE;
+            calc_big_text[len++] = L'[';
+            for (UINTN i = 0; i < value.rows * value.cols; i++) {
+                if (i > 0) {
+                    calc_big_text[len++] = i % value.cols == 0 ? L';' : L',';
+                    calc_big_text[len++] = L' ';
+                }
+                len += calc_format_decimal(value.data[i], p.digits, calc_big_text + len);
+            }
+            calc_big_text[len++] = L']';
+            calc_big_text[len] = 0;
+            *text = calc_big_text;
+        }
+    }
+
+    for (UINTN i = 0; i < p.temp_count; i++) BS->FreePool(p.temps[i]);
+    *error = p.error;
+    return TRUE;
+}
+
+/*
+ * Evaluate an expression to decimal text. With digits == 0 this tries
+ * 64-bit arithmetic first and re-runs the same bytecode in arbitrary
+ * precision on overflow; otherwise it evaluates in decimal mode with that
+ * many fraction digits. Function definitions return CALC_DEFINED with no
+ * text, and input mentioning a matrix goes to the matrix evaluator. The
+ * returned text stays valid until the next call.
+ */
+CALC_ERROR calc_evaluate_text(CHAR16 *expr, UINTN digits, CHAR16 **text) {
+    CALC_PROGRAM *prog;
+    CALC_ERROR error;
+    INT64 value;
+    BIGNUM big;
+
+    if (calc_define(expr, digits, &error)) return error;
+    if (calc_matrix_statement(expr, digits, &error, text)) return error;
+
+    error = calc_lookup(expr, digits, &prog);
+    if (error != CALC_OK) return error;
+
+    if (digits != 0) {
+        error = calc_run_decimal(prog, digits, &value);
+        if (error != CALC_OK) return error;
+        calc_format_decimal(value, digits, calc_small_text);
+        *text = calc_small_text;
+        return CALC_OK;
+    }
+
+    error = calc_execute(prog, &value);
+    if (error == CALC_OK) {
+        calc_format_int64(value, calc_small_text);
+        *text = calc_small_text;
+        return CALC_OK;
+    }
+    if (error != CALC_ERR_OVERFLOW) return error;
+
+    error = calc_run_big(prog, &big);
+    if (error != CALC_OK) return error;
+
+    if (calc_big_text != NULL) {
+        BS->FreePool(calc_big_text);
+        calc_big_text = NULL;
+    }
+    if (EFI_ERROR(BS->AllocatePool(EfiLoaderData, BN_DECIMAL_CHARS(big.len) * sizeof(CHAR16),
+                                   (VOID **)&calc_big_text))) {
+        calc_big_text = NULL;
+        return CALC_ERR_TOO_LARGE;
+    }
+    if (bn_to_decimal(&big, calc_big_text) == 0) return CALC_ERR_TOO_LARGE;
+    *text = calc_big_text;
+    return CALC_OK;
+}
+
+/*
+ * Tasks
+ *
+ * Apps run as cooperative tasks, each on its own stack, so one that is
+ * waiting does not hold up the others: the demo keeps animating in a
+ * small window while the notepad waits for keys. A task gives up the CPU
+ * only where it would block - waiting for a key or for the next frame -
+ * by naming the events it waits on and calling into the scheduler, which
+ * switches to the next task that can run. When none can, it sleeps in
+ * WaitForEvent on everything the tasks are waiting for. The switch itself
+ * saves the callee-saved registers on the old stack and pops them off the
+ * new one, so a task resumes exactly where it called the scheduler.
+ *
+ * The keyboard belongs to one task at a time, the focus, and only its key
+ * waits can complete. The console is shared too: every task keeps its
+ * own cursor and attribute across switches, and the windows drawn by the
+ * focus since it last cleared the screen are recorded so that background
+ * tasks can keep out of them. Task 0 is the main menu on the firmware's
+ * stack; the others are started from it and hand the focus back to it
+ * when they finish or step into the background.
+ */
+#define TASK_MAX          4
+#define TASK_STACK_PAGES  64                /* 256 KB, twice what firmware gives the boot stack */
+#define TASK_MAX_EVENTS   2
+#define TASK_IDLE_STALL   1000              /* Microseconds between polls when there is nothing to sleep on */
+
+typedef struct _TASK TASK;
+
+struct _TASK {
+    UINT32 esp;                     /* Saved stack pointer while switched out */
+    EFI_PHYSICAL_ADDRESS stack;     /* 0 for task 0 */
+    VOID (*entry)(VOID);
+    BOOLEAN used, done;
+    BOOLEAN cancel;                 /* Asked to finish */
+    EFI_EVENT *events;              /* What the task waits on; count 0 when it is not waiting */
+    UINTN event_count;
+    UINTN signalled;                /* Which of them ended the wait */
+    TASK *join;                     /* Waiting for this task to finish */
+    BOOLEAN wait_focus;             /* Waiting to be given the keyboard */
+    INT32 column, row, attribute;   /* Console state while switched out */
+    UINTN window_left, window_top, window_right, window_bottom;   /* Empty when right is 0 */
+};
+
+TASK tasks[TASK_MAX];
+UINTN task_current = 0;
+UINTN task_focus = 0;
+UINTN task_console = 0;             /* Whose cursor and attribute the console shows */
+UINT32 screen_generation = 0;       /* Bumped whenever the screen is cleared */
+
+/*
+ * Save the callee-saved registers and the stack pointer, switch to the
+ * other stack and return into whatever called task_switch there. A new
+ * task's stack is laid out so that the return lands in task_start.
+ */
+VOID task_switch(UINT32 *save_esp, UINT32 new_esp);
+
+__asm__(
+    ".text\n"
+    ".globl task_switch\n"
+    "task_switch:\n"
+    "    pushl %ebp\n"
+    "    pushl %ebx\n"
+    "    pushl %esi\n"
+    "    pushl %edi\n"
+    "    movl 20(%esp), %eax\n"
+    "    movl 24(%esp), %ecx\n"
+    "    movl %esp, (%eax)\n"
+    "    movl %ecx, %esp\n"
+    "    popl %edi\n"
+    "    popl %esi\n"
+    "    popl %ebx\n"
+    "    popl %ebp\n"
+    "    ret\n");
+
+/* Whether a task can carry on: running, or its wait is over */
+BOOLEAN task_ready(TASK *task) {
+    if (!task->used || task->done) return FALSE;
+    if (task->join != NULL) return task->join->done;
+    if (task->wait_focus) return task == &tasks[task_focus];
+    for (UINTN i = 0; i < task->event_count; i++) {
+        /* Keys only go to the focus */
+        if (task->events[i] == ConIn->WaitForKey && task != &tasks[task_focus]) continue;
+        if (!EFI_ERROR(BS->CheckEvent(task->events[i]))) {
+            task->signalled = i;
+            return TRUE;
+        }
+    }
+    return task->event_count == 0;
+}
+
+/* Give the console a task's cursor and attribute */
+VOID task_restore_console(UINTN index) {
+    TASK *task = &tasks[index];
+
+    if (task_console == index) return;
+    ConOut->SetAttribute(ConOut, (UINTN)task->attribute);
+    if (task->column >= 0 && task->row >= 0) {
+        ConOut->SetCursorPosition(ConOut, (UINTN)task->column, (UINTN)task->row);
+    }
+    task_console = index;
+}
+
+/*
+ * Run the next task that is ready, round robin from the current one; it
+ * may be the current one again. While none is ready, show the focus's
+ * cursor and sleep on every event a task waits for. With no event to
+ * sleep on, or when the firmware refuses the wait, poll instead.
+ */
+VOID task_schedule(VOID) {
+    TASK *self = &tasks[task_current];
+    UINTN next = task_current;
+
+    if (task_console == task_current) {
+        self->column = ConOut->Mode->CursorColumn;
+        self->row = ConOut->Mode->CursorRow;
+        self->attribute = ConOut->Mode->Attribute;
+    }
+    while (TRUE) {
+        EFI_EVENT events[TASK_MAX * TASK_MAX_EVENTS];
+        TASK *owners[TASK_MAX * TASK_MAX_EVENTS];
+        UINTN count = 0, index;
+        BOOLEAN found = FALSE;
+        EFI_STATUS status;
+
+        for (UINTN i = 1; i <= TASK_MAX && !found; i++) {
+            next = (task_current + i) % TASK_MAX;
+            found = task_ready(&tasks[next]);
+        }
+        if (found) break;
+
+        for (UINTN t = 0; t < TASK_MAX; t++) {
+            TASK *task = &tasks[t];
+
+            if (!task->used || task->done) continue;
+            for (UINTN i = 0; i < task->event_count; i++) {
+                if (task->events[i] == ConIn->WaitForKey && t != task_focus) continue;
+                events[count] = task->events[i];
+                owners[count++] = task;
+            }
+        }
+        task_restore_console(task_focus);
+        if (count == 0) {
+            /* Only joins, focus waits or background key waits: they change without an event */
+            BS->Stall(TASK_IDLE_STALL);
+            continue;
+        }
+        index = count;
+        status = BS->WaitForEvent(count, events, &index);
+        if (EFI_ERROR(status)) {
+            /* Not at TPL_APPLICATION, or a notify-signal event: don't retry the same wait */
+            BS->Stall(TASK_IDLE_STALL);
+            if (index >= count) continue;
+        }
+        /*
+         * WaitForEvent clears the event it returns, so the wait is ended
+         * here. An event it rejected ends its task's wait as well; the task
+         * checks what it was waiting for and, failing again, polls.
+         */
+        for (UINTN i = 0; i < owners[index]->event_count; i++) {
+            if (owners[index]->events[i] == events[index]) owners[index]->signalled = i;
+        }
+        owners[index]->event_count = 0;
+    }
+
+    tasks[next].event_count = 0;
+    tasks[next].join = NULL;
+    tasks[next].wait_focus = FALSE;
+    task_restore_console(next);
+    if (next != task_current) {
+        task_current = next;
+        task_switch(&self->esp, tasks[next].esp);
+    }
+}
+
+/* Let the other tasks run until one of the events is signalled; returns its index */
+UINTN task_wait(UINTN count, EFI_EVENT *events) {
+    TASK *self = &tasks[task_current];
+
+    self->events = events;
+    self->event_count = count;
+    task_schedule();
+    return self->signalled;
+}
+
+/* Where every task but task 0 begins: run the app, then leave for good */
+VOID task_start(VOID) {
+    TASK *self = &tasks[task_current];
+
+    self->entry();
+    self->done = TRUE;
+    if (task_focus == task_current) task_focus = 0;
+    task_schedule();
+}
+
+/* Start a task for an app on a stack of its own; its index, or 0 when there is no room */
+UINTN task_spawn(VOID (*entry)(VOID)) {
+    for (UINTN t = 1; t < TASK_MAX; t++) {
+        TASK *task = &tasks[t];
+        UINT32 *top;
+
+        if (task->used) continue;
+        SetMem(task, sizeof(*task), 0);
+        if (EFI_ERROR(BS->AllocatePages(AllocateAnyPages, EfiLoaderData, TASK_STACK_PAGES, &task->stack))) {
+            return 0;
+        }
+        /* Registers for task_switch to pop, its return into task_start, then task_start's own return slot */
+        top = (UINT32 *)(UINTN)(task->stack + TASK_STACK_PAGES * 4096);
+        top[-1] = 0;
+        top[-2] = (UINT32)(UINTN)task_start;
+        top[-3] = top[-4] = top[-5] = top[-6] = 0;
+        task->esp = (UINT32)(UINTN)&top[-6];
+        task->entry = entry;
+        task->attribute = COLOR_NORMAL;
+        task->column = task->row = -1;
+        task->used = TRUE;
+        return t;
+    }
+    return 0;
+}
+
+/* Free the stacks of tasks that have finished */
+VOID task_reap(VOID) {
+    for (UINTN t = 1; t < TASK_MAX; t++) {
+        if (tasks[t].used && tasks[t].done) {
+            BS->FreePages(tasks[t].stack, TASK_STACK_PAGES);
+            SetMem(&tasks[t], sizeof(tasks[t]), 0);
+        }
+    }
+}
+
+/* Hand the keyboard to a task and wait until it comes back */
+VOID task_focus_on(UINTN index) {
+    task_focus = index;
+    tasks[task_current].wait_focus = TRUE;
+    task_schedule();
+    task_reap();
+}
+
+/* Run an app as a task with the keyboard until it finishes or steps back; directly when no task is free */
+VOID task_run(VOID (*entry)(VOID)) {
+    UINTN index = task_spawn(entry);
+
+    if (index == 0) {
+        entry();
+        return;
+    }
+    task_focus_on(index);
+}
+
+/* Give the keyboard back to the main menu, carrying on in the background */
+VOID task_step_back(VOID) {
+    task_focus = 0;
+}
+
+/* Ask a task to finish and wait until it has */
+VOID task_cancel(UINTN index) {
+    tasks[index].cancel = TRUE;
+    tasks[task_current].join = &tasks[index];
+    task_schedule();
+    task_reap();
+}
+
+/* Whether the current task has been asked to finish */
+BOOLEAN task_cancelled(VOID) {
+    return tasks[task_current].cancel;
+}
+
+/* The task running an app, or 0 when there is none */
+UINTN task_find(VOID (*entry)(VOID)) {
+    for (UINTN t = 1; t < TASK_MAX; t++) {
+        if (tasks[t].used && !tasks[t].done && tasks[t].entry == entry) return t;
+    }
+    return 0;
+}
+
+/* Whether the current task has the keyboard */
+BOOLEAN task_has_focus(VOID) {
+    return task_current == task_focus;
+}
+
+/* Record a window the current task has drawn */
+VOID task_add_window(UINTN x, UINTN y, UINTN width, UINTN height) {
+    TASK *self = &tasks[task_current];
+
+    if (self->window_right == 0) {
+        self->window_left = x;
+        self->window_top = y;
+        self->window_right = x + width;
+        self->window_bottom = y + height;
+        return;
+    }
+    if (x < self->window_left) self->window_left = x;
+    if (y < self->window_top) self->window_top = y;
+    if (x + width > self->window_right) self->window_right = x + width;
+    if (y + height > self->window_bottom) self->window_bottom = y + height;
+}
+
+/* Whether a cell is under the focus's windows; never for the focus itself */
+BOOLEAN task_obscured(UINTN x, UINTN y) {
+    TASK *focus = &tasks[task_focus];
+
+    if (task_current == task_focus) return FALSE;
+    /* With no window drawn the focus may be using the whole screen, as the plot does */
+    if (focus->window_right == 0) return TRUE;
+    return x >= focus->window_left && x < focus->window_right &&
+           y >= focus->window_top && y < focus->window_bottom;
+}
+
+/* Clear screen and reset attributes */
+VOID clear_screen(VOID) {
+    ConOut->ClearScreen(ConOut);
+    ConOut->SetAttribute(ConOut, COLOR_NORMAL);
+    tasks[task_current].window_right = 0;
+    screen_generation++;
+}
+
+/* Set cursor position */
+VOID set_cursor(UINTN x, UINTN y) {
+    ConOut->SetCursorPosition(ConOut, x, y);
+}
+
+/* Draw top bar with clock and menu */
+VOID draw_topbar(VOID) {
+    EFI_TIME time;
+    CHAR16 buf[100];
+    
+    /* Get current time from UEFI runtime services */
+    ST->RuntimeServices->GetTime(&time, NULL);
+    
+    ConOut->SetAttribute(ConOut, COLOR_TOPBAR);
+    set_cursor(0, 0);
+    
+    /* Clear the line */
+    for (UINTN i = 0; i < SCREEN_WIDTH; i++) {
+        ConOut->OutputString(ConOut, L" ");
+    }
+    
+    /* Draw menu items */
+    set_cursor(1, 0);
+    SPrint(buf, sizeof(buf), L"ASCII-OS  \u2022  Activities  \u2022  Files  \u2022  Apps");
+    ConOut->OutputString(ConOut, buf);
+    
+    /* Draw clock on right side */
+    set_cursor(60, 0);
+    SPrint(buf, sizeof(buf), L"%02d:%02d:%02d", time.Hour, time.Minute, time.Second);
+    ConOut->OutputString(ConOut, buf);
+    
+    ConOut->SetAttribute(ConOut, COLOR_NORMAL);
+}
+
+/* Draw dock/menu with hotkeys */
+VOID draw_dock(VOID) {
+    set_cursor(2, 23);
+    ConOut->SetAttribute(ConOut, COLOR_HIGHLIGHT);
+    ConOut->OutputString(ConOut, L"[N]otepad  [C]alc  [P]lot  [E]ditor  [D]emos  [S]cript  [Q]uit");
+    ConOut->SetAttribute(ConOut, COLOR_NORMAL);
+}
+
+/* Draw the top border of a window with its centred title (which may be NULL) */
+VOID draw_window_title(UINTN x, UINTN y, UINTN width, CHAR16 *title) {
+    ConOut->SetAttribute(ConOut, COLOR_WINDOW);
+    
+    /* Top border */
+    set_cursor(x, y);
+    ConOut->OutputString(ConOut, L"\u256d");  /* Rounded top-left */
+    for (UINTN i = 0; i < width - 2; i++) {
+        ConOut->OutputString(ConOut, L"\u2500");  /* Horizontal line */
+    }
+    ConOut->OutputString(ConOut, L"\u256e");  /* Rounded top-right */
+    
+    /* Title */
+    if (title) {
+        UINTN title_len = StrLen(title);
+        set_cursor(x + (width - title_len) / 2, y);
+        ConOut->OutputString(ConOut, title);
+    }
+    
+    ConOut->SetAttribute(ConOut, COLOR_NORMAL);
+}
+
+/* Draw a window frame using box drawing characters */
+VOID draw_window(UINTN x, UINTN y, UINTN width, UINTN height, CHAR16 *title) {
+    task_add_window(x, y, width, height);
+    draw_window_title(x, y, width, title);
+    ConOut->SetAttribute(ConOut, COLOR_WINDOW);
+    
+    /* Sides */
+    for (UINTN i = 1; i < height - 1; i++) {
+        set_cursor(x, y + i);
+        ConOut->OutputString(ConOut, L"\u2502");  /* Vertical line */
+        set_cursor(x + width - 1, y + i);
+        ConOut->OutputString(ConOut, L"\u2502");
+    }
+    
+    /* Bottom border */
+    set_cursor(x, y + height - 1);
+    ConOut->OutputString(ConOut, L"\u2570");  /* Rounded bottom-left */
+    for (UINTN i = 0; i < width - 2; i++) {
+        ConOut->OutputString(ConOut, L"\u2500");
+    }
+    ConOut->OutputString(ConOut, L"\u256f");  /* Rounded bottom-right */
+    
+    ConOut->SetAttribute(ConOut, COLOR_NORMAL);
+}
+
+/* Read a single keystroke, letting other tasks run until one arrives */
+EFI_INPUT_KEY read_key(VOID) {
+    EFI_INPUT_KEY key;
+    
+    /* Wait for key event */
+    do {
+        task_wait(1, &ConIn->WaitForKey);
+    } while (EFI_ERROR(ConIn->ReadKeyStroke(ConIn, &key)));
+    
+    return key;
+}
+
+/* Find the Graphics Output Protocol; NULL on text-only systems */
+EFI_GRAPHICS_OUTPUT_PROTOCOL *locate_gop(VOID) {
+    EFI_GUID gop_guid = EFI_GRAPHICS_OUTPUT_PROTOCOL_GUID;
+    EFI_GRAPHICS_OUTPUT_PROTOCOL *gop;
+
+    if (EFI_ERROR(BS->LocateProtocol(&gop_guid, NULL, (VOID **)&gop))) return NULL;
+    return gop;
+}
+
+/*
+ * Multiprocessor services
+ *
+ * The PI specification's EFI_MP_SERVICES_PROTOCOL, declared here because
+ * gnu-efi does not ship it. Only the services used are typed; procedures
+ * run on APs must not call boot services.
+ */
+#define MP_SERVICES_PROTOCOL_GUID \
+    { 0x3fdda605, 0xa76e, 0x4f46, { 0xad, 0x29, 0x12, 0xf4, 0x53, 0x1b, 0x3d, 0x08 } }
+
+typedef VOID (EFIAPI *MP_AP_PROCEDURE)(VOID *argument);
+
+typedef struct _MP_SERVICES_PROTOCOL MP_SERVICES_PROTOCOL;
+
+struct _MP_SERVICES_PROTOCOL {
+    EFI_STATUS (EFIAPI *GetNumberOfProcessors)(MP_SERVICES_PROTOCOL *This, UINTN *count, UINTN *enabled);
+    VOID *GetProcessorInfo;
+    EFI_STATUS (EFIAPI *StartupAllAPs)(MP_SERVICES_PROTOCOL *This, MP_AP_PROCEDURE procedure,
+                                       BOOLEAN single_thread, EFI_EVENT wait_event, UINTN timeout_us,
+                                       VOID *argument, UINTN **failed_cpus);
+    VOID *StartupThisAP;
+    VOID *SwitchBSP;
+    VOID *EnableDisableAP;
+    EFI_STATUS (EFIAPI *WhoAmI)(MP_SERVICES_PROTOCOL *This, UINTN *number);
+};
+
+/* Find the MP services and the number of enabled APs; NULL on single-processor firmware */
+MP_SERVICES_PROTOCOL *locate_mp(UINTN *ap_count) {
+    EFI_GUID mp_guid = MP_SERVICES_PROTOCOL_GUID;
+    MP_SERVICES_PROTOCOL *mp;
+    UINTN count, enabled;
+
+    *ap_count = 0;
+    if (EFI_ERROR(BS->LocateProtocol(&mp_guid, NULL, (VOID **)&mp))) return NULL;
+    if (EFI_ERROR(mp->GetNumberOfProcessors(mp, &count, &enabled)) || enabled < 2) return NULL;
+    *ap_count = enabled - 1;
+    return mp;
+}
+
+/*
+ * Job system
+ *
+ * jobs_start sends every enabled AP into job_worker with one non-blocking
+ * StartupAllAPs, and there they stay until jobs_stop. Each processor, the
+ * BSP included, owns a work-stealing deque (Chase and Lev): the owner
+ * pushes and pops jobs (a function and its data) at the bottom without
+ * locking, and a processor with nothing to do steals the oldest job from
+ * the top of a randomly chosen victim with one compare-and-swap, backing
+ * off with PAUSE while there is nothing to steal. Jobs may submit jobs of
+ * their own; a job that splits its work in two keeps half and leaves the
+ * other half for a thief, so divide and conquer spreads itself over the
+ * processors. Every job counts down the JOB_COUNTER it was submitted
+ * with, and job_wait runs other jobs until its counter reaches zero, so
+ * waiting never idles a processor. Jobs are pure computation: they must
+ * not call boot services, which stay on the BSP. With no APs the BSP
+ * simply runs everything itself.
+ *
+ * Work the BSP should not wait for in a spin goes the other way: it is
+ * posted into one AP's inbox, a single-producer single-consumer ring, and
+ * the AP hands it back when done through a multi-producer ring that only
+ * the BSP drains. Neither ring has a lock; each index lives on its own
+ * cache line, and release stores publish a slot only after its contents.
+ * A task waiting for posted work sleeps in the scheduler with the other
+ * tasks, so the BSP goes on servicing firmware events and never waits on
+ * anything an AP holds.
+ */
+#define JOB_MAX_WORKERS     32          /* APs used; the BSP is worker 0 */
+#define JOB_DEQUE_SIZE      256         /* Per worker, a power of two */
+#define JOB_INBOX_SIZE      16          /* Posted jobs waiting per AP, a power of two */
+#define JOB_RESULTS_SIZE    512         /* At least JOB_MAX_WORKERS * JOB_INBOX_SIZE, a power of two */
+#define JOB_POLL_PERIOD     10000       /* 100 ns units: how often a waiting task looks for results */
+#define CACHE_LINE          64
+#define JOB_MAX_BACKOFF     256         /* Most PAUSEs between looks for work */
+#define JOB_START_TIMEOUT   100         /* Milliseconds for every AP to reach its deque */
+#define JOB_STOP_TIMEOUT    1000        /* Milliseconds for the workers to leave */
+
+typedef struct _JOB_WORKER JOB_WORKER;
+
+typedef VOID (*JOB_PROC)(JOB_WORKER *worker, VOID *data);
+
+/* Jobs submitted against it and not yet finished */
+typedef struct {
+    volatile UINT32 pending;
+} JOB_COUNTER;
+
+typedef struct {
+    JOB_PROC proc;
+    VOID *data;
+    JOB_COUNTER *counter;
+} JOB;
+
+/* Work posted to an AP; done is set on the BSP once the result is collected */
+typedef struct {
+    JOB_PROC proc;
+    VOID *data;
+    volatile BOOLEAN done;
+} JOB_POST;
+
+/* One producer, one consumer; each index on its own cache line */
+typedef struct {
+    volatile UINT32 head;               /* Next slot to read; only the consumer moves it */
+    UINT8 head_pad[CACHE_LINE - sizeof(UINT32)];
+    volatile UINT32 tail;               /* Next slot to write; only the producer moves it */
+    UINT8 tail_pad[CACHE_LINE - sizeof(UINT32)];
+    VOID *slots[JOB_INBOX_SIZE];
+} __attribute__((aligned(CACHE_LINE))) SPSC_RING;
+
+/* A slot of an MPSC ring: its sequence says whose turn it is */
+typedef struct {
+    volatile UINT32 sequence;
+    VOID *item;
+} MPSC_SLOT;
+
+/* Many producers, one consumer (Vyukov's bounded queue) */
+typedef struct {
+    volatile UINT32 head;               /* Only the consumer moves it */
+    UINT8 head_pad[CACHE_LINE - sizeof(UINT32)];
+    volatile UINT32 tail;               /* Producers claim slots here with compare-and-swap */
+    UINT8 tail_pad[CACHE_LINE - sizeof(UINT32)];
+    MPSC_SLOT slots[JOB_RESULTS_SIZE];
+} __attribute__((aligned(CACHE_LINE))) MPSC_RING;
+
+struct _JOB_WORKER {
+    volatile INT32 top;                 /* Oldest job; thieves advance it */
+    volatile INT32 bottom;              /* One past the newest; only the owner moves it */
+    JOB jobs[JOB_DEQUE_SIZE];
+    UINT32 number;
+    UINT32 seed;                        /* Victim choice */
+    SPSC_RING inbox;                    /* APs: posted jobs, from the BSP */
+};
+
+JOB_WORKER job_workers[JOB_MAX_WORKERS + 1];
+MPSC_RING job_results;                  /* Finished posts, from the APs to the BSP */
+UINTN job_post_next = 0;                /* Round robin over the inboxes */
+EFI_EVENT job_poll = NULL;              /* Periodic timer a task waiting for posts sleeps on */
+UINTN job_poll_waiters = 0;
+UINTN job_worker_count = 0;             /* APs taking part; 0 runs everything on the BSP */
+volatile UINT32 job_started = 0;        /* Deques claimed by APs */
+volatile BOOLEAN job_quit = FALSE;
+MP_SERVICES_PROTOCOL *job_mp = NULL;
+EFI_EVENT job_done_event = NULL;        /* Signalled once every AP has left job_worker */
+
+/* Spin-wait hint: saves power and lets a hyper-threaded sibling run */
+VOID cpu_pause(VOID) {
+    __asm__ volatile("pause" ::: "memory");
+}
+
+/* Add an item to an SPSC ring from its producer; FALSE when it is full */
+BOOLEAN spsc_push(SPSC_RING *ring, VOID *item) {
+    UINT32 tail = ring->tail;
+
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) >= JOB_INBOX_SIZE) return FALSE;
+    ring->slots[tail & (JOB_INBOX_SIZE - 1)] = item;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return TRUE;
+}
+
+/* Take the oldest item from an SPSC ring at its consumer; FALSE when it is empty */
+BOOLEAN spsc_pop(SPSC_RING *ring, VOID **item) {
+    UINT32 head = ring->head;
+
+    if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) return FALSE;
+    *item = ring->slots[head & (JOB_INBOX_SIZE - 1)];
+    /* The slot may be reused once head moves past it */
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return TRUE;
+}
+
+/* Empty an MPSC ring: slot i starts out waiting for the producer of position i */
+VOID mpsc_init(MPSC_RING *ring) {
+    SetMem(ring, sizeof(*ring), 0);
+    for (UINT32 i = 0; i < JOB_RESULTS_SIZE; i++) ring->slots[i].sequence = i;
+}
+
+/* Add an item to an MPSC ring from any processor; FALSE when it is full */
+BOOLEAN mpsc_push(MPSC_RING *ring, VOID *item) {
+    UINT32 position = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    MPSC_SLOT *slot;
+
+    for (;;) {
+        INT32 turn;
+
+        slot = &ring->slots[position & (JOB_RESULTS_SIZE - 1)];
+        turn = (INT32)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - position);
+        if (turn == 0) {
+            if (__sync_bool_compare_and_swap(&ring->tail, position, position + 1)) break;
+            position = ring->tail;
+        } else if (turn < 0) {
+            /* The consumer has not freed the slot from the last lap yet */
+            return FALSE;
+        } else {
+            /* Another producer took this position */
+            position = ring->tail;
+        }
+    }
+    slot->item = item;
+    __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+    return TRUE;
+}
+
+/* Take the oldest item from an MPSC ring at its consumer; FALSE when it is empty or the next one is still being written */
+BOOLEAN mpsc_pop(MPSC_RING *ring, VOID **item) {
+    UINT32 head = ring->head;
+    MPSC_SLOT *slot = &ring->slots[head & (JOB_RESULTS_SIZE - 1)];
+
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != head + 1) return FALSE;
+    *item = slot->item;
+    /* Hand the slot to the producer one lap later */
+    __atomic_store_n(&slot->sequence, head + JOB_RESULTS_SIZE, __ATOMIC_RELEASE);
+    ring->head = head + 1;
+    return TRUE;
+}
+
+/* Push a job on the worker's own deque; FALSE when it is full */
+BOOLEAN job_push(JOB_WORKER *worker, JOB *job) {
+    INT32 bottom = worker->bottom;
+
+    if (bottom - worker->top >= JOB_DEQUE_SIZE) return FALSE;
+    worker->jobs[bottom & (JOB_DEQUE_SIZE - 1)] = *job;
+    /* The job must be visible before the bottom that publishes it */
+    __sync_synchronize();
+    worker->bottom = bottom + 1;
+    return TRUE;
+}
+
+/* Take the newest job from the worker's own deque */
+BOOLEAN job_pop(JOB_WORKER *worker, JOB *job) {
+    INT32 bottom = worker->bottom - 1;
+    INT32 top;
+
+    /* Claim the slot before looking at top; a thief does the opposite */
+    worker->bottom = bottom;
+    __sync_synchronize();
+    top = worker->top;
+    if (top > bottom) {
+        worker->bottom = bottom + 1;
+        return FALSE;
+    }
+    *job = worker->jobs[bottom & (JOB_DEQUE_SIZE - 1)];
+    if (top == bottom) {
+        /* The last job: race any thief for it */
+        BOOLEAN won = __sync_bool_compare_and_swap(&worker->top, top, top + 1);
+        worker->bottom = bottom + 1;
+        return won;
+    }
+    return TRUE;
+}
+
+/* Take the oldest job from another worker's deque */
+BOOLEAN job_steal(JOB_WORKER *victim, JOB *job) {
+    INT32 top = victim->top;
+    INT32 bottom;
+
+    __sync_synchronize();
+    bottom = victim->bottom;
+    if (top >= bottom) return FALSE;
+    *job = victim->jobs[top & (JOB_DEQUE_SIZE - 1)];
+    /* Losing means the owner or another thief got it; the copy is then stale */
+    return __sync_bool_compare_and_swap(&victim->top, top, top + 1);
+}
+
+/* Find work: the worker's own newest job, else one stolen from random victims */
+BOOLEAN job_find(JOB_WORKER *worker, JOB *job) {
+    UINT32 victims = (UINT32)job_worker_count + 1;
+
+    if (job_pop(worker, job)) return TRUE;
+    for (UINT32 tries = 1; tries < victims; tries++) {
+        UINT32 victim;
+
+        worker->seed ^= worker->seed << 13;
+        worker->seed ^= worker->seed >> 17;
+        worker->seed ^= worker->seed << 5;
+        victim = worker->seed % victims;
+        if (victim != worker->number && job_steal(&job_workers[victim], job)) return TRUE;
+    }
+    return FALSE;
+}
+
+/* Run a job and count it done */
+VOID job_run(JOB_WORKER *worker, JOB *job) {
+    job->proc(worker, job->data);
+    __sync_fetch_and_sub(&job->counter->pending, 1);
+}
+
+/* Claim a deque and run jobs until jobs_stop; every AP runs this */
+VOID EFIAPI job_worker(VOID *argument) {
+    UINT32 number = __sync_fetch_and_add(&job_started, 1) + 1;
+    UINT32 backoff = 1;
+    JOB_WORKER *worker;
+    JOB job;
+
+    (VOID)argument;
+    if (number > JOB_MAX_WORKERS) return;
+    worker = &job_workers[number];
+    for (;;) {
+        VOID *item;
+
+        if (spsc_pop(&worker->inbox, &item)) {
+            JOB_POST *post = (JOB_POST *)item;
+
+            post->proc(worker, post->data);
+            /* The ring holds every post that can be out, so this only waits for the BSP to catch up */
+            while (!mpsc_push(&job_results, post)) cpu_pause();
+            backoff = 1;
+        } else if (job_find(worker, &job)) {
+            job_run(worker, &job);
+            backoff = 1;
+        } else if (job_quit) {
+            return;
+        } else {
+            for (UINT32 i = 0; i < backoff; i++) cpu_pause();
+            if (backoff < JOB_MAX_BACKOFF) backoff *= 2;
+        }
+    }
+}
+
+/* Wait up to timeout_ms for the workers to leave; FALSE if they did not */
+BOOLEAN jobs_wait_done(UINTN timeout_ms) {
+    for (UINTN waited = 0; waited < timeout_ms; waited++) {
+        if (BS->CheckEvent(job_done_event) == EFI_SUCCESS) return TRUE;
+        BS->Stall(1000);
+    }
+    return FALSE;
+}
+
+/* Park every enabled AP in job_worker; without MP services jobs simply run on the BSP */
+VOID jobs_start(VOID) {
+    UINTN ap_count;
+    UINTN workers;
+
+    SetMem(job_workers, sizeof(job_workers), 0);
+    for (UINT32 i = 0; i <= JOB_MAX_WORKERS; i++) {
+        job_workers[i].number = i;
+        job_workers[i].seed = 0x9E3779B9 * (i + 1);
+    }
+    mpsc_init(&job_results);
+    job_mp = locate_mp(&ap_count);
+    if (job_mp == NULL) return;
+    workers = ap_count < JOB_MAX_WORKERS ? ap_count : JOB_MAX_WORKERS;
+    job_started = 0;
+    job_quit = FALSE;
+
+    if (EFI_ERROR(BS->CreateEvent(0, 0, NULL, NULL, &job_done_event))) {
+        job_mp = NULL;
+        return;
+    }
+    /* A wait event makes the call return at once, leaving the APs in the loop */
+    if (EFI_ERROR(job_mp->StartupAllAPs(job_mp, job_worker, FALSE, job_done_event, 0, NULL, NULL))) {
+        BS->CloseEvent(job_done_event);
+        job_mp = NULL;
+        return;
+    }
+
+    /* Use the APs only if all of them turn up, so no victim is missing */
+    for (UINTN waited = 0; job_started < workers && waited < JOB_START_TIMEOUT; waited++) {
+        BS->Stall(1000);
+    }
+    if (job_started >= workers) {
+        job_worker_count = workers;
+    } else {
+        job_quit = TRUE;
+        /* The firmware owns the event until the last AP leaves; if one is late, jobs_stop waits for it */
+        if (jobs_wait_done(JOB_STOP_TIMEOUT)) {
+            BS->CloseEvent(job_done_event);
+            job_mp = NULL;
+        }
+    }
+}
+
+/* Let the workers finish and return to the firmware */
+VOID jobs_stop(VOID) {
+    if (job_poll != NULL) {
+        BS->CloseEvent(job_poll);
+        job_poll = NULL;
+    }
+    if (job_mp == NULL) return;
+    job_quit = TRUE;
+    /* Returning would unload job_worker from under an AP still running it, so keep waiting */
+    if (!jobs_wait_done(JOB_STOP_TIMEOUT)) {
+        ConOut->OutputString(ConOut, L"Waiting for the other processors to finish...\r\n");
+        do {
+            BS->Stall(1000);
+        } while (BS->CheckEvent(job_done_event) != EFI_SUCCESS);
+    }
+    BS->CloseEvent(job_done_event);
+    job_mp = NULL;
+    job_worker_count = 0;
+}
+
+/* Submit proc(data) from worker, counted in counter; run it at once when the deque is full */
+VOID job_submit(JOB_WORKER *worker, JOB_PROC proc, VOID *data, JOB_COUNTER *counter) {
+    JOB job;
+
+    job.proc = proc;
+    job.data = data;
+    job.counter = counter;
+    __sync_fetch_and_add(&counter->pending, 1);
+    if (!job_push(worker, &job)) job_run(worker, &job);
+}
+
+/* Run jobs, this worker's or stolen ones, until every job counted in counter has finished */
+VOID job_wait(JOB_WORKER *worker, JOB_COUNTER *counter) {
+    JOB job;
+
+    while (counter->pending != 0) {
+        if (job_find(worker, &job)) {
+            job_run(worker, &job);
+        } else {
+            cpu_pause();
+        }
+    }
+}
+
+/* Run proc(data) once per processor, in parallel as far as thieves allow, from the BSP */
+VOID job_run_everywhere(JOB_PROC proc, VOID *data) {
+    JOB_WORKER *bsp = &job_workers[0];
+    JOB_COUNTER counter;
+
+    counter.pending = 0;
+    for (UINTN i = 0; i < job_worker_count; i++) job_submit(bsp, proc, data, &counter);
+    proc(bsp, data);
+    job_wait(bsp, &counter);
+}
+
+/*
+ * Post proc(data) to an AP from the BSP without waiting for it; the post
+ * must stay put until it is done. With no AP free it runs here and now.
+ */
+VOID job_post(JOB_POST *post, JOB_PROC proc, VOID *data) {
+    post->proc = proc;
+    post->data = data;
+    post->done = FALSE;
+    for (UINTN i = 0; i < job_worker_count; i++) {
+        JOB_WORKER *ap = &job_workers[1 + job_post_next++ % job_worker_count];
+
+        if (spsc_push(&ap->inbox, post)) return;
+    }
+    proc(&job_workers[0], data);
+    post->done = TRUE;
+}
+
+/* Mark every post the APs have handed back as done; BSP only */
+VOID job_collect(VOID) {
+    VOID *item;
+
+    while (mpsc_pop(&job_results, &item)) ((JOB_POST *)item)->done = TRUE;
+}
+
+/* Let the other tasks run until a post is done, looking for results on a timer */
+VOID job_post_wait(JOB_POST *post) {
+    job_collect();
+    if (post->done) return;
+    if (job_poll == NULL && EFI_ERROR(BS->CreateEvent(EVT_TIMER, 0, NULL, NULL, &job_poll))) job_poll = NULL;
+    if (job_poll != NULL && job_poll_waiters++ == 0) BS->SetTimer(job_poll, TimerPeriodic, JOB_POLL_PERIOD);
+    while (!post->done) {
+        if (job_poll != NULL) {
+            task_wait(1, &job_poll);
+        } else {
+            cpu_pause();
+        }
+        job_collect();
+    }
+    if (job_poll != NULL && --job_poll_waiters == 0) BS->SetTimer(job_poll, TimerCancel, 0);
+}
+
+/* A piece of a job_parallel_for */
+typedef struct {
+    VOID (*proc)(VOID *data, UINTN first, UINTN end);
+    VOID *data;
+    UINTN first, end, grain;
+} JOB_RANGE;
+
+/* Halve the range until it is no more than grain, leaving the upper halves to thieves */
+VOID job_range(JOB_WORKER *worker, VOID *argument) {
+    JOB_RANGE *range = (JOB_RANGE *)argument;
+    JOB_RANGE lower = *range, upper = *range;
+    JOB_COUNTER counter;
+
+    if (range->end - range->first <= range->grain) {
+        range->proc(range->data, range->first, range->end);
+        return;
+    }
+    counter.pending = 0;
+    lower.end = upper.first = range->first + (range->end - range->first) / 2;
+    job_submit(worker, job_range, &upper, &counter);
+    job_range(worker, &lower);
+    job_wait(worker, &counter);
+}
+
+/* Call proc on pieces of [first, end) no larger than grain, spread over every processor, from the BSP */
+VOID job_parallel_for(UINTN first, UINTN end, UINTN grain, VOID (*proc)(VOID *data, UINTN first, UINTN end),
+                      VOID *data) {
+    JOB_RANGE range;
+
+    if (job_worker_count == 0 || end - first <= grain) {
+        if (first < end) proc(data, first, end);
+        return;
+    }
+    range.proc = proc;
+    range.data = data;
+    range.first = first;
+    range.end = end;
+    range.grain = grain;
+    job_range(&job_workers[0], &range);
+}
+
+/* Open the root directory of the first file system (normally the boot volume) */
+EFI_STATUS open_root_volume(EFI_FILE_PROTOCOL **root) {
+    EFI_STATUS status;
+    EFI_GUID fs_guid = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID;
+    EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *fs;
+    UINTN handles_count = 0;
+    EFI_HANDLE *handles = NULL;
+    
+    /* Locate filesystem protocol - try to find writable filesystem */
+    status = BS->LocateHandleBuffer(ByProtocol, &fs_guid, NULL, &handles_count, &handles);
+    if (EFI_ERROR(status) || handles_count == 0) {
+        /* No filesystem available */
+        return EFI_NOT_FOUND;
+    }
+    
+    /* Open the first available filesystem */
+    status = BS->HandleProtocol(handles[0], &fs_guid, (VOID **)&fs);
+    BS->FreePool(handles);
+    
+    if (EFI_ERROR(status)) {
+        return status;
+    }
+    
+    /* Open the root directory */
+    return fs->OpenVolume(fs, root);
+}
+
+/* Save buffer to UEFI filesystem */
+EFI_STATUS save_to_file(CHAR16 *filename, CHAR16 buffer[MAX_LINES][MAX_LINE_LENGTH], UINTN num_lines) {
+    EFI_STATUS status;
+    EFI_FILE_PROTOCOL *root;
+    EFI_FILE_PROTOCOL *file;
+    
+    status = open_root_volume(&root);
+    if (EFI_ERROR(status)) {
+        return status;
+    }
+    
+    /* Create/open the file for writing */
+    status = root->Open(root, &file, filename, 
+                       EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE,
+                       0);
+    
+    if (EFI_ERROR(status)) {
+        root->Close(root);
+        return status;
+    }
+    
+    /* Write each line to the file */
+    for (UINTN i = 0; i < num_lines; i++) {
+        UINTN len = StrLen(buffer[i]) * sizeof(CHAR16);
+        file->Write(file, &len, buffer[i]);
+        
+        /* Add newline */
+        CHAR16 newline[] = L"\r\n";
+        len = 4;
+        file->Write(file, &len, newline);
+    }
+    
+    file->Close(file);
+    root->Close(root);
+    
+    return EFI_SUCCESS;
+}
+
+/* Read a whole file of at most max_size bytes into pool memory; the caller frees *data */
+EFI_STATUS read_file_data(CHAR16 *filename, UINTN max_size, VOID **data, UINTN *size) {
+    EFI_STATUS status;
+    EFI_FILE_PROTOCOL *root;
+    EFI_FILE_PROTOCOL *file;
+    UINT64 end = 0;
+    
+    status = open_root_volume(&root);
+    if (EFI_ERROR(status)) return status;
+    
+    status = root->Open(root, &file, filename, EFI_FILE_MODE_READ, 0);
+    root->Close(root);
+    if (EFI_ERROR(status)) return status;
+    
+    /* Seeking to 0xFFFFFFFFFFFFFFFF moves to end-of-file, revealing the size */
+    status = file->SetPosition(file, 0xFFFFFFFFFFFFFFFFULL);
+    if (!EFI_ERROR(status)) status = file->GetPosition(file, &end);
+    if (!EFI_ERROR(status) && end > max_size) status = EFI_BAD_BUFFER_SIZE;
+    if (!EFI_ERROR(status)) status = file->SetPosition(file, 0);
+    if (!EFI_ERROR(status)) {
+        *size = (UINTN)end;
+        status = BS->AllocatePool(EfiLoaderData, *size + sizeof(CHAR16), data);
+    }
+    if (!EFI_ERROR(status)) {
+        status = file->Read(file, size, *data);
+        if (EFI_ERROR(status)) BS->FreePool(*data);
+    }
+    
+    file->Close(file);
+    return status;
+}
+
+/* Replace a file's contents with one Write call */
+EFI_STATUS write_file_data(CHAR16 *filename, VOID *data, UINTN size) {
+    EFI_STATUS status;
+    EFI_FILE_PROTOCOL *root;
+    EFI_FILE_PROTOCOL *file;
+    UINTN written = size;
+    
+    status = open_root_volume(&root);
+    if (EFI_ERROR(status)) return status;
+    
+    /* Delete any old copy so a shorter result leaves no stale tail */
+    status = root->Open(root, &file, filename, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0);
+    if (!EFI_ERROR(status)) file->Delete(file);
+    
+    status = root->Open(root, &file, filename,
+                        EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE, 0);
+    root->Close(root);
+    if (EFI_ERROR(status)) return status;
+    
+    status = file->Write(file, &written, data);
+    if (!EFI_ERROR(status) && written != size) status = EFI_VOLUME_FULL;
+    
+    file->Close(file);
+    return status;
+}
+
+/*
+ * Text decoding
+ *
+ * Files are ASCII, UTF-8 or UTF-16 (a byte-order mark or a zero high
+ * byte in the first character gives UTF-16 away). Decoding them into
+ * CHAR16 and finding where the lines start is pure computation, so big
+ * files are cut into TEXT_CHUNK byte chunks and job_parallel_for spreads
+ * them over the processors in two passes: the first counts each chunk's
+ * characters and line breaks, the BSP turns the counts into offsets and
+ * allocates, and the second decodes every chunk into its place and fills
+ * in its part of the line index. Chunks must not split a character, so
+ * a UTF-8 chunk starts past any continuation bytes at its nominal start
+ * (at most three) and ends where the next one starts. A line ends at LF,
+ * or at a CR that is not followed by LF; the one place a chunk looks
+ * beyond its end is the byte after a final CR.
+ */
+#define TEXT_CHUNK      65536           /* Bytes, even so UTF-16 chunks stay whole */
+#define TEXT_MAX_FILE   (16 * 1024 * 1024)
+
+/* One chunk's share of a text_decode */
+typedef struct {
+    UINTN first, end;                   /* Units (bytes, or CHAR16 for UTF-16) this chunk decodes */
+    UINTN chars;                        /* CHAR16s it produces */
+    UINTN breaks;                       /* Line breaks among them */
+    UINTN out;                          /* Where its characters go */
+    UINTN line;                         /* Index of the first line starting in it, less one */
+} TEXT_CHUNK_STATE;
+
+typedef struct {
+    UINT8 *data;
+    UINTN count;                        /* Units in data */
+    BOOLEAN wide;
+    TEXT_CHUNK_STATE *chunks;
+    CHAR16 *text;                       /* NULL in the counting pass */
+    UINT32 *lines;                      /* NULL when no index is wanted */
+} TEXT_DECODE;
+
+/* Decode the character at *pos, moving past it; malformed UTF-8 gives U+FFFD one byte at a time */
+UINT32 text_next_char(TEXT_DECODE *decode, UINTN *pos) {
+    UINT8 *data = decode->data;
+    UINTN p = *pos;
+    UINT32 c, min;
+    UINTN more;
+
+    if (decode->wide) {
+        *pos = p + 1;
+        return ((CHAR16 *)data)[p];
+    }
+    c = data[p];
+    *pos = p + 1;
+    if (c < 0x80) return c;
+    if (c >= 0xC2 && c <= 0xDF) {
+        c &= 0x1F;
+        more = 1;
+        min = 0x80;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        c &= 0x0F;
+        more = 2;
+        min = 0x800;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        c &= 0x07;
+        more = 3;
+        min = 0x10000;
+    } else {
+        return 0xFFFD;
+    }
+    for (UINTN k = 1; k <= more; k++) {
+        if (p + k >= decode->count || (data[p + k] & 0xC0) != 0x80) return 0xFFFD;
+        c = (c << 6) | (data[p + k] & 0x3F);
+    }
+    if (c < min || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF)) return 0xFFFD;
+    *pos = p + 1 + more;
+    return c;
+}
+
+/* Where chunk i starts: past any continuation bytes at its nominal start, so no character is split */
+UINTN text_chunk_start(TEXT_DECODE *decode, UINTN i) {
+    UINTN start = i * (decode->wide ? TEXT_CHUNK / sizeof(CHAR16) : TEXT_CHUNK);
+
+    if (start >= decode->count) return decode->count;
+    for (UINTN k = 0; i > 0 && k < 3 && !decode->wide && start < decode->count &&
+                      (decode->data[start] & 0xC0) == 0x80; k++) {
+        start++;
+    }
+    return start;
+}
+
+/* Whether the unit at pos is an LF; the only look past a chunk's end */
+BOOLEAN text_lf_at(TEXT_DECODE *decode, UINTN pos) {
+    if (pos >= decode->count) return FALSE;
+    return decode->wide ? ((CHAR16 *)decode->data)[pos] == L'\n' : decode->data[pos] == '\n';
+}
+
+/* Count or decode chunks [first, end); run by job_parallel_for */
+VOID text_decode_chunks(VOID *data, UINTN first, UINTN end) {
+    TEXT_DECODE *decode = (TEXT_DECODE *)data;
+
+    for (UINTN i = first; i < end; i++) {
+        TEXT_CHUNK_STATE *chunk = &decode->chunks[i];
+        UINTN pos = chunk->first;
+        UINTN out = chunk->out;
+        UINTN line = chunk->line;
+
+        if (decode->text == NULL) {
+            chunk->chars = 0;
+            chunk->breaks = 0;
+        }
+        while (pos < chunk->end) {
+            UINT32 c = text_next_char(decode, &pos);
+            BOOLEAN line_end = c == L'\n' || (c == L'\r' && !text_lf_at(decode, pos));
+
+            if (decode->text == NULL) {
+                chunk->chars += c > 0xFFFF ? 2 : 1;
+                if (line_end) chunk->breaks++;
+                continue;
+            }
+            if (c > 0xFFFF) {
+                c -= 0x10000;
+                decode->text[out++] = (CHAR16)(0xD800 + (c >> 10));
+                decode->text[out++] = (CHAR16)(0xDC00 + (c & 0x3FF));
+            } else {
+                decode->text[out++] = (CHAR16)c;
+            }
+            if (line_end && decode->lines != NULL) decode->lines[++line] = (UINT32)out;
+        }
+    }
+}
+
+/*
+ * Decode a file's bytes into a NUL-terminated pool string (line breaks
+ * kept) and, when lines is not NULL, a pool array of the offsets where
+ * its lines start; a final line break does not start another line. The
+ * caller frees both.
+ */
+EFI_STATUS text_decode(UINT8 *data, UINTN size, CHAR16 **text, UINTN *len, UINT32 **lines, UINTN *line_count) {
+    TEXT_DECODE decode;
+    UINTN chunk_count, chars = 0, breaks = 0;
+    UINTN skip = 0;
+
+    decode.wide = size >= 2 && ((data[0] == 0xFF && data[1] == 0xFE) || (data[0] != 0 && data[1] == 0));
+    if (decode.wide && data[0] == 0xFF) {
+        skip = 2;
+    } else if (!decode.wide && size >= 3 && data[0] == 0xEF && data[1] == 0xBB && data[2] == 0xBF) {
+        skip = 3;
+    }
+    decode.data = data + skip;
+    decode.count = decode.wide ? (size - skip) / sizeof(CHAR16) : size - skip;
+    decode.text = NULL;
+    decode.lines = NULL;
+    chunk_count = (size - skip + TEXT_CHUNK - 1) / TEXT_CHUNK;
+    if (chunk_count == 0) chunk_count = 1;
+    if (EFI_ERROR(BS->AllocatePool(EfiLoaderData, chunk_count * sizeof(TEXT_CHUNK_STATE), (VOID **)&decode.chunks))) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    /* Pass one: characters and line breaks per chunk */
+    for (UINTN i = 0; i < chunk_count; i++) decode.chunks[i].first = text_chunk_start(&decode, i);
+    for (UINTN i = 0; i < chunk_count; i++) {
+        decode.chunks[i].end = i + 1 < chunk_count ? decode.chunks[i + 1].first : decode.count;
+    }
+    job_parallel_for(0, chunk_count, 1, text_decode_chunks, &decode);
+
+    /* Offsets on the BSP, which also owns allocation */
+    for (UINTN i = 0; i < chunk_count; i++) {
+        decode.chunks[i].out = chars;
+        decode.chunks[i].line = breaks;
+        chars += decode.chunks[i].chars;
+        breaks += decode.chunks[i].breaks;
+    }
+    if (EFI_ERROR(BS->AllocatePool(EfiLoaderData, (chars + 1) * sizeof(CHAR16), (VOID **)&decode.text))) {
+        BS->FreePool(decode.chunks);
+        return EFI_OUT_OF_RESOURCES;
+    }
+    if (lines != NULL && EFI_ERROR(BS->AllocatePool(EfiLoaderData, (breaks + 1) * sizeof(UINT32),
+                                                    (VOID **)&decode.lines))) {
+        BS->FreePool(decode.text);
+        BS->FreePool(decode.chunks);
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    /* Pass two: decode into place and index the lines */
+    if (decode.lines != NULL) decode.lines[0] = 0;
+    job_parallel_for(0, chunk_count, 1, text_decode_chunks, &decode);
+    BS->FreePool(decode.chunks);
+
+    decode.text[chars] = 0;
+    *text = decode.text;
+    *len = chars;
+    if (lines != NULL) {
+        *lines = decode.lines;
+        *line_count = breaks + 1;
+        if (decode.lines[breaks] == chars) (*line_count)--;
+    }
+    return EFI_SUCCESS;
+}
+
+/* Read a text file (ASCII, UTF-8 or UTF-16) into a NUL-terminated pool string; the caller frees *text */
+EFI_STATUS read_text_file(CHAR16 *filename, UINTN max_size, CHAR16 **text, UINTN *len) {
+    EFI_STATUS status;
+    UINT8 *data;
+    UINTN size;
+    
+    status = read_file_data(filename, max_size, (VOID **)&data, &size);
+    if (EFI_ERROR(status)) return status;
+    status = text_decode(data, size, text, len, NULL, NULL);
+    BS->FreePool(data);
+    return status;
+}
+
+/* Load a text file into line buffers; lines past MAX_LINES are dropped and long ones cut short */
+EFI_STATUS load_from_file(CHAR16 *filename, CHAR16 buffer[MAX_LINES][MAX_LINE_LENGTH], UINTN *num_lines) {
+    EFI_STATUS status;
+    UINT8 *data;
+    UINTN size, len, line_count;
+    CHAR16 *text;
+    UINT32 *lines;
+    
+    *num_lines = 0;
+    
+    status = read_file_data(filename, TEXT_MAX_FILE, (VOID **)&data, &size);
+    if (EFI_ERROR(status)) return status;
+    status = text_decode(data, size, &text, &len, &lines, &line_count);
+    BS->FreePool(data);
+    if (EFI_ERROR(status)) return status;
+    
+    /* Copy each line up to its CR or LF */
+    for (UINTN i = 0; i < line_count && i < MAX_LINES; i++) {
+        CHAR16 *line = text + lines[i];
+        UINTN col = 0;
+        
+        while (line[col] != 0 && line[col] != L'\r' && line[col] != L'\n' && col < MAX_LINE_LENGTH - 1) {
+            buffer[i][col] = line[col];
+            col++;
+        }
+        buffer[i][col] = 0;
+    }
+    *num_lines = line_count < MAX_LINES ? line_count : MAX_LINES;
+    
+    BS->FreePool(lines);
+    BS->FreePool(text);
+    return EFI_SUCCESS;
+}
+
+/* Write text as ASCII when every character fits, otherwise as UTF-16 with a byte-order mark */
+EFI_STATUS write_text_file(CHAR16 *filename, CHAR16 *text, UINTN len) {
+    EFI_STATUS status;
+    UINT8 *data;
+    UINTN size;
+    BOOLEAN wide = FALSE;
+    
+    for (UINTN i = 0; i < len && !wide; i++) wide = text[i] >= 0x80;
+    size = wide ? (len + 1) * sizeof(CHAR16) : len;
+    status = BS->AllocatePool(EfiLoaderData, size + 1, (VOID **)&data);
+    if (EFI_ERROR(status)) return status;
+    
+    if (wide) {
+        ((CHAR16 *)data)[0] = 0xFEFF;
+        CopyMem(data + sizeof(CHAR16), text, len * sizeof(CHAR16));
+    } else {
+        for (UINTN i = 0; i < len; i++) data[i] = (UINT8)text[i];
+    }
+    status = write_file_data(filename, data, size);
+    BS->FreePool(data);
+    return status;
+}
+
+/* Send text to the first serial port as ASCII, with CR LF line ends */
+EFI_STATUS write_serial(CHAR16 *text) {
+    EFI_GUID serial_guid = SERIAL_IO_PROTOCOL;
+    SERIAL_IO_INTERFACE *serial;
+    CHAR8 chunk[128];
+    EFI_STATUS status;
+
+    status = BS->LocateProtocol(&serial_guid, NULL, (VOID **)&serial);
+    if (EFI_ERROR(status)) return status;
+
+    while (*text != 0) {
+        UINTN size = 0;
+
+        while (*text != 0 && size < sizeof(chunk) - 1) {
+            if (*text == L'\n') chunk[size++] = '\r';
+            chunk[size++] = *text < 0x80 ? (CHAR8)*text : '?';
+            text++;
+        }
+        status = serial->Write(serial, &size, chunk);
+        if (EFI_ERROR(status)) return status;
+    }
+    return EFI_SUCCESS;
+}
+
+/* Notepad application */
+VOID app_notepad(VOID) {
+    EFI_INPUT_KEY key;
+    BOOLEAN running = TRUE;
+    
+    clear_screen();
+    draw_topbar();
+    draw_window(10, 3, 60, 18, L" Notepad ");
+    
+    set_cursor(12, 20);
+    ConOut->OutputString(ConOut, L"Type text. F2=Save, ESC=Exit");
+    
+    notepad_cursor_line = 0;
+    notepad_cursor_col = 0;
+    
+    while (running) {
+        /* Display current buffer */
+        for (UINTN i = 0; i < 16 && i < notepad_lines; i++) {
+            set_cursor(12, 4 + i);
+            ConOut->OutputString(ConOut, L"                                                      ");
+            set_cursor(12, 4 + i);
+            ConOut->OutputString(ConOut, notepad_buffer[i]);
+        }
+        
+        /* Show cursor */
+        set_cursor(12 + notepad_cursor_col, 4 + notepad_cursor_line);
+        
+        key = read_key();
+        
+        if (key.ScanCode == SCAN_ESC) {
+            running = FALSE;
+        } else if (key.ScanCode == SCAN_F2) {
+            /* Save to file */
+            EFI_STATUS status = save_to_file(L"\\notepad.txt", notepad_buffer, notepad_lines);
+            set_cursor(12, 20);
+            if (EFI_ERROR(status)) {
+                ConOut->OutputString(ConOut, L"Save failed (filesystem unavailable)");
+            } else {
+                ConOut->OutputString(ConOut, L"Saved to \\notepad.txt            ");
+            }
+        } else if (key.UnicodeChar == CHAR_BACKSPACE) {
+            if (notepad_cursor_col > 0) {
+                notepad_cursor_col--;
+                notepad_buffer[notepad_cursor_line][notepad_cursor_col] = 0;
+            }
+        } else if (key.UnicodeChar == CHAR_CARRIAGE_RETURN) {
+            notepad_buffer[notepad_cursor_line][notepad_cursor_col] = 0;
+            notepad_cursor_line++;
+            notepad_cursor_col = 0;
+            if (notepad_cursor_line >= MAX_LINES) notepad_cursor_line = MAX_LINES - 1;
+            if (notepad_cursor_line >= notepad_lines) notepad_lines = notepad_cursor_line + 1;
+        } else if (key.UnicodeChar >= 32 && key.UnicodeChar < 127) {
+            if (notepad_cursor_col < MAX_LINE_LENGTH - 1) {
+                notepad_buffer[notepad_cursor_line][notepad_cursor_col++] = key.UnicodeChar;
+                notepad_buffer[notepad_cursor_line][notepad_cursor_col] = 0;
+                if (notepad_cursor_line >= notepad_lines) notepad_lines = notepad_cursor_line + 1;
+            }
+        }
+    }
+}
+
+/* Calculator application */
+CHAR16 calc_history[CALC_HISTORY_SIZE][CALC_MAX_INPUT];
+UINTN calc_history_count = 0;
+BOOLEAN calc_decimal_mode = FALSE;
+UINTN calc_digits = CALC_DEFAULT_DIGITS;
+
+/* Remember an evaluated expression, dropping the oldest when full */
+VOID calc_history_add(CHAR16 *expr) {
+    if (calc_history_count > 0 &&
+        StrCmp(calc_history[calc_history_count - 1], expr) == 0) {
+        return;
+    }
+    if (calc_history_count == CALC_HISTORY_SIZE) {
+        for (UINTN i = 1; i < CALC_HISTORY_SIZE; i++) {
+            StrCpy(calc_history[i - 1], calc_history[i]);
+        }
+        calc_history_count--;
+    }
+    StrCpy(calc_history[calc_history_count++], expr);
+}
+
+/* Result pane geometry inside the calculator window */
+#define CALC_PANE_X     7
+#define CALC_PANE_Y     9
+#define CALC_PANE_COLS  64
+#define CALC_PANE_ROWS  10
+
+/* Draw one pane-wide line: up to CALC_PANE_COLS characters, space padded */
+VOID calc_draw_pane_row(UINTN y, CHAR16 *text, UINTN count) {
+    CHAR16 line[CALC_PANE_COLS + 1];
+
+    for (UINTN i = 0; i < CALC_PANE_COLS; i++) {
+        line[i] = i < count ? text[i] : L' ';
+    }
+    line[CALC_PANE_COLS] = 0;
+    set_cursor(CALC_PANE_X, y);
+    ConOut->OutputString(ConOut, line);
+}
+
+/* Draw the status line and the visible window of a wrapped result */
+VOID calc_draw_result(CHAR16 *status, CHAR16 *text, UINTN scroll) {
+    UINTN len = text ? StrLen(text) : 0;
+    UINTN total = (len + CALC_PANE_COLS - 1) / CALC_PANE_COLS;
+    CHAR16 header[80];
+
+    if (status == NULL) {
+        if (total <= CALC_PANE_ROWS) {
+            SPrint(header, sizeof(header), L"Result (%d digits):", len);
+        } else {
+            UINTN last = scroll + CALC_PANE_ROWS;
+            if (last > total) last = total;
+            SPrint(header, sizeof(header), L"Result (%d digits, lines %d-%d of %d):",
+                   len, scroll + 1, last, total);
+        }
+        status = header;
+    }
+    calc_draw_pane_row(CALC_PANE_Y - 1, status, StrLen(status));
+
+    for (UINTN row = 0; row < CALC_PANE_ROWS; row++) {
+        UINTN line = scroll + row;
+        if (line < total) {
+            UINTN start = line * CALC_PANE_COLS;
+            UINTN count = len - start;
+            calc_draw_pane_row(CALC_PANE_Y + row, text + start, count);
+        } else {
+            calc_draw_pane_row(CALC_PANE_Y + row, L"", 0);
+        }
+    }
+}
+
+/* Draw the last matrix result as a right-aligned grid, starting at the given row and column */
+VOID calc_draw_matrix(UINTN row, UINTN col) {
+    CALC_MATRIX *m = &calc_mat_result;
+    CHAR16 cell[24];
+    CHAR16 header[80];
+    UINTN width = 0;
+    UINTN per_line, last_row, last_col;
+
+    for (UINTN i = 0; i < m->rows * m->cols; i++) {
+        UINTN len = calc_format_decimal(m->data[i], calc_mat_result_digits, cell);
+        if (len > width) width = len;
+    }
+    width += 2;
+    per_line = CALC_PANE_COLS / width;
+    last_col = col + per_line < m->cols ? col + per_line : m->cols;
+    last_row = row + CALC_PANE_ROWS < m->rows ? row + CALC_PANE_ROWS : m->rows;
+
+    SPrint(header, sizeof(header), L"Matrix %dx%d (rows %d-%d, columns %d-%d):",
+           m->rows, m->cols, row + 1, last_row, col + 1, last_col);
+    calc_draw_pane_row(CALC_PANE_Y - 1, header, StrLen(header));
+
+    for (UINTN y = 0; y < CALC_PANE_ROWS; y++) {
+        CHAR16 line[CALC_PANE_COLS];
+        UINTN len = 0;
+
+        for (UINTN j = col; row + y < m->rows && j < last_col; j++) {
+            UINTN cell_len = calc_format_decimal(m->data[(row + y) * m->cols + j], calc_mat_result_digits, cell);
+            while (cell_len + len < width * (j - col + 1)) line[len++] = L' ';
+            CopyMem(line + len, cell, cell_len * sizeof(CHAR16));
+            len += cell_len;
+        }
+        calc_draw_pane_row(CALC_PANE_Y + y, line, len);
+    }
+}
+
+/* Show the current number mode below the result pane */
+VOID calc_draw_mode(VOID) {
+    CHAR16 line[64];
+
+    if (calc_decimal_mode) {
+        SPrint(line, sizeof(line), L"Mode: Decimal, %d digits", calc_digits);
+    } else if (calc_jit_enabled && CALC_JIT_SUPPORTED && !calc_jit_unavailable) {
+        SPrint(line, sizeof(line), L"Mode: Integer, native code");
+    } else {
+        SPrint(line, sizeof(line), L"Mode: Integer, interpreted");
+    }
+    calc_draw_pane_row(CALC_PANE_Y + CALC_PANE_ROWS, line, StrLen(line));
+}
+
+/*
+ * Batch evaluation
+ *
+ * Each line of CALC_BATCH_INPUT is evaluated in order exactly as if it had
+ * been typed at the prompt, so assignments and definitions carry over to
+ * later lines and repeated expressions hit the bytecode cache. One output
+ * line is produced per input line: the result, "Function defined" or
+ * "Error: ...". Blank lines and lines starting with '#' are copied through.
+ * Results are collected in a growing pool buffer and written with a single
+ * Write call. Input may be ASCII/UTF-8 or UTF-16; output uses the same form.
+ */
+#define CALC_BATCH_INPUT      L"\\calc_in.txt"
+#define CALC_BATCH_OUTPUT     L"\\calc_out.txt"
+#define CALC_BATCH_MAX_SIZE   (4 * 1024 * 1024)
+
+typedef struct {
+    UINT8 *data;
+    UINTN len;
+    UINTN capacity;
+    BOOLEAN wide;       /* Emit UTF-16 code units instead of bytes */
+    BOOLEAN failed;     /* Out of memory; later appends are dropped */
+} CALC_OUTPUT;
+
+/* Append text to the output buffer, doubling its capacity as needed */
+VOID calc_output_append(CALC_OUTPUT *out, CHAR16 *text) {
+    UINTN count = StrLen(text);
+    UINTN bytes = out->wide ? count * sizeof(CHAR16) : count;
+
+    if (out->failed) return;
+    if (out->len + bytes > out->capacity) {
+        UINTN capacity = out->capacity ? out->capacity : 4096;
+        UINT8 *data;
+
+        while (capacity < out->len + bytes) capacity *= 2;
+        if (EFI_ERROR(BS->AllocatePool(EfiLoaderData, capacity, (VOID **)&data))) {
+            out->failed = TRUE;
+            return;
+        }
+        if (out->data != NULL) {
+            CopyMem(data, out->data, out->len);
+            BS->FreePool(out->data);
+        }
+        out->data = data;
+        out->capacity = capacity;
+    }
+
+    if (out->wide) {
+        CopyMem(out->data + out->len, text, bytes);
+    } else {
+        for (UINTN i = 0; i < count; i++) {
+            out->data[out->len + i] = text[i] < 0x80 ? (UINT8)text[i] : '?';
+        }
+    }
+    out->len += bytes;
+}
+
+/* Evaluate the batch input file into the batch output file */
+EFI_STATUS calc_run_batch(UINTN digits, UINTN *lines, UINTN *errors) {
+    EFI_STATUS status;
+    UINT8 *data;
+    UINTN size;
+    UINTN count;
+    UINTN pos = 0;
+    CALC_OUTPUT out;
+    CHAR16 line[CALC_MAX_INPUT];
+
+    *lines = 0;
+    *errors = 0;
+    status = read_file_data(CALC_BATCH_INPUT, CALC_BATCH_MAX_SIZE, (VOID **)&data, &size);
+    if (EFI_ERROR(status)) return status;
+
+    /* A byte-order mark or a zero high byte in the first character means UTF-16 */
+    out.data = NULL;
+    out.len = 0;
+    out.capacity = 0;
+    out.failed = FALSE;
+    out.wide = size >= 2 && ((data[0] == 0xFF && data[1] == 0xFE) || (data[0] != 0 && data[1] == 0));
+    count = out.wide ? size / sizeof(CHAR16) : size;
+    if (out.wide && data[0] == 0xFF) {
+        calc_output_append(&out, L"\xFEFF");
+        pos = 1;
+    } else if (!out.wide && size >= 3 && data[0] == 0xEF && data[1] == 0xBB && data[2] == 0xBF) {
+        pos = 3;
+    }
+
+    while (pos < count) {
+        UINTN len = 0;
+        UINTN start = 0;
+        BOOLEAN too_long = FALSE;
+
+        /* Split off one line, dropping CRs and turning tabs into spaces */
+        while (pos < count) {
+            CHAR16 c = out.wide ? ((CHAR16 *)data)[pos] : data[pos];
+            pos++;
+            if (c == L'\n') break;
+            if (c == L'\r') continue;
+            if (c == L'\t') c = L' ';
+            if (len < CALC_MAX_INPUT - 1) {
+                line[len++] = c;
+            } else {
+                too_long = TRUE;
+            }
+        }
+        line[len] = 0;
+        (*lines)++;
+
+        while (line[start] == L' ') start++;
+        if (line[start] == 0 || line[start] == L'#') {
+            calc_output_append(&out, line);
+        } else {
+            CHAR16 *text;
+            CALC_ERROR error = too_long ? CALC_ERR_TOO_LONG : calc_evaluate_text(line, digits, &text);
+
+            if (error == CALC_OK) {
+                calc_output_append(&out, text);
+            } else if (error == CALC_DEFINED) {
+                calc_output_append(&out, calc_error_text(error));
+            } else {
+                calc_output_append(&out, L"Error: ");
+                calc_output_append(&out, calc_error_text(error));
+                (*errors)++;
+            }
+        }
+        calc_output_append(&out, L"\r\n");
+    }
+    BS->FreePool(data);
+
+    status = out.failed ? EFI_OUT_OF_RESOURCES : write_file_data(CALC_BATCH_OUTPUT, out.data, out.len);
+    if (out.data != NULL) BS->FreePool(out.data);
+    return status;
+}
+
+VOID app_calc(VOID) {
+    EFI_INPUT_KEY key;
+    BOOLEAN running = TRUE;
+    CHAR16 input[CALC_MAX_INPUT];
+    UINTN input_pos = 0;
+    UINTN history_pos = calc_history_count;
+    CHAR16 *result_text = NULL;
+    UINTN result_lines = 0;
+    UINTN scroll = 0;
+    UINTN col_scroll = 0;
+    BOOLEAN matrix_shown = FALSE;
+    CHAR16 status[64];
+    
+    input[0] = 0;
+    
+    clear_screen();
+    draw_topbar();
+    draw_window(5, 2, 70, 21, L" Calculator ");
+    
+    set_cursor(7, 4);
+    ConOut->OutputString(ConOut, L"Enter expression (e.g., (5+3)*-2, 2^4096, 1000!, sqrt(2)):");
+    
+    set_cursor(7, 20);
+    ConOut->OutputString(ConOut, L"ENTER=Calc  UP/DOWN=History  PGUP/PGDN/LEFT/RIGHT=Scroll  ESC=Exit");
+    set_cursor(7, 21);
+    ConOut->OutputString(ConOut, L"F2=Int/Dec  F3/F4=Digits  F5=Batch file  F6=Native code");
+    calc_draw_mode();
+    
+    while (running) {
+        /* Display input, scrolled so the end stays visible */
+        UINTN shown = input_pos >= CALC_PANE_COLS ? input_pos - CALC_PANE_COLS + 1 : 0;
+        calc_draw_pane_row(6, input + shown, input_pos - shown);
+        set_cursor(CALC_PANE_X + input_pos - shown, 6);
+        
+        key = read_key();
+        
+        if (key.ScanCode == SCAN_ESC) {
+            running = FALSE;
+        } else if (key.ScanCode == SCAN_F2 || key.ScanCode == SCAN_F3 || key.ScanCode == SCAN_F4 ||
+                   key.ScanCode == SCAN_F6) {
+            /* Switch number mode or execution engine; the next ENTER recompiles for a new scale */
+            if (key.ScanCode == SCAN_F2) {
+                calc_decimal_mode = !calc_decimal_mode;
+            } else if (key.ScanCode == SCAN_F3 && calc_digits > 1) {
+                calc_digits--;
+            } else if (key.ScanCode == SCAN_F4 && calc_digits < CALC_MAX_DIGITS) {
+                calc_digits++;
+            } else if (key.ScanCode == SCAN_F6) {
+                calc_jit_enabled = !calc_jit_enabled;
+            }
+            calc_draw_mode();
+        } else if (key.ScanCode == SCAN_F5) {
+            /* Evaluate \calc_in.txt in the current mode */
+            UINTN lines;
+            UINTN errors;
+            EFI_STATUS file_status;
+
+            calc_draw_result(L"Running batch file...", NULL, 0);
+            file_status = calc_run_batch(calc_decimal_mode ? calc_digits : 0, &lines, &errors);
+            result_text = NULL;
+            result_lines = 0;
+            scroll = 0;
+            matrix_shown = FALSE;
+            if (EFI_ERROR(file_status)) {
+                SPrint(status, sizeof(status), L"Batch failed: %r", file_status);
+            } else {
+                SPrint(status, sizeof(status), L"Batch: %d lines, %d errors -> calc_out.txt",
+                       lines, errors);
+            }
+            calc_draw_result(status, NULL, 0);
+        } else if (key.ScanCode == SCAN_PAGE_UP || key.ScanCode == SCAN_PAGE_DOWN) {
+            /* Scroll long results a page at a time */
+            if (key.ScanCode == SCAN_PAGE_UP) {
+                scroll = scroll > CALC_PANE_ROWS ? scroll - CALC_PANE_ROWS : 0;
+            } else if (scroll + CALC_PANE_ROWS < result_lines) {
+                scroll += CALC_PANE_ROWS;
+            }
+            if (matrix_shown) {
+                calc_draw_matrix(scroll, col_scroll);
+            } else if (result_text != NULL) {
+                calc_draw_result(NULL, result_text, scroll);
+            }
+        } else if ((key.ScanCode == SCAN_LEFT || key.ScanCode == SCAN_RIGHT) && matrix_shown) {
+            /* Scroll a wide matrix a column at a time */
+            if (key.ScanCode == SCAN_LEFT && col_scroll > 0) {
+                col_scroll--;
+            } else if (key.ScanCode == SCAN_RIGHT && col_scroll + 1 < calc_mat_result.cols) {
+                col_scroll++;
+            }
+            calc_draw_matrix(scroll, col_scroll);
+        } else if (key.ScanCode == SCAN_UP || key.ScanCode == SCAN_DOWN) {
+            /* Recall history; cached bytecode makes re-evaluation cheap */
+            if (key.ScanCode == SCAN_UP && history_pos > 0) {
+                history_pos--;
+            } else if (key.ScanCode == SCAN_DOWN && history_pos < calc_history_count) {
+                history_pos++;
+            }
+            if (history_pos < calc_history_count) {
+                StrCpy(input, calc_history[history_pos]);
+            } else {
+                input[0] = 0;
+            }
+            input_pos = StrLen(input);
+        } else if (key.UnicodeChar == CHAR_CARRIAGE_RETURN) {
+            /* Evaluate expression */
+            CALC_ERROR error = calc_evaluate_text(input, calc_decimal_mode ? calc_digits : 0,
+                                                  &result_text);
+            scroll = 0;
+            col_scroll = 0;
+            matrix_shown = error == CALC_OK && calc_result_is_matrix;
+            if (matrix_shown) {
+                result_lines = calc_mat_result.rows;
+                calc_draw_matrix(0, 0);
+            } else if (error == CALC_OK) {
+                result_lines = (StrLen(result_text) + CALC_PANE_COLS - 1) / CALC_PANE_COLS;
+                calc_draw_result(NULL, result_text, scroll);
+            } else if (error == CALC_DEFINED) {
+                result_text = NULL;
+                result_lines = 0;
+                calc_draw_result(calc_error_text(error), NULL, 0);
+            } else {
+                result_text = NULL;
+                result_lines = 0;
+                SPrint(status, sizeof(status), L"Error: %s", calc_error_text(error));
+                calc_draw_result(status, NULL, 0);
+            }
+            
+            /* Clear input */
+            if (input_pos > 0) calc_history_add(input);
+            history_pos = calc_history_count;
+            input[0] = 0;
+            input_pos = 0;
+        } else if (key.UnicodeChar == CHAR_BACKSPACE) {
+            if (input_pos > 0) {
+                input_pos--;
+                input[input_pos] = 0;
+            }
+        } else if (key.UnicodeChar >= L' ' && key.UnicodeChar <= L'~') {
+            /* Any printable ASCII; the parser reports what it cannot use */
+            if (input_pos < CALC_MAX_INPUT - 1) {
+                input[input_pos++] = key.UnicodeChar;
+                input[input_pos] = 0;
+            }
+        }
+    }
+}
+
+/*
+ * Plotter application
+ *
+ * Graphs up to three functions of x. Each is compiled once in decimal
+ * mode as the body of a one-parameter function and sampled a batch of
+ * columns at a time with calc_run_lanes. Samples are cached per column
+ * along with the grid (x of the first column and the step) they were
+ * taken on; after a pan or a zoom by two, every column whose x is already
+ * on the old grid keeps its sample, so only newly exposed columns are
+ * evaluated. Text mode draws two dots per character cell with half-block
+ * characters; G switches to the GOP framebuffer at one sample per pixel
+ * column.
+ */
+#define PLOT_FUNCS        3
+#define PLOT_DIGITS       6               /* Fixed-point scale of x and y */
+#define PLOT_MAX_COLUMNS  2048
+#define PLOT_TEXT_TOP     2               /* First text row of the graph */
+#define PLOT_TEXT_ROWS    20
+#define PLOT_MAX_STEP     1000000000000LL /* Per column, in 10^-6 units */
+
+typedef struct {
+    CHAR16 text[CALC_MAX_INPUT];
+    CALC_PROGRAM prog;
+    BOOLEAN ready;                        /* Compiled and non-empty */
+    BOOLEAN stale;                        /* Cached samples belong to an older text */
+    CALC_ERROR error;                     /* Compile error, or the last evaluation error */
+    INT64 ys[PLOT_MAX_COLUMNS];
+    BOOLEAN valid[PLOT_MAX_COLUMNS];
+} PLOT_FUNC;
+
+PLOT_FUNC plot_funcs[PLOT_FUNCS];
+CHAR16 plot_param[1][CALC_MAX_NAME + 1] = { L"x" };
+UINTN plot_colors[PLOT_FUNCS] = {
+    EFI_TEXT_ATTR(EFI_YELLOW, EFI_BLACK),
+    EFI_TEXT_ATTR(EFI_LIGHTCYAN, EFI_BLACK),
+    EFI_TEXT_ATTR(EFI_LIGHTMAGENTA, EFI_BLACK)
+};
+EFI_GRAPHICS_OUTPUT_BLT_PIXEL plot_pixels[PLOT_FUNCS + 1] = {
+    { 0x00, 0xFF, 0xFF, 0 }, { 0xFF, 0xFF, 0x00, 0 }, { 0xFF, 0x00, 0xFF, 0 }, { 0x60, 0x60, 0x60, 0 }
+};
+
+/* View: x of column 0 and per column, y of dot row 0 and per dot row */
+INT64 plot_x0, plot_step;
+INT64 plot_ytop, plot_ystep;
+UINTN plot_columns, plot_dots;
+
+/* Grid the cached samples were taken on */
+INT64 plot_grid_x0, plot_grid_step;
+UINTN plot_grid_columns = 0;
+UINTN plot_sampled = 0;                   /* Samples evaluated by the last update */
+
+INT32 plot_source[PLOT_MAX_COLUMNS];      /* Cached column reused by each column, or -1 */
+INT64 plot_new_ys[PLOT_MAX_COLUMNS];
+BOOLEAN plot_new_valid[PLOT_MAX_COLUMNS];
+
+/* Text mode dots: bit 0 upper, bit 1 lower half of each cell, plus the function drawn there */
+UINT8 plot_cells[PLOT_TEXT_ROWS][SCREEN_WIDTH];
+UINT8 plot_owner[PLOT_TEXT_ROWS][SCREEN_WIDTH];
+
+/* Graphics mode */
+EFI_GRAPHICS_OUTPUT_PROTOCOL *plot_gop = NULL;
+EFI_GRAPHICS_OUTPUT_BLT_PIXEL *plot_frame = NULL;
+
+/* x of a column on the current view */
+INT64 plot_column_x(UINTN col) {
+    return plot_x0 + (INT64)col * plot_step;
+}
+
+/* Evaluate the pending columns of one function and scatter the results */
+VOID plot_flush(PLOT_FUNC *f, INT64 *xs, UINTN *cols, UINTN count) {
+    INT64 ys[CALC_LANES];
+    BOOLEAN valid[CALC_LANES];
+    CALC_ERROR error = calc_run_lanes(&f->prog, PLOT_DIGITS, xs, ys, valid, count);
+
+    for (UINTN i = 0; i < count; i++) {
+        plot_new_ys[cols[i]] = ys[i];
+        plot_new_valid[cols[i]] = error == CALC_OK && valid[i];
+    }
+    if (error != CALC_OK) f->error = error;
+    plot_sampled += count;
+}
+
+/* Bring every function's samples up to date with the view, evaluating only columns not on the old grid */
+VOID plot_sample(VOID) {
+    INT64 xs[CALC_LANES];
+    UINTN cols[CALC_LANES];
+
+    calc_compile_bodies(PLOT_DIGITS);
+    for (UINTN col = 0; col < plot_columns; col++) {
+        INT64 x = plot_column_x(col);
+        INT64 k, r;
+
+        plot_source[col] = -1;
+        if (plot_grid_columns > 0 && x >= plot_grid_x0) {
+            calc_div64(x - plot_grid_x0, plot_grid_step, &k, &r);
+            if (r == 0 && k < (INT64)plot_grid_columns) plot_source[col] = (INT32)k;
+        }
+    }
+
+    plot_sampled = 0;
+    for (UINTN n = 0; n < PLOT_FUNCS; n++) {
+        PLOT_FUNC *f = &plot_funcs[n];
+        UINTN pending = 0;
+
+        if (!f->ready) continue;
+        if (f->stale) f->error = CALC_OK;
+        for (UINTN col = 0; col < plot_columns; col++) {
+            if (!f->stale && plot_source[col] >= 0) {
+                plot_new_ys[col] = f->ys[plot_source[col]];
+                plot_new_valid[col] = f->valid[plot_source[col]];
+                continue;
+            }
+            xs[pending] = plot_column_x(col);
+            cols[pending++] = col;
+            if (pending == CALC_LANES) {
+                plot_flush(f, xs, cols, pending);
+                pending = 0;
+            }
+        }
+        if (pending > 0) plot_flush(f, xs, cols, pending);
+        CopyMem(f->ys, plot_new_ys, plot_columns * sizeof(INT64));
+        CopyMem(f->valid, plot_new_valid, plot_columns * sizeof(BOOLEAN));
+        f->stale = FALSE;
+    }
+
+    plot_grid_x0 = plot_x0;
+    plot_grid_step = plot_step;
+    plot_grid_columns = plot_columns;
+}
+
+/* Dot row of a y value, clamped to one row beyond either edge */
+INT64 plot_dot_row(INT64 y) {
+    INT64 diff, row, rem;
+
+    if (__builtin_sub_overflow(plot_ytop, y, &diff)) return y > 0 ? -1 : (INT64)plot_dots;
+    calc_div64(diff, plot_ystep, &row, &rem);
+    if (rem < 0) row--;
+    if (row < -1) return -1;
+    if (row > (INT64)plot_dots) return (INT64)plot_dots;
+    return row;
+}
+
+/* Set one dot of the graph to a function's color (PLOT_FUNCS for the axes) */
+VOID plot_dot(UINTN col, UINTN row, UINTN color) {
+    if (plot_frame != NULL) {
+        plot_frame[row * plot_columns + col] = plot_pixels[color];
+    } else {
+        plot_cells[row / 2][col] |= (row & 1) ? 2 : 1;
+        plot_owner[row / 2][col] = (UINT8)color;
+    }
+}
+
+/* Draw the curves and axes into the text cells or the frame buffer */
+VOID plot_render(VOID) {
+    INT64 axis_row = plot_dot_row(0);
+    INT64 axis_col, rem;
+
+    if (plot_frame != NULL) {
+        SetMem(plot_frame, plot_columns * plot_dots * sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL), 0);
+    } else {
+        SetMem(plot_cells, sizeof(plot_cells), 0);
+    }
+
+    /* Axes go in the frame buffer; text mode draws them as line characters instead */
+    calc_div64(0 - plot_x0, plot_step, &axis_col, &rem);
+    if (plot_frame != NULL) {
+        if (axis_row >= 0 && axis_row < (INT64)plot_dots) {
+            for (UINTN col = 0; col < plot_columns; col++) plot_dot(col, (UINTN)axis_row, PLOT_FUNCS);
+        }
+        if (plot_x0 <= 0 && axis_col < (INT64)plot_columns) {
+            for (UINTN row = 0; row < plot_dots; row++) plot_dot((UINTN)axis_col, row, PLOT_FUNCS);
+        }
+    }
+
+    for (UINTN n = 0; n < PLOT_FUNCS; n++) {
+        PLOT_FUNC *f = &plot_funcs[n];
+        INT64 prev = 0;
+        BOOLEAN have_prev = FALSE;
+
+        if (!f->ready) continue;
+        for (UINTN col = 0; col < plot_columns; col++) {
+            INT64 row, from, to;
+
+            if (!f->valid[col]) {
+                have_prev = FALSE;
+                continue;
+            }
+            row = plot_dot_row(f->ys[col]);
+            /* Join steep segments: fill from halfway to the previous sample */
+            from = have_prev ? (prev + row) >> 1 : row;
+            to = row;
+            if (from > to) {
+                INT64 t = from;
+                from = to;
+                to = t;
+            }
+            if (from < 0) from = 0;
+            if (to >= (INT64)plot_dots) to = (INT64)plot_dots - 1;
+            for (INT64 r = from; r <= to; r++) plot_dot(col, (UINTN)r, n);
+            prev = row;
+            have_prev = TRUE;
+        }
+    }
+
+    if (plot_frame != NULL) {
+        plot_gop->Blt(plot_gop, plot_frame, EfiBltBufferToVideo, 0, 0, 0, 0, plot_columns, plot_dots, 0);
+        return;
+    }
+
+    /* Text mode: emit each row in runs of one color */
+    for (UINTN y = 0; y < PLOT_TEXT_ROWS; y++) {
+        CHAR16 run[SCREEN_WIDTH + 1];
+        UINTN run_len = 0;
+        UINTN run_attr = 0;
+
+        set_cursor(0, PLOT_TEXT_TOP + y);
+        for (UINTN col = 0; col <= plot_columns; col++) {
+            CHAR16 c = L' ';
+            UINTN attr = EFI_TEXT_ATTR(EFI_DARKGRAY, EFI_BLACK);
+
+            if (col < plot_columns) {
+                BOOLEAN on_row = axis_row >= 0 && (UINTN)(axis_row >> 1) == y;
+                BOOLEAN on_col = plot_x0 <= 0 && axis_col == (INT64)col;
+                UINT8 bits = plot_cells[y][col];
+
+                if (bits != 0) {
+                    c = bits == 1 ? L'▀' : bits == 2 ? L'▄' : L'█';
+                    attr = plot_colors[plot_owner[y][col]];
+                } else if (on_row && on_col) {
+                    c = L'┼';
+                } else if (on_row) {
+                    c = L'─';
+                } else if (on_col) {
+                    c = L'│';
+                }
+            }
+            if (run_len > 0 && (attr != run_attr || col == plot_columns)) {
+                run[run_len] = 0;
+                ConOut->SetAttribute(ConOut, run_attr);
+                ConOut->OutputString(ConOut, run);
+                run_len = 0;
+            }
+            run[run_len++] = c;
+            run_attr = attr;
+        }
+    }
+    ConOut->SetAttribute(ConOut, COLOR_NORMAL);
+}
+
+/* Write a pane-wide line at the given text row, padded with spaces */
+VOID plot_line(UINTN y, CHAR16 *text) {
+    CHAR16 line[SCREEN_WIDTH];
+    UINTN len = StrLen(text);
+
+    for (UINTN i = 0; i < SCREEN_WIDTH - 1; i++) line[i] = i < len ? text[i] : L' ';
+    line[SCREEN_WIDTH - 1] = 0;
+    set_cursor(0, y);
+    ConOut->OutputString(ConOut, line);
+}
+
+/* Show the visible ranges, how much was re-sampled and any evaluation error */
+VOID plot_status(UINTN y) {
+    CHAR16 x_lo[24], x_hi[24], y_lo[24], y_hi[24];
+    CHAR16 line[128];
+
+    calc_format_decimal(plot_x0, PLOT_DIGITS, x_lo);
+    calc_format_decimal(plot_column_x(plot_columns - 1), PLOT_DIGITS, x_hi);
+    calc_format_decimal(plot_ytop - (INT64)(plot_dots - 1) * plot_ystep, PLOT_DIGITS, y_lo);
+    calc_format_decimal(plot_ytop, PLOT_DIGITS, y_hi);
+    SPrint(line, sizeof(line), L"x: %s .. %s  y: %s .. %s  (%d new samples)",
+           x_lo, x_hi, y_lo, y_hi, plot_sampled);
+    for (UINTN n = 0; n < PLOT_FUNCS; n++) {
+        if (plot_funcs[n].error != CALC_OK) {
+            SPrint(line, sizeof(line), L"f%d: %s", n + 1, calc_error_text(plot_funcs[n].error));
+            break;
+        }
+    }
+    plot_line(y, line);
+}
+
+/* List the functions above the graph, each in its curve's color */
+VOID plot_draw_legend(VOID) {
+    plot_line(1, L"");
+    set_cursor(0, 1);
+    for (UINTN n = 0; n < PLOT_FUNCS; n++) {
+        CHAR16 item[CALC_MAX_INPUT + 16];
+
+        if (!plot_funcs[n].ready) continue;
+        SPrint(item, sizeof(item), L"f%d(x)=%s  ", n + 1, plot_funcs[n].text);
+        if (StrLen(item) > 26) {
+            item[24] = L'.';
+            item[25] = L' ';
+            item[26] = 0;
+        }
+        ConOut->SetAttribute(ConOut, plot_colors[n]);
+        ConOut->OutputString(ConOut, item);
+    }
+    ConOut->SetAttribute(ConOut, COLOR_NORMAL);
+}
+
+/* Change the number of columns and dot rows, keeping the visible x and y ranges */
+VOID plot_resize(UINTN columns, UINTN dots) {
+    INT64 rem;
+
+    calc_div64(plot_step * (INT64)plot_columns, (INT64)columns, &plot_step, &rem);
+    calc_div64(plot_ystep * (INT64)plot_dots, (INT64)dots, &plot_ystep, &rem);
+    if (plot_step < 1) plot_step = 1;
+    if (plot_ystep < 1) plot_ystep = 1;
+    plot_columns = columns;
+    plot_dots = dots;
+    plot_grid_columns = 0;
+}
+
+/* Zoom by two about the centre of the view */
+VOID plot_zoom(BOOLEAN in) {
+    INT64 cx = plot_column_x(plot_columns / 2);
+    INT64 cy = plot_ytop - (INT64)(plot_dots / 2) * plot_ystep;
+
+    if (in && plot_step > 1 && plot_ystep > 1) {
+        plot_step >>= 1;
+        plot_ystep >>= 1;
+    } else if (!in && plot_step < PLOT_MAX_STEP && plot_ystep < PLOT_MAX_STEP) {
+        plot_step <<= 1;
+        plot_ystep <<= 1;
+    }
+    plot_x0 = cx - (INT64)(plot_columns / 2) * plot_step;
+    plot_ytop = cy + (INT64)(plot_dots / 2) * plot_ystep;
+}
+
+/* Fit the y range to the visible samples */
+VOID plot_autoscale(VOID) {
+    INT64 lo = 0, hi = 0, rem;
+    BOOLEAN any = FALSE;
+
+    for (UINTN n = 0; n < PLOT_FUNCS; n++) {
+        if (!plot_funcs[n].ready) continue;
+        for (UINTN col = 0; col < plot_columns; col++) {
+            INT64 y = plot_funcs[n].ys[col];
+            if (!plot_funcs[n].valid[col]) continue;
+            if (!any || y < lo) lo = y;
+            if (!any || y > hi) hi = y;
+            any = TRUE;
+        }
+    }
+    if (!any || __builtin_sub_overflow(hi, lo, &rem)) return;
+    calc_div64(rem + (INT64)plot_dots - 2, (INT64)plot_dots - 1, &plot_ystep, &rem);
+    if (plot_ystep < 1) plot_ystep = 1;
+    plot_ytop = hi;
+}
+
+/* Edit a function's text on the given row; TRUE if it was changed */
+BOOLEAN plot_edit(UINTN n, UINTN y) {
+    PLOT_FUNC *f = &plot_funcs[n];
+    CHAR16 text[CALC_MAX_INPUT];
+    CHAR16 prompt[16];
+    UINTN len;
+    UINTN width;
+    EFI_INPUT_KEY key;
+
+    StrCpy(text, f->text);
+    len = StrLen(text);
+    SPrint(prompt, sizeof(prompt), L"f%d(x) = ", n + 1);
+    width = SCREEN_WIDTH - 1 - StrLen(prompt);
+
+    for (;;) {
+        UINTN shown = len >= width ? len - width + 1 : 0;
+        CHAR16 line[SCREEN_WIDTH + CALC_MAX_INPUT];
+
+        SPrint(line, sizeof(line), L"%s%s", prompt, text + shown);
+        plot_line(y, line);
+        set_cursor(StrLen(prompt) + len - shown, y);
+
+        key = read_key();
+        if (key.ScanCode == SCAN_ESC) return FALSE;
+        if (key.UnicodeChar == CHAR_CARRIAGE_RETURN) break;
+        if (key.UnicodeChar == CHAR_BACKSPACE) {
+            if (len > 0) text[--len] = 0;
+        } else if (key.UnicodeChar >= 32 && key.UnicodeChar < 127 && len < CALC_MAX_INPUT - 1) {
+            text[len++] = key.UnicodeChar;
+            text[len] = 0;
+        }
+    }
+
+    StrCpy(f->text, text);
+    f->stale = TRUE;
+    f->ready = FALSE;
+    f->error = CALC_OK;
+    if (len > 0) {
+        calc_compile_bodies(PLOT_DIGITS);
+        f->error = calc_compile(text, PLOT_DIGITS, plot_param, 1, &f->prog);
+        f->ready = f->error == CALC_OK;
+    }
+    return TRUE;
+}
+
+/* Switch between the text grid and the GOP frame buffer */
+BOOLEAN plot_set_graphics(BOOLEAN on) {
+    if (on) {
+        EFI_GRAPHICS_OUTPUT_MODE_INFORMATION *info;
+        UINTN columns, dots;
+
+        plot_gop = locate_gop();
+        if (plot_gop == NULL) return FALSE;
+        info = plot_gop->Mode->Info;
+        columns = info->HorizontalResolution < PLOT_MAX_COLUMNS ? info->HorizontalResolution : PLOT_MAX_COLUMNS;
+        /* Leave the bottom two text rows for the status and help lines */
+        dots = info->VerticalResolution - info->VerticalResolution * 2 / SCREEN_HEIGHT;
+        if (EFI_ERROR(BS->AllocatePool(EfiLoaderData, columns * dots * sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL),
+                                       (VOID **)&plot_frame))) {
+            plot_frame = NULL;
+            return FALSE;
+        }
+        plot_resize(columns, dots);
+    } else {
+        if (plot_frame != NULL) BS->FreePool(plot_frame);
+        plot_frame = NULL;
+        plot_resize(SCREEN_WIDTH, PLOT_TEXT_ROWS * 2);
+    }
+    return TRUE;
+}
+
+VOID app_plot(VOID) {
+    EFI_INPUT_KEY key;
+    BOOLEAN running = TRUE;
+    BOOLEAN redraw = TRUE;
+    BOOLEAN resample = TRUE;
+    CHAR16 *message = NULL;
+
+    /* First visit: sin(x) over -8..8, one text column per 0.2 */
+    if (plot_columns == 0) {
+        StrCpy(plot_funcs[0].text, L"sin(x)");
+        plot_funcs[0].stale = TRUE;
+        calc_compile_bodies(PLOT_DIGITS);
+        plot_funcs[0].ready = calc_compile(plot_funcs[0].text, PLOT_DIGITS, plot_param, 1,
+                                           &plot_funcs[0].prog) == CALC_OK;
+        plot_columns = SCREEN_WIDTH;
+        plot_dots = PLOT_TEXT_ROWS * 2;
+        plot_step = 200000;
+        plot_ystep = 200000;
+        plot_x0 = -8000000;
+        plot_ytop = 4000000;
+    }
+
+    while (running) {
+        UINTN status_row = plot_frame != NULL ? SCREEN_HEIGHT - 2 : PLOT_TEXT_TOP + PLOT_TEXT_ROWS;
+
+        if (resample) {
+            plot_sample();
+            resample = FALSE;
+            redraw = TRUE;
+        }
+        if (redraw) {
+            if (plot_frame == NULL) {
+                clear_screen();
+                draw_topbar();
+                plot_draw_legend();
+            }
+            plot_render();
+            if (message != NULL) {
+                plot_line(status_row, message);
+                message = NULL;
+            } else {
+                plot_status(status_row);
+            }
+            plot_line(status_row + 1, L"1-3=Edit f1-f3  Arrows=Pan  +/-=Zoom  A=Fit y  G=Graphics/Text  ESC=Exit");
+            redraw = FALSE;
+        }
+
+        key = read_key();
+
+        if (key.ScanCode == SCAN_ESC) {
+            running = FALSE;
+        } else if (key.ScanCode == SCAN_LEFT || key.ScanCode == SCAN_RIGHT) {
+            /* Pan by an eighth of the width: only those columns are new */
+            INT64 shift = (INT64)(plot_columns / 8) * plot_step;
+            plot_x0 += key.ScanCode == SCAN_LEFT ? -shift : shift;
+            resample = TRUE;
+        } else if (key.ScanCode == SCAN_UP || key.ScanCode == SCAN_DOWN) {
+            /* Vertical panning needs no new samples */
+            INT64 shift = (INT64)(plot_dots / 8) * plot_ystep;
+            plot_ytop += key.ScanCode == SCAN_UP ? shift : -shift;
+            redraw = TRUE;
+        } else if (key.UnicodeChar == L'+' || key.UnicodeChar == L'=' || key.UnicodeChar == L'-') {
+            plot_zoom(key.UnicodeChar != L'-');
+            resample = TRUE;
+        } else if (key.UnicodeChar == L'a' || key.UnicodeChar == L'A') {
+            plot_autoscale();
+            redraw = TRUE;
+        } else if (key.UnicodeChar == L'g' || key.UnicodeChar == L'G') {
+            if (!plot_set_graphics(plot_frame == NULL)) message = L"No graphics output available";
+            clear_screen();
+            resample = TRUE;
+        } else if (key.UnicodeChar >= L'1' && key.UnicodeChar < L'1' + PLOT_FUNCS) {
+            if (plot_edit(key.UnicodeChar - L'1', status_row)) {
+                plot_draw_legend();
+                resample = TRUE;
+            } else {
+                redraw = TRUE;
+            }
+        }
+    }
+
+    if (plot_frame != NULL) plot_set_graphics(FALSE);
+}
+
+/*
+ * Script language
+ *
+ * A small HolyC-flavoured language for automating the other apps. Source
+ * is loaded from the boot volume and compiled in one pass into bytecode
+ * for a register machine: each function call gets a window of 64-bit
+ * registers (parameters, locals, then temporaries) on a shared register
+ * stack, and a call slides the window up instead of copying arguments.
+ * Instructions are 32-bit words (opcode, A, B, C or a 16-bit Bx); branches
+ * carry their target in a second word. Comparisons used as conditions are
+ * fused into a single compare-and-branch, and loops are compiled with the
+ * test at the bottom, so an iteration costs one branch.
+ *
+ * The interpreter uses threaded dispatch: every handler ends by jumping
+ * straight to the next instruction's handler through a table of label
+ * offsets (GCC's labels as values), so there is no central switch and each
+ * handler has its own, better predicted, indirect branch. The table holds
+ * offsets rather than addresses so it needs no relocations in the PIC image.
+ *
+ * Values are I64 integers or U8* strings. Types are checked at compile time,
+ * so registers hold raw 64-bit values without tags. Strings are immutable
+ * CHAR16 text with a length header, allocated from an arena that is freed
+ * when the script ends.
+ */
+#define SCRIPT_DEFAULT_FILE L"\\script.hc"
+#define SCRIPT_MAX_PATH     60
+#define SCRIPT_MAX_SOURCE   (256 * 1024)   /* Bytes */
+#define SCRIPT_MAX_CODE     65535          /* Instruction words */
+#define SCRIPT_MAX_CONSTS   4096
+#define SCRIPT_MAX_GLOBALS  256
+#define SCRIPT_MAX_FUNCS    128
+#define SCRIPT_MAX_LOCALS   128            /* Named locals visible at once */
+#define SCRIPT_MAX_REGS     250            /* Registers per function */
+#define SCRIPT_MAX_NAME     31
+#define SCRIPT_MAX_PARAMS   8
+#define SCRIPT_MAX_ARGS     16
+#define SCRIPT_MAX_NESTING  256            /* Parser recursion depth */
+#define SCRIPT_STACK_REGS   (64 * 1024)
+#define SCRIPT_MAX_FRAMES   1024
+#define SCRIPT_MAX_STRING   (1024 * 1024)  /* Characters */
+#define SCRIPT_HEAP_CHUNK   (64 * 1024)
+#define SCRIPT_HEAP_LIMIT   (32 * 1024 * 1024)
+#define SCRIPT_POLL_MASK    0xFFFFF        /* Taken branches between ESC checks */
+#define SCRIPT_SLEEP_SLICE  10             /* Milliseconds of Sleep between ESC checks */
+#define SCRIPT_NO_JUMP      0xFFFFFFFF
+
+#define SCRIPT_OP2(a, b)    ((UINT32)(a) | ((UINT32)(b) << 8))
+#define SCRIPT_OP3(a, b, c) (SCRIPT_OP2(a, b) | ((UINT32)(c) << 16))
+#define SCRIPT_ABC(op, a, b, c) ((UINT32)(op) | ((UINT32)(a) << 8) | ((UINT32)(b) << 16) | ((UINT32)(c) << 24))
+#define SCRIPT_ABX(op, a, bx)   ((UINT32)(op) | ((UINT32)(a) << 8) | ((UINT32)(bx) << 16))
+
+typedef enum {
+    SCRIPT_VOID,
+    SCRIPT_INT,
+    SCRIPT_STR
+} SCRIPT_TYPE;
+
+/*
+ * Opcodes. The dispatch table in script_run lists handlers in this order.
+ * Branches are followed by a word holding the target; the K forms compare
+ * register A with constant Bx and are ordered like SCRIPT_CMP.
+ */
+typedef enum {
+    SOP_MOV,        /* A = B */
+    SOP_LOADI,      /* A = signed Bx */
+    SOP_LOADK,      /* A = K[Bx] */
+    SOP_GETG,       /* A = G[Bx] */
+    SOP_SETG,       /* G[Bx] = A */
+    SOP_ADD,        /* A = B op C */
+    SOP_SUB,
+    SOP_MUL,
+    SOP_DIV,
+    SOP_MOD,
+    SOP_AND,
+    SOP_OR,
+    SOP_XOR,
+    SOP_SHL,
+    SOP_SHR,
+    SOP_ADDI,       /* A = B + signed C */
+    SOP_NEG,        /* A = op B */
+    SOP_NOT,
+    SOP_BNOT,
+    SOP_EQ,         /* A = (B cmp C) */
+    SOP_NE,
+    SOP_LT,
+    SOP_LE,
+    SOP_CONCAT,     /* A = B + C, strings */
+    SOP_STREQ,      /* A = (B and C hold the same text) */
+    SOP_INDEX,      /* A = character C of string B */
+    SOP_JMP,
+    SOP_JZ,         /* Jump if A == 0 */
+    SOP_JNZ,
+    SOP_JEQ,        /* Jump if A cmp B */
+    SOP_JNE,
+    SOP_JLT,
+    SOP_JLE,
+    SOP_JEQK,       /* Jump if A cmp K[Bx] */
+    SOP_JNEK,
+    SOP_JLTK,
+    SOP_JGEK,
+    SOP_JLEK,
+    SOP_JGTK,
+    SOP_CALL,       /* A = function B, C arguments starting at A */
+    SOP_NATIVE,     /* A = builtin B, C arguments starting at A */
+    SOP_RET,        /* Return A */
+    SOP_COUNT
+} SCRIPT_OPCODE;
+
+/* Comparisons; cmp ^ 1 is the negation */
+typedef enum {
+    SCRIPT_CMP_EQ,
+    SCRIPT_CMP_NE,
+    SCRIPT_CMP_LT,
+    SCRIPT_CMP_GE,
+    SCRIPT_CMP_LE,
+    SCRIPT_CMP_GT,
+    SCRIPT_CMP_NONE
+} SCRIPT_CMP;
+
+/* The same comparison with its operands swapped */
+CONST UINT8 script_cmp_mirror[] = {
+    SCRIPT_CMP_EQ, SCRIPT_CMP_NE, SCRIPT_CMP_GT, SCRIPT_CMP_LE, SCRIPT_CMP_GE, SCRIPT_CMP_LT
+};
+
+typedef enum {
+    SCRIPT_BI_PRINT,
+    SCRIPT_BI_MSTRPRINT,
+    SCRIPT_BI_STRLEN,
+    SCRIPT_BI_STRCMP,
+    SCRIPT_BI_STRSUB,
+    SCRIPT_BI_STRFIND,
+    SCRIPT_BI_STR2I64,
+    SCRIPT_BI_GETKEY,
+    SCRIPT_BI_SCANKEY,
+    SCRIPT_BI_CLS,
+    SCRIPT_BI_SETCURSOR,
+    SCRIPT_BI_SETCOLOR,
+    SCRIPT_BI_DRAWWINDOW,
+    SCRIPT_BI_SLEEP,
+    SCRIPT_BI_FILEREAD,
+    SCRIPT_BI_FILEWRITE,
+    SCRIPT_BI_CALC,
+    SCRIPT_BI_CALCDEC,
+    SCRIPT_BI_RAND,
+    SCRIPT_BI_COUNT
+} SCRIPT_BUILTIN_ID;
+
+/* Parameter strings: 'i' = I64, 's' = U8*, 'f' = format literal then any arguments */
+typedef struct {
+    CHAR16 *name;
+    UINT8 ret;
+    CHAR8 *params;
+} SCRIPT_BUILTIN;
+
+SCRIPT_BUILTIN script_builtins[SCRIPT_BI_COUNT] = {
+    { L"Print",      SCRIPT_VOID, (CHAR8 *)"f" },
+    { L"MStrPrint",  SCRIPT_STR,  (CHAR8 *)"f" },
+    { L"StrLen",     SCRIPT_INT,  (CHAR8 *)"s" },
+    { L"StrCmp",     SCRIPT_INT,  (CHAR8 *)"ss" },
+    { L"StrSub",     SCRIPT_STR,  (CHAR8 *)"sii" },
+    { L"StrFind",    SCRIPT_INT,  (CHAR8 *)"ss" },
+    { L"Str2I64",    SCRIPT_INT,  (CHAR8 *)"s" },
+    { L"GetKey",     SCRIPT_INT,  (CHAR8 *)"" },
+    { L"ScanKey",    SCRIPT_INT,  (CHAR8 *)"" },
+    { L"Cls",        SCRIPT_VOID, (CHAR8 *)"" },
+    { L"SetCursor",  SCRIPT_VOID, (CHAR8 *)"ii" },
+    { L"SetColor",   SCRIPT_VOID, (CHAR8 *)"i" },
+    { L"DrawWindow", SCRIPT_VOID, (CHAR8 *)"iiiis" },
+    { L"Sleep",      SCRIPT_VOID, (CHAR8 *)"i" },
+    { L"FileRead",   SCRIPT_STR,  (CHAR8 *)"s" },
+    { L"FileWrite",  SCRIPT_INT,  (CHAR8 *)"ss" },
+    { L"Calc",       SCRIPT_STR,  (CHAR8 *)"s" },
+    { L"CalcDec",    SCRIPT_STR,  (CHAR8 *)"si" },
+    { L"Rand",       SCRIPT_INT,  (CHAR8 *)"" }
+};
+
+CHAR16 *script_keywords[] = {
+    L"if", L"else", L"while", L"for", L"do", L"break", L"continue", L"return",
+    L"I64", L"Bool", L"U8", L"U0", NULL
+};
+
+CHAR16 *script_ops2[] = {
+    L"==", L"!=", L"<=", L">=", L"<<", L">>", L"&&", L"||", L"++", L"--",
+    L"+=", L"-=", L"*=", L"/=", L"%=", L"&=", L"|=", L"^=", NULL
+};
+
+/* Strings carry their length in front of the text */
+typedef struct {
+    UINT32 length;
+    UINT32 reserved;
+} SCRIPT_STRING;
+
+#define SCRIPT_LENGTH(text) (((SCRIPT_STRING *)(text) - 1)->length)
+#define SCRIPT_TEXT(value)  ((CHAR16 *)(UINTN)(value))
+#define SCRIPT_VALUE(text)  ((INT64)(UINTN)(text))
+
+typedef struct SCRIPT_CHUNK {
+    struct SCRIPT_CHUNK *next;
+    UINTN used;
+    UINTN size;
+} SCRIPT_CHUNK;
+
+typedef enum {
+    SCRIPT_TK_EOF,
+    SCRIPT_TK_NUMBER,
+    SCRIPT_TK_STRING,
+    SCRIPT_TK_NAME,
+    SCRIPT_TK_OP
+} SCRIPT_TOKEN_KIND;
+
+/* Lexer position and current token, saved and restored to re-read conditions */
+typedef struct {
+    UINTN pos;
+    UINTN line;
+    UINT8 kind;
+    UINT32 op;
+    INT64 value;
+    CHAR16 *name;
+    UINTN name_len;
+    UINTN tok_line;
+} SCRIPT_TOKEN;
+
+typedef struct {
+    CHAR16 name[SCRIPT_MAX_NAME + 1];
+    UINT8 type;
+    UINTN index;        /* Register for locals, slot for globals */
+    UINTN depth;
+} SCRIPT_VAR;
+
+typedef struct {
+    CHAR16 name[SCRIPT_MAX_NAME + 1];
+    UINT8 ret;
+    UINT8 param_count;
+    UINT8 params[SCRIPT_MAX_PARAMS];
+    UINT32 entry;
+    UINT32 reg_count;
+} SCRIPT_FUNC;
+
+/* Compile state of the function being compiled (or of the top level) */
+typedef struct {
+    UINTN local_base;   /* Its first entry in locals[] */
+    UINTN local_regs;   /* Registers held by live locals; temporaries follow */
+    UINTN free_reg;
+    UINTN max_reg;
+    UINTN depth;
+    UINT8 ret_type;
+    BOOLEAN in_function;
+    BOOLEAN in_loop;
+    UINTN break_list;
+    UINTN continue_list;
+} SCRIPT_SCOPE;
+
+typedef struct {
+    UINT32 ret_pc;
+    UINT32 base;
+} SCRIPT_FRAME;
+
+typedef struct {
+    CHAR16 *src;
+    SCRIPT_TOKEN tok;
+
+    UINT32 *code;
+    UINT32 *lines;
+    UINTN code_len;
+    UINTN retarget_pc;  /* Last instruction whose destination may be changed */
+    INT64 consts[SCRIPT_MAX_CONSTS];
+    UINTN const_count;
+    INT64 globals[SCRIPT_MAX_GLOBALS];
+    SCRIPT_VAR global_vars[SCRIPT_MAX_GLOBALS];
+    UINTN global_count;
+    SCRIPT_VAR locals[SCRIPT_MAX_LOCALS];
+    UINTN local_count;
+    SCRIPT_FUNC funcs[SCRIPT_MAX_FUNCS];
+    UINTN func_count;
+    SCRIPT_SCOPE fn;
+    UINTN main_regs;
+    CHAR16 *empty;
+
+    INT64 *stack;
+    SCRIPT_FRAME frames[SCRIPT_MAX_FRAMES];
+    SCRIPT_CHUNK *heap;
+    UINTN heap_total;
+    CHAR16 *out;        /* Formatting buffer */
+    UINTN out_len;
+    UINTN out_capacity;
+    UINT64 rand_state;
+
+    UINTN nesting;      /* Recursion depth of the parser */
+    BOOLEAN failed;
+    CHAR16 error[96];
+} SCRIPT;
+
+/* Describes a compiled (sub)expression: a constant, a register or a pending comparison */
+typedef enum {
+    SCRIPT_E_CONST,
+    SCRIPT_E_REG,
+    SCRIPT_E_CMP
+} SCRIPT_EXPR_KIND;
+
+typedef struct {
+    UINT8 kind;
+    UINT8 type;
+    UINT8 cmp;
+    BOOLEAN rhs_const;
+    UINTN reg;          /* Value (REG) or left operand (CMP) */
+    UINTN rhs;          /* Right operand register (CMP) */
+    INT64 value;        /* Constant (CONST) or constant right operand (CMP) */
+    UINTN base;         /* Free register when the expression began */
+} SCRIPT_EXPR;
+
+VOID script_expr(SCRIPT *s, UINTN min_prec, SCRIPT_EXPR *e);
+VOID script_statement(SCRIPT *s);
+
+/* Record an error; only the first is kept and the lexer then reports end of input */
+VOID script_error(SCRIPT *s, CHAR16 *message) {
+    if (s->failed) return;
+    s->failed = TRUE;
+    SPrint(s->error, sizeof(s->error), L"Line %d: %s", s->tok.tok_line, message);
+}
+
+/* Allocate an uninitialised string of len characters from the script heap */
+CHAR16 *script_new_string(SCRIPT *s, UINTN len) {
+    SCRIPT_CHUNK *chunk = s->heap;
+    SCRIPT_STRING *header;
+    UINTN bytes;
+
+    if (len > SCRIPT_MAX_STRING) {
+        script_error(s, L"String too long");
+        return NULL;
+    }
+    bytes = (sizeof(SCRIPT_STRING) + (len + 1) * sizeof(CHAR16) + 7) & ~(UINTN)7;
+
+    if (chunk == NULL || chunk->size - chunk->used < bytes) {
+        /* Large strings get a chunk of their own behind the current one */
+        UINTN size = bytes > SCRIPT_HEAP_CHUNK / 4 ? bytes : SCRIPT_HEAP_CHUNK;
+
+        if (s->heap_total + size > SCRIPT_HEAP_LIMIT ||
+            EFI_ERROR(BS->AllocatePool(EfiLoaderData, sizeof(SCRIPT_CHUNK) + size, (VOID **)&chunk))) {
+            script_error(s, L"Out of memory");
+            return NULL;
+        }
+        s->heap_total += size;
+        chunk->used = 0;
+        chunk->size = size;
+        if (size != SCRIPT_HEAP_CHUNK && s->heap != NULL) {
+            chunk->next = s->heap->next;
+            s->heap->next = chunk;
+        } else {
+            chunk->next = s->heap;
+            s->heap = chunk;
+        }
+    }
+
+    header = (SCRIPT_STRING *)((UINT8 *)(chunk + 1) + chunk->used);
+    chunk->used += bytes;
+    header->length = (UINT32)len;
+    ((CHAR16 *)(header + 1))[len] = 0;
+    return (CHAR16 *)(header + 1);
+}
+
+/* Copy count characters into a new script string */
+CHAR16 *script_copy_string(SCRIPT *s, CHAR16 *text, UINTN count) {
+    CHAR16 *copy = script_new_string(s, count);
+
+    if (copy != NULL) CopyMem(copy, text, count * sizeof(CHAR16));
+    return copy;
+}
+
+/* Compare the current name token with a word */
+BOOLEAN script_is(SCRIPT *s, CHAR16 *word) {
+    return s->tok.kind == SCRIPT_TK_NAME && StrLen(word) == s->tok.name_len &&
+           StrnCmp(s->tok.name, word, s->tok.name_len) == 0;
+}
+
+/* Whether the current token is the given operator */
+BOOLEAN script_is_op(SCRIPT *s, UINT32 op) {
+    return s->tok.kind == SCRIPT_TK_OP && s->tok.op == op;
+}
+
+/* Read a string or character literal escape, advancing past it */
+CHAR16 script_escape(CHAR16 *src, UINTN *pos) {
+    CHAR16 c = src[(*pos)++];
+
+    if (c != L'\\') return c;
+    c = src[(*pos)++];
+    switch (c) {
+    case L'n': return L'\n';
+    case L'r': return L'\r';
+    case L't': return L'\t';
+    case L'0': return 0;
+    case 0: (*pos)--; return 0;
+    default: return c;
+    }
+}
+
+/* Advance to the next token */
+VOID script_next(SCRIPT *s) {
+    CHAR16 *src = s->src;
+    UINTN pos = s->tok.pos;
+    CHAR16 c;
+
+    /* Skip white space and comments */
+    for (;;) {
+        c = src[pos];
+        if (c == L'\n') {
+            s->tok.line++;
+            pos++;
+        } else if (c == L' ' || c == L'\t' || c == L'\r') {
+            pos++;
+        } else if (c == L'/' && src[pos + 1] == L'/') {
+            while (src[pos] != 0 && src[pos] != L'\n') pos++;
+        } else if (c == L'/' && src[pos + 1] == L'*') {
+            pos += 2;
+            while (src[pos] != 0 && !(src[pos] == L'*' && src[pos + 1] == L'/')) {
+                if (src[pos] == L'\n') s->tok.line++;
+                pos++;
+            }
+            if (src[pos] == 0) {
+                s->tok.tok_line = s->tok.line;
+                script_error(s, L"Unterminated comment");
+                break;
+            }
+            pos += 2;
+        } else {
+            break;
+        }
+    }
+
+    s->tok.tok_line = s->tok.line;
+    if (s->failed || c == 0) {
+        s->tok.kind = SCRIPT_TK_EOF;
+        s->tok.pos = pos;
+        return;
+    }
+
+    if (c >= L'0' && c <= L'9') {
+        UINT64 value = 0;
+        UINTN base = 10;
+        BOOLEAN overflow = FALSE;
+
+        if (c == L'0' && (src[pos + 1] == L'x' || src[pos + 1] == L'X')) {
+            base = 16;
+            pos += 2;
+        }
+        for (;;) {
+            UINTN digit;
+            c = src[pos];
+            if (c >= L'0' && c <= L'9') digit = c - L'0';
+            else if (base == 16 && c >= L'a' && c <= L'f') digit = c - L'a' + 10;
+            else if (base == 16 && c >= L'A' && c <= L'F') digit = c - L'A' + 10;
+            else break;
+            if (__builtin_mul_overflow(value, (UINT64)base, &value) ||
+                __builtin_add_overflow(value, (UINT64)digit, &value)) {
+                overflow = TRUE;
+            }
+            pos++;
+        }
+        s->tok.kind = SCRIPT_TK_NUMBER;
+        s->tok.value = (INT64)value;
+        s->tok.pos = pos;
+        if (overflow) script_error(s, L"Number does not fit in 64 bits");
+        return;
+    }
+
+    if ((c >= L'a' && c <= L'z') || (c >= L'A' && c <= L'Z') || c == L'_') {
+        UINTN start = pos;
+        while ((src[pos] >= L'a' && src[pos] <= L'z') || (src[pos] >= L'A' && src[pos] <= L'Z') ||
+               (src[pos] >= L'0' && src[pos] <= L'9') || src[pos] == L'_') {
+            pos++;
+        }
+        s->tok.kind = SCRIPT_TK_NAME;
+        s->tok.name = src + start;
+        s->tok.name_len = pos - start;
+        s->tok.pos = pos;
+        if (s->tok.name_len > SCRIPT_MAX_NAME) script_error(s, L"Name too long");
+        return;
+    }
+
+    if (c == L'"') {
+        /* Measure, then decode into a string that lives as long as the script */
+        UINTN scan = pos + 1;
+        UINTN len = 0;
+        CHAR16 *text;
+
+        while (src[scan] != L'"') {
+            if (src[scan] == 0 || src[scan] == L'\n') {
+                script_error(s, L"Unterminated string");
+                s->tok.kind = SCRIPT_TK_EOF;
+                return;
+            }
+            script_escape(src, &scan);
+            len++;
+        }
+        text = script_new_string(s, len);
+        if (text == NULL) {
+            s->tok.kind = SCRIPT_TK_EOF;
+            return;
+        }
+        pos++;
+        for (UINTN i = 0; i < len; i++) text[i] = script_escape(src, &pos);
+        s->tok.kind = SCRIPT_TK_STRING;
+        s->tok.value = SCRIPT_VALUE(text);
+        s->tok.pos = pos + 1;
+        return;
+    }
+
+    if (c == L'\'') {
+        pos++;
+        s->tok.kind = SCRIPT_TK_NUMBER;
+        s->tok.value = script_escape(src, &pos);
+        if (src[pos] != L'\'') script_error(s, L"Bad character literal");
+        s->tok.pos = pos + 1;
+        return;
+    }
+
+    /* Operators, longest match first */
+    s->tok.kind = SCRIPT_TK_OP;
+    if ((c == L'<' || c == L'>') && src[pos + 1] == c && src[pos + 2] == L'=') {
+        s->tok.op = SCRIPT_OP3(c, c, L'=');
+        s->tok.pos = pos + 3;
+        return;
+    }
+    for (UINTN i = 0; script_ops2[i] != NULL; i++) {
+        if (script_ops2[i][0] == c && script_ops2[i][1] == src[pos + 1]) {
+            s->tok.op = SCRIPT_OP2(c, src[pos + 1]);
+            s->tok.pos = pos + 2;
+            return;
+        }
+    }
+    for (CHAR16 *p = L"+-*/%&|^~!<>=(){}[],;"; *p; p++) {
+        if (*p == c) {
+            s->tok.op = c;
+            s->tok.pos = pos + 1;
+            return;
+        }
+    }
+    script_error(s, L"Unexpected character");
+    s->tok.kind = SCRIPT_TK_EOF;
+}
+
+/* Consume the operator if it is next */
+BOOLEAN script_accept(SCRIPT *s, UINT32 op) {
+    if (!script_is_op(s, op)) return FALSE;
+    script_next(s);
+    return TRUE;
+}
+
+/* Consume a required operator */
+VOID script_expect(SCRIPT *s, UINT32 op, CHAR16 *message) {
+    if (!script_accept(s, op)) script_error(s, message);
+}
+
+/* Look at the operator after the current token without consuming anything */
+UINT32 script_peek_op(SCRIPT *s) {
+    SCRIPT_TOKEN saved;
+    UINT32 op;
+
+    CopyMem(&saved, &s->tok, sizeof(saved));
+    script_next(s);
+    op = s->tok.kind == SCRIPT_TK_OP ? s->tok.op : 0;
+    CopyMem(&s->tok, &saved, sizeof(saved));
+    return op;
+}
+
+/* Skip tokens up to (not past) an unnested stop operator */
+VOID script_skip_to(SCRIPT *s, UINT32 stop) {
+    UINTN depth = 0;
+
+    while (s->tok.kind != SCRIPT_TK_EOF) {
+        if (depth == 0 && script_is_op(s, stop)) return;
+        if (script_is_op(s, L'(')) depth++;
+        if (script_is_op(s, L')')) {
+            if (depth == 0) break;
+            depth--;
+        }
+        script_next(s);
+    }
+    script_error(s, L"Unbalanced parentheses");
+}
+
+/* Append an instruction word */
+UINTN script_emit(SCRIPT *s, UINT32 word) {
+    if (s->code_len >= SCRIPT_MAX_CODE) {
+        script_error(s, L"Script too large");
+        return 0;
+    }
+    s->code[s->code_len] = word;
+    s->lines[s->code_len] = (UINT32)s->tok.tok_line;
+    s->retarget_pc = SCRIPT_NO_JUMP;
+    return s->code_len++;
+}
+
+/* Append an instruction whose only effect is writing register A */
+VOID script_emit_value(SCRIPT *s, UINT32 word) {
+    UINTN pc = script_emit(s, word);
+
+    if (!s->failed) s->retarget_pc = pc;
+}
+
+/* Append a branch with an unknown target, chaining it onto *list */
+VOID script_emit_jump(SCRIPT *s, UINT32 word, UINTN *list) {
+    UINTN at;
+
+    script_emit(s, word);
+    at = script_emit(s, (UINT32)*list);
+    if (!s->failed) *list = at;
+}
+
+/* Point every branch on a list at the target */
+VOID script_patch(SCRIPT *s, UINTN list, UINTN target) {
+    if (s->failed) return;
+    while (list != SCRIPT_NO_JUMP) {
+        UINTN next = s->code[list];
+        s->code[list] = (UINT32)target;
+        list = next;
+    }
+}
+
+/* The current position as a branch target; code before it can no longer be rewritten */
+UINTN script_label(SCRIPT *s) {
+    s->retarget_pc = SCRIPT_NO_JUMP;
+    return s->code_len;
+}
+
+/* Index of a constant in the pool, adding it if needed */
+UINTN script_const(SCRIPT *s, INT64 value) {
+    for (UINTN i = 0; i < s->const_count; i++) {
+        if (s->consts[i] == value) return i;
+    }
+    if (s->const_count == SCRIPT_MAX_CONSTS) {
+        script_error(s, L"Too many constants");
+        return 0;
+    }
+    s->consts[s->const_count] = value;
+    return s->const_count++;
+}
+
+/* Take the next free register */
+UINTN script_alloc_reg(SCRIPT *s) {
+    if (s->fn.free_reg >= SCRIPT_MAX_REGS) {
+        script_error(s, L"Too many variables or expression too complex");
+        return 0;
+    }
+    s->fn.free_reg++;
+    if (s->fn.free_reg > s->fn.max_reg) s->fn.max_reg = s->fn.free_reg;
+    return s->fn.free_reg - 1;
+}
+
+/* Destination for a result computed from temporaries starting at base */
+UINTN script_result_reg(SCRIPT *s, UINTN base) {
+    if (base < s->fn.free_reg) {
+        s->fn.free_reg = base + 1;
+        return base;
+    }
+    return script_alloc_reg(s);
+}
+
+/* Compute an expression into a given register */
+VOID script_load(SCRIPT *s, SCRIPT_EXPR *e, UINTN reg) {
+    if (e->kind == SCRIPT_E_CONST) {
+        if (e->type == SCRIPT_INT && e->value >= -32768 && e->value <= 32767) {
+            script_emit_value(s, SCRIPT_ABX(SOP_LOADI, reg, (UINT16)e->value));
+        } else {
+            script_emit_value(s, SCRIPT_ABX(SOP_LOADK, reg, script_const(s, e->value)));
+        }
+    } else if (e->kind == SCRIPT_E_CMP) {
+        UINTN a = e->reg;
+        UINTN b = e->rhs;
+
+        if (e->rhs_const) {
+            b = script_alloc_reg(s);
+            if (e->value >= -32768 && e->value <= 32767) {
+                script_emit(s, SCRIPT_ABX(SOP_LOADI, b, (UINT16)e->value));
+            } else {
+                script_emit(s, SCRIPT_ABX(SOP_LOADK, b, script_const(s, e->value)));
+            }
+        }
+        switch (e->cmp) {
+        case SCRIPT_CMP_EQ: script_emit_value(s, SCRIPT_ABC(SOP_EQ, reg, a, b)); break;
+        case SCRIPT_CMP_NE: script_emit_value(s, SCRIPT_ABC(SOP_NE, reg, a, b)); break;
+        case SCRIPT_CMP_LT: script_emit_value(s, SCRIPT_ABC(SOP_LT, reg, a, b)); break;
+        case SCRIPT_CMP_GE: script_emit_value(s, SCRIPT_ABC(SOP_LE, reg, b, a)); break;
+        case SCRIPT_CMP_LE: script_emit_value(s, SCRIPT_ABC(SOP_LE, reg, a, b)); break;
+        default:            script_emit_value(s, SCRIPT_ABC(SOP_LT, reg, b, a)); break;
+        }
+    } else if (e->reg != reg) {
+        /* Have the instruction that produced a temporary write the target directly */
+        if (e->reg >= s->fn.local_regs && s->retarget_pc != SCRIPT_NO_JUMP &&
+            s->retarget_pc + 1 == s->code_len && ((s->code[s->retarget_pc] >> 8) & 0xFF) == e->reg) {
+            s->code[s->retarget_pc] = (s->code[s->retarget_pc] & 0xFFFF00FF) | ((UINT32)reg << 8);
+        } else {
+            script_emit_value(s, SCRIPT_ABC(SOP_MOV, reg, e->reg, 0));
+        }
+    }
+    e->kind = SCRIPT_E_REG;
+    e->reg = reg;
+}
+
+/* Make sure an expression's value is in some register and return it */
+UINTN script_to_reg(SCRIPT *s, SCRIPT_EXPR *e) {
+    if (e->kind != SCRIPT_E_REG) {
+        UINTN reg = e->kind == SCRIPT_E_CMP ? script_result_reg(s, e->base) : script_alloc_reg(s);
+        script_load(s, e, reg);
+    }
+    return e->reg;
+}
+
+/* Emit a branch taken when the expression's truth equals jump_if */
+VOID script_branch(SCRIPT *s, SCRIPT_EXPR *e, BOOLEAN jump_if, UINTN *list) {
+    if (e->type != SCRIPT_INT) {
+        script_error(s, L"Condition must be I64");
+        return;
+    }
+    if (e->kind == SCRIPT_E_CONST) {
+        if ((e->value != 0) == jump_if) script_emit_jump(s, SCRIPT_ABC(SOP_JMP, 0, 0, 0), list);
+    } else if (e->kind == SCRIPT_E_CMP) {
+        UINTN cmp = jump_if ? e->cmp : e->cmp ^ 1;
+        UINTN a = e->reg;
+        UINTN b = e->rhs;
+
+        if (e->rhs_const) {
+            script_emit_jump(s, SCRIPT_ABX(SOP_JEQK + cmp, a, script_const(s, e->value)), list);
+        } else if (cmp == SCRIPT_CMP_EQ) {
+            script_emit_jump(s, SCRIPT_ABC(SOP_JEQ, a, b, 0), list);
+        } else if (cmp == SCRIPT_CMP_NE) {
+            script_emit_jump(s, SCRIPT_ABC(SOP_JNE, a, b, 0), list);
+        } else if (cmp == SCRIPT_CMP_LT) {
+            script_emit_jump(s, SCRIPT_ABC(SOP_JLT, a, b, 0), list);
+        } else if (cmp == SCRIPT_CMP_GE) {
+            script_emit_jump(s, SCRIPT_ABC(SOP_JLE, b, a, 0), list);
+        } else if (cmp == SCRIPT_CMP_LE) {
+            script_emit_jump(s, SCRIPT_ABC(SOP_JLE, a, b, 0), list);
+        } else {
+            script_emit_jump(s, SCRIPT_ABC(SOP_JLT, b, a, 0), list);
+        }
+    } else {
+        script_emit_jump(s, SCRIPT_ABX(jump_if ? SOP_JNZ : SOP_JZ, e->reg, 0), list);
+    }
+    s->fn.free_reg = e->base;
+}
+
+/* Compile a parenthesised or bare condition followed by its branch */
+VOID script_condition(SCRIPT *s, BOOLEAN jump_if, UINTN *list) {
+    SCRIPT_EXPR e;
+
+    script_expr(s, 0, &e);
+    script_branch(s, &e, jump_if, list);
+}
+
+/* Signed division shared by constant folding and the VM; FALSE on division by zero */
+BOOLEAN script_divide(INT64 a, INT64 b, INT64 *quot, INT64 *rem) {
+    if (b == 0) return FALSE;
+    if (b == -1) {
+        /* Wraps for the most negative value instead of trapping */
+        *quot = (INT64)(0 - (UINT64)a);
+        *rem = 0;
+        return TRUE;
+    }
+    calc_div64(a, b, quot, rem);
+    return TRUE;
+}
+
+/* Binding precedence of a binary operator, 0 if the token is not one */
+UINTN script_precedence(SCRIPT *s) {
+    if (s->tok.kind != SCRIPT_TK_OP) return 0;
+    switch (s->tok.op) {
+    case SCRIPT_OP2(L'|', L'|'): return 1;
+    case SCRIPT_OP2(L'&', L'&'): return 2;
+    case L'|': return 3;
+    case L'^': return 4;
+    case L'&': return 5;
+    case SCRIPT_OP2(L'=', L'='): case SCRIPT_OP2(L'!', L'='): return 6;
+    case L'<': case L'>': case SCRIPT_OP2(L'<', L'='): case SCRIPT_OP2(L'>', L'='): return 7;
+    case SCRIPT_OP2(L'<', L'<'): case SCRIPT_OP2(L'>', L'>'): return 8;
+    case L'+': case L'-': return 9;
+    case L'*': case L'/': case L'%': return 10;
+    }
+    return 0;
+}
+
+/* Comparison code of an operator, SCRIPT_CMP_NONE for anything else */
+UINTN script_cmp_code(UINT32 op) {
+    switch (op) {
+    case SCRIPT_OP2(L'=', L'='): return SCRIPT_CMP_EQ;
+    case SCRIPT_OP2(L'!', L'='): return SCRIPT_CMP_NE;
+    case L'<': return SCRIPT_CMP_LT;
+    case SCRIPT_OP2(L'>', L'='): return SCRIPT_CMP_GE;
+    case SCRIPT_OP2(L'<', L'='): return SCRIPT_CMP_LE;
+    case L'>': return SCRIPT_CMP_GT;
+    }
+    return SCRIPT_CMP_NONE;
+}
+
+/* Arithmetic opcode of a binary operator */
+UINTN script_arith_op(UINT32 op) {
+    switch (op) {
+    case L'+': return SOP_ADD;
+    case L'-': return SOP_SUB;
+    case L'*': return SOP_MUL;
+    case L'/': return SOP_DIV;
+    case L'%': return SOP_MOD;
+    case L'&': return SOP_AND;
+    case L'|': return SOP_OR;
+    case L'^': return SOP_XOR;
+    case SCRIPT_OP2(L'<', L'<'): return SOP_SHL;
+    case SCRIPT_OP2(L'>', L'>'): return SOP_SHR;
+    }
+    return SOP_COUNT;
+}
+
+/* Evaluate an integer operation on constants; FALSE on division by zero */
+BOOLEAN script_fold(UINTN op, INT64 a, INT64 b, INT64 *result) {
+    INT64 quot, rem;
+
+    switch (op) {
+    case SOP_ADD: *result = (INT64)((UINT64)a + (UINT64)b); break;
+    case SOP_SUB: *result = (INT64)((UINT64)a - (UINT64)b); break;
+    case SOP_MUL: *result = (INT64)((UINT64)a * (UINT64)b); break;
+    case SOP_DIV:
+    case SOP_MOD:
+        if (!script_divide(a, b, &quot, &rem)) return FALSE;
+        *result = op == SOP_DIV ? quot : rem;
+        break;
+    case SOP_AND: *result = a & b; break;
+    case SOP_OR:  *result = a | b; break;
+    case SOP_XOR: *result = a ^ b; break;
+    case SOP_SHL: *result = (INT64)((UINT64)a << (b & 63)); break;
+    default:      *result = a >> (b & 63); break;
+    }
+    return TRUE;
+}
+
+/* Combine two operands; the result replaces l */
+VOID script_binary(SCRIPT *s, UINT32 op, SCRIPT_EXPR *l, SCRIPT_EXPR *r) {
+    UINTN base = l->base;
+    UINTN cmp = script_cmp_code(op);
+    UINTN code = script_arith_op(op);
+    UINTN a, b, dest;
+
+    if (l->type == SCRIPT_VOID || r->type == SCRIPT_VOID) {
+        script_error(s, L"Expression has no value");
+        return;
+    }
+    if (l->type != r->type) {
+        script_error(s, L"Operand types do not match");
+        return;
+    }
+
+    if (l->type == SCRIPT_STR) {
+        if (op != L'+' && cmp != SCRIPT_CMP_EQ && cmp != SCRIPT_CMP_NE) {
+            script_error(s, L"Operator needs I64 operands");
+            return;
+        }
+        a = script_to_reg(s, l);
+        b = script_to_reg(s, r);
+        dest = script_result_reg(s, base);
+        script_emit_value(s, SCRIPT_ABC(op == L'+' ? SOP_CONCAT : SOP_STREQ, dest, a, b));
+        if (cmp == SCRIPT_CMP_NE) script_emit_value(s, SCRIPT_ABC(SOP_NOT, dest, dest, 0));
+        l->kind = SCRIPT_E_REG;
+        l->type = op == L'+' ? SCRIPT_STR : SCRIPT_INT;
+        l->reg = dest;
+        return;
+    }
+
+    if (l->kind == SCRIPT_E_CONST && r->kind == SCRIPT_E_CONST) {
+        if (cmp != SCRIPT_CMP_NONE) {
+            switch (cmp) {
+            case SCRIPT_CMP_EQ: l->value = l->value == r->value; break;
+            case SCRIPT_CMP_NE: l->value = l->value != r->value; break;
+            case SCRIPT_CMP_LT: l->value = l->value < r->value; break;
+            case SCRIPT_CMP_GE: l->value = l->value >= r->value; break;
+            case SCRIPT_CMP_LE: l->value = l->value <= r->value; break;
+            default:            l->value = l->value > r->value; break;
+            }
+        } else if (!script_fold(code, l->value, r->value, &l->value)) {
+            script_error(s, L"Division by zero");
+        }
+        return;
+    }
+
+    if (cmp != SCRIPT_CMP_NONE) {
+        /* Keep the comparison pending so a condition can branch on it directly */
+        if (l->kind == SCRIPT_E_CONST) {
+            SCRIPT_EXPR t = *l;
+            *l = *r;
+            *r = t;
+            cmp = script_cmp_mirror[cmp];
+        }
+        a = script_to_reg(s, l);
+        l->kind = SCRIPT_E_CMP;
+        l->cmp = (UINT8)cmp;
+        l->reg = a;
+        l->rhs_const = r->kind == SCRIPT_E_CONST;
+        if (l->rhs_const) {
+            l->value = r->value;
+        } else {
+            l->rhs = script_to_reg(s, r);
+        }
+        l->base = base;
+        return;
+    }
+
+    if (op == L'+' && l->kind == SCRIPT_E_CONST) {
+        SCRIPT_EXPR t = *l;
+        *l = *r;
+        *r = t;
+        l->base = base;
+    }
+    if ((op == L'+' || op == L'-') && r->kind == SCRIPT_E_CONST) {
+        INT64 imm = op == L'+' ? r->value : (INT64)(0 - (UINT64)r->value);
+        if (imm >= -128 && imm <= 127) {
+            a = script_to_reg(s, l);
+            dest = script_result_reg(s, base);
+            script_emit_value(s, SCRIPT_ABC(SOP_ADDI, dest, a, (UINT8)imm));
+            l->kind = SCRIPT_E_REG;
+            l->reg = dest;
+            return;
+        }
+    }
+
+    a = script_to_reg(s, l);
+    b = script_to_reg(s, r);
+    dest = script_result_reg(s, base);
+    script_emit_value(s, SCRIPT_ABC(code, dest, a, b));
+    l->kind = SCRIPT_E_REG;
+    l->reg = dest;
+}
+
+/* Short-circuit && and ||, producing 0 or 1 */
+VOID script_logical(SCRIPT *s, BOOLEAN is_and, UINTN prec, SCRIPT_EXPR *e) {
+    UINTN base = e->base;
+    UINTN decided = SCRIPT_NO_JUMP;
+    UINTN done = SCRIPT_NO_JUMP;
+    UINTN dest;
+    SCRIPT_EXPR rhs;
+
+    /* && stops at the first false operand, || at the first true one */
+    script_branch(s, e, !is_and, &decided);
+    script_expr(s, prec + 1, &rhs);
+    script_branch(s, &rhs, !is_and, &decided);
+    dest = script_alloc_reg(s);
+    script_emit(s, SCRIPT_ABX(SOP_LOADI, dest, is_and ? 1 : 0));
+    script_emit_jump(s, SCRIPT_ABC(SOP_JMP, 0, 0, 0), &done);
+    script_patch(s, decided, script_label(s));
+    script_emit(s, SCRIPT_ABX(SOP_LOADI, dest, is_and ? 0 : 1));
+    script_patch(s, done, script_label(s));
+
+    e->kind = SCRIPT_E_REG;
+    e->type = SCRIPT_INT;
+    e->reg = dest;
+    e->base = base;
+}
+
+/* Find a local by name, innermost first */
+SCRIPT_VAR *script_find_local(SCRIPT *s, CHAR16 *name, UINTN len) {
+    for (UINTN i = s->local_count; i > s->fn.local_base; i--) {
+        SCRIPT_VAR *v = &s->locals[i - 1];
+        if (StrnCmp(v->name, name, len) == 0 && v->name[len] == 0) return v;
+    }
+    return NULL;
+}
+
+/* Find a global variable by name */
+SCRIPT_VAR *script_find_global(SCRIPT *s, CHAR16 *name, UINTN len) {
+    for (UINTN i = 0; i < s->global_count; i++) {
+        SCRIPT_VAR *v = &s->global_vars[i];
+        if (StrnCmp(v->name, name, len) == 0 && v->name[len] == 0) return v;
+    }
+    return NULL;
+}
+
+/* Find a script function by name, returning its index or -1 */
+INTN script_find_func(SCRIPT *s, CHAR16 *name, UINTN len) {
+    for (UINTN i = 0; i < s->func_count; i++) {
+        if (StrnCmp(s->funcs[i].name, name, len) == 0 && s->funcs[i].name[len] == 0) return (INTN)i;
+    }
+    return -1;
+}
+
+/* Find a builtin by name, returning its index or -1 */
+INTN script_find_builtin(CHAR16 *name, UINTN len) {
+    for (UINTN i = 0; i < SCRIPT_BI_COUNT; i++) {
+        if (StrnCmp(script_builtins[i].name, name, len) == 0 && script_builtins[i].name[len] == 0) {
+            return (INTN)i;
+        }
+    }
+    return -1;
+}
+
+/* Check that a new name is not a keyword or already taken in its scope */
+BOOLEAN script_check_name(SCRIPT *s, CHAR16 *name, UINTN len, BOOLEAN local) {
+    for (UINTN i = 0; script_keywords[i] != NULL; i++) {
+        if (StrLen(script_keywords[i]) == len && StrnCmp(script_keywords[i], name, len) == 0) {
+            script_error(s, L"Reserved word");
+            return FALSE;
+        }
+    }
+    if (local) {
+        SCRIPT_VAR *v = script_find_local(s, name, len);
+        if (v != NULL && v->depth == s->fn.depth) {
+            script_error(s, L"Name already defined");
+            return FALSE;
+        }
+    } else if (script_find_global(s, name, len) != NULL || script_find_func(s, name, len) >= 0 ||
+               script_find_builtin(name, len) >= 0) {
+        script_error(s, L"Name already defined");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Copy a name token into a fixed-size name field */
+VOID script_copy_name(CHAR16 *dest, CHAR16 *name, UINTN len) {
+    CopyMem(dest, name, len * sizeof(CHAR16));
+    dest[len] = 0;
+}
+
+/* Check Print-style arguments against the conversions of a format literal */
+VOID script_check_format(SCRIPT *s, CHAR16 *format, UINT8 *types, UINTN count) {
+    UINTN used = 0;
+
+    for (CHAR16 *p = format; *p; p++) {
+        UINT8 want;
+
+        if (*p != L'%') continue;
+        p++;
+        if (*p == L'%') continue;
+        while (*p == L'-' || *p == L'0') p++;
+        while (*p >= L'0' && *p <= L'9') p++;
+        if (*p == L's') {
+            want = SCRIPT_STR;
+        } else if (*p == L'd' || *p == L'x' || *p == L'X' || *p == L'c') {
+            want = SCRIPT_INT;
+        } else {
+            script_error(s, L"Unknown conversion in format");
+            return;
+        }
+        if (used == count) {
+            script_error(s, L"Too few arguments for format");
+            return;
+        }
+        if (types[used++] != want) {
+            script_error(s, L"Argument does not match format");
+            return;
+        }
+    }
+    if (used != count) script_error(s, L"Too many arguments for format");
+}
+
+/* Compile one call argument into its register */
+VOID script_argument(SCRIPT *s, UINTN *argc, UINT8 *types, CHAR16 **format) {
+    SCRIPT_EXPR arg;
+    UINTN reg;
+
+    if (*argc == SCRIPT_MAX_ARGS) {
+        script_error(s, L"Too many arguments");
+        return;
+    }
+    reg = script_alloc_reg(s);
+    script_expr(s, 0, &arg);
+    if (*argc == 0 && format != NULL) {
+        if (arg.kind != SCRIPT_E_CONST || arg.type != SCRIPT_STR) {
+            script_error(s, L"Format must be a string literal");
+            return;
+        }
+        *format = SCRIPT_TEXT(arg.value);
+    }
+    if (arg.type == SCRIPT_VOID) script_error(s, L"Expression has no value");
+    types[(*argc)++] = arg.type;
+    script_load(s, &arg, reg);
+    s->fn.free_reg = reg + 1;
+}
+
+/* Finish a call: check arguments and emit CALL or NATIVE with the result in base */
+VOID script_finish_call(SCRIPT *s, INTN func, INTN builtin, UINTN base, UINTN argc,
+                        UINT8 *types, CHAR16 *format, SCRIPT_EXPR *e) {
+    UINT8 ret;
+
+    if (builtin >= 0) {
+        CHAR8 *params = script_builtins[builtin].params;
+        if (params[0] == 'f') {
+            script_check_format(s, format, types + 1, argc - 1);
+        } else {
+            UINTN i = 0;
+            while (params[i] != 0 && i < argc &&
+                   types[i] == (params[i] == 's' ? SCRIPT_STR : SCRIPT_INT)) {
+                i++;
+            }
+            if (params[i] != 0 || i != argc) script_error(s, L"Wrong arguments for builtin");
+        }
+        ret = script_builtins[builtin].ret;
+    } else {
+        SCRIPT_FUNC *f = &s->funcs[func];
+        UINTN i = 0;
+        while (i < f->param_count && i < argc && types[i] == f->params[i]) i++;
+        if (i != f->param_count || i != argc) script_error(s, L"Wrong arguments for function");
+        ret = f->ret;
+    }
+
+    if (argc == 0) base = script_alloc_reg(s);
+    if (builtin >= 0) {
+        script_emit(s, SCRIPT_ABC(SOP_NATIVE, base, builtin, argc));
+    } else {
+        script_emit(s, SCRIPT_ABC(SOP_CALL, base, func, argc));
+    }
+    s->fn.free_reg = base + 1;
+    e->kind = SCRIPT_E_REG;
+    e->type = ret;
+    e->reg = base;
+    e->base = base;
+}
+
+/* Compile a call; the current token is the opening parenthesis */
+VOID script_call(SCRIPT *s, CHAR16 *name, UINTN len, SCRIPT_EXPR *e) {
+    INTN func = script_find_func(s, name, len);
+    INTN builtin = func < 0 ? script_find_builtin(name, len) : -1;
+    UINTN base = s->fn.free_reg;
+    UINTN argc = 0;
+    UINT8 types[SCRIPT_MAX_ARGS];
+    CHAR16 *format = NULL;
+
+    if (func < 0 && builtin < 0) {
+        script_error(s, L"Unknown function");
+        return;
+    }
+    script_next(s);
+    if (!script_accept(s, L')')) {
+        do {
+            script_argument(s, &argc, types,
+                            builtin >= 0 && script_builtins[builtin].params[0] == 'f' ? &format : NULL);
+        } while (!s->failed && script_accept(s, L','));
+        script_expect(s, L')', L"Expected ')'");
+    }
+    if (s->failed) return;
+    if (builtin >= 0 && script_builtins[builtin].params[0] == 'f' && argc == 0) {
+        script_error(s, L"Missing format");
+        return;
+    }
+    script_finish_call(s, func, builtin, base, argc, types, format, e);
+}
+
+/* Literals, names, calls, parentheses and string indexing */
+VOID script_primary(SCRIPT *s, SCRIPT_EXPR *e) {
+    e->base = s->fn.free_reg;
+    e->kind = SCRIPT_E_CONST;
+    e->type = SCRIPT_INT;
+    e->value = 0;
+
+    if (s->tok.kind == SCRIPT_TK_NUMBER) {
+        e->value = s->tok.value;
+        script_next(s);
+    } else if (s->tok.kind == SCRIPT_TK_STRING) {
+        e->type = SCRIPT_STR;
+        e->value = s->tok.value;
+        script_next(s);
+    } else if (script_accept(s, L'(')) {
+        script_expr(s, 0, e);
+        script_expect(s, L')', L"Expected ')'");
+    } else if (s->tok.kind == SCRIPT_TK_NAME) {
+        CHAR16 *name = s->tok.name;
+        UINTN len = s->tok.name_len;
+        SCRIPT_VAR *v;
+
+        script_next(s);
+        if (script_is_op(s, L'(')) {
+            script_call(s, name, len, e);
+        } else if ((v = script_find_local(s, name, len)) != NULL) {
+            e->kind = SCRIPT_E_REG;
+            e->type = v->type;
+            e->reg = v->index;
+        } else if ((v = script_find_global(s, name, len)) != NULL) {
+            e->kind = SCRIPT_E_REG;
+            e->type = v->type;
+            e->reg = script_alloc_reg(s);
+            script_emit_value(s, SCRIPT_ABX(SOP_GETG, e->reg, v->index));
+        } else {
+            script_error(s, L"Unknown name");
+        }
+    } else {
+        script_error(s, L"Expected an expression");
+    }
+
+    while (!s->failed && script_accept(s, L'[')) {
+        SCRIPT_EXPR index;
+        UINTN str, dest;
+
+        if (e->type != SCRIPT_STR) {
+            script_error(s, L"Only strings can be indexed");
+            return;
+        }
+        str = script_to_reg(s, e);
+        script_expr(s, 0, &index);
+        if (index.type != SCRIPT_INT) script_error(s, L"Index must be I64");
+        script_to_reg(s, &index);
+        script_expect(s, L']', L"Expected ']'");
+        dest = script_result_reg(s, e->base);
+        script_emit_value(s, SCRIPT_ABC(SOP_INDEX, dest, str, index.reg));
+        e->kind = SCRIPT_E_REG;
+        e->type = SCRIPT_INT;
+        e->reg = dest;
+    }
+}
+
+/* Prefix operators */
+VOID script_unary(SCRIPT *s, SCRIPT_EXPR *e) {
+    UINTN base = s->fn.free_reg;
+    UINT32 op = s->tok.kind == SCRIPT_TK_OP ? s->tok.op : 0;
+    UINTN reg, dest;
+
+    /* Every operand and parenthesis passes through here, so this bounds the stack */
+    if (++s->nesting > SCRIPT_MAX_NESTING) {
+        e->base = base;
+        e->kind = SCRIPT_E_CONST;
+        e->type = SCRIPT_INT;
+        e->value = 0;
+        script_error(s, L"Expression too deeply nested");
+        s->nesting--;
+        return;
+    }
+    if (op != L'-' && op != L'!' && op != L'~') {
+        script_primary(s, e);
+        s->nesting--;
+        return;
+    }
+    script_next(s);
+    script_unary(s, e);
+    s->nesting--;
+    if (s->failed) return;
+    if (e->type != SCRIPT_INT) {
+        script_error(s, L"Operator needs an I64 operand");
+        return;
+    }
+    if (e->kind == SCRIPT_E_CONST) {
+        if (op == L'-') e->value = (INT64)(0 - (UINT64)e->value);
+        else if (op == L'!') e->value = e->value == 0;
+        else e->value = ~e->value;
+        return;
+    }
+    if (op == L'!' && e->kind == SCRIPT_E_CMP) {
+        e->cmp ^= 1;
+        return;
+    }
+    reg = script_to_reg(s, e);
+    dest = script_result_reg(s, base);
+    script_emit_value(s, SCRIPT_ABC(op == L'-' ? SOP_NEG : op == L'!' ? SOP_NOT : SOP_BNOT, dest, reg, 0));
+    e->kind = SCRIPT_E_REG;
+    e->reg = dest;
+    e->base = base;
+}
+
+/* Binary operators by precedence climbing */
+VOID script_expr(SCRIPT *s, UINTN min_prec, SCRIPT_EXPR *e) {
+    script_unary(s, e);
+    while (!s->failed) {
+        UINTN prec = script_precedence(s);
+        UINT32 op = s->tok.op;
+        SCRIPT_EXPR rhs;
+
+        if (prec == 0 || prec < min_prec) break;
+        script_next(s);
+        if (op == SCRIPT_OP2(L'&', L'&') || op == SCRIPT_OP2(L'|', L'|')) {
+            script_logical(s, op == SCRIPT_OP2(L'&', L'&'), prec, e);
+            continue;
+        }
+        if (e->kind == SCRIPT_E_CMP || (e->kind == SCRIPT_E_CONST && e->type == SCRIPT_STR)) {
+            script_to_reg(s, e);
+        }
+        script_expr(s, prec + 1, &rhs);
+        script_binary(s, op, e, &rhs);
+    }
+}
+
+/* Parse a type: I64 or Bool, U8 * (string) or U0 (no value); FALSE if there is none */
+BOOLEAN script_type(SCRIPT *s, UINT8 *type) {
+    if (script_is(s, L"I64") || script_is(s, L"Bool")) {
+        *type = SCRIPT_INT;
+    } else if (script_is(s, L"U0")) {
+        *type = SCRIPT_VOID;
+    } else if (script_is(s, L"U8")) {
+        script_next(s);
+        if (!script_is_op(s, L'*')) script_error(s, L"Strings are declared as U8 *");
+        *type = SCRIPT_STR;
+    } else {
+        return FALSE;
+    }
+    script_next(s);
+    return TRUE;
+}
+
+/* Initialise a register or global to the zero value of its type */
+VOID script_zero(SCRIPT *s, UINT8 type, UINTN reg) {
+    if (type == SCRIPT_STR) {
+        script_emit_value(s, SCRIPT_ABX(SOP_LOADK, reg, script_const(s, SCRIPT_VALUE(s->empty))));
+    } else {
+        script_emit_value(s, SCRIPT_ABX(SOP_LOADI, reg, 0));
+    }
+}
+
+/* Variable declarations; the type has been read. Globals at file scope, registers elsewhere */
+VOID script_declare(SCRIPT *s, UINT8 type, CHAR16 *name, UINTN len) {
+    BOOLEAN global = !s->fn.in_function && s->fn.depth == 0;
+
+    if (type == SCRIPT_VOID) {
+        script_error(s, L"Variables cannot be U0");
+        return;
+    }
+    for (;;) {
+        SCRIPT_EXPR init;
+        SCRIPT_VAR *v;
+        UINTN reg = 0;
+
+        init.kind = SCRIPT_E_CONST;
+
+        if (!script_check_name(s, name, len, !global)) return;
+        if (global ? s->global_count == SCRIPT_MAX_GLOBALS : s->local_count == SCRIPT_MAX_LOCALS) {
+            script_error(s, L"Too many variables");
+            return;
+        }
+        s->fn.free_reg = s->fn.local_regs;
+        if (!global) reg = script_alloc_reg(s);
+
+        /* The initialiser is compiled before the name becomes visible */
+        if (script_accept(s, L'=')) {
+            script_expr(s, 0, &init);
+            if (init.type != type) {
+                script_error(s, L"Initializer has the wrong type");
+                return;
+            }
+            if (global) {
+                reg = script_to_reg(s, &init);
+            } else {
+                script_load(s, &init, reg);
+            }
+        } else if (!global) {
+            script_zero(s, type, reg);
+        }
+
+        if (global) {
+            v = &s->global_vars[s->global_count];
+            v->index = s->global_count++;
+            s->globals[v->index] = type == SCRIPT_STR ? SCRIPT_VALUE(s->empty) : 0;
+            if (init.kind == SCRIPT_E_REG) {
+                script_emit(s, SCRIPT_ABX(SOP_SETG, reg, v->index));
+            }
+        } else {
+            v = &s->locals[s->local_count++];
+            v->index = reg;
+            s->fn.local_regs = reg + 1;
+        }
+        script_copy_name(v->name, name, len);
+        v->type = type;
+        v->depth = s->fn.depth;
+        s->fn.free_reg = s->fn.local_regs;
+
+        if (!script_accept(s, L',')) break;
+        if (type == SCRIPT_STR) script_accept(s, L'*');
+        name = s->tok.name;
+        len = s->tok.name_len;
+        if (s->tok.kind != SCRIPT_TK_NAME) {
+            script_error(s, L"Expected a name");
+            return;
+        }
+        script_next(s);
+    }
+    script_expect(s, L';', L"Expected ';'");
+}
+
+/* Operator applied by an assignment operator token: '=' itself, ++, -- or the binary operator; 0 if none */
+UINT32 script_assign_op(UINT32 op) {
+    switch (op) {
+    case L'=':
+    case SCRIPT_OP2(L'+', L'+'):
+    case SCRIPT_OP2(L'-', L'-'):
+        return op;
+    case SCRIPT_OP2(L'+', L'='): case SCRIPT_OP2(L'-', L'='): case SCRIPT_OP2(L'*', L'='):
+    case SCRIPT_OP2(L'/', L'='): case SCRIPT_OP2(L'%', L'='): case SCRIPT_OP2(L'&', L'='):
+    case SCRIPT_OP2(L'|', L'='): case SCRIPT_OP2(L'^', L'='):
+        return op & 0xFF;
+    case SCRIPT_OP3(L'<', L'<', L'='):
+    case SCRIPT_OP3(L'>', L'>', L'='):
+        return op & 0xFFFF;
+    }
+    return 0;
+}
+
+/* Assignment, increment or expression (usually a call) without the ';' */
+VOID script_simple(SCRIPT *s) {
+    UINT32 op = 0;
+    SCRIPT_VAR *v;
+    BOOLEAN global = FALSE;
+    SCRIPT_EXPR target, value;
+
+    s->fn.free_reg = s->fn.local_regs;
+
+    if (script_is_op(s, SCRIPT_OP2(L'+', L'+')) || script_is_op(s, SCRIPT_OP2(L'-', L'-'))) {
+        op = s->tok.op;
+        script_next(s);
+        if (s->tok.kind != SCRIPT_TK_NAME) {
+            script_error(s, L"Expected a name");
+            return;
+        }
+    } else if (s->tok.kind == SCRIPT_TK_NAME) {
+        op = script_assign_op(script_peek_op(s));
+    }
+    if (op == 0) {
+        /* Plain expression; the value is discarded */
+        script_expr(s, 0, &value);
+        if (value.kind == SCRIPT_E_CMP) script_to_reg(s, &value);
+        return;
+    }
+
+    /* Resolve the variable being assigned */
+    v = script_find_local(s, s->tok.name, s->tok.name_len);
+    if (v == NULL) {
+        v = script_find_global(s, s->tok.name, s->tok.name_len);
+        global = TRUE;
+    }
+    if (v == NULL) {
+        script_error(s, L"Unknown variable");
+        return;
+    }
+    script_next(s);
+    if (script_assign_op(s->tok.kind == SCRIPT_TK_OP ? s->tok.op : 0) != 0) script_next(s);
+
+    target.kind = SCRIPT_E_REG;
+    target.type = v->type;
+    target.base = s->fn.free_reg;
+    if (global) {
+        target.reg = script_alloc_reg(s);
+        if (op != L'=') script_emit(s, SCRIPT_ABX(SOP_GETG, target.reg, v->index));
+    } else {
+        target.reg = v->index;
+    }
+
+    if (op == SCRIPT_OP2(L'+', L'+') || op == SCRIPT_OP2(L'-', L'-')) {
+        if (v->type != SCRIPT_INT) {
+            script_error(s, L"Operator needs an I64 operand");
+            return;
+        }
+        value.kind = SCRIPT_E_CONST;
+        value.type = SCRIPT_INT;
+        value.value = op == SCRIPT_OP2(L'+', L'+') ? 1 : -1;
+        value.base = s->fn.free_reg;
+        script_binary(s, L'+', &target, &value);
+    } else {
+        script_expr(s, 0, &value);
+        if (value.type != v->type) {
+            script_error(s, L"Value has the wrong type");
+            return;
+        }
+        if (op == L'=') {
+            target = value;
+        } else if (v->type == SCRIPT_STR && op != L'+') {
+            script_error(s, L"Operator needs I64 operands");
+            return;
+        } else {
+            script_binary(s, op, &target, &value);
+        }
+    }
+    if (s->failed) return;
+
+    if (global) {
+        script_emit(s, SCRIPT_ABX(SOP_SETG, script_to_reg(s, &target), v->index));
+    } else {
+        script_load(s, &target, v->index);
+    }
+}
+
+/* Drop the locals of the innermost block */
+VOID script_close_scope(SCRIPT *s) {
+    s->fn.depth--;
+    while (s->local_count > s->fn.local_base && s->locals[s->local_count - 1].depth > s->fn.depth) {
+        s->local_count--;
+        s->fn.local_regs = s->locals[s->local_count].index;
+    }
+}
+
+/* { statements } */
+VOID script_block(SCRIPT *s) {
+    script_next(s);
+    s->fn.depth++;
+    while (!s->failed && s->tok.kind != SCRIPT_TK_EOF && !script_is_op(s, L'}')) {
+        script_statement(s);
+    }
+    script_expect(s, L'}', L"Expected '}'");
+    script_close_scope(s);
+}
+
+/* Compile a loop body with its own break and continue lists; continue goes to next */
+VOID script_loop_body(SCRIPT *s, UINTN *break_list, UINTN *continue_list) {
+    BOOLEAN in_loop = s->fn.in_loop;
+    UINTN outer_break = s->fn.break_list;
+    UINTN outer_continue = s->fn.continue_list;
+
+    s->fn.in_loop = TRUE;
+    s->fn.break_list = SCRIPT_NO_JUMP;
+    s->fn.continue_list = SCRIPT_NO_JUMP;
+    script_statement(s);
+    *break_list = s->fn.break_list;
+    *continue_list = s->fn.continue_list;
+    s->fn.in_loop = in_loop;
+    s->fn.break_list = outer_break;
+    s->fn.continue_list = outer_continue;
+}
+
+/*
+ * while (cond) body, compiled as
+ *     jmp test; top: body; test: if (cond) goto top
+ * The condition is skipped on the first pass and re-read after the body.
+ */
+VOID script_while(SCRIPT *s) {
+    SCRIPT_TOKEN cond, after;
+    UINTN entry = SCRIPT_NO_JUMP;
+    UINTN top, breaks, continues;
+    UINTN body = SCRIPT_NO_JUMP;
+
+    script_next(s);
+    script_expect(s, L'(', L"Expected '('");
+    CopyMem(&cond, &s->tok, sizeof(cond));
+    script_skip_to(s, L')');
+    script_next(s);
+
+    script_emit_jump(s, SCRIPT_ABC(SOP_JMP, 0, 0, 0), &entry);
+    top = script_label(s);
+    script_loop_body(s, &breaks, &continues);
+    CopyMem(&after, &s->tok, sizeof(after));
+
+    script_patch(s, entry, script_label(s));
+    script_patch(s, continues, s->code_len);
+    CopyMem(&s->tok, &cond, sizeof(cond));
+    s->fn.free_reg = s->fn.local_regs;
+    script_condition(s, TRUE, &body);
+    if (!script_is_op(s, L')')) script_error(s, L"Expected ')'");
+    script_patch(s, body, top);
+    if (!s->failed) CopyMem(&s->tok, &after, sizeof(after));
+    script_patch(s, breaks, script_label(s));
+}
+
+/* for (init; cond; step) body, laid out like while with the step before the test */
+VOID script_for(SCRIPT *s) {
+    SCRIPT_TOKEN cond, step, after;
+    UINTN entry = SCRIPT_NO_JUMP;
+    UINTN body = SCRIPT_NO_JUMP;
+    UINTN top, breaks, continues;
+    UINT8 type;
+    BOOLEAN has_cond;
+
+    script_next(s);
+    script_expect(s, L'(', L"Expected '('");
+    s->fn.depth++;
+    if (script_type(s, &type)) {
+        CHAR16 *name = s->tok.name;
+        UINTN len = s->tok.name_len;
+        if (s->tok.kind != SCRIPT_TK_NAME) script_error(s, L"Expected a name");
+        script_next(s);
+        script_declare(s, type, name, len);
+    } else {
+        if (!script_is_op(s, L';')) script_simple(s);
+        script_expect(s, L';', L"Expected ';'");
+    }
+
+    CopyMem(&cond, &s->tok, sizeof(cond));
+    has_cond = !script_is_op(s, L';');
+    script_skip_to(s, L';');
+    script_next(s);
+    CopyMem(&step, &s->tok, sizeof(step));
+    script_skip_to(s, L')');
+    script_next(s);
+
+    script_emit_jump(s, SCRIPT_ABC(SOP_JMP, 0, 0, 0), &entry);
+    top = script_label(s);
+    script_loop_body(s, &breaks, &continues);
+    CopyMem(&after, &s->tok, sizeof(after));
+
+    script_patch(s, continues, script_label(s));
+    CopyMem(&s->tok, &step, sizeof(step));
+    if (!script_is_op(s, L')')) script_simple(s);
+    if (!script_is_op(s, L')')) script_error(s, L"Expected ')'");
+    script_patch(s, entry, script_label(s));
+    if (has_cond) {
+        CopyMem(&s->tok, &cond, sizeof(cond));
+        s->fn.free_reg = s->fn.local_regs;
+        script_condition(s, TRUE, &body);
+        if (!script_is_op(s, L';')) script_error(s, L"Expected ';'");
+        script_patch(s, body, top);
+    } else {
+        script_emit(s, SCRIPT_ABC(SOP_JMP, 0, 0, 0));
+        script_emit(s, (UINT32)top);
+    }
+    if (!s->failed) CopyMem(&s->tok, &after, sizeof(after));
+    script_patch(s, breaks, script_label(s));
+    script_close_scope(s);
+}
+
+/* do body while (cond); */
+VOID script_do(SCRIPT *s) {
+    UINTN top, breaks, continues;
+    UINTN body = SCRIPT_NO_JUMP;
+
+    script_next(s);
+    top = script_label(s);
+    script_loop_body(s, &breaks, &continues);
+    script_patch(s, continues, script_label(s));
+    if (!script_is(s, L"while")) script_error(s, L"Expected 'while'");
+    script_next(s);
+    script_expect(s, L'(', L"Expected '('");
+    s->fn.free_reg = s->fn.local_regs;
+    script_condition(s, TRUE, &body);
+    script_patch(s, body, top);
+    script_expect(s, L')', L"Expected ')'");
+    script_expect(s, L';', L"Expected ';'");
+    script_patch(s, breaks, script_label(s));
+}
+
+/* if (cond) statement [else statement] */
+VOID script_if(SCRIPT *s) {
+    UINTN skip = SCRIPT_NO_JUMP;
+
+    script_next(s);
+    script_expect(s, L'(', L"Expected '('");
+    script_condition(s, FALSE, &skip);
+    script_expect(s, L')', L"Expected ')'");
+    script_statement(s);
+    if (script_is(s, L"else")) {
+        UINTN end = SCRIPT_NO_JUMP;
+        script_emit_jump(s, SCRIPT_ABC(SOP_JMP, 0, 0, 0), &end);
+        script_patch(s, skip, script_label(s));
+        script_next(s);
+        script_statement(s);
+        script_patch(s, end, script_label(s));
+    } else {
+        script_patch(s, skip, script_label(s));
+    }
+}
+
+/* return [expr]; */
+VOID script_return(SCRIPT *s) {
+    script_next(s);
+    if (s->fn.ret_type == SCRIPT_VOID) {
+        if (!script_is_op(s, L';')) script_error(s, L"This function does not return a value");
+        script_emit(s, SCRIPT_ABC(SOP_RET, 0, 0, 0));
+    } else {
+        SCRIPT_EXPR e;
+        script_expr(s, 0, &e);
+        if (e.type != s->fn.ret_type) script_error(s, L"Return value has the wrong type");
+        script_emit(s, SCRIPT_ABC(SOP_RET, script_to_reg(s, &e), 0, 0));
+    }
+    script_expect(s, L';', L"Expected ';'");
+}
+
+/* "format", args; prints like Print("format", args) */
+VOID script_print_statement(SCRIPT *s) {
+    UINTN base = s->fn.free_reg;
+    UINTN argc = 0;
+    UINT8 types[SCRIPT_MAX_ARGS];
+    CHAR16 *format = NULL;
+    SCRIPT_EXPR e;
+
+    do {
+        script_argument(s, &argc, types, &format);
+    } while (!s->failed && script_accept(s, L','));
+    if (!s->failed) script_finish_call(s, -1, SCRIPT_BI_PRINT, base, argc, types, format, &e);
+    script_expect(s, L';', L"Expected ';'");
+}
+
+/* Function definition; the return type and name have been read and '(' is current */
+VOID script_function(SCRIPT *s, UINT8 ret, CHAR16 *name, UINTN len) {
+    SCRIPT_SCOPE outer;
+    SCRIPT_FUNC *f;
+    UINTN skip = SCRIPT_NO_JUMP;
+    UINTN reg;
+
+    if (s->fn.in_function || s->fn.depth != 0) {
+        script_error(s, L"Functions must be defined at the top level");
+        return;
+    }
+    if (!script_check_name(s, name, len, FALSE)) return;
+    if (s->func_count == SCRIPT_MAX_FUNCS) {
+        script_error(s, L"Too many functions");
+        return;
+    }
+
+    /* Registered before the body so it can call itself */
+    f = &s->funcs[s->func_count++];
+    script_copy_name(f->name, name, len);
+    f->ret = ret;
+    f->param_count = 0;
+
+    /* Top-level code jumps over the body */
+    script_emit_jump(s, SCRIPT_ABC(SOP_JMP, 0, 0, 0), &skip);
+    f->entry = (UINT32)script_label(s);
+
+    CopyMem(&outer, &s->fn, sizeof(outer));
+    s->fn.local_base = s->local_count;
+    s->fn.local_regs = 0;
+    s->fn.free_reg = 0;
+    s->fn.max_reg = 1;
+    s->fn.depth = 1;
+    s->fn.ret_type = ret;
+    s->fn.in_function = TRUE;
+    s->fn.in_loop = FALSE;
+
+    script_next(s);
+    if (!script_accept(s, L')')) {
+        do {
+            UINT8 type;
+            SCRIPT_VAR *v;
+
+            if (!script_type(s, &type) || type == SCRIPT_VOID) {
+                script_error(s, L"Expected a parameter type");
+                break;
+            }
+            if (s->tok.kind != SCRIPT_TK_NAME) {
+                script_error(s, L"Expected a name");
+                break;
+            }
+            if (!script_check_name(s, s->tok.name, s->tok.name_len, TRUE)) break;
+            if (f->param_count == SCRIPT_MAX_PARAMS || s->local_count == SCRIPT_MAX_LOCALS) {
+                script_error(s, L"Too many parameters");
+                break;
+            }
+            v = &s->locals[s->local_count++];
+            script_copy_name(v->name, s->tok.name, s->tok.name_len);
+            v->type = type;
+            v->depth = s->fn.depth;
+            v->index = script_alloc_reg(s);
+            s->fn.local_regs = v->index + 1;
+            f->params[f->param_count++] = type;
+            script_next(s);
+        } while (script_accept(s, L','));
+        script_expect(s, L')', L"Expected ')'");
+    }
+
+    if (!script_is_op(s, L'{')) script_error(s, L"Expected '{'");
+    script_block(s);
+
+    /* Falling off the end returns 0 or "" */
+    s->fn.free_reg = s->fn.local_regs;
+    reg = script_alloc_reg(s);
+    script_zero(s, ret, reg);
+    script_emit(s, SCRIPT_ABC(SOP_RET, reg, 0, 0));
+    f->reg_count = (UINT32)s->fn.max_reg;
+
+    s->local_count = s->fn.local_base;
+    CopyMem(&s->fn, &outer, sizeof(outer));
+    script_patch(s, skip, script_label(s));
+}
+
+/* One statement */
+VOID script_statement(SCRIPT *s) {
+    UINT8 type;
+
+    if (++s->nesting > SCRIPT_MAX_NESTING) {
+        script_error(s, L"Statements too deeply nested");
+        s->nesting--;
+        return;
+    }
+    s->fn.free_reg = s->fn.local_regs;
+
+    if (script_is_op(s, L'{')) {
+        script_block(s);
+    } else if (script_accept(s, L';')) {
+        /* Empty statement */
+    } else if (s->tok.kind == SCRIPT_TK_STRING) {
+        script_print_statement(s);
+    } else if (script_is(s, L"if")) {
+        script_if(s);
+    } else if (script_is(s, L"while")) {
+        script_while(s);
+    } else if (script_is(s, L"for")) {
+        script_for(s);
+    } else if (script_is(s, L"do")) {
+        script_do(s);
+    } else if (script_is(s, L"return")) {
+        script_return(s);
+    } else if (script_is(s, L"break") || script_is(s, L"continue")) {
+        BOOLEAN is_break = script_is(s, L"break");
+        if (!s->fn.in_loop) script_error(s, L"Not inside a loop");
+        script_emit_jump(s, SCRIPT_ABC(SOP_JMP, 0, 0, 0),
+                         is_break ? &s->fn.break_list : &s->fn.continue_list);
+        script_next(s);
+        script_expect(s, L';', L"Expected ';'");
+    } else if (script_type(s, &type)) {
+        CHAR16 *name = s->tok.name;
+        UINTN len = s->tok.name_len;
+
+        if (s->tok.kind != SCRIPT_TK_NAME) {
+            script_error(s, L"Expected a name");
+        } else {
+            script_next(s);
+            if (script_is_op(s, L'(')) {
+                script_function(s, type, name, len);
+            } else {
+                script_declare(s, type, name, len);
+            }
+        }
+    } else {
+        script_simple(s);
+        script_expect(s, L';', L"Expected ';'");
+    }
+    s->nesting--;
+}
+
+/* Compile a whole script; the top level becomes the code starting at 0 */
+BOOLEAN script_compile(SCRIPT *s, CHAR16 *source) {
+    UINTN reg;
+
+    s->src = source;
+    s->tok.pos = 0;
+    s->tok.line = 1;
+    s->tok.tok_line = 1;
+    s->fn.max_reg = 1;
+    s->fn.ret_type = SCRIPT_VOID;
+    s->fn.break_list = SCRIPT_NO_JUMP;
+    s->fn.continue_list = SCRIPT_NO_JUMP;
+    s->empty = script_new_string(s, 0);
+
+    script_next(s);
+    while (!s->failed && s->tok.kind != SCRIPT_TK_EOF) script_statement(s);
+
+    s->fn.free_reg = s->fn.local_regs;
+    reg = script_alloc_reg(s);
+    script_emit(s, SCRIPT_ABX(SOP_LOADI, reg, 0));
+    script_emit(s, SCRIPT_ABC(SOP_RET, reg, 0, 0));
+    s->main_regs = s->fn.max_reg;
+    return !s->failed;
+}
+
+/* Append count characters to the formatting buffer */
+BOOLEAN script_out(SCRIPT *s, CHAR16 *text, UINTN count) {
+    if (s->out_len + count > SCRIPT_MAX_STRING) {
+        script_error(s, L"String too long");
+        return FALSE;
+    }
+    if (s->out_len + count + 1 > s->out_capacity) {
+        UINTN capacity = s->out_capacity ? s->out_capacity : 256;
+        CHAR16 *data;
+
+        while (capacity < s->out_len + count + 1) capacity *= 2;
+        if (EFI_ERROR(BS->AllocatePool(EfiLoaderData, capacity * sizeof(CHAR16), (VOID **)&data))) {
+            script_error(s, L"Out of memory");
+            return FALSE;
+        }
+        if (s->out != NULL) {
+            CopyMem(data, s->out, s->out_len * sizeof(CHAR16));
+            BS->FreePool(s->out);
+        }
+        s->out = data;
+        s->out_capacity = capacity;
+    }
+    CopyMem(s->out + s->out_len, text, count * sizeof(CHAR16));
+    s->out_len += count;
+    s->out[s->out_len] = 0;
+    return TRUE;
+}
+
+/* Expand a format whose conversions were checked at compile time: %d %x %X %c %s with '-', '0' and width */
+BOOLEAN script_format(SCRIPT *s, CHAR16 *format, INT64 *args) {
+    s->out_len = 0;
+    if (!script_out(s, L"", 0)) return FALSE;
+
+    while (*format) {
+        CHAR16 *start = format;
+        CHAR16 buf[24];
+        CHAR16 *text = buf;
+        UINTN len = 0;
+        UINTN width = 0;
+        BOOLEAN left = FALSE;
+        BOOLEAN zero = FALSE;
+        CHAR16 conv;
+
+        while (*format != 0 && *format != L'%') format++;
+        if (format > start && !script_out(s, start, format - start)) return FALSE;
+        if (*format == 0) break;
+        format++;
+        if (*format == L'%') {
+            if (!script_out(s, L"%", 1)) return FALSE;
+            format++;
+            continue;
+        }
+        for (; *format == L'-' || *format == L'0'; format++) {
+            if (*format == L'-') left = TRUE;
+            else zero = TRUE;
+        }
+        while (*format >= L'0' && *format <= L'9') {
+            if (width < 1000) width = width * 10 + (*format - L'0');
+            format++;
+        }
+
+        conv = *format++;
+        if (conv == L'd') {
+            len = calc_format_int64(*args++, buf);
+        } else if (conv == L'x' || conv == L'X') {
+            UINT64 value = (UINT64)*args++;
+            CHAR16 *digits = conv == L'x' ? L"0123456789abcdef" : L"0123456789ABCDEF";
+            UINTN n = 0;
+            do {
+                n++;
+            } while ((value >> (4 * n)) != 0 && n < 16);
+            for (UINTN i = 0; i < n; i++) buf[i] = digits[(value >> (4 * (n - 1 - i))) & 15];
+            len = n;
+        } else if (conv == L'c') {
+            buf[0] = (CHAR16)*args++;
+            len = 1;
+        } else {
+            text = SCRIPT_TEXT(*args++);
+            len = SCRIPT_LENGTH(text);
+            zero = FALSE;
+        }
+
+        /* Pad to the width; zero padding goes after a minus sign */
+        if (!left && zero && len < width) {
+            if (text[0] == L'-') {
+                if (!script_out(s, L"-", 1)) return FALSE;
+                text++;
+                len--;
+                width--;
+            }
+            while (len < width--) {
+                if (!script_out(s, L"0", 1)) return FALSE;
+            }
+        }
+        while (!left && len < width--) {
+            if (!script_out(s, L" ", 1)) return FALSE;
+        }
+        if (!script_out(s, text, len)) return FALSE;
+        while (left && len < width--) {
+            if (!script_out(s, L" ", 1)) return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* Write text to the console, turning \n into CR LF */
+VOID script_print(CHAR16 *text, UINTN len) {
+    CHAR16 line[130];
+    UINTN n = 0;
+
+    for (UINTN i = 0; i < len; i++) {
+        if (text[i] == L'\n') line[n++] = L'\r';
+        line[n++] = text[i];
+        if (n >= 128 || i + 1 == len) {
+            line[n] = 0;
+            ConOut->OutputString(ConOut, line);
+            n = 0;
+        }
+    }
+}
+
+/* Key code returned by GetKey and ScanKey: the character, 27 for ESC, else 256 + scan code */
+INT64 script_key_code(EFI_INPUT_KEY key) {
+    if (key.ScanCode == SCAN_ESC) return 27;
+    if (key.UnicodeChar != 0) return key.UnicodeChar;
+    return 256 + key.ScanCode;
+}
+
+/* Check for ESC without waiting; other keys pressed meanwhile are discarded */
+BOOLEAN script_escape_pressed(VOID) {
+    EFI_INPUT_KEY key;
+
+    while (!EFI_ERROR(BS->CheckEvent(ConIn->WaitForKey))) {
+        if (!EFI_ERROR(ConIn->ReadKeyStroke(ConIn, &key)) && key.ScanCode == SCAN_ESC) return TRUE;
+    }
+    return FALSE;
+}
+
+/* Sleep in slices, letting other tasks run; FALSE when ESC or a cancel cut it short */
+BOOLEAN script_sleep(UINT64 ms) {
+    EFI_EVENT events[2];
+    BOOLEAN finished = TRUE;
+
+    if (EFI_ERROR(BS->CreateEvent(EVT_TIMER, 0, NULL, NULL, &events[0]))) events[0] = NULL;
+    events[1] = ConIn->WaitForKey;
+    while (ms > 0 && finished) {
+        UINT64 step = ms < SCRIPT_SLEEP_SLICE ? ms : SCRIPT_SLEEP_SLICE;
+
+        if (events[0] == NULL) {
+            BS->Stall((UINTN)step * 1000);
+        } else {
+            BS->SetTimer(events[0], TimerRelative, step * 10000);
+            /* A key ends the wait early; the timer keeps running meanwhile */
+            while (finished && task_wait(2, events) == 1) finished = !script_escape_pressed();
+        }
+        ms -= step;
+        if (finished && (script_escape_pressed() || task_cancelled())) finished = FALSE;
+    }
+    if (events[0] != NULL) BS->CloseEvent(events[0]);
+    return finished;
+}
+
+/* Run a builtin; arguments start at args[0], which receives the result */
+BOOLEAN script_native(SCRIPT *s, UINTN id, INT64 *args, UINTN argc) {
+    CHAR16 *a = SCRIPT_TEXT(args[0]);
+    CHAR16 *b = argc > 1 ? SCRIPT_TEXT(args[1]) : NULL;
+    CHAR16 *text;
+    EFI_INPUT_KEY key;
+
+    switch (id) {
+    case SCRIPT_BI_PRINT:
+        if (!script_format(s, a, args + 1)) return FALSE;
+        script_print(s->out, s->out_len);
+        args[0] = 0;
+        break;
+
+    case SCRIPT_BI_MSTRPRINT:
+        if (!script_format(s, a, args + 1)) return FALSE;
+        text = script_copy_string(s, s->out, s->out_len);
+        if (text == NULL) return FALSE;
+        args[0] = SCRIPT_VALUE(text);
+        break;
+
+    case SCRIPT_BI_STRLEN:
+        args[0] = SCRIPT_LENGTH(a);
+        break;
+
+    case SCRIPT_BI_STRCMP: {
+        INTN order = StrCmp(a, b);
+        args[0] = order < 0 ? -1 : order > 0 ? 1 : 0;
+        break;
+    }
+
+    case SCRIPT_BI_STRSUB: {
+        /* StrSub(s, start, count), clamped to the string */
+        INT64 len = SCRIPT_LENGTH(a);
+        INT64 start = args[1] < 0 ? 0 : args[1] > len ? len : args[1];
+        INT64 count = args[2] < 0 ? 0 : args[2] > len - start ? len - start : args[2];
+        text = script_copy_string(s, a + start, (UINTN)count);
+        if (text == NULL) return FALSE;
+        args[0] = SCRIPT_VALUE(text);
+        break;
+    }
+
+    case SCRIPT_BI_STRFIND: {
+        UINTN len = SCRIPT_LENGTH(a);
+        UINTN need = SCRIPT_LENGTH(b);
+        args[0] = -1;
+        for (UINTN i = 0; need <= len && i <= len - need; i++) {
+            if (StrnCmp(a + i, b, need) == 0) {
+                args[0] = (INT64)i;
+                break;
+            }
+        }
+        break;
+    }
+
+    case SCRIPT_BI_STR2I64: {
+        /* Optional sign, then decimal or 0x hex digits up to the first other character */
+        UINT64 value = 0;
+        BOOLEAN neg = FALSE;
+        UINTN base = 10;
+        while (*a == L' ') a++;
+        if (*a == L'-' || *a == L'+') neg = *a++ == L'-';
+        if (a[0] == L'0' && (a[1] == L'x' || a[1] == L'X')) {
+            base = 16;
+            a += 2;
+        }
+        for (;; a++) {
+            UINTN digit;
+            if (*a >= L'0' && *a <= L'9') digit = *a - L'0';
+            else if (base == 16 && *a >= L'a' && *a <= L'f') digit = *a - L'a' + 10;
+            else if (base == 16 && *a >= L'A' && *a <= L'F') digit = *a - L'A' + 10;
+            else break;
+            value = value * base + digit;
+        }
+        args[0] = neg ? (INT64)(0 - value) : (INT64)value;
+        break;
+    }
+
+    case SCRIPT_BI_GETKEY:
+        args[0] = script_key_code(read_key());
+        break;
+
+    case SCRIPT_BI_SCANKEY:
+        args[0] = 0;
+        if (!EFI_ERROR(BS->CheckEvent(ConIn->WaitForKey)) && !EFI_ERROR(ConIn->ReadKeyStroke(ConIn, &key))) {
+            args[0] = script_key_code(key);
+        }
+        break;
+
+    case SCRIPT_BI_CLS:
+        clear_screen();
+        args[0] = 0;
+        break;
+
+    case SCRIPT_BI_SETCURSOR:
+        if (args[0] < 0 || args[0] >= SCREEN_WIDTH || args[1] < 0 || args[1] >= SCREEN_HEIGHT) {
+            script_error(s, L"Cursor position off screen");
+            return FALSE;
+        }
+        set_cursor((UINTN)args[0], (UINTN)args[1]);
+        args[0] = 0;
+        break;
+
+    case SCRIPT_BI_SETCOLOR:
+        ConOut->SetAttribute(ConOut, (UINTN)(args[0] & 0x7F));
+        args[0] = 0;
+        break;
+
+    case SCRIPT_BI_DRAWWINDOW:
+        if (args[0] < 0 || args[1] < 0 || args[2] < 2 || args[3] < 2 ||
+            args[0] + args[2] > SCREEN_WIDTH || args[1] + args[3] > SCREEN_HEIGHT ||
+            SCRIPT_LENGTH(SCRIPT_TEXT(args[4])) > (UINTN)args[2]) {
+            script_error(s, L"Window does not fit on the screen");
+            return FALSE;
+        }
+        draw_window((UINTN)args[0], (UINTN)args[1], (UINTN)args[2], (UINTN)args[3],
+                    SCRIPT_LENGTH(SCRIPT_TEXT(args[4])) ? SCRIPT_TEXT(args[4]) : NULL);
+        args[0] = 0;
+        break;
+
+    case SCRIPT_BI_SLEEP:
+        if (args[0] > 0 && !script_sleep((UINT64)(args[0] > 1000000 ? 1000000 : args[0]))) {
+            script_error(s, L"Stopped by ESC");
+            return FALSE;
+        }
+        args[0] = 0;
+        break;
+
+    case SCRIPT_BI_FILEREAD: {
+        UINTN len;
+        if (EFI_ERROR(read_text_file(a, SCRIPT_MAX_STRING * sizeof(CHAR16), &text, &len))) {
+            args[0] = SCRIPT_VALUE(s->empty);
+            break;
+        }
+        args[0] = SCRIPT_VALUE(script_copy_string(s, text, len));
+        BS->FreePool(text);
+        if (args[0] == 0) return FALSE;
+        break;
+    }
+
+    case SCRIPT_BI_FILEWRITE:
+        args[0] = !EFI_ERROR(write_text_file(a, b, SCRIPT_LENGTH(b)));
+        break;
+
+    case SCRIPT_BI_CALC:
+    case SCRIPT_BI_CALCDEC: {
+        UINTN digits = 0;
+        CALC_ERROR error;
+        if (id == SCRIPT_BI_CALCDEC) {
+            digits = args[1] < 1 ? 1 : args[1] > CALC_MAX_DIGITS ? CALC_MAX_DIGITS : (UINTN)args[1];
+        }
+        error = SCRIPT_LENGTH(a) >= CALC_MAX_INPUT ? CALC_ERR_TOO_LONG : calc_evaluate_text(a, digits, &text);
+        if (error != CALC_OK) {
+            s->out_len = 0;
+            if (!script_out(s, L"Error: ", 7)) return FALSE;
+            text = calc_error_text(error);
+            if (error == CALC_DEFINED) s->out_len = 0;
+            if (!script_out(s, text, StrLen(text))) return FALSE;
+            text = s->out;
+        }
+        text = script_copy_string(s, text, StrLen(text));
+        if (text == NULL) return FALSE;
+        args[0] = SCRIPT_VALUE(text);
+        break;
+    }
+
+    case SCRIPT_BI_RAND:
+        /* xorshift64 */
+        s->rand_state ^= s->rand_state << 13;
+        s->rand_state ^= s->rand_state >> 7;
+        s->rand_state ^= s->rand_state << 17;
+        args[0] = (INT64)(s->rand_state >> 1);
+        break;
+    }
+    return TRUE;
+}
+
+/* Execute compiled code from the top level; FALSE with s->error set on a run-time error */
+BOOLEAN script_run(SCRIPT *s) {
+    /* Handler offsets from sop_mov, in SCRIPT_OPCODE order */
+    static CONST INT32 targets[SOP_COUNT] = {
+        &&sop_mov - &&sop_mov, &&sop_loadi - &&sop_mov, &&sop_loadk - &&sop_mov,
+        &&sop_getg - &&sop_mov, &&sop_setg - &&sop_mov,
+        &&sop_add - &&sop_mov, &&sop_sub - &&sop_mov, &&sop_mul - &&sop_mov,
+        &&sop_div - &&sop_mov, &&sop_mod - &&sop_mov, &&sop_and - &&sop_mov,
+        &&sop_or - &&sop_mov, &&sop_xor - &&sop_mov, &&sop_shl - &&sop_mov,
+        &&sop_shr - &&sop_mov, &&sop_addi - &&sop_mov,
+        &&sop_neg - &&sop_mov, &&sop_not - &&sop_mov, &&sop_bnot - &&sop_mov,
+        &&sop_eq - &&sop_mov, &&sop_ne - &&sop_mov, &&sop_lt - &&sop_mov, &&sop_le - &&sop_mov,
+        &&sop_concat - &&sop_mov, &&sop_streq - &&sop_mov, &&sop_index - &&sop_mov,
+        &&sop_jmp - &&sop_mov, &&sop_jz - &&sop_mov, &&sop_jnz - &&sop_mov,
+        &&sop_jeq - &&sop_mov, &&sop_jne - &&sop_mov, &&sop_jlt - &&sop_mov, &&sop_jle - &&sop_mov,
+        &&sop_jeqk - &&sop_mov, &&sop_jnek - &&sop_mov, &&sop_jltk - &&sop_mov,
+        &&sop_jgek - &&sop_mov, &&sop_jlek - &&sop_mov, &&sop_jgtk - &&sop_mov,
+        &&sop_call - &&sop_mov, &&sop_native - &&sop_mov, &&sop_ret - &&sop_mov
+    };
+    UINT32 *code = s->code;
+    INT64 *k = s->consts;
+    INT64 *g = s->globals;
+    INT64 *r = s->stack;
+    UINTN pc = 0;
+    UINTN frame_count = 0;
+    UINT32 ticks = 0;
+    UINT32 ins;
+    INT64 quot, rem;
+    CHAR16 *message;
+
+#define SCRIPT_A  ((ins >> 8) & 0xFF)
+#define SCRIPT_B  ((ins >> 16) & 0xFF)
+#define SCRIPT_C  (ins >> 24)
+#define SCRIPT_BX (ins >> 16)
+#define SCRIPT_NEXT() do { ins = code[pc++]; goto *(&&sop_mov + targets[ins & 0xFF]); } while (0)
+#define SCRIPT_BRANCH(cond) do {                                                        \
+        if (cond) {                                                                     \
+            pc = code[pc];                                                              \
+            if ((++ticks & SCRIPT_POLL_MASK) == 0 && script_escape_pressed()) goto stopped; \
+        } else {                                                                        \
+            pc++;                                                                       \
+        }                                                                               \
+        SCRIPT_NEXT();                                                                  \
+    } while (0)
+
+    SCRIPT_NEXT();
+
+sop_mov:    r[SCRIPT_A] = r[SCRIPT_B]; SCRIPT_NEXT();
+sop_loadi:  r[SCRIPT_A] = (INT16)SCRIPT_BX; SCRIPT_NEXT();
+sop_loadk:  r[SCRIPT_A] = k[SCRIPT_BX]; SCRIPT_NEXT();
+sop_getg:   r[SCRIPT_A] = g[SCRIPT_BX]; SCRIPT_NEXT();
+sop_setg:   g[SCRIPT_BX] = r[SCRIPT_A]; SCRIPT_NEXT();
+sop_add:    r[SCRIPT_A] = (INT64)((UINT64)r[SCRIPT_B] + (UINT64)r[SCRIPT_C]); SCRIPT_NEXT();
+sop_sub:    r[SCRIPT_A] = (INT64)((UINT64)r[SCRIPT_B] - (UINT64)r[SCRIPT_C]); SCRIPT_NEXT();
+sop_mul:    r[SCRIPT_A] = (INT64)((UINT64)r[SCRIPT_B] * (UINT64)r[SCRIPT_C]); SCRIPT_NEXT();
+sop_div:
+    if (!script_divide(r[SCRIPT_B], r[SCRIPT_C], &quot, &rem)) goto div_zero;
+    r[SCRIPT_A] = quot;
+    SCRIPT_NEXT();
+sop_mod:
+    if (!script_divide(r[SCRIPT_B], r[SCRIPT_C], &quot, &rem)) goto div_zero;
+    r[SCRIPT_A] = rem;
+    SCRIPT_NEXT();
+sop_and:    r[SCRIPT_A] = r[SCRIPT_B] & r[SCRIPT_C]; SCRIPT_NEXT();
+sop_or:     r[SCRIPT_A] = r[SCRIPT_B] | r[SCRIPT_C]; SCRIPT_NEXT();
+sop_xor:    r[SCRIPT_A] = r[SCRIPT_B] ^ r[SCRIPT_C]; SCRIPT_NEXT();
+sop_shl:    r[SCRIPT_A] = (INT64)((UINT64)r[SCRIPT_B] << (r[SCRIPT_C] & 63)); SCRIPT_NEXT();
+sop_shr:    r[SCRIPT_A] = r[SCRIPT_B] >> (r[SCRIPT_C] & 63); SCRIPT_NEXT();
+sop_addi:   r[SCRIPT_A] = (INT64)((UINT64)r[SCRIPT_B] + (UINT64)(INT64)(INT8)SCRIPT_C); SCRIPT_NEXT();
+sop_neg:    r[SCRIPT_A] = (INT64)(0 - (UINT64)r[SCRIPT_B]); SCRIPT_NEXT();
+sop_not:    r[SCRIPT_A] = r[SCRIPT_B] == 0; SCRIPT_NEXT();
+sop_bnot:   r[SCRIPT_A] = ~r[SCRIPT_B]; SCRIPT_NEXT();
+sop_eq:     r[SCRIPT_A] = r[SCRIPT_B] == r[SCRIPT_C]; SCRIPT_NEXT();
+sop_ne:     r[SCRIPT_A] = r[SCRIPT_B] != r[SCRIPT_C]; SCRIPT_NEXT();
+sop_lt:     r[SCRIPT_A] = r[SCRIPT_B] < r[SCRIPT_C]; SCRIPT_NEXT();
+sop_le:     r[SCRIPT_A] = r[SCRIPT_B] <= r[SCRIPT_C]; SCRIPT_NEXT();
+sop_concat: {
+        CHAR16 *left = SCRIPT_TEXT(r[SCRIPT_B]);
+        CHAR16 *right = SCRIPT_TEXT(r[SCRIPT_C]);
+        UINTN left_len = SCRIPT_LENGTH(left);
+        UINTN right_len = SCRIPT_LENGTH(right);
+        CHAR16 *text;
+
+        /* An allocation failure is reported at once, so it needs this line */
+        s->tok.tok_line = s->lines[pc - 1];
+        text = script_new_string(s, left_len + right_len);
+        if (text == NULL) goto failed;
+        CopyMem(text, left, left_len * sizeof(CHAR16));
+        CopyMem(text + left_len, right, right_len * sizeof(CHAR16));
+        r[SCRIPT_A] = SCRIPT_VALUE(text);
+        SCRIPT_NEXT();
+    }
+sop_streq: {
+        CHAR16 *left = SCRIPT_TEXT(r[SCRIPT_B]);
+        CHAR16 *right = SCRIPT_TEXT(r[SCRIPT_C]);
+        r[SCRIPT_A] = SCRIPT_LENGTH(left) == SCRIPT_LENGTH(right) && StrCmp(left, right) == 0;
+        SCRIPT_NEXT();
+    }
+sop_index: {
+        CHAR16 *text = SCRIPT_TEXT(r[SCRIPT_B]);
+        INT64 i = r[SCRIPT_C];
+
+        if (i < 0 || i >= SCRIPT_LENGTH(text)) {
+            message = L"String index out of range";
+            goto error;
+        }
+        r[SCRIPT_A] = text[i];
+        SCRIPT_NEXT();
+    }
+sop_jmp:    SCRIPT_BRANCH(TRUE);
+sop_jz:     SCRIPT_BRANCH(r[SCRIPT_A] == 0);
+sop_jnz:    SCRIPT_BRANCH(r[SCRIPT_A] != 0);
+sop_jeq:    SCRIPT_BRANCH(r[SCRIPT_A] == r[SCRIPT_B]);
+sop_jne:    SCRIPT_BRANCH(r[SCRIPT_A] != r[SCRIPT_B]);
+sop_jlt:    SCRIPT_BRANCH(r[SCRIPT_A] < r[SCRIPT_B]);
+sop_jle:    SCRIPT_BRANCH(r[SCRIPT_A] <= r[SCRIPT_B]);
+sop_jeqk:   SCRIPT_BRANCH(r[SCRIPT_A] == k[SCRIPT_BX]);
+sop_jnek:   SCRIPT_BRANCH(r[SCRIPT_A] != k[SCRIPT_BX]);
+sop_jltk:   SCRIPT_BRANCH(r[SCRIPT_A] < k[SCRIPT_BX]);
+sop_jgek:   SCRIPT_BRANCH(r[SCRIPT_A] >= k[SCRIPT_BX]);
+sop_jlek:   SCRIPT_BRANCH(r[SCRIPT_A] <= k[SCRIPT_BX]);
+sop_jgtk:   SCRIPT_BRANCH(r[SCRIPT_A] > k[SCRIPT_BX]);
+sop_call: {
+        SCRIPT_FUNC *f = &s->funcs[SCRIPT_B];
+        UINTN base = (UINTN)(r - s->stack);
+
+        if (frame_count == SCRIPT_MAX_FRAMES || base + SCRIPT_A + f->reg_count > SCRIPT_STACK_REGS) {
+            message = L"Stack overflow (recursion too deep)";
+            goto error;
+        }
+        s->frames[frame_count].ret_pc = (UINT32)pc;
+        s->frames[frame_count].base = (UINT32)base;
+        frame_count++;
+        r += SCRIPT_A;
+        pc = f->entry;
+        SCRIPT_NEXT();
+    }
+sop_native:
+    s->tok.tok_line = s->lines[pc - 1];
+    if (!script_native(s, SCRIPT_B, r + SCRIPT_A, SCRIPT_C)) goto failed;
+    SCRIPT_NEXT();
+sop_ret:
+    if (frame_count == 0) return TRUE;
+    r[0] = r[SCRIPT_A];
+    frame_count--;
+    pc = s->frames[frame_count].ret_pc;
+    r = s->stack + s->frames[frame_count].base;
+    SCRIPT_NEXT();
+
+div_zero:
+    message = L"Division by zero";
+    goto error;
+stopped:
+    message = L"Stopped by ESC";
+error:
+    s->tok.tok_line = s->lines[pc - 1];
+    script_error(s, message);
+failed:
+    return FALSE;
+
+#undef SCRIPT_A
+#undef SCRIPT_B
+#undef SCRIPT_C
+#undef SCRIPT_BX
+#undef SCRIPT_NEXT
+#undef SCRIPT_BRANCH
+}
+
+/* Release everything a script allocated */
+VOID script_free(SCRIPT *s) {
+    while (s->heap != NULL) {
+        SCRIPT_CHUNK *next = s->heap->next;
+        BS->FreePool(s->heap);
+        s->heap = next;
+    }
+    if (s->out != NULL) BS->FreePool(s->out);
+    if (s->stack != NULL) BS->FreePool(s->stack);
+    if (s->lines != NULL) BS->FreePool(s->lines);
+    if (s->code != NULL) BS->FreePool(s->code);
+    BS->FreePool(s);
+}
+
+/* Load, compile and run a script file; message receives the outcome */
+BOOLEAN script_execute(CHAR16 *filename, CHAR16 *message, UINTN message_size) {
+    SCRIPT *s;
+    CHAR16 *source;
+    UINTN len;
+    EFI_TIME time;
+    BOOLEAN ok;
+    EFI_STATUS status;
+
+    status = read_text_file(filename, SCRIPT_MAX_SOURCE, &source, &len);
+    if (EFI_ERROR(status)) {
+        SPrint(message, message_size, L"Cannot read %s: %r", filename, status);
+        return FALSE;
+    }
+    if (EFI_ERROR(BS->AllocatePool(EfiLoaderData, sizeof(SCRIPT), (VOID **)&s))) {
+        BS->FreePool(source);
+        SPrint(message, message_size, L"Out of memory");
+        return FALSE;
+    }
+    SetMem(s, sizeof(SCRIPT), 0);
+    if (EFI_ERROR(BS->AllocatePool(EfiLoaderData, SCRIPT_MAX_CODE * sizeof(UINT32), (VOID **)&s->code)) ||
+        EFI_ERROR(BS->AllocatePool(EfiLoaderData, SCRIPT_MAX_CODE * sizeof(UINT32), (VOID **)&s->lines)) ||
+        EFI_ERROR(BS->AllocatePool(EfiLoaderData, SCRIPT_STACK_REGS * sizeof(INT64), (VOID **)&s->stack))) {
+        script_free(s);
+        BS->FreePool(source);
+        SPrint(message, message_size, L"Out of memory");
+        return FALSE;
+    }
+
+    ST->RuntimeServices->GetTime(&time, NULL);
+    s->rand_state = 0x9E3779B97F4A7C15ULL ^ ((UINT64)time.Nanosecond << 20) ^
+                    (time.Second + 60 * (time.Minute + 60 * (UINT64)time.Hour));
+
+    ok = script_compile(s, source);
+    BS->FreePool(source);
+    if (ok) {
+        clear_screen();
+        ok = script_run(s);
+    }
+    if (ok) {
+        SPrint(message, message_size, L"Finished: %s", filename);
+    } else {
+        SPrint(message, message_size, L"%s", s->error);
+    }
+    script_free(s);
+    return ok;
+}
+
+/* Script application: run a script file from the boot volume */
+VOID app_script(VOID) {
+    EFI_INPUT_KEY key;
+    BOOLEAN running = TRUE;
+    BOOLEAN redraw = TRUE;
+    CHAR16 filename[SCRIPT_MAX_PATH];
+    CHAR16 message[128];
+    UINTN len;
+
+    StrCpy(filename, SCRIPT_DEFAULT_FILE);
+    len = StrLen(filename);
+    message[0] = 0;
+
+    while (running) {
+        if (redraw) {
+            clear_screen();
+            draw_topbar();
+            draw_window(5, 2, 70, 21, L" Script ");
+            set_cursor(7, 4);
+            ConOut->OutputString(ConOut, L"HolyC-style script file on the boot volume:");
+            set_cursor(7, 18);
+            ConOut->OutputString(ConOut, message);
+            set_cursor(7, 20);
+            ConOut->OutputString(ConOut, L"ENTER=Run  ESC=Exit (ESC also stops a running script)");
+            redraw = FALSE;
+        }
+        set_cursor(7, 6);
+        ConOut->OutputString(ConOut, L"> ");
+        ConOut->OutputString(ConOut, filename);
+        ConOut->OutputString(ConOut, L" ");
+        set_cursor(9 + len, 6);
+
+        key = read_key();
+
+        if (key.ScanCode == SCAN_ESC) {
+            running = FALSE;
+        } else if (key.UnicodeChar == CHAR_CARRIAGE_RETURN && len > 0) {
+            /* The script owns the screen until it ends; then wait so its output can be read */
+            BOOLEAN ok = script_execute(filename, message, sizeof(message));
+            ConOut->SetAttribute(ConOut, COLOR_NORMAL);
+            ConOut->OutputString(ConOut, ok ? L"\r\n-- Finished, press a key --" : L"\r\n-- Error, press a key --");
+            read_key();
+            redraw = TRUE;
+        } else if (key.UnicodeChar == CHAR_BACKSPACE) {
+            if (len > 0) filename[--len] = 0;
+        } else if (key.UnicodeChar >= 32 && key.UnicodeChar < 127 && len < SCRIPT_MAX_PATH - 1) {
+            filename[len++] = key.UnicodeChar;
+            filename[len] = 0;
+        }
+    }
+}
+
+/* Editor application */
+VOID app_editor(VOID) {
+    EFI_INPUT_KEY key;
+    BOOLEAN running = TRUE;
+    CHAR16 editor_buffer[MAX_LINES][MAX_LINE_LENGTH];
+    UINTN editor_lines = 1;
+    UINTN editor_cursor_line = 0;
+    UINTN editor_cursor_col = 0;
     
-    while (expr[i] != 0) {
-        if (expr[i] >= L'0' && expr[i] <= L'9') {
-            current_num = current_num * 10 + (expr[i] - L'0');
-        } else if (expr[i] == L'+' || expr[i] == L'-' || 
-                   expr[i] == L'*' || expr[i] == L'/') {
-            /* Apply previous operation */
-            if (op == L'+') result += current_num;
-            else if (op == L'-') result -= current_num;
-            else if (op == L'*') result *= current_num;
-            else if (op == L'/' && current_num != 0) result /= current_num;
-            
-            op = expr[i];
-            current_num = 0;
+    /* Try to load sample.txt */
+    EFI_STATUS status = load_from_file(L"\\sample.txt", editor_buffer, &editor_lines);
+    
+    if (EFI_ERROR(status)) {
+        /* Create default content */
+        StrCpy(editor_buffer[0], L"This is a sample file.");
+        StrCpy(editor_buffer[1], L"Edit this text and press F2 to save.");
+        editor_lines = 2;
+    }
+    
+    clear_screen();
+    draw_topbar();
+    draw_window(8, 2, 64, 20, L" Editor - sample.txt ");
+    
+    set_cursor(10, 21);
+    ConOut->OutputString(ConOut, L"F2=Save, F3=Reload, ESC=Exit");
+    
+    while (running) {
+        /* Display buffer */
+        for (UINTN i = 0; i < 18 && i < editor_lines; i++) {
+            set_cursor(10, 3 + i);
+            ConOut->OutputString(ConOut, L"                                                            ");
+            set_cursor(10, 3 + i);
+            ConOut->OutputString(ConOut, editor_buffer[i]);
+        }
+        
+        /* Show cursor */
+        set_cursor(10 + editor_cursor_col, 3 + editor_cursor_line);
+        
+        key = read_key();
+        
+        if (key.ScanCode == SCAN_ESC) {
+            running = FALSE;
+        } else if (key.ScanCode == SCAN_F2) {
+            /* Save file */
+            status = save_to_file(L"\\sample.txt", editor_buffer, editor_lines);
+            set_cursor(10, 21);
+            if (EFI_ERROR(status)) {
+                ConOut->OutputString(ConOut, L"Save failed (filesystem unavailable)");
+            } else {
+                ConOut->OutputString(ConOut, L"Saved to \\sample.txt            ");
+            }
+        } else if (key.ScanCode == SCAN_F3) {
+            /* Reload file */
+            load_from_file(L"\\sample.txt", editor_buffer, &editor_lines);
+            editor_cursor_line = 0;
+            editor_cursor_col = 0;
+        } else if (key.UnicodeChar == CHAR_BACKSPACE) {
+            if (editor_cursor_col > 0) {
+                editor_cursor_col--;
+                editor_buffer[editor_cursor_line][editor_cursor_col] = 0;
+            }
+        } else if (key.UnicodeChar == CHAR_CARRIAGE_RETURN) {
+            editor_buffer[editor_cursor_line][editor_cursor_col] = 0;
+            editor_cursor_line++;
+            editor_cursor_col = 0;
+            if (editor_cursor_line >= MAX_LINES) editor_cursor_line = MAX_LINES - 1;
+            if (editor_cursor_line >= editor_lines) editor_lines = editor_cursor_line + 1;
+        } else if (key.UnicodeChar >= 32 && key.UnicodeChar < 127) {
+            if (editor_cursor_col < MAX_LINE_LENGTH - 1) {
+                editor_buffer[editor_cursor_line][editor_cursor_col++] = key.UnicodeChar;
+                editor_buffer[editor_cursor_line][editor_cursor_col] = 0;
+                if (editor_cursor_line >= editor_lines) editor_lines = editor_cursor_line + 1;
+            }
+        }
+    }
+}
+
+/*
+ * Frame pacing
+ *
+ * Animations run off a periodic timer at the target frame rate. Its notify
+ * function counts periods and signals a plain event that the render loop
+ * sleeps on together with the keyboard, so the CPU idles between frames
+ * rather than spinning in Stall(). A loop that falls behind finds several
+ * periods waiting and advances its animation by all of them, drawing only
+ * the latest frame. The TSC is stamped on every period, which calibrates
+ * it against the timer so render time can be reported in milliseconds.
+ */
+#define FRAME_MIN_FPS 5
+#define FRAME_MAX_FPS 60
+
+typedef struct {
+    EFI_EVENT tick;                 /* Periodic timer, notify at TPL_CALLBACK */
+    EFI_EVENT wake;                 /* Signalled by every tick; waited on */
+    volatile UINT32 ticks;          /* Periods since the clock started */
+    volatile UINT64 tick_tsc;       /* TSC at the latest period */
+    UINTN fps;                      /* Target frame rate */
+    UINT32 seen;                    /* Periods already handed to the loop */
+    UINT32 window_ticks;            /* Start of the current ~1 s measurement */
+    UINT64 window_tsc;
+    UINT32 frames;                  /* Frames drawn in the window */
+    UINT64 busy;                    /* TSC cycles spent drawing them */
+    UINT64 render;                  /* The part of busy spent rendering */
+    UINT32 shown_fps;               /* Last measurement */
+    UINT32 shown_mfps;              /* The same in thousandths */
+    UINT32 shown_tenths;            /* Average frame time, 0.1 ms */
+    UINT32 shown_render_tenths;     /* Average rendering time, 0.1 ms */
+} FRAME_CLOCK;
+
+/* Read the time-stamp counter */
+UINT64 read_tsc(VOID) {
+    UINT32 lo, hi;
+    
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((UINT64)hi << 32) | lo;
+}
+
+/* Timer notify function: count the period and wake the render loop */
+VOID EFIAPI frame_clock_notify(EFI_EVENT event, VOID *context) {
+    FRAME_CLOCK *clock = (FRAME_CLOCK *)context;
+    
+    (VOID)event;
+    clock->tick_tsc = read_tsc();
+    clock->ticks++;
+    BS->SignalEvent(clock->wake);
+}
+
+/* Read the period count and its TSC stamp consistently */
+UINT32 frame_clock_now(FRAME_CLOCK *clock, UINT64 *tsc) {
+    EFI_TPL old_tpl = BS->RaiseTPL(TPL_CALLBACK);
+    UINT32 ticks = clock->ticks;
+    
+    *tsc = clock->tick_tsc;
+    BS->RestoreTPL(old_tpl);
+    return ticks;
+}
+
+/* Start (or restart at a new rate) a frame clock; on failure frame_clock_wait falls back to Stall */
+VOID frame_clock_start(FRAME_CLOCK *clock, UINTN fps) {
+    if (fps < FRAME_MIN_FPS) fps = FRAME_MIN_FPS;
+    if (fps > FRAME_MAX_FPS) fps = FRAME_MAX_FPS;
+    if (clock->tick != NULL) BS->SetTimer(clock->tick, TimerCancel, 0);
+    
+    clock->fps = fps;
+    clock->ticks = 0;
+    clock->seen = 0;
+    clock->tick_tsc = read_tsc();
+    clock->window_ticks = 0;
+    clock->window_tsc = clock->tick_tsc;
+    clock->frames = 0;
+    clock->busy = 0;
+    clock->render = 0;
+    
+    if (clock->wake == NULL && EFI_ERROR(BS->CreateEvent(0, 0, NULL, NULL, &clock->wake))) {
+        clock->wake = NULL;
+        return;
+    }
+    if (clock->tick == NULL &&
+        EFI_ERROR(BS->CreateEvent(EVT_TIMER | EVT_NOTIFY_SIGNAL, TPL_CALLBACK,
+                                  frame_clock_notify, clock, &clock->tick))) {
+        clock->tick = NULL;
+        return;
+    }
+    /* Timer periods are in 100 ns units */
+    BS->SetTimer(clock->tick, TimerPeriodic, 10000000 / fps);
+}
+
+/* Stop a frame clock and release its events */
+VOID frame_clock_stop(FRAME_CLOCK *clock) {
+    if (clock->tick != NULL) {
+        BS->SetTimer(clock->tick, TimerCancel, 0);
+        BS->CloseEvent(clock->tick);
+        clock->tick = NULL;
+    }
+    if (clock->wake != NULL) {
+        BS->CloseEvent(clock->wake);
+        clock->wake = NULL;
+    }
+}
+
+/*
+ * Let the other tasks run until the next frame is due or a key arrives.
+ * Returns the number of periods since the last frame (more than one when
+ * behind), or 0 with *key filled in. Keys are checked first so a loop
+ * that is always behind still responds; a task in the background never
+ * gets any.
+ */
+UINT32 frame_clock_wait(FRAME_CLOCK *clock, EFI_INPUT_KEY *key) {
+    EFI_EVENT events[2];
+    UINT32 ticks, periods;
+    UINT64 tsc;
+    
+    if (task_has_focus() && !EFI_ERROR(BS->CheckEvent(ConIn->WaitForKey)) &&
+        !EFI_ERROR(ConIn->ReadKeyStroke(ConIn, key))) {
+        return 0;
+    }
+    if (clock->tick == NULL) {
+        BS->Stall(1000000 / clock->fps);
+        return 1;
+    }
+    
+    events[0] = clock->wake;
+    events[1] = ConIn->WaitForKey;
+    while ((ticks = frame_clock_now(clock, &tsc)) == clock->seen) {
+        if (task_wait(2, events) == 1 && !EFI_ERROR(ConIn->ReadKeyStroke(ConIn, key))) {
+            return 0;
+        }
+    }
+    periods = ticks - clock->seen;
+    clock->seen = ticks;
+    return periods;
+}
+
+/*
+ * Account for one drawn frame that took busy_cycles, render_cycles of
+ * them producing the image; TRUE when about a second has passed and the
+ * shown_ values are new.
+ */
+BOOLEAN frame_clock_account(FRAME_CLOCK *clock, UINT64 busy_cycles, UINT64 render_cycles) {
+    UINT64 tsc;
+    UINT32 ticks = frame_clock_now(clock, &tsc);
+    UINT32 elapsed = ticks - clock->window_ticks;
+    UINT64 cycles_per_tick;
+    
+    clock->frames++;
+    clock->busy += busy_cycles;
+    clock->render += render_cycles;
+    if (clock->tick == NULL || elapsed < clock->fps) return FALSE;
+    
+    clock->shown_mfps = (UINT32)calc_udiv64((UINT64)clock->frames * clock->fps * 1000, elapsed, NULL);
+    clock->shown_fps = (clock->shown_mfps + 500) / 1000;
+    cycles_per_tick = calc_udiv64(tsc - clock->window_tsc, elapsed, NULL);
+    if (cycles_per_tick != 0) {
+        clock->shown_tenths = (UINT32)calc_udiv64(clock->busy * 10000,
+                                                  cycles_per_tick * clock->frames * clock->fps, NULL);
+        clock->shown_render_tenths = (UINT32)calc_udiv64(clock->render * 10000,
+                                                         cycles_per_tick * clock->frames * clock->fps, NULL);
+    }
+    
+    clock->window_ticks = ticks;
+    clock->window_tsc = tsc;
+    clock->frames = 0;
+    clock->busy = 0;
+    clock->render = 0;
+    return TRUE;
+}
+
+/*
+ * Demo host
+ *
+ * The demos (donut, plasma, fire, starfield, matrix rain) are effects
+ * behind one interface: open sets up an effect's state for a grid,
+ * update advances it by dt milliseconds, render fills the grid with a
+ * shade per cell (0 is background) and close releases the state. The
+ * grid is either the text window or the GOP frame buffer at its native
+ * resolution, and everything apart from rendering is shared: the frame
+ * clock, mapping shades through the effect's character ramp or colour
+ * palette, writing only the changed text cells or blitting a back
+ * buffer, and timing. Update and render are timed apart from presenting,
+ * so the status line compares the effects as rendering benchmarks.
+ */
+#define DEMO_LEFT         6                 /* Interior of the demo window */
+#define DEMO_TOP          3
+#define DEMO_COLS         68
+#define DEMO_ROWS         18                /* The row below holds the key help */
+#define DEMO_BACK_LEFT    56                /* Interior of the window a demo keeps in the background */
+#define DEMO_BACK_TOP     13
+#define DEMO_BACK_COLS    22
+#define DEMO_BACK_ROWS    8
+#define DEMO_MAX_PIXELS   2048              /* Largest frame buffer side rendered */
+#define DEMO_RUN_GAP      4                 /* Unchanged cells worth rewriting to save a cursor move */
+#define DEMO_DEFAULT_FPS  30
+
+/* Where effects draw: the text window or the frame buffer */
+typedef struct {
+    UINTN cols, rows;                   /* Cells or pixels */
+    UINTN left, top;                    /* Text: where the cells go on screen */
+    BOOLEAN background;                 /* Text: the small window, kept out of the focus's way */
+    UINT32 generation;                  /* Text: screen_generation when the window was last drawn */
+    UINT8 *shade;                       /* The frame being rendered; 0 is background */
+    CHAR16 *shown;                      /* Text: what the window holds now */
+    EFI_GRAPHICS_OUTPUT_PROTOCOL *gop;  /* Graphics: NULL in text mode */
+    EFI_GRAPHICS_OUTPUT_BLT_PIXEL *frame;
+    UINTN ap_count;                     /* Job workers effects may share a frame with */
+} DEMO_GRID;
+
+/* One effect; open returns its state, or NULL when memory is short */
+typedef struct {
+    CHAR16 *name;
+    CHAR16 *ramp;                                   /* Text: characters for shades 1-255, dimmest first */
+    UINT8 stops[3][3];                              /* Graphics: RGB at shades 1, 128 and 255 */
+    VOID *(*open)(DEMO_GRID *grid);
+    VOID (*update)(VOID *state, UINT32 dt);         /* Advance by dt milliseconds */
+    VOID (*render)(VOID *state, DEMO_GRID *grid);
+    VOID (*close)(VOID *state);
+} DEMO_EFFECT;
+
+CHAR16 demo_glyphs[256];
+EFI_GRAPHICS_OUTPUT_BLT_PIXEL demo_palette[256];
+UINT32 demo_bench_seed = 0;             /* Non-zero: the seed every effect gets, for repeatable runs */
+
+/* Pool memory for a grid or an effect, or NULL */
+VOID *demo_alloc(UINTN bytes) {
+    VOID *memory;
+
+    if (EFI_ERROR(BS->AllocatePool(EfiLoaderData, bytes, &memory))) return NULL;
+    return memory;
+}
+
+/* Next value of a xorshift generator; the seed must not be 0 */
+UINT32 demo_random(UINT32 *seed) {
+    UINT32 x = *seed;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *seed = x;
+    return x;
+}
+
+/* A generator seed that differs from run to run, unless a benchmark has fixed it */
+UINT32 demo_seed(VOID) {
+    if (demo_bench_seed != 0) return demo_bench_seed;
+    return (UINT32)read_tsc() | 1;
+}
+
+/* Release everything a grid holds */
+VOID demo_grid_close(DEMO_GRID *grid) {
+    if (grid->shade != NULL) BS->FreePool(grid->shade);
+    if (grid->shown != NULL) BS->FreePool(grid->shown);
+    if (grid->frame != NULL) BS->FreePool(grid->frame);
+    SetMem(grid, sizeof(*grid), 0);
+}
+
+/*
+ * Set up the text window grid, or with graphics the frame buffer above
+ * the bottom two text rows. FALSE (and nothing held) when there is no
+ * GOP or not enough memory.
+ */
+BOOLEAN demo_grid_open(DEMO_GRID *grid, BOOLEAN graphics, UINTN ap_count) {
+    UINTN cells;
+
+    SetMem(grid, sizeof(*grid), 0);
+    grid->ap_count = ap_count;
+    if (graphics) {
+        EFI_GRAPHICS_OUTPUT_MODE_INFORMATION *info;
+
+        grid->gop = locate_gop();
+        if (grid->gop == NULL) return FALSE;
+        info = grid->gop->Mode->Info;
+        grid->cols = info->HorizontalResolution < DEMO_MAX_PIXELS ? info->HorizontalResolution : DEMO_MAX_PIXELS;
+        grid->rows = info->VerticalResolution - info->VerticalResolution * 2 / SCREEN_HEIGHT;
+        if (grid->rows > DEMO_MAX_PIXELS) grid->rows = DEMO_MAX_PIXELS;
+    } else {
+        grid->cols = DEMO_COLS;
+        grid->rows = DEMO_ROWS;
+        grid->left = DEMO_LEFT;
+        grid->top = DEMO_TOP;
+    }
+    cells = grid->cols * grid->rows;
+
+    grid->shade = demo_alloc(cells * sizeof(UINT8));
+    if (graphics) {
+        grid->frame = demo_alloc(cells * sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL));
+    } else {
+        grid->shown = demo_alloc(cells * sizeof(CHAR16));
+    }
+    if (grid->shade == NULL || (grid->frame == NULL && grid->shown == NULL)) {
+        demo_grid_close(grid);
+        return FALSE;
+    }
+    SetMem(grid->shade, cells, 0);
+    return TRUE;
+}
+
+/*
+ * Set up the small text window a demo keeps animating in once it has
+ * stepped into the background. It keeps the full window's buffers.
+ */
+BOOLEAN demo_grid_open_background(DEMO_GRID *grid, UINTN ap_count) {
+    if (!demo_grid_open(grid, FALSE, ap_count)) return FALSE;
+    grid->cols = DEMO_BACK_COLS;
+    grid->rows = DEMO_BACK_ROWS;
+    grid->left = DEMO_BACK_LEFT;
+    grid->top = DEMO_BACK_TOP;
+    grid->background = TRUE;
+    grid->generation = screen_generation - 1;
+    return TRUE;
+}
+
+/*
+ * Move an effect onto a newly opened grid. The old state goes first so
+ * the new one has its memory; when the effect does not fit it goes back
+ * on the old grid. Returns whether it moved; *state is NULL when the
+ * effect fits on neither.
+ */
+BOOLEAN demo_move(DEMO_GRID *grid, DEMO_GRID *next, DEMO_EFFECT *effect, VOID **state) {
+    effect->close(*state);
+    *state = effect->open(next);
+    if (*state != NULL) {
+        demo_grid_close(grid);
+        *grid = *next;
+        return TRUE;
+    }
+    demo_grid_close(next);
+    *state = effect->open(grid);
+    return FALSE;
+}
+
+/* Shade lookups for an effect: its ramp for text, its colour stops for graphics; shade 0 stays blank */
+VOID demo_build_palette(DEMO_EFFECT *effect) {
+    UINTN ramp_len = StrLen(effect->ramp);
+
+    demo_glyphs[0] = L' ';
+    SetMem(&demo_palette[0], sizeof(demo_palette[0]), 0);
+    for (UINTN s = 1; s < 256; s++) {
+        UINTN seg = s < 128 ? 0 : 1;
+        UINTN f = s < 128 ? s - 1 : s - 128;     /* Position along the segment, out of len */
+        UINTN len = s < 128 ? 126 : 127;
+
+        demo_glyphs[s] = effect->ramp[(s - 1) * ramp_len / 255];
+        demo_palette[s].Red = (UINT8)((effect->stops[seg][0] * (len - f) + effect->stops[seg + 1][0] * f) / len);
+        demo_palette[s].Green = (UINT8)((effect->stops[seg][1] * (len - f) + effect->stops[seg + 1][1] * f) / len);
+        demo_palette[s].Blue = (UINT8)((effect->stops[seg][2] * (len - f) + effect->stops[seg + 1][2] * f) / len);
+        demo_palette[s].Reserved = 0;
+    }
+}
+
+/*
+ * Bring the window interior up to date with the rendered frame, writing
+ * only the cells that changed. Changes on a row separated by a few
+ * unchanged cells are sent as one string, which is cheaper than another
+ * cursor move. In the background, cells under the focus's windows are
+ * left alone.
+ */
+VOID demo_present_text(DEMO_GRID *grid) {
+    CHAR16 now[DEMO_COLS];
+    CHAR16 run[DEMO_COLS + 1];
+
+    for (UINTN row = 0; row < grid->rows; row++) {
+        CHAR16 *was = grid->shown + row * grid->cols;
+        UINTN col = 0;
+
+        for (UINTN k = 0; k < grid->cols; k++) {
+            now[k] = demo_glyphs[grid->shade[row * grid->cols + k]];
+            if (grid->background && task_obscured(grid->left + k, grid->top + row)) now[k] = was[k];
+        }
+        while (col < grid->cols) {
+            UINTN start = col, end = col + 1, gap = 0;
+
+            if (now[col] == was[col]) {
+                col++;
+                continue;
+            }
+            for (col = end; col < grid->cols && gap <= DEMO_RUN_GAP; col++) {
+                if (now[col] != was[col]) {
+                    end = col + 1;
+                    gap = 0;
+                } else {
+                    gap++;
+                }
+            }
+            for (UINTN k = start; k < end; k++) {
+                run[k - start] = now[k];
+                was[k] = now[k];
+            }
+            run[end - start] = 0;
+            set_cursor(grid->left + start, grid->top + row);
+            ConOut->OutputString(ConOut, run);
+            col = end;
+        }
+    }
+}
+
+/* Shade the rendered frame through the palette into the back buffer and show it */
+VOID demo_present_gop(DEMO_GRID *grid) {
+    UINTN cells = grid->cols * grid->rows;
+
+    for (UINTN o = 0; o < cells; o++) {
+        grid->frame[o] = demo_palette[grid->shade[o]];
+    }
+    grid->gop->Blt(grid->gop, grid->frame, EfiBltBufferToVideo, 0, 0, 0, 0, grid->cols, grid->rows, 0);
+}
+
+/*
+ * Donut renderer. Everything is integer fixed point (10.22), so it does
+ * not depend on the FPU/SSE state the firmware leaves behind. The torus
+ * is swept over theta_steps points around the tube and phi_steps around
+ * its axis; their sines and cosines are computed once per view, by
+ * repeatedly rotating through the step angle, so the points of a frame
+ * need no trigonometry. The two viewing angles advance by rotating their
+ * sine/cosine pairs. Each point costs one 32-bit division, for 1/depth,
+ * which doubles as the 16-bit z-buffer value; luminance is only worked
+ * out for points that pass the depth test.
+ *
+ * In the text window that is 68x18 cells and ~28,000 points; on the
+ * frame buffer the sampling density grows with the projection scale so
+ * neighbouring points stay about a pixel apart. The depth buffer belongs
+ * to the view; the demo grid receives a shade of 1-255 per lit cell.
+ *
+ * When the CPU has SSE2 and the firmware has enabled it, each ring of the
+ * torus is instead projected and lit four phi steps at a time in packed
+ * single precision (GCC vector extensions, so no intrinsics headers); the
+ * z-buffer test and shade store stay a scalar scatter. IA-32 firmware
+ * only promises a 4-byte aligned stack, so that function realigns its own.
+ *
+ * When the job system has workers parked on the APs, donut_render hands
+ * the frame to job_run_everywhere: the BSP and every worker that picks up
+ * the job while rings remain claim a private shade/z tile, then take
+ * rings one at a time from a shared counter until none are left, so a
+ * slow or busy worker costs nothing. The BSP renders a tile too. Only the
+ * tiles that received rings are merged by depth, in bands of rows
+ * spread over the processors with job_parallel_for.
+ */
+#define DONUT_SCALE_X     24                /* Text projection scale; cells are about twice as tall as wide */
+#define DONUT_SCALE_Y     12
+#define DONUT_TEXT_THETA  90                /* Text samples around the tube */
+#define DONUT_TEXT_PHI    314               /* Text samples around the axis */
+#define DONUT_MAX_TILES   32                /* Processors beyond this sit the frame out */
+#define DONUT_MERGE_BAND  16                /* Fewest rows worth a merge job of their own */
+#define DONUT_SHADE_SCALE 180               /* Luminance (at most sqrt 2) to a 0-255 shade */
+#define DONUT_FRAC        22                /* Renderer fraction bits */
+#define DONUT_ONE         (1 << DONUT_FRAC)
+#define DONUT_TRIG_FRAC   30                /* Table generation and rotation */
+#define DONUT_TWO_PI      6746518852LL      /* 2pi in Q30 */
+#define DONUT_SPIN_A      858993459         /* 0.8 rad/s about the x axis, Q30 */
+#define DONUT_SPIN_B      429496730         /* 0.4 rad/s about the z axis, Q30 */
+
+/* Product of two 10.22 values */
+#define DONUT_MUL(a, b)   ((INT32)(((INT64)(a) * (b)) >> DONUT_FRAC))
+
+typedef float DONUT_V4SF __attribute__((vector_size(16)));
+typedef INT32 DONUT_V4SI __attribute__((vector_size(16)));
+
+/* One ring of the torus (fixed theta) under this frame's rotation, 10.22 */
+typedef struct {
+    INT32 h;                    /* Distance from the axis, cos theta + 2 */
+    INT32 h_sin_a, h_cos_a;
+    INT32 sin_t_cos_a, sin_t_sin_a;
+    INT32 cos_t_cos_a, cos_t_sin_a, cos_t_sin_b;
+    INT32 sin_b, cos_b;
+} DONUT_RING;
+
+/* The donut effect's state for one demo grid */
+typedef struct {
+    UINTN cols, rows;                   /* Cells or pixels */
+    INT32 scale_x, scale_y;             /* Projection scale */
+    UINTN theta_steps, phi_steps;
+    INT32 *sin_theta, *cos_theta;       /* 10.22 */
+    INT32 *sin_phi, *cos_phi;           /* 10.22, padded to whole SSE2 vectors */
+    float *sin_phi_f, *cos_phi_f;       /* The same for the SSE2 path */
+    EFI_PHYSICAL_ADDRESS tables;        /* Pages holding all of the above */
+    UINTN table_pages;
+    UINT8 *shade;                       /* The grid's shades, while rendering */
+    UINT16 *z;                          /* 0 means empty */
+    UINT32 tile_count;                  /* Private tiles, one per processor, when there are APs */
+    UINT8 *tile_shade;
+    UINT16 *tile_z;
+    INT32 sin_a, cos_a, sin_b, cos_b;   /* Viewing angles, Q30 */
+} DONUT_VIEW;
+
+/* One frame shared out among processors */
+typedef struct {
+    DONUT_VIEW *view;
+    INT32 sa, ca, sb, cb;               /* Viewing angles, 10.22 */
+    volatile UINT32 next_tile;
+    volatile UINT32 next_ring;
+    volatile UINT32 tiles_drawn;        /* Bit per tile that received at least one ring */
+    UINT32 tile_count;
+    UINT8 *shade;                       /* tile_count tiles of cols * rows */
+    UINT16 *z;
+    UINT32 merge[DONUT_MAX_TILES];      /* The drawn tiles, for the merge */
+    UINT32 merge_count;
+} DONUT_JOB;
+
+BOOLEAN donut_use_sse2 = FALSE;
+
+/* Product of two Q30 values */
+INT32 donut_mul_q30(INT32 a, INT32 b) {
+    return (INT32)(((INT64)a * b) >> DONUT_TRIG_FRAC);
+}
+
+/* sin and cos of a small Q30 angle from their Taylor series */
+VOID donut_sincos_small(INT32 x, INT32 *s, INT32 *c) {
+    INT32 x2 = donut_mul_q30(x, x);
+    INT32 x3 = donut_mul_q30(x2, x);
+    INT32 x4 = donut_mul_q30(x2, x2);
+
+    *s = x - x3 / 6 + donut_mul_q30(x3, x2) / 120;
+    *c = (1 << DONUT_TRIG_FRAC) - x2 / 2 + x4 / 24 - donut_mul_q30(x4, x2) / 720;
+}
+
+/* Advance the Q30 pair (s, c) = (sin a, cos a) to angle a + d, given sin d and cos d */
+VOID donut_rotate(INT32 *s, INT32 *c, INT32 sin_d, INT32 cos_d) {
+    INT64 next_s = ((INT64)*s * cos_d + (INT64)*c * sin_d) >> DONUT_TRIG_FRAC;
+    INT64 next_c = ((INT64)*c * cos_d - (INT64)*s * sin_d) >> DONUT_TRIG_FRAC;
+    /* One Newton step towards s^2 + c^2 = 1 stops rounding from drifting off the circle */
+    INT64 k = ((3LL << DONUT_TRIG_FRAC) - ((next_s * next_s + next_c * next_c) >> DONUT_TRIG_FRAC)) >> 1;
+
+    *s = (INT32)((next_s * k) >> DONUT_TRIG_FRAC);
+    *c = (INT32)((next_c * k) >> DONUT_TRIG_FRAC);
+}
+
+/* Fill 10.22 sin/cos tables for k * step, step being a Q30 angle */
+VOID donut_fill_table(INT32 *sin_table, INT32 *cos_table, UINTN steps, INT32 step) {
+    INT32 sin_d, cos_d;
+    INT32 s = 0, c = 1 << DONUT_TRIG_FRAC;
+    INT32 half = 1 << (DONUT_TRIG_FRAC - DONUT_FRAC - 1);
+
+    donut_sincos_small(step, &sin_d, &cos_d);
+    for (UINTN k = 0; k < steps; k++) {
+        sin_table[k] = (s + half) >> (DONUT_TRIG_FRAC - DONUT_FRAC);
+        cos_table[k] = (c + half) >> (DONUT_TRIG_FRAC - DONUT_FRAC);
+        donut_rotate(&s, &c, sin_d, cos_d);
+    }
+}
+
+/* TRUE when the CPU has SSE2 and the firmware has enabled SSE (CR4.OSFXSR) */
+BOOLEAN cpu_has_sse2(VOID) {
+    UINT32 eax = 1, ebx, ecx = 0, edx, cr4;
+
+    __asm__ volatile("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    if (!(edx & (1 << 26))) {
+        return FALSE;
+    }
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    return (cr4 & (1 << 9)) != 0;
+}
+
+/* Hoist the terms of ring j that do not depend on phi, for viewing angles sa/ca/sb/cb */
+VOID donut_ring_setup(DONUT_VIEW *view, DONUT_RING *ring, UINTN j, INT32 sa, INT32 ca, INT32 sb, INT32 cb) {
+    INT32 sin_t = view->sin_theta[j];
+    INT32 cos_t = view->cos_theta[j];
+
+    ring->h = cos_t + 2 * DONUT_ONE;
+    ring->h_sin_a = DONUT_MUL(ring->h, sa);
+    ring->h_cos_a = DONUT_MUL(ring->h, ca);
+    ring->sin_t_cos_a = DONUT_MUL(sin_t, ca);
+    ring->sin_t_sin_a = DONUT_MUL(sin_t, sa);
+    ring->cos_t_cos_a = DONUT_MUL(cos_t, ca);
+    ring->cos_t_sin_a = DONUT_MUL(cos_t, sa);
+    ring->cos_t_sin_b = DONUT_MUL(cos_t, sb);
+    ring->sin_b = sb;
+    ring->cos_b = cb;
+}
+
+/* Render one ring into shade/z with the integer path */
+VOID donut_ring(DONUT_VIEW *view, DONUT_RING *ring, UINT8 *shade, UINT16 *z) {
+    int cols = (int)view->cols, rows = (int)view->rows;
+
+    for (UINTN i = 0; i < view->phi_steps; i++) {
+        INT32 sin_p = view->sin_phi[i];
+        INT32 cos_p = view->cos_phi[i];
+        INT32 depth = DONUT_MUL(sin_p, ring->h_sin_a) + ring->sin_t_cos_a + 5 * DONUT_ONE;   /* 1 to 9 */
+        INT32 t = DONUT_MUL(sin_p, ring->h_cos_a) - ring->sin_t_sin_a;
+        INT32 ch = DONUT_MUL(cos_p, ring->h);
+        UINT32 D = 0xFFFFFFFFu / (UINT32)(depth >> 6);                                  /* 1/depth, 0.16 */
+        int x = cols / 2 + (int)(((INT64)(DONUT_MUL(ch, ring->cos_b) - DONUT_MUL(t, ring->sin_b)) *
+                                  (INT32)(view->scale_x * D)) >> (DONUT_FRAC + 16));
+        int y = rows / 2 + (int)(((INT64)(DONUT_MUL(ch, ring->sin_b) + DONUT_MUL(t, ring->cos_b)) *
+                                  (INT32)(view->scale_y * D)) >> (DONUT_FRAC + 16));
+        int o = x + cols * y;
+        if (y >= 0 && y < rows && x >= 0 && x < cols && D > z[o]) {
+            INT32 L = DONUT_MUL(ring->sin_t_sin_a - DONUT_MUL(sin_p, ring->cos_t_cos_a), ring->cos_b) -
+                      DONUT_MUL(sin_p, ring->cos_t_sin_a) - ring->sin_t_cos_a - DONUT_MUL(cos_p, ring->cos_t_sin_b);
+            INT32 s = (L * DONUT_SHADE_SCALE) >> DONUT_FRAC;
+            z[o] = (UINT16)D;
+            shade[o] = (UINT8)(s < 1 ? 1 : s > 255 ? 255 : s);
+        }
+    }
+}
+
+/* Convert an integer, or a 10.22 value, to a vector of four floats */
+#define DONUT_SPLAT_INT(v) __builtin_convertvector(((DONUT_V4SI){ (v), (v), (v), (v) }), DONUT_V4SF)
+#define DONUT_SPLAT(v)     (DONUT_SPLAT_INT(v) * (1.0f / DONUT_ONE))
+
+/* Float copy of a 10.22 table whose length is a multiple of four, for the SSE2 path */
+__attribute__((target("sse2"), force_align_arg_pointer))
+VOID donut_float_table(INT32 *table, float *copy, UINTN count) {
+    for (UINTN k = 0; k < count; k += 4) {
+        *(DONUT_V4SF *)&copy[k] = __builtin_convertvector(*(DONUT_V4SI *)&table[k], DONUT_V4SF) * (1.0f / DONUT_ONE);
+    }
+}
+
+/* Render one ring four phi steps at a time; only call when cpu_has_sse2() */
+__attribute__((target("sse2"), force_align_arg_pointer))
+VOID donut_ring_sse2(DONUT_VIEW *view, DONUT_RING *ring, UINT8 *shade, UINT16 *z) {
+    int cols = (int)view->cols, rows = (int)view->rows;
+    DONUT_V4SF center_x = DONUT_SPLAT_INT(cols / 2);
+    DONUT_V4SF center_y = DONUT_SPLAT_INT(rows / 2);
+    DONUT_V4SF scale_x = DONUT_SPLAT_INT(view->scale_x);
+    DONUT_V4SF scale_y = DONUT_SPLAT_INT(view->scale_y);
+    DONUT_V4SF h = DONUT_SPLAT(ring->h);
+    DONUT_V4SF h_sin_a = DONUT_SPLAT(ring->h_sin_a);
+    DONUT_V4SF h_cos_a = DONUT_SPLAT(ring->h_cos_a);
+    DONUT_V4SF sin_t_cos_a = DONUT_SPLAT(ring->sin_t_cos_a);
+    DONUT_V4SF sin_t_sin_a = DONUT_SPLAT(ring->sin_t_sin_a);
+    DONUT_V4SF cos_t_cos_a = DONUT_SPLAT(ring->cos_t_cos_a);
+    DONUT_V4SF cos_t_sin_a = DONUT_SPLAT(ring->cos_t_sin_a);
+    DONUT_V4SF cos_t_sin_b = DONUT_SPLAT(ring->cos_t_sin_b);
+    DONUT_V4SF sin_b = DONUT_SPLAT(ring->sin_b);
+    DONUT_V4SF cos_b = DONUT_SPLAT(ring->cos_b);
+
+    /* The padding lanes repeat phi = 0, which at worst redraws a point */
+    for (UINTN i = 0; i < view->phi_steps; i += 4) {
+        DONUT_V4SF sin_p = *(DONUT_V4SF *)&view->sin_phi_f[i];
+        DONUT_V4SF cos_p = *(DONUT_V4SF *)&view->cos_phi_f[i];
+        DONUT_V4SF D = 1.0f / (sin_p * h_sin_a + sin_t_cos_a + 5.0f);
+        DONUT_V4SF t = sin_p * h_cos_a - sin_t_sin_a;
+        DONUT_V4SF ch = cos_p * h;
+        DONUT_V4SI x = __builtin_convertvector(center_x + scale_x * D * (ch * cos_b - t * sin_b), DONUT_V4SI);
+        DONUT_V4SI y = __builtin_convertvector(center_y + scale_y * D * (ch * sin_b + t * cos_b), DONUT_V4SI);
+        DONUT_V4SI s = __builtin_convertvector((float)DONUT_SHADE_SCALE *
+                                               ((sin_t_sin_a - sin_p * cos_t_cos_a) * cos_b -
+                                                sin_p * cos_t_sin_a - sin_t_cos_a - cos_p * cos_t_sin_b),
+                                               DONUT_V4SI);
+        DONUT_V4SI zq = __builtin_convertvector(D * 65535.0f, DONUT_V4SI);
+
+        for (int k = 0; k < 4; k++) {
+            int o = x[k] + cols * y[k];
+            if (y[k] >= 0 && y[k] < rows && x[k] >= 0 && x[k] < cols && zq[k] > z[o]) {
+                z[o] = (UINT16)zq[k];
+                shade[o] = (UINT8)(s[k] < 1 ? 1 : s[k] > 255 ? 255 : s[k]);
+            }
+        }
+    }
+}
+
+/* Claim a tile and render rings into it until none are left; runs on the BSP and the job workers */
+VOID donut_worker(JOB_WORKER *worker, VOID *argument) {
+    DONUT_JOB *job = (DONUT_JOB *)argument;
+    DONUT_VIEW *view = job->view;
+    UINTN cells = view->cols * view->rows;
+    UINT32 tile;
+    UINT8 *shade;
+    UINT16 *z;
+    BOOLEAN sse2;
+    UINT32 j;
+
+    (VOID)worker;
+    /* A worker that turns up after the last ring was taken claims nothing */
+    if (job->next_ring >= view->theta_steps) return;
+    tile = __sync_fetch_and_add(&job->next_tile, 1);
+    if (tile >= job->tile_count) return;
+    /* Losing the race for the last ring leaves the tile uncleared and out of the merge */
+    j = __sync_fetch_and_add(&job->next_ring, 1);
+    if (j >= view->theta_steps) return;
+    shade = job->shade + tile * cells;
+    z = job->z + tile * cells;
+    for (UINTN i = 0; i < cells; i++) {
+        shade[i] = 0;
+        z[i] = 0;
+    }
+    __sync_fetch_and_or(&job->tiles_drawn, 1u << tile);
+
+    /* Firmware normally gives APs the BSP's CR4, but check rather than fault */
+    sse2 = donut_use_sse2 && cpu_has_sse2();
+    do {
+        DONUT_RING ring;
+        donut_ring_setup(view, &ring, j, job->sa, job->ca, job->sb, job->cb);
+        if (sse2) {
+            donut_ring_sse2(view, &ring, shade, z);
+        } else {
+            donut_ring(view, &ring, shade, z);
+        }
+    } while ((j = __sync_fetch_and_add(&job->next_ring, 1)) < view->theta_steps);
+}
+
+/* Merge rows [first, end) of the drawn tiles into the view, keeping the nearest point of each cell */
+VOID donut_merge_rows(VOID *data, UINTN first, UINTN end) {
+    DONUT_JOB *job = (DONUT_JOB *)data;
+    DONUT_VIEW *view = job->view;
+    UINTN cells = view->cols * view->rows;
+
+    for (UINTN o = first * view->cols; o < end * view->cols; o++) {
+        UINT16 nearest = 0;
+        UINT8 shade = 0;
+        for (UINT32 i = 0; i < job->merge_count; i++) {
+            UINTN t = job->merge[i] * cells + o;
+            if (job->z[t] > nearest) {
+                nearest = job->z[t];
+                shade = job->shade[t];
+            }
+        }
+        view->z[o] = nearest;
+        view->shade[o] = shade;
+    }
+}
+
+/* Merge the tiles that received rings into the view, in bands of rows spread over the processors */
+VOID donut_merge(DONUT_JOB *job) {
+    job->merge_count = 0;
+    for (UINT32 tile = 0; tile < job->tile_count; tile++) {
+        if (job->tiles_drawn & (1u << tile)) job->merge[job->merge_count++] = tile;
+    }
+    job_parallel_for(0, job->view->rows, DONUT_MERGE_BAND, donut_merge_rows, job);
+}
+
+/* Render the frame at the current viewing angles into the grid, on the APs when there are any */
+VOID donut_render(VOID *state, DEMO_GRID *grid) {
+    DONUT_VIEW *view = (DONUT_VIEW *)state;
+    DONUT_JOB job;
+
+    view->shade = grid->shade;
+    job.view = view;
+    job.sa = view->sin_a >> (DONUT_TRIG_FRAC - DONUT_FRAC);
+    job.ca = view->cos_a >> (DONUT_TRIG_FRAC - DONUT_FRAC);
+    job.sb = view->sin_b >> (DONUT_TRIG_FRAC - DONUT_FRAC);
+    job.cb = view->cos_b >> (DONUT_TRIG_FRAC - DONUT_FRAC);
+    job.next_tile = 0;
+    job.next_ring = 0;
+    job.tiles_drawn = 0;
+    if (view->tile_count > 1) {
+        job.tile_count = view->tile_count;
+        job.shade = view->tile_shade;
+        job.z = view->tile_z;
+        job_run_everywhere(donut_worker, &job);
+        donut_merge(&job);
+        return;
+    }
+
+    /* No APs: render everything here */
+    job.tile_count = 1;
+    job.shade = view->shade;
+    job.z = view->z;
+    donut_worker(&job_workers[0], &job);
+}
+
+/* Turn the torus by dt milliseconds' worth of spin */
+VOID donut_update(VOID *state, UINT32 dt) {
+    DONUT_VIEW *view = (DONUT_VIEW *)state;
+    INT32 sin_d, cos_d;
+
+    donut_sincos_small(DONUT_SPIN_A / 1000 * (INT32)dt, &sin_d, &cos_d);
+    donut_rotate(&view->sin_a, &view->cos_a, sin_d, cos_d);
+    donut_sincos_small(DONUT_SPIN_B / 1000 * (INT32)dt, &sin_d, &cos_d);
+    donut_rotate(&view->sin_b, &view->cos_b, sin_d, cos_d);
+}
+
+/* Release everything a view holds */
+VOID donut_close(VOID *state) {
+    DONUT_VIEW *view = (DONUT_VIEW *)state;
+
+    if (view->tables != 0) BS->FreePages(view->tables, view->table_pages);
+    if (view->z != NULL) BS->FreePool(view->z);
+    if (view->tile_shade != NULL) BS->FreePool(view->tile_shade);
+    if (view->tile_z != NULL) BS->FreePool(view->tile_z);
+    BS->FreePool(view);
+}
+
+/* Allocate and fill the view's sine/cosine tables; the float copies sit on 16-byte boundaries */
+BOOLEAN donut_view_tables(DONUT_VIEW *view, UINTN theta_steps, UINTN phi_steps) {
+    UINTN theta_lanes = (theta_steps + 3) & ~3;
+    UINTN phi_lanes = (phi_steps + 3) & ~3;
+    INT32 *tables;
+
+    view->table_pages = EFI_SIZE_TO_PAGES((2 * theta_lanes + 4 * phi_lanes) * sizeof(INT32));
+    if (EFI_ERROR(BS->AllocatePages(AllocateAnyPages, EfiLoaderData, view->table_pages, &view->tables))) {
+        view->tables = 0;
+        return FALSE;
+    }
+    tables = (INT32 *)(UINTN)view->tables;
+    view->theta_steps = theta_steps;
+    view->phi_steps = phi_steps;
+    view->sin_theta = tables;
+    view->cos_theta = view->sin_theta + theta_lanes;
+    view->sin_phi = view->cos_theta + theta_lanes;
+    view->cos_phi = view->sin_phi + phi_lanes;
+    view->sin_phi_f = (float *)(view->cos_phi + phi_lanes);
+    view->cos_phi_f = view->sin_phi_f + phi_lanes;
+
+    donut_fill_table(view->sin_theta, view->cos_theta, theta_steps,
+                     (INT32)calc_udiv64(DONUT_TWO_PI, theta_steps, NULL));
+    donut_fill_table(view->sin_phi, view->cos_phi, phi_steps,
+                     (INT32)calc_udiv64(DONUT_TWO_PI, phi_steps, NULL));
+    for (UINTN k = phi_steps; k < phi_lanes; k++) {
+        view->sin_phi[k] = view->sin_phi[0];
+        view->cos_phi[k] = view->cos_phi[0];
+    }
+    if (donut_use_sse2) {
+        donut_float_table(view->sin_phi, view->sin_phi_f, phi_lanes);
+        donut_float_table(view->cos_phi, view->cos_phi_f, phi_lanes);
+    }
+    return TRUE;
+}
+
+/*
+ * Set up the donut for a grid: the text window's fixed projection, or
+ * one sized to the frame buffer. Up to one AP tile per AP is allocated,
+ * fewer if memory is short.
+ */
+VOID *donut_open(DEMO_GRID *grid) {
+    DONUT_VIEW *view = demo_alloc(sizeof(DONUT_VIEW));
+    UINTN cells = grid->cols * grid->rows;
+    UINTN theta_steps, phi_steps;
+
+    if (view == NULL) return NULL;
+    SetMem(view, sizeof(*view), 0);
+    view->cols = grid->cols;
+    view->rows = grid->rows;
+    view->cos_a = 1 << DONUT_TRIG_FRAC;
+    view->cos_b = 1 << DONUT_TRIG_FRAC;
+    if (grid->gop != NULL) {
+        /* Square pixels; the torus spans at most 1.5 * scale either way */
+        INT32 scale = (INT32)(view->rows < view->cols ? view->rows * 3 / 5 : view->cols * 3 / 5);
+
+        view->scale_x = scale;
+        view->scale_y = scale;
+        /*
+         * At the nearest point (depth 2) a step around the tube covers
+         * pi * scale / theta_steps pixels and one around the axis three
+         * times as much per phi step; keep both under 0.75 so no gaps show.
+         */
+        theta_steps = scale * 17 / 4;
+        phi_steps = scale * 25 / 2;
+    } else {
+        view->scale_x = DONUT_SCALE_X;
+        view->scale_y = DONUT_SCALE_Y;
+        theta_steps = DONUT_TEXT_THETA;
+        phi_steps = DONUT_TEXT_PHI;
+    }
+
+    view->z = demo_alloc(cells * sizeof(UINT16));
+    if (view->z == NULL || !donut_view_tables(view, theta_steps, phi_steps)) {
+        donut_close(view);
+        return NULL;
+    }
+
+    view->tile_count = grid->ap_count + 1 < DONUT_MAX_TILES ? (UINT32)grid->ap_count + 1 : DONUT_MAX_TILES;
+    while (view->tile_count > 1) {
+        view->tile_shade = demo_alloc(view->tile_count * cells * sizeof(UINT8));
+        view->tile_z = demo_alloc(view->tile_count * cells * sizeof(UINT16));
+        if (view->tile_shade != NULL && view->tile_z != NULL) break;
+        if (view->tile_shade != NULL) BS->FreePool(view->tile_shade);
+        if (view->tile_z != NULL) BS->FreePool(view->tile_z);
+        view->tile_shade = NULL;
+        view->tile_z = NULL;
+        view->tile_count /= 2;
+    }
+    return view;
+}
+
+/*
+ * Plasma. Each cell sums three waves read from a 256-entry table (angles
+ * in 1/256 turns): one along x whose phase is bent by a wave along y, one
+ * along y bent by a wave along x, and one diagonal. Everything that
+ * depends on one coordinate is worked out once per row or column, so a
+ * cell costs three table reads and a few adds; the phases drift with
+ * time in 24.8 fixed point. Bands of rows are shared among the processors.
+ */
+#define PLASMA_PEAK       84                /* Wave table range 0-84, so three sum to at most 252 */
+#define PLASMA_BAND       16                /* Fewest rows worth a job of their own */
+
+typedef struct {
+    UINTN cols, rows;
+    UINT32 t[4];                        /* Phase of each wave, 24.8 turns/256 */
+    UINT8 wave[256];
+    UINT32 *col_phase, *col_bend;       /* Per column: wave 1 phase, wave 2 bend */
+    UINT32 *row_phase, *row_bend;       /* Per row: wave 2 phase, wave 1 bend */
+    UINT8 *shade;                       /* The grid's shades, while rendering */
+    UINT32 t2;
+} PLASMA;
+
+/* Phase speeds in 1/256 turns per second, 24.8 */
+CONST UINT32 plasma_speed[4] = { 23 << 8, 37 << 8, 17 << 8, 29 << 8 };
+
+/* Plasma state and its row/column tables in one block */
+VOID *plasma_open(DEMO_GRID *grid) {
+    PLASMA *plasma = demo_alloc(sizeof(PLASMA) + 2 * (grid->cols + grid->rows) * sizeof(UINT32));
+    INT32 sin_table[256], cos_table[256];
+
+    if (plasma == NULL) return NULL;
+    SetMem(plasma, sizeof(*plasma), 0);
+    plasma->cols = grid->cols;
+    plasma->rows = grid->rows;
+    plasma->col_phase = (UINT32 *)(plasma + 1);
+    plasma->col_bend = plasma->col_phase + grid->cols;
+    plasma->row_phase = plasma->col_bend + grid->cols;
+    plasma->row_bend = plasma->row_phase + grid->rows;
+
+    donut_fill_table(sin_table, cos_table, 256, (INT32)calc_udiv64(DONUT_TWO_PI, 256, NULL));
+    for (UINTN k = 0; k < 256; k++) {
+        plasma->wave[k] = (UINT8)(((sin_table[k] + DONUT_ONE) * PLASMA_PEAK / 2 + DONUT_ONE / 2) >> DONUT_FRAC);
+    }
+    return plasma;
+}
+
+/* Drift the phases */
+VOID plasma_update(VOID *state, UINT32 dt) {
+    PLASMA *plasma = (PLASMA *)state;
+
+    for (UINTN k = 0; k < 4; k++) {
+        plasma->t[k] += plasma_speed[k] * dt / 1000;
+    }
+}
+
+/* Shade rows first to end - 1 from the row and column tables */
+VOID plasma_rows(VOID *state, UINTN first, UINTN end) {
+    PLASMA *plasma = (PLASMA *)state;
+    UINTN cols = plasma->cols;
+    UINT32 t2 = plasma->t2;
+
+    for (UINTN y = first; y < end; y++) {
+        UINT8 *shade = plasma->shade + y * cols;
+        UINT32 row_phase = plasma->row_phase[y], row_bend = plasma->row_bend[y];
+
+        for (UINTN x = 0; x < cols; x++) {
+            shade[x] = (UINT8)(1 + plasma->wave[(plasma->col_phase[x] + row_bend) & 255] +
+                               plasma->wave[(row_phase + plasma->col_bend[x]) & 255] +
+                               plasma->wave[(plasma->col_phase[x] + row_phase - t2) & 255]);
+        }
+    }
+}
+
+/* Fill the grid; about two periods of each wave span the width and height */
+VOID plasma_render(VOID *state, DEMO_GRID *grid) {
+    PLASMA *plasma = (PLASMA *)state;
+    UINTN cols = plasma->cols, rows = plasma->rows;
+    UINT32 t0 = plasma->t[0] >> 8, t1 = plasma->t[1] >> 8, t2 = plasma->t[2] >> 8, t3 = plasma->t[3] >> 8;
+
+    for (UINTN x = 0; x < cols; x++) {
+        plasma->col_phase[x] = (UINT32)(x * 512 / cols) + t0;
+        plasma->col_bend[x] = plasma->wave[((UINT32)(x * 384 / cols) + t3) & 255];
+    }
+    for (UINTN y = 0; y < rows; y++) {
+        plasma->row_phase[y] = (UINT32)(y * 512 / rows) + t1;
+        plasma->row_bend[y] = plasma->wave[((UINT32)(y * 320 / rows) - t2) & 255];
+    }
+    plasma->shade = grid->shade;
+    plasma->t2 = t2;
+    job_parallel_for(0, rows, PLASMA_BAND, plasma_rows, plasma);
+}
+
+/* Release the plasma state */
+VOID plasma_close(VOID *state) {
+    BS->FreePool(state);
+}
+
+/*
+ * Fire. A heat field (8.8 fixed point) sits on a fuel row kept at full
+ * heat. Every step each cell passes its heat to the cell above it, or to
+ * one of that cell's neighbours, less a random amount of cooling; the
+ * drift and the uneven cooling are what break the rising heat into
+ * flames. The field is at most FIRE_MAX_COLS wide and keeps the grid's
+ * shape, so it is stretched over the frame buffer and the flames take
+ * the same time to climb in either mode. Cooling is scaled so they die
+ * out about two thirds of the way up.
+ */
+#define FIRE_MAX_COLS     240
+#define FIRE_STEPS        90                /* Simulation steps (rows climbed) per second */
+
+typedef struct {
+    UINTN cols, rows;                   /* Heat field size */
+    UINT32 cool;                        /* Average heat lost per step */
+    UINT32 pending;                     /* Milliseconds not yet simulated, times FIRE_STEPS */
+    UINT32 seed;
+    UINT16 *heat;                       /* rows + 1, the last being the fuel row */
+    UINT16 *col_map;                    /* Grid column to heat column */
+} FIRE;
+
+/* Fire state, heat field and column map in one block */
+VOID *fire_open(DEMO_GRID *grid) {
+    UINTN cols = grid->cols < FIRE_MAX_COLS ? grid->cols : FIRE_MAX_COLS;
+    UINTN rows = grid->rows * cols / grid->cols;
+    FIRE *fire = demo_alloc(sizeof(FIRE) + ((rows + 1) * cols + grid->cols) * sizeof(UINT16));
+
+    if (fire == NULL) return NULL;
+    SetMem(fire, sizeof(*fire), 0);
+    fire->cols = cols;
+    fire->rows = rows;
+    fire->cool = (255 << 8) * 3 / (2 * (UINT32)rows);
+    fire->seed = demo_seed();
+    fire->heat = (UINT16 *)(fire + 1);
+    fire->col_map = fire->heat + (rows + 1) * cols;
+    SetMem(fire->heat, rows * cols * sizeof(UINT16), 0);
+    for (UINTN x = 0; x < cols; x++) {
+        fire->heat[rows * cols + x] = 255 << 8;
+    }
+    for (UINTN x = 0; x < grid->cols; x++) {
+        fire->col_map[x] = (UINT16)(x * cols / grid->cols);
+    }
+    return fire;
+}
+
+/* One step: every row takes its heat from the row below, top row first */
+VOID fire_step(FIRE *fire) {
+    UINTN cols = fire->cols, rows = fire->rows;
+
+    for (UINTN y = 0; y < rows; y++) {
+        UINT16 *row = fire->heat + y * cols;
+        UINT16 *below = row + cols;
+
+        for (UINTN x = 0; x < cols; x++) {
+            UINT32 r = demo_random(&fire->seed);
+            UINTN to = x + r % 3;                           /* One left of x to one right, plus one */
+            UINT32 cool = ((r >> 8) & 255) * fire->cool / 128;
+
+            if (to < 1 || to > cols) continue;
+            row[to - 1] = (UINT16)(below[x] > cool ? below[x] - cool : 0);
+        }
+    }
+}
+
+/* Run the steps that dt milliseconds call for */
+VOID fire_update(VOID *state, UINT32 dt) {
+    FIRE *fire = (FIRE *)state;
+
+    fire->pending += dt * FIRE_STEPS;
+    while (fire->pending >= 1000) {
+        fire_step(fire);
+        fire->pending -= 1000;
+    }
+}
+
+/* Stretch the heat field over the grid */
+VOID fire_render(VOID *state, DEMO_GRID *grid) {
+    FIRE *fire = (FIRE *)state;
+
+    for (UINTN y = 0; y < grid->rows; y++) {
+        UINT16 *heat = fire->heat + (y * fire->rows / grid->rows) * fire->cols;
+        UINT8 *shade = grid->shade + y * grid->cols;
+
+        for (UINTN x = 0; x < grid->cols; x++) {
+            shade[x] = (UINT8)(heat[fire->col_map[x]] >> 8);
+        }
+    }
+}
+
+/* Release the fire state */
+VOID fire_close(VOID *state) {
+    BS->FreePool(state);
+}
+
+/*
+ * Starfield. Stars sit at random x and y in [-1, 1) and fly towards the
+ * viewer from depth 1; projecting one is a pair of 32-bit divisions by
+ * its depth, and it brightens as it comes closer. A star that reaches
+ * STAR_NEAR or leaves the grid starts again at the back. The number of
+ * stars grows with the grid; on the frame buffer the nearest quarter of
+ * the way are drawn two pixels square.
+ */
+#define STAR_MAX          2048
+#define STAR_NEAR         4096              /* Closest depth, 16.16 */
+#define STAR_SPEED        24576             /* Depth covered per second, 16.16 */
+
+typedef struct {
+    INT32 x, y;                         /* 16.16, -1 to 1 */
+    INT32 z;                            /* 16.16, STAR_NEAR to 1 */
+} STAR;
+
+typedef struct {
+    INT32 cols, rows;
+    INT32 scale_x, scale_y;             /* Projection; text cells are about twice as tall as wide */
+    INT32 size;                         /* Side of a near star */
+    UINTN count;
+    UINT32 seed;
+    STAR stars[STAR_MAX];
+} STARFIELD;
+
+/* Put a star at a random position at the given depth */
+VOID star_place(STARFIELD *field, STAR *star, INT32 z) {
+    star->x = (INT32)(demo_random(&field->seed) & 0x1FFFF) - 0x10000;
+    star->y = (INT32)(demo_random(&field->seed) & 0x1FFFF) - 0x10000;
+    star->z = z;
+}
+
+/* A field of stars spread through every depth */
+VOID *starfield_open(DEMO_GRID *grid) {
+    STARFIELD *field = demo_alloc(sizeof(STARFIELD));
+    UINTN count = grid->cols * grid->rows / 16;
+
+    if (field == NULL) return NULL;
+    field->cols = (INT32)grid->cols;
+    field->rows = (INT32)grid->rows;
+    field->scale_x = field->cols / 2;
+    field->scale_y = grid->gop != NULL ? field->scale_x : field->scale_x / 2;
+    field->size = grid->gop != NULL ? 2 : 1;
+    field->count = count < 64 ? 64 : count > STAR_MAX ? STAR_MAX : count;
+    field->seed = demo_seed();
+    for (UINTN i = 0; i < field->count; i++) {
+        star_place(field, &field->stars[i], STAR_NEAR + (INT32)(demo_random(&field->seed) % (0x10000 - STAR_NEAR)));
+    }
+    return field;
+}
+
+/* Where a star lands on the grid; FALSE when it is off the edge */
+BOOLEAN star_project(STARFIELD *field, STAR *star, INT32 *x, INT32 *y, INT32 *side) {
+    *x = field->cols / 2 + star->x * field->scale_x / star->z;
+    *y = field->rows / 2 + star->y * field->scale_y / star->z;
+    *side = star->z < 0x4000 ? field->size : 1;
+    return *x >= 0 && *y >= 0 && *x + *side <= field->cols && *y + *side <= field->rows;
+}
+
+/* Bring every star closer, recycling the ones that pass STAR_NEAR or leave the grid */
+VOID starfield_update(VOID *state, UINT32 dt) {
+    STARFIELD *field = (STARFIELD *)state;
+    INT32 step = (INT32)(STAR_SPEED * dt / 1000);
+    INT32 x, y, side;
+
+    for (UINTN i = 0; i < field->count; i++) {
+        STAR *star = &field->stars[i];
+
+        star->z -= step;
+        if (star->z < STAR_NEAR || !star_project(field, star, &x, &y, &side)) {
+            star_place(field, star, 0x10000);
+        }
+    }
+}
+
+/* Clear the grid and plot each star */
+VOID starfield_render(VOID *state, DEMO_GRID *grid) {
+    STARFIELD *field = (STARFIELD *)state;
+    INT32 x, y, side;
+
+    SetMem(grid->shade, grid->cols * grid->rows, 0);
+    for (UINTN i = 0; i < field->count; i++) {
+        STAR *star = &field->stars[i];
+        UINT8 shade = (UINT8)(255 - ((star->z * 254) >> 16));
+
+        if (!star_project(field, star, &x, &y, &side)) continue;
+        for (INT32 dy = 0; dy < side; dy++) {
+            for (INT32 dx = 0; dx < side; dx++) {
+                grid->shade[(y + dy) * field->cols + x + dx] = shade;
+            }
+        }
+    }
+}
+
+/* Release the starfield state */
+VOID starfield_close(VOID *state) {
+    BS->FreePool(state);
+}
+
+/*
+ * Matrix rain. Glyph columns each carry a falling drop whose head is
+ * brightest and whose trail fades; a few glyphs change every frame. In
+ * text mode a glyph is a cell and its shade picks a character, jittered
+ * by the glyph so a trail shows a mix of characters that still thins out
+ * towards its end. On the frame buffer a glyph is a MATRIX_CELL_W by
+ * MATRIX_CELL_H block holding a random 5x7 dot pattern drawn at double
+ * size, so the cost grows with the number of lit glyphs, not pixels.
+ */
+#define MATRIX_CELL_W     12
+#define MATRIX_CELL_H     16
+#define MATRIX_GLYPHS     64
+#define MATRIX_MAX_COLS   (DEMO_MAX_PIXELS / MATRIX_CELL_W)
+
+/* One column's drop; positions in glyph rows, 24.8 */
+typedef struct {
+    INT32 head;
+    INT32 speed;                        /* Per second */
+    INT32 length;                       /* Trail, whole glyphs */
+} MATRIX_DROP;
+
+typedef struct {
+    UINTN cols, rows;                   /* In glyphs */
+    BOOLEAN text;
+    UINT32 seed;
+    UINT32 pending;                     /* Glyph changes owed, times 1000 */
+    MATRIX_DROP drops[MATRIX_MAX_COLS];
+    UINT8 dots[MATRIX_GLYPHS][7];       /* Graphics: five bits per glyph row */
+    UINT8 *glyph;                       /* Per cell: a glyph number */
+} MATRIX;
+
+/* Start a drop above the top, with a random speed and trail */
+VOID matrix_drop(MATRIX *matrix, MATRIX_DROP *drop) {
+    INT32 rows = (INT32)matrix->rows;
+
+    drop->head = -((INT32)(demo_random(&matrix->seed) % (UINT32)rows) << 8);
+    drop->speed = (rows / 2 + (INT32)(demo_random(&matrix->seed) % (UINT32)rows)) << 8;
+    drop->length = rows / 4 + (INT32)(demo_random(&matrix->seed) % (UINT32)(rows / 2 + 1));
+}
+
+/* Matrix state and its glyph cells in one block */
+VOID *matrix_open(DEMO_GRID *grid) {
+    BOOLEAN text = grid->gop == NULL;
+    UINTN cols = text ? grid->cols : grid->cols / MATRIX_CELL_W;
+    UINTN rows = text ? grid->rows : grid->rows / MATRIX_CELL_H;
+    MATRIX *matrix = demo_alloc(sizeof(MATRIX) + cols * rows);
+
+    if (matrix == NULL) return NULL;
+    matrix->cols = cols;
+    matrix->rows = rows;
+    matrix->text = text;
+    matrix->seed = demo_seed();
+    matrix->pending = 0;
+    matrix->glyph = (UINT8 *)(matrix + 1);
+    for (UINTN i = 0; i < cols * rows; i++) {
+        matrix->glyph[i] = (UINT8)(demo_random(&matrix->seed) % MATRIX_GLYPHS);
+    }
+    for (UINTN g = 0; g < MATRIX_GLYPHS; g++) {
+        for (UINTN r = 0; r < 7; r++) {
+            matrix->dots[g][r] = (UINT8)(demo_random(&matrix->seed) & 0x1F);
+        }
+    }
+    for (UINTN x = 0; x < cols; x++) {
+        matrix_drop(matrix, &matrix->drops[x]);
+        /* Spread the first drops over the screen rather than all starting at the top */
+        matrix->drops[x].head += (INT32)(demo_random(&matrix->seed) % (UINT32)rows) << 8;
+    }
+    return matrix;
+}
+
+/* Let the drops fall and change some glyphs; a cell changes about every two seconds */
+VOID matrix_update(VOID *state, UINT32 dt) {
+    MATRIX *matrix = (MATRIX *)state;
+    UINTN cells = matrix->cols * matrix->rows;
+
+    for (UINTN x = 0; x < matrix->cols; x++) {
+        MATRIX_DROP *drop = &matrix->drops[x];
+
+        drop->head += drop->speed * (INT32)dt / 1000;
+        if ((drop->head >> 8) - drop->length >= (INT32)matrix->rows) {
+            matrix_drop(matrix, drop);
+        }
+    }
+    matrix->pending += (UINT32)cells * dt / 2;
+    while (matrix->pending >= 1000) {
+        matrix->glyph[demo_random(&matrix->seed) % cells] = (UINT8)(demo_random(&matrix->seed) % MATRIX_GLYPHS);
+        matrix->pending -= 1000;
+    }
+}
+
+/* Brightness of a glyph d rows behind the head of a drop with the given trail, 0 if unlit */
+UINT8 matrix_brightness(INT32 d, INT32 length) {
+    if (d < 0 || d >= length) return 0;
+    if (d == 0) return 255;
+    return (UINT8)(200 - d * 180 / length);
+}
+
+/* Clear the grid and draw every lit glyph */
+VOID matrix_render(VOID *state, DEMO_GRID *grid) {
+    MATRIX *matrix = (MATRIX *)state;
+
+    SetMem(grid->shade, grid->cols * grid->rows, 0);
+    for (UINTN x = 0; x < matrix->cols; x++) {
+        MATRIX_DROP *drop = &matrix->drops[x];
+        INT32 head = drop->head >> 8;
+
+        for (INT32 y = head - drop->length + 1; y <= head; y++) {
+            UINT8 shade = matrix_brightness(head - y, drop->length);
+            UINT8 glyph;
+
+            if (y < 0 || y >= (INT32)matrix->rows || shade == 0) continue;
+            glyph = matrix->glyph[y * matrix->cols + x];
+            if (matrix->text) {
+                grid->shade[y * grid->cols + x] = (UINT8)(shade > glyph / 2 ? shade - glyph / 2 : 1);
+                continue;
+            }
+            for (UINTN r = 0; r < 14; r++) {
+                UINT8 *row = grid->shade + ((UINTN)y * MATRIX_CELL_H + 1 + r) * grid->cols + x * MATRIX_CELL_W + 1;
+                UINT8 bits = matrix->dots[glyph][r / 2];
+
+                for (UINTN c = 0; c < 10; c++) {
+                    if (bits & (1 << (c / 2))) row[c] = shade;
+                }
+            }
+        }
+    }
+}
+
+/* Release the matrix state */
+VOID matrix_close(VOID *state) {
+    BS->FreePool(state);
+}
+
+/*
+ * Meshes. A small 3D engine behind two effects, filled and wireframe.
+ * The mesh comes from MESH_FILE on the boot volume, a subset of the
+ * Wavefront OBJ text format: "v x y z" vertices and "f a b c ..." faces
+ * (1-based or negative indices, "a/t/n" forms use the first number,
+ * polygons are fanned into triangles, other lines are ignored). Without
+ * the file a bumpy sphere of MESH_BUILTIN_FACES triangles is built.
+ *
+ * Loading centres the mesh and scales it into the unit sphere, in 1.14
+ * fixed point, and works out unit face normals. Every frame the vertices
+ * are turned by a rotation matrix (the donut's sine/cosine rotation
+ * steps), pushed MESH_DISTANCE in front of the camera and projected to
+ * screen coordinates with MESH_SUB bits of sub-pixel precision and a
+ * 16-bit 1/depth. A face whose projected winding is clockwise faces away
+ * and is culled. The rest are lit by their rotated normal, then either
+ * drawn as outlines or filled with integer edge functions: each row of
+ * the triangle's bounding box is walked adding the per-pixel steps of
+ * the three edge functions and of the depth plane, leaving the row once
+ * past the triangle, with a top-left rule so shared edges are drawn once.
+ * The unit sphere always projects inside the grid (see mesh_open), which
+ * keeps every edge function within 32 bits.
+ */
+#define MESH_FILE           L"\\mesh.obj"
+#define MESH_MAX_FILE       (8 * 1024 * 1024)
+#define MESH_MAX_VERTICES   262144
+#define MESH_MAX_FACES      262144
+#define MESH_FRAC           14                  /* Model and camera space */
+#define MESH_ONE            (1 << MESH_FRAC)
+#define MESH_SUB            3                   /* Screen sub-pixel bits */
+#define MESH_DISTANCE       (3 * MESH_ONE)      /* Camera on the z axis, looking back at the origin */
+#define MESH_AMBIENT        40                  /* Shade of an unlit face */
+#define MESH_MAX_Z_STEP     (1 << 18)           /* Depth change per pixel, 24.8 */
+#define MESH_GRAIN          1024                /* Fewest vertices or faces worth a job of their own */
+#define MESH_BANDS_PER_CPU  4                   /* Filled frames are drawn in bands, this many per processor */
+#define MESH_BUILTIN_COLS   128                 /* The built-in sphere: 2 * 128 * 64 triangles */
+#define MESH_BUILTIN_ROWS   64
+
+typedef struct {
+    INT32 x, y, z;
+} MESH_VECTOR;
+
+/* A projected vertex: screen position in MESH_SUB fixed point and 1/depth */
+typedef struct {
+    INT32 x, y;
+    INT32 z;
+} MESH_POINT;
+
+typedef struct {
+    UINTN cols, rows;
+    BOOLEAN wireframe;
+    INT32 scale_x, scale_y;
+    UINTN vertex_count, face_count;
+    MESH_VECTOR *vertices;              /* Model space, inside the unit sphere */
+    MESH_VECTOR *normals;               /* Unit, one per face */
+    UINT32 *faces;                      /* Three vertex numbers per face, counter-clockwise from outside */
+    MESH_POINT *points;                 /* Each vertex this frame */
+    UINT8 *face_shade;                  /* Each face this frame; 0 when it is not drawn */
+    INT32 *face_area;                   /* Twice the projected area, in sub-pixels squared */
+    INT32 matrix[3][3];                 /* This frame's rotation, MESH_FRAC */
+    UINT8 *shade;                       /* The grid's shades, while rendering */
+    UINT16 *z;
+    UINTN band_rows;                    /* Rows drawn by one job */
+    INT32 sin_a, cos_a, sin_b, cos_b;   /* Q30 */
+} MESH;
+
+/* Integer square root */
+UINT32 mesh_isqrt(UINT64 n) {
+    UINT64 root = 0;
+    UINT64 bit = (UINT64)1 << 62;
+
+    while (bit > n) bit >>= 2;
+    while (bit != 0) {
+        if (n >= root + bit) {
+            n -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return (UINT32)root;
+}
+
+/* Skip spaces and tabs */
+VOID mesh_skip_blanks(CHAR16 **text) {
+    while (**text == L' ' || **text == L'\t') (*text)++;
+}
+
+/*
+ * Read a decimal number with optional sign, fraction and exponent as
+ * 16.16 fixed point. FALSE when there is no number or it is out of range.
+ */
+BOOLEAN mesh_number(CHAR16 **text, INT32 *value) {
+    CHAR16 *p;
+    BOOLEAN negative = FALSE, digits = FALSE;
+    UINT64 mantissa = 0;
+    INTN exponent = 0;
+    UINT64 result;
+
+    mesh_skip_blanks(text);
+    p = *text;
+    if (*p == L'-' || *p == L'+') negative = *p++ == L'-';
+    for (; *p >= L'0' && *p <= L'9'; p++, digits = TRUE) {
+        /* Twelve significant digits are plenty; later ones only move the exponent */
+        if (mantissa < 100000000000ULL) mantissa = mantissa * 10 + (*p - L'0');
+        else exponent++;
+    }
+    if (*p == L'.') {
+        for (p++; *p >= L'0' && *p <= L'9'; p++, digits = TRUE) {
+            if (mantissa < 100000000000ULL) {
+                mantissa = mantissa * 10 + (*p - L'0');
+                exponent--;
+            }
+        }
+    }
+    if (!digits) return FALSE;
+    if (*p == L'e' || *p == L'E') {
+        BOOLEAN negative_exponent = FALSE;
+        INTN e = 0;
+
+        p++;
+        if (*p == L'-' || *p == L'+') negative_exponent = *p++ == L'-';
+        for (; *p >= L'0' && *p <= L'9'; p++) {
+            if (e < 100) e = e * 10 + (*p - L'0');
         }
-        i++;
+        exponent += negative_exponent ? -e : e;
     }
-    
-    /* Apply final operation */
-    if (op == L'+') result += current_num;
-    else if (op == L'-') result -= current_num;
-    else if (op == L'*') result *= current_num;
-    else if (op == L'/' && current_num != 0) result /= current_num;
-    
-    return result;
-}
+    *text = p;
 
-/* Clear screen and reset attributes */
-VOID clear_screen(VOID) {
-    ConOut->ClearScreen(ConOut);
-    ConOut->SetAttribute(ConOut, COLOR_NORMAL);
+    if (mantissa == 0 || exponent < -18) {
+        result = 0;
+    } else if (exponent < 0) {
+        result = calc_udiv64(mantissa << 16, calc_pow10[-exponent], NULL);
+    } else if (exponent > 4 || mantissa > calc_udiv64(0x7FFF, calc_pow10[exponent], NULL)) {
+        return FALSE;
+    } else {
+        result = (mantissa * calc_pow10[exponent]) << 16;
+    }
+    if (result > 0x7FFFFFFF) return FALSE;
+    *value = negative ? -(INT32)result : (INT32)result;
+    return TRUE;
 }
 
-/* Set cursor position */
-VOID set_cursor(UINTN x, UINTN y) {
-    ConOut->SetCursorPosition(ConOut, x, y);
+/* Read a face's vertex number, dropping any "/texture/normal" part; 0 when there is none */
+INT32 mesh_index(CHAR16 **text) {
+    CHAR16 *p;
+    BOOLEAN negative = FALSE;
+    INT32 index = 0;
+
+    mesh_skip_blanks(text);
+    p = *text;
+    if (*p == L'-') {
+        negative = TRUE;
+        p++;
+    }
+    if (*p < L'0' || *p > L'9') return 0;
+    for (; *p >= L'0' && *p <= L'9'; p++) {
+        if (index < 100000000) index = index * 10 + (*p - L'0');
+    }
+    while (*p != 0 && *p != L' ' && *p != L'\t' && *p != L'\r' && *p != L'\n') p++;
+    *text = p;
+    return negative ? -index : index;
 }
 
-/* Draw top bar with clock and menu */
-VOID draw_topbar(VOID) {
-    EFI_TIME time;
-    CHAR16 buf[100];
-    
-    /* Get current time from UEFI runtime services */
-    ST->RuntimeServices->GetTime(&time, NULL);
-    
-    ConOut->SetAttribute(ConOut, COLOR_TOPBAR);
-    set_cursor(0, 0);
-    
-    /* Clear the line */
-    for (UINTN i = 0; i < SCREEN_WIDTH; i++) {
-        ConOut->OutputString(ConOut, L" ");
+/*
+ * Go through OBJ text. Without mesh->vertices it only counts vertices
+ * and triangles; with them it fills them in as 16.16 and checks every
+ * index. FALSE on a bad number, a bad index or too large a mesh.
+ */
+BOOLEAN mesh_parse(MESH *mesh, CHAR16 *text) {
+    BOOLEAN fill = mesh->vertices != NULL;
+    UINTN vertices = 0, faces = 0;
+
+    while (*text != 0) {
+        mesh_skip_blanks(&text);
+        if (text[0] == L'v' && (text[1] == L' ' || text[1] == L'\t')) {
+            MESH_VECTOR v;
+
+            text++;
+            if (!mesh_number(&text, &v.x) || !mesh_number(&text, &v.y) || !mesh_number(&text, &v.z)) return FALSE;
+            if (vertices == MESH_MAX_VERTICES) return FALSE;
+            if (fill) mesh->vertices[vertices] = v;
+            vertices++;
+        } else if (text[0] == L'f' && (text[1] == L' ' || text[1] == L'\t')) {
+            UINT32 first = 0, previous = 0;
+            UINTN corners = 0;
+            INT32 index;
+
+            text++;
+            while ((index = mesh_index(&text)) != 0) {
+                /* Negative numbers count back from the latest vertex */
+                INT32 n = index > 0 ? index - 1 : (INT32)vertices + index;
+                if (n < 0 || (UINTN)n >= vertices) return FALSE;
+                if (corners >= 2) {
+                    if (faces == MESH_MAX_FACES) return FALSE;
+                    if (fill) {
+                        mesh->faces[faces * 3] = first;
+                        mesh->faces[faces * 3 + 1] = previous;
+                        mesh->faces[faces * 3 + 2] = (UINT32)n;
+                    }
+                    faces++;
+                }
+                if (corners == 0) first = (UINT32)n;
+                previous = (UINT32)n;
+                corners++;
+            }
+        }
+        while (*text != 0 && *text != L'\n') text++;
+        if (*text == L'\n') text++;
     }
-    
-    /* Draw menu items */
-    set_cursor(1, 0);
-    SPrint(buf, sizeof(buf), L"ASCII-OS  \u2022  Activities  \u2022  Files  \u2022  Apps");
-    ConOut->OutputString(ConOut, buf);
-    
-    /* Draw clock on right side */
-    set_cursor(60, 0);
-    SPrint(buf, sizeof(buf), L"%02d:%02d:%02d", time.Hour, time.Minute, time.Second);
-    ConOut->OutputString(ConOut, buf);
-    
-    ConOut->SetAttribute(ConOut, COLOR_NORMAL);
+    mesh->vertex_count = vertices;
+    mesh->face_count = faces;
+    return TRUE;
 }
 
-/* Draw dock/menu with hotkeys */
-VOID draw_dock(VOID) {
-    set_cursor(2, 23);
-    ConOut->SetAttribute(ConOut, COLOR_HIGHLIGHT);
-    ConOut->OutputString(ConOut, L"[N]otepad  [C]alc  [E]ditor  [D]onut  [Q]uit");
-    ConOut->SetAttribute(ConOut, COLOR_NORMAL);
+/* Room for the vertices, faces and normals and the per-frame points and faces */
+BOOLEAN mesh_alloc(MESH *mesh) {
+    mesh->vertices = demo_alloc(mesh->vertex_count * sizeof(MESH_VECTOR));
+    mesh->points = demo_alloc(mesh->vertex_count * sizeof(MESH_POINT));
+    mesh->faces = demo_alloc(mesh->face_count * 3 * sizeof(UINT32));
+    mesh->normals = demo_alloc(mesh->face_count * sizeof(MESH_VECTOR));
+    mesh->face_shade = demo_alloc(mesh->face_count * sizeof(UINT8));
+    mesh->face_area = demo_alloc(mesh->face_count * sizeof(INT32));
+    return mesh->vertices != NULL && mesh->points != NULL && mesh->faces != NULL && mesh->normals != NULL &&
+           mesh->face_shade != NULL && mesh->face_area != NULL;
 }
 
-/* Draw a window frame using box drawing characters */
-VOID draw_window(UINTN x, UINTN y, UINTN width, UINTN height, CHAR16 *title) {
-    ConOut->SetAttribute(ConOut, COLOR_WINDOW);
-    
-    /* Top border */
-    set_cursor(x, y);
-    ConOut->OutputString(ConOut, L"\u256d");  /* Rounded top-left */
-    for (UINTN i = 0; i < width - 2; i++) {
-        ConOut->OutputString(ConOut, L"\u2500");  /* Horizontal line */
+/* Free the geometry, leaving the mesh ready for another go */
+VOID mesh_free(MESH *mesh) {
+    if (mesh->vertices != NULL) BS->FreePool(mesh->vertices);
+    if (mesh->points != NULL) BS->FreePool(mesh->points);
+    if (mesh->faces != NULL) BS->FreePool(mesh->faces);
+    if (mesh->normals != NULL) BS->FreePool(mesh->normals);
+    if (mesh->face_shade != NULL) BS->FreePool(mesh->face_shade);
+    if (mesh->face_area != NULL) BS->FreePool(mesh->face_area);
+    mesh->vertices = NULL;
+    mesh->points = NULL;
+    mesh->faces = NULL;
+    mesh->normals = NULL;
+    mesh->face_shade = NULL;
+    mesh->face_area = NULL;
+}
+
+/* A mesh_parse pass posted to an AP */
+typedef struct {
+    MESH *mesh;
+    CHAR16 *text;
+    BOOLEAN ok;
+} MESH_PARSE;
+
+/* Run a parse pass; the job side of mesh_parse_posted */
+VOID mesh_parse_job(JOB_WORKER *worker, VOID *data) {
+    MESH_PARSE *parse = (MESH_PARSE *)data;
+
+    (VOID)worker;
+    parse->ok = mesh_parse(parse->mesh, parse->text);
+}
+
+/* Parse on an AP while the other tasks carry on; the allocation between passes stays on the BSP */
+BOOLEAN mesh_parse_posted(MESH *mesh, CHAR16 *text) {
+    MESH_PARSE parse;
+    JOB_POST post;
+
+    parse.mesh = mesh;
+    parse.text = text;
+    parse.ok = FALSE;
+    job_post(&post, mesh_parse_job, &parse);
+    job_post_wait(&post);
+    return parse.ok;
+}
+
+/* Load MESH_FILE; FALSE (with nothing allocated) when it is missing or unusable */
+BOOLEAN mesh_load(MESH *mesh) {
+    CHAR16 *text;
+    UINTN len;
+    BOOLEAN ok;
+
+    if (EFI_ERROR(read_text_file(MESH_FILE, MESH_MAX_FILE, &text, &len))) return FALSE;
+    ok = mesh_parse_posted(mesh, text) && mesh->face_count > 0 && mesh_alloc(mesh) && mesh_parse_posted(mesh, text);
+    BS->FreePool(text);
+    if (!ok) mesh_free(mesh);
+    return ok;
+}
+
+/* The built-in mesh: a sphere with bumps, 16.16 like a loaded one */
+BOOLEAN mesh_builtin(MESH *mesh) {
+    INT32 sin_t[MESH_BUILTIN_ROWS + 1], cos_t[MESH_BUILTIN_ROWS + 1];
+    INT32 sin_p[MESH_BUILTIN_COLS], cos_p[MESH_BUILTIN_COLS];
+    UINTN f = 0;
+
+    mesh->vertex_count = MESH_BUILTIN_COLS * (MESH_BUILTIN_ROWS + 1);
+    mesh->face_count = 2 * MESH_BUILTIN_COLS * MESH_BUILTIN_ROWS;
+    if (!mesh_alloc(mesh)) return FALSE;
+
+    /* theta runs from pole to pole, phi around the axis; both tables are 10.22 */
+    donut_fill_table(sin_t, cos_t, MESH_BUILTIN_ROWS + 1, (INT32)calc_udiv64(DONUT_TWO_PI / 2, MESH_BUILTIN_ROWS, NULL));
+    donut_fill_table(sin_p, cos_p, MESH_BUILTIN_COLS, (INT32)calc_udiv64(DONUT_TWO_PI, MESH_BUILTIN_COLS, NULL));
+    for (UINTN j = 0; j <= MESH_BUILTIN_ROWS; j++) {
+        for (UINTN i = 0; i < MESH_BUILTIN_COLS; i++) {
+            /* Radius 1 + 0.2 sin(5 theta) sin(7 phi), 10.22; the phi table has the same step and wraps */
+            INT32 bump = DONUT_MUL(sin_p[(j * 5) % MESH_BUILTIN_COLS], sin_p[(i * 7) % MESH_BUILTIN_COLS]);
+            INT32 r = DONUT_ONE + bump / 5;
+            MESH_VECTOR *v = &mesh->vertices[j * MESH_BUILTIN_COLS + i];
+
+            v->x = DONUT_MUL(DONUT_MUL(r, sin_t[j]), cos_p[i]) >> (DONUT_FRAC - 16);
+            v->y = DONUT_MUL(r, cos_t[j]) >> (DONUT_FRAC - 16);
+            v->z = DONUT_MUL(DONUT_MUL(r, sin_t[j]), sin_p[i]) >> (DONUT_FRAC - 16);
+        }
     }
-    ConOut->OutputString(ConOut, L"\u256e");  /* Rounded top-right */
-    
-    /* Title */
-    if (title) {
-        UINTN title_len = StrLen(title);
-        set_cursor(x + (width - title_len) / 2, y);
-        ConOut->OutputString(ConOut, title);
+    for (UINT32 j = 0; j < MESH_BUILTIN_ROWS; j++) {
+        for (UINT32 i = 0; i < MESH_BUILTIN_COLS; i++) {
+            UINT32 a = j * MESH_BUILTIN_COLS + i;
+            UINT32 b = j * MESH_BUILTIN_COLS + (i + 1) % MESH_BUILTIN_COLS;
+            UINT32 c = a + MESH_BUILTIN_COLS, d = b + MESH_BUILTIN_COLS;
+
+            mesh->faces[f++] = a; mesh->faces[f++] = b; mesh->faces[f++] = c;
+            mesh->faces[f++] = b; mesh->faces[f++] = d; mesh->faces[f++] = c;
+        }
     }
-    
-    /* Sides */
-    for (UINTN i = 1; i < height - 1; i++) {
-        set_cursor(x, y + i);
-        ConOut->OutputString(ConOut, L"\u2502");  /* Vertical line */
-        set_cursor(x + width - 1, y + i);
-        ConOut->OutputString(ConOut, L"\u2502");
+    return TRUE;
+}
+
+/* Centre the 16.16 vertices and scale them into the unit sphere in MESH_FRAC, then work out face normals */
+VOID mesh_normalize(MESH *mesh) {
+    MESH_VECTOR lo = mesh->vertices[0], hi = mesh->vertices[0];
+    INT64 centre[3], half = 1;
+    UINT64 radius2 = 0, square;
+    UINT32 radius;
+
+    for (UINTN i = 1; i < mesh->vertex_count; i++) {
+        MESH_VECTOR *v = &mesh->vertices[i];
+        if (v->x < lo.x) lo.x = v->x;
+        if (v->y < lo.y) lo.y = v->y;
+        if (v->z < lo.z) lo.z = v->z;
+        if (v->x > hi.x) hi.x = v->x;
+        if (v->y > hi.y) hi.y = v->y;
+        if (v->z > hi.z) hi.z = v->z;
     }
-    
-    /* Bottom border */
-    set_cursor(x, y + height - 1);
-    ConOut->OutputString(ConOut, L"\u2570");  /* Rounded bottom-left */
-    for (UINTN i = 0; i < width - 2; i++) {
-        ConOut->OutputString(ConOut, L"\u2500");
+    centre[0] = ((INT64)lo.x + hi.x) / 2;
+    centre[1] = ((INT64)lo.y + hi.y) / 2;
+    centre[2] = ((INT64)lo.z + hi.z) / 2;
+    if ((INT64)hi.x - lo.x > 2 * half) half = ((INT64)hi.x - lo.x) / 2;
+    if ((INT64)hi.y - lo.y > 2 * half) half = ((INT64)hi.y - lo.y) / 2;
+    if ((INT64)hi.z - lo.z > 2 * half) half = ((INT64)hi.z - lo.z) / 2;
+
+    /* First into the unit cube, which leaves room to square, then into the unit sphere */
+    for (UINTN i = 0; i < mesh->vertex_count; i++) {
+        INT32 *c = &mesh->vertices[i].x;
+        for (UINTN k = 0; k < 3; k++) {
+            INT64 q, r;
+            calc_div64((c[k] - centre[k]) * MESH_ONE, half, &q, &r);
+            c[k] = (INT32)q;
+        }
+        square = (UINT64)((INT64)c[0] * c[0] + (INT64)c[1] * c[1] + (INT64)c[2] * c[2]);
+        if (square > radius2) radius2 = square;
+    }
+    radius = mesh_isqrt(radius2);
+    if (radius == 0) radius = 1;
+    for (UINTN i = 0; i < mesh->vertex_count; i++) {
+        MESH_VECTOR *v = &mesh->vertices[i];
+        v->x = v->x * MESH_ONE / (INT32)radius;
+        v->y = v->y * MESH_ONE / (INT32)radius;
+        v->z = v->z * MESH_ONE / (INT32)radius;
+    }
+
+    for (UINTN f = 0; f < mesh->face_count; f++) {
+        MESH_VECTOR *a = &mesh->vertices[mesh->faces[f * 3]];
+        MESH_VECTOR *b = &mesh->vertices[mesh->faces[f * 3 + 1]];
+        MESH_VECTOR *c = &mesh->vertices[mesh->faces[f * 3 + 2]];
+        INT64 ux = b->x - a->x, uy = b->y - a->y, uz = b->z - a->z;
+        INT64 vx = c->x - a->x, vy = c->y - a->y, vz = c->z - a->z;
+        INT64 n[3] = { uy * vz - uz * vy, uz * vx - ux * vz, ux * vy - uy * vx };
+        INT32 *out = &mesh->normals[f].x;
+        UINT32 length;
+
+        /* Bring the cross product under 2^30 so its squared length fits */
+        while (n[0] >= (1 << 30) || n[0] <= -(1 << 30) || n[1] >= (1 << 30) || n[1] <= -(1 << 30) ||
+               n[2] >= (1 << 30) || n[2] <= -(1 << 30)) {
+            n[0] >>= 1;
+            n[1] >>= 1;
+            n[2] >>= 1;
+        }
+        length = mesh_isqrt((UINT64)(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]));
+        for (UINTN k = 0; k < 3; k++) {
+            INT64 q = 0, r;
+            if (length != 0) calc_div64(n[k] * MESH_ONE, length, &q, &r);
+            out[k] = (INT32)q;
+        }
     }
-    ConOut->OutputString(ConOut, L"\u256f");  /* Rounded bottom-right */
-    
-    ConOut->SetAttribute(ConOut, COLOR_NORMAL);
 }
 
-/* Read a single keystroke with waiting */
-EFI_INPUT_KEY read_key(VOID) {
-    EFI_INPUT_KEY key;
-    UINTN index;
-    
-    /* Wait for key event */
-    BS->WaitForEvent(1, &ConIn->WaitForKey, &index);
-    
-    /* Read the keystroke */
-    ConIn->ReadKeyStroke(ConIn, &key);
-    
-    return key;
+/* Release a mesh and everything it holds */
+VOID mesh_close(VOID *state) {
+    MESH *mesh = (MESH *)state;
+
+    mesh_free(mesh);
+    if (mesh->z != NULL) BS->FreePool(mesh->z);
+    BS->FreePool(mesh);
 }
 
-/* Save buffer to file using UEFI Simple File System Protocol */
-EFI_STATUS save_to_file(CHAR16 *filename, CHAR16 buffer[MAX_LINES][MAX_LINE_LENGTH], UINTN num_lines) {
-    EFI_STATUS status;
-    EFI_GUID fs_guid = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID;
-    EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *fs;
-    EFI_FILE_PROTOCOL *root;
-    EFI_FILE_PROTOCOL *file;
-    UINTN handles_count = 0;
-    EFI_HANDLE *handles = NULL;
-    
-    /* Locate filesystem protocol - try to find writable filesystem */
-    status = BS->LocateHandleBuffer(ByProtocol, &fs_guid, NULL, &handles_count, &handles);
-    if (EFI_ERROR(status) || handles_count == 0) {
-        /* No filesystem available */
-        return EFI_NOT_FOUND;
+/* Load (or build) the mesh and size the projection so the unit sphere fits the grid */
+VOID *mesh_open(DEMO_GRID *grid, BOOLEAN wireframe) {
+    MESH *mesh = demo_alloc(sizeof(MESH));
+    INT32 fit;
+
+    if (mesh == NULL) return NULL;
+    SetMem(mesh, sizeof(*mesh), 0);
+    mesh->cols = grid->cols;
+    mesh->rows = grid->rows;
+    mesh->wireframe = wireframe;
+    mesh->cos_a = 1 << DONUT_TRIG_FRAC;
+    mesh->cos_b = 1 << DONUT_TRIG_FRAC;
+    mesh->z = demo_alloc(grid->cols * grid->rows * sizeof(UINT16));
+    if (mesh->z == NULL || (!mesh_load(mesh) && !mesh_builtin(mesh))) {
+        mesh_close(mesh);
+        return NULL;
     }
-    
-    /* Open the first available filesystem */
-    status = BS->HandleProtocol(handles[0], &fs_guid, (VOID **)&fs);
-    BS->FreePool(handles);
-    
-    if (EFI_ERROR(status)) {
-        return status;
+    mesh_normalize(mesh);
+
+    /*
+     * Seen from MESH_DISTANCE the unit sphere spans tan(asin(1/3)) < 0.36
+     * of the scale either side of the centre, so a scale of 4/3 of the
+     * height keeps it inside; text cells are about twice as tall as wide.
+     */
+    fit = (INT32)(grid->rows * 4 / 3);
+    if (grid->gop != NULL) {
+        if (fit > (INT32)(grid->cols * 4 / 3)) fit = (INT32)(grid->cols * 4 / 3);
+        mesh->scale_x = fit;
+    } else {
+        mesh->scale_x = 2 * fit;
     }
-    
-    /* Open the root directory */
-    status = fs->OpenVolume(fs, &root);
-    if (EFI_ERROR(status)) {
-        return status;
+    mesh->scale_y = fit;
+    return mesh;
+}
+
+/* Filled mesh effect */
+VOID *mesh_open_filled(DEMO_GRID *grid) {
+    return mesh_open(grid, FALSE);
+}
+
+/* Wireframe mesh effect */
+VOID *mesh_open_wireframe(DEMO_GRID *grid) {
+    return mesh_open(grid, TRUE);
+}
+
+/* Turn the mesh as fast as the donut spins */
+VOID mesh_update(VOID *state, UINT32 dt) {
+    MESH *mesh = (MESH *)state;
+    INT32 sin_d, cos_d;
+
+    donut_sincos_small(DONUT_SPIN_B / 1000 * (INT32)dt, &sin_d, &cos_d);
+    donut_rotate(&mesh->sin_a, &mesh->cos_a, sin_d, cos_d);
+    donut_sincos_small(DONUT_SPIN_A / 1000 * (INT32)dt, &sin_d, &cos_d);
+    donut_rotate(&mesh->sin_b, &mesh->cos_b, sin_d, cos_d);
+}
+
+/* Fill triangle a, b, c (counter-clockwise on screen) with shade where it is nearer than the z-buffer, in rows top to bottom - 1 */
+VOID mesh_fill(MESH *mesh, MESH_POINT *a, MESH_POINT *b, MESH_POINT *c, INT32 top, INT32 bottom, INT32 area, UINT8 shade) {
+    INT32 cols = (INT32)mesh->cols;
+    INT32 x0 = a->x, x1 = a->x, y0 = a->y, y1 = a->y;
+    INT32 half = 1 << (MESH_SUB - 1);
+    INT32 px, py;
+    MESH_POINT *from[3] = { b, c, a }, *to[3] = { c, a, b };
+    INT32 row[3], step_x[3], step_y[3];
+    INT64 z_x = 0, z_y = 0, z_0 = 0, q, r;
+    INT32 z_row, z_step, z_down;
+
+    /* The bounding box in pixels, and the centre of its first pixel */
+    if (b->x < x0) x0 = b->x;
+    if (c->x < x0) x0 = c->x;
+    if (b->x > x1) x1 = b->x;
+    if (c->x > x1) x1 = c->x;
+    if (b->y < y0) y0 = b->y;
+    if (c->y < y0) y0 = c->y;
+    if (b->y > y1) y1 = b->y;
+    if (c->y > y1) y1 = c->y;
+    x0 >>= MESH_SUB;
+    x1 >>= MESH_SUB;
+    y0 >>= MESH_SUB;
+    y1 >>= MESH_SUB;
+    if (y1 >= bottom) y1 = bottom - 1;
+    px = (x0 << MESH_SUB) + half;
+    py = (y0 << MESH_SUB) + half;
+
+    /*
+     * Edge k is opposite vertex k, so its function is that vertex's
+     * barycentric weight times area. Edges that are not top or left edges
+     * give up their boundary pixels to the neighbouring triangle.
+     */
+    for (UINTN k = 0; k < 3; k++) {
+        INT32 dx = to[k]->x - from[k]->x, dy = to[k]->y - from[k]->y;
+        BOOLEAN top_left = dy > 0 || (dy == 0 && dx < 0);
+        INT32 z = k == 0 ? a->z : k == 1 ? b->z : c->z;
+
+        row[k] = (px - from[k]->x) * dy - (py - from[k]->y) * dx - (top_left ? 0 : 1);
+        step_x[k] = dy << MESH_SUB;
+        step_y[k] = -(dx << MESH_SUB);
+        z_x += (INT64)step_x[k] * z;
+        z_y += (INT64)step_y[k] * z;
+        z_0 += (INT64)row[k] * z;
     }
-    
-    /* Create/open the file for writing */
-    status = root->Open(root, &file, filename, 
-                       EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE,
-                       0);
-    
-    if (EFI_ERROR(status)) {
-        root->Close(root);
-        return status;
+    /* The depth plane, in 1/256ths of a z-buffer unit; only slivers have steps steep enough to clamp */
+    calc_div64(z_x << 8, area, &q, &r);
+    z_step = q > MESH_MAX_Z_STEP ? MESH_MAX_Z_STEP : q < -MESH_MAX_Z_STEP ? -MESH_MAX_Z_STEP : (INT32)q;
+    calc_div64(z_y << 8, area, &q, &r);
+    z_down = q > MESH_MAX_Z_STEP ? MESH_MAX_Z_STEP : q < -MESH_MAX_Z_STEP ? -MESH_MAX_Z_STEP : (INT32)q;
+    calc_div64(z_0 << 8, area, &q, &r);
+    z_row = q > (1 << 29) ? (1 << 29) : q < -(1 << 29) ? -(1 << 29) : (INT32)q;
+
+    /* Step down to the band rather than start there, so every band split draws the same depths */
+    if (y0 < top) {
+        INT32 skip = top - y0;
+
+        row[0] += skip * step_y[0];
+        row[1] += skip * step_y[1];
+        row[2] += skip * step_y[2];
+        z_row += skip * z_down;
+        y0 = top;
     }
-    
-    /* Write each line to the file */
-    for (UINTN i = 0; i < num_lines; i++) {
-        UINTN len = StrLen(buffer[i]) * sizeof(CHAR16);
-        file->Write(file, &len, buffer[i]);
-        
-        /* Add newline */
-        CHAR16 newline[] = L"\r\n";
-        len = 4;
-        file->Write(file, &len, newline);
+
+    for (INT32 y = y0; y <= y1; y++) {
+        INT32 e0 = row[0], e1 = row[1], e2 = row[2], z = z_row;
+        UINT16 *zbuf = mesh->z + y * cols;
+        UINT8 *out = mesh->shade + y * cols;
+        BOOLEAN entered = FALSE;
+
+        for (INT32 x = x0; x <= x1; x++) {
+            if ((e0 | e1 | e2) >= 0) {
+                UINT16 depth = (UINT16)(z >> 8);
+                entered = TRUE;
+                if (depth > zbuf[x]) {
+                    zbuf[x] = depth;
+                    out[x] = shade;
+                }
+            } else if (entered) {
+                break;
+            }
+            e0 += step_x[0];
+            e1 += step_x[1];
+            e2 += step_x[2];
+            z += z_step;
+        }
+        row[0] += step_y[0];
+        row[1] += step_y[1];
+        row[2] += step_y[2];
+        z_row += z_down;
     }
-    
-    file->Close(file);
-    root->Close(root);
-    
-    return EFI_SUCCESS;
 }
 
-/* Load file from UEFI filesystem */
-EFI_STATUS load_from_file(CHAR16 *filename, CHAR16 buffer[MAX_LINES][MAX_LINE_LENGTH], UINTN *num_lines) {
-    EFI_STATUS status;
-    EFI_GUID fs_guid = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID;
-    EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *fs;
-    EFI_FILE_PROTOCOL *root;
-    EFI_FILE_PROTOCOL *file;
-    UINTN handles_count = 0;
-    EFI_HANDLE *handles = NULL;
-    CHAR16 *file_buffer;
-    UINTN file_size = 8192;  /* Read up to 8KB */
-    
-    *num_lines = 0;
-    
-    /* Locate filesystem protocol */
-    status = BS->LocateHandleBuffer(ByProtocol, &fs_guid, NULL, &handles_count, &handles);
-    if (EFI_ERROR(status) || handles_count == 0) {
-        return EFI_NOT_FOUND;
+/* Draw a line between two projected points */
+VOID mesh_line(MESH *mesh, UINT8 *grid_shade, MESH_POINT *a, MESH_POINT *b, UINT8 shade) {
+    INT32 x = a->x >> MESH_SUB, y = a->y >> MESH_SUB;
+    INT32 x_end = b->x >> MESH_SUB, y_end = b->y >> MESH_SUB;
+    INT32 dx = x_end > x ? x_end - x : x - x_end, sx = x_end > x ? 1 : -1;
+    INT32 dy = y_end > y ? y - y_end : y_end - y, sy = y_end > y ? 1 : -1;
+    INT32 err = dx + dy, twice;
+
+    for (;;) {
+        if (x >= 0 && y >= 0 && x < (INT32)mesh->cols && y < (INT32)mesh->rows) {
+            grid_shade[y * (INT32)mesh->cols + x] = shade;
+        }
+        if (x == x_end && y == y_end) break;
+        twice = 2 * err;
+        if (twice >= dy) {
+            err += dy;
+            x += sx;
+        }
+        if (twice <= dx) {
+            err += dx;
+            y += sy;
+        }
     }
-    
-    status = BS->HandleProtocol(handles[0], &fs_guid, (VOID **)&fs);
-    BS->FreePool(handles);
-    
-    if (EFI_ERROR(status)) return status;
-    
-    status = fs->OpenVolume(fs, &root);
-    if (EFI_ERROR(status)) return status;
-    
-    /* Open file for reading */
-    status = root->Open(root, &file, filename, EFI_FILE_MODE_READ, 0);
-    if (EFI_ERROR(status)) {
-        root->Close(root);
-        return status;
+}
+
+/* Rotate and project vertices first to end - 1 */
+VOID mesh_transform(VOID *state, UINTN first, UINTN end) {
+    MESH *mesh = (MESH *)state;
+    INT32 centre_x = (INT32)mesh->cols << (MESH_SUB - 1), centre_y = (INT32)mesh->rows << (MESH_SUB - 1);
+    INT32 (*m)[3] = mesh->matrix;
+
+    for (UINTN i = first; i < end; i++) {
+        MESH_VECTOR *v = &mesh->vertices[i];
+        MESH_POINT *p = &mesh->points[i];
+        INT32 x = (m[0][0] * v->x + m[0][1] * v->y + m[0][2] * v->z) >> MESH_FRAC;
+        INT32 y = (m[1][0] * v->x + m[1][1] * v->y + m[1][2] * v->z) >> MESH_FRAC;
+        INT32 z = MESH_DISTANCE - ((m[2][0] * v->x + m[2][1] * v->y + m[2][2] * v->z) >> MESH_FRAC);
+
+        p->x = centre_x + (x * (mesh->scale_x << MESH_SUB)) / z;
+        p->y = centre_y - (y * (mesh->scale_y << MESH_SUB)) / z;
+        p->z = 0x7FFFFFFF / z;                              /* Depth 2 to 4 maps to 65535 down to 32767 */
     }
-    
-    /* Allocate buffer for file contents */
-    status = BS->AllocatePool(EfiLoaderData, file_size, (VOID **)&file_buffer);
-    if (EFI_ERROR(status)) {
-        file->Close(file);
-        root->Close(root);
-        return status;
+}
+
+/* Cull and light faces first to end - 1, leaving shade 0 for the ones not drawn */
+VOID mesh_light(VOID *state, UINTN first, UINTN end) {
+    MESH *mesh = (MESH *)state;
+    INT32 (*m)[3] = mesh->matrix;
+    /* Towards the light: up, left and behind the viewer */
+    static CONST INT32 light[3] = { -5734, 8192, 13107 };
+    INT32 max_x = (INT32)mesh->cols << MESH_SUB, max_y = (INT32)mesh->rows << MESH_SUB;
+
+    for (UINTN f = first; f < end; f++) {
+        MESH_POINT *a = &mesh->points[mesh->faces[f * 3]];
+        MESH_POINT *b = &mesh->points[mesh->faces[f * 3 + 1]];
+        MESH_POINT *c = &mesh->points[mesh->faces[f * 3 + 2]];
+        INT32 area = (c->x - a->x) * (b->y - a->y) - (b->x - a->x) * (c->y - a->y);
+        MESH_VECTOR *n;
+        INT32 lit;
+
+        /* Clockwise on screen faces away; the bounds check only guards against bad input */
+        mesh->face_shade[f] = 0;
+        if (area <= 0) continue;
+        if (a->x < 0 || b->x < 0 || c->x < 0 || a->y < 0 || b->y < 0 || c->y < 0 ||
+            a->x >= max_x || b->x >= max_x || c->x >= max_x || a->y >= max_y || b->y >= max_y || c->y >= max_y) {
+            continue;
+        }
+
+        n = &mesh->normals[f];
+        lit = (((m[0][0] * n->x + m[0][1] * n->y + m[0][2] * n->z) >> MESH_FRAC) * light[0] +
+               ((m[1][0] * n->x + m[1][1] * n->y + m[1][2] * n->z) >> MESH_FRAC) * light[1] +
+               ((m[2][0] * n->x + m[2][1] * n->y + m[2][2] * n->z) >> MESH_FRAC) * light[2]) >> MESH_FRAC;
+        if (lit > MESH_ONE) lit = MESH_ONE;
+        mesh->face_shade[f] = (UINT8)(MESH_AMBIENT + (lit > 0 ? lit * (255 - MESH_AMBIENT) / MESH_ONE : 0));
+        mesh->face_area[f] = area;
     }
-    
-    /* Read file */
-    status = file->Read(file, &file_size, file_buffer);
-    file->Close(file);
-    root->Close(root);
-    
-    if (EFI_ERROR(status)) {
-        BS->FreePool(file_buffer);
-        return status;
+}
+
+/* Clear bands first to end - 1 of the frame and fill every face that reaches into them */
+VOID mesh_bands(VOID *state, UINTN first, UINTN end) {
+    MESH *mesh = (MESH *)state;
+    UINTN top = first * mesh->band_rows;
+    UINTN bottom = end * mesh->band_rows < mesh->rows ? end * mesh->band_rows : mesh->rows;
+    INT32 band_top = (INT32)top << MESH_SUB, band_bottom = (INT32)bottom << MESH_SUB;
+
+    SetMem(mesh->shade + top * mesh->cols, (bottom - top) * mesh->cols, 0);
+    SetMem(mesh->z + top * mesh->cols, (bottom - top) * mesh->cols * sizeof(UINT16), 0);
+    for (UINTN f = 0; f < mesh->face_count; f++) {
+        MESH_POINT *a, *b, *c;
+
+        if (mesh->face_shade[f] == 0) continue;
+        a = &mesh->points[mesh->faces[f * 3]];
+        b = &mesh->points[mesh->faces[f * 3 + 1]];
+        c = &mesh->points[mesh->faces[f * 3 + 2]];
+        if ((a->y < band_top && b->y < band_top && c->y < band_top) ||
+            (a->y >= band_bottom && b->y >= band_bottom && c->y >= band_bottom)) {
+            continue;
+        }
+        mesh_fill(mesh, a, b, c, (INT32)top, (INT32)bottom, mesh->face_area[f], mesh->face_shade[f]);
+    }
+}
+
+/*
+ * Transform, cull, light and draw every face. Vertices and faces are
+ * shared out in pieces; filled faces are drawn in horizontal bands, a few
+ * per processor, each band clearing and filling only its own rows.
+ */
+VOID mesh_render(VOID *state, DEMO_GRID *grid) {
+    MESH *mesh = (MESH *)state;
+    INT32 sa = mesh->sin_a >> (DONUT_TRIG_FRAC - MESH_FRAC), ca = mesh->cos_a >> (DONUT_TRIG_FRAC - MESH_FRAC);
+    INT32 sb = mesh->sin_b >> (DONUT_TRIG_FRAC - MESH_FRAC), cb = mesh->cos_b >> (DONUT_TRIG_FRAC - MESH_FRAC);
+    UINTN bands = (job_worker_count + 1) * MESH_BANDS_PER_CPU;
+
+    /* A turn of b about the vertical axis, then a tilt of a about the horizontal one */
+    mesh->matrix[0][0] = cb;
+    mesh->matrix[0][1] = 0;
+    mesh->matrix[0][2] = sb;
+    mesh->matrix[1][0] = (INT32)(((INT64)sa * sb) >> MESH_FRAC);
+    mesh->matrix[1][1] = ca;
+    mesh->matrix[1][2] = -(INT32)(((INT64)sa * cb) >> MESH_FRAC);
+    mesh->matrix[2][0] = -(INT32)(((INT64)ca * sb) >> MESH_FRAC);
+    mesh->matrix[2][1] = sa;
+    mesh->matrix[2][2] = (INT32)(((INT64)ca * cb) >> MESH_FRAC);
+    mesh->shade = grid->shade;
+
+    job_parallel_for(0, mesh->vertex_count, MESH_GRAIN, mesh_transform, mesh);
+    job_parallel_for(0, mesh->face_count, MESH_GRAIN, mesh_light, mesh);
+
+    if (mesh->wireframe) {
+        SetMem(grid->shade, grid->cols * grid->rows, 0);
+        for (UINTN f = 0; f < mesh->face_count; f++) {
+            MESH_POINT *a = &mesh->points[mesh->faces[f * 3]];
+            MESH_POINT *b = &mesh->points[mesh->faces[f * 3 + 1]];
+            MESH_POINT *c = &mesh->points[mesh->faces[f * 3 + 2]];
+            UINT8 shade = mesh->face_shade[f];
+
+            if (shade == 0) continue;
+            mesh_line(mesh, grid->shade, a, b, shade);
+            mesh_line(mesh, grid->shade, b, c, shade);
+            mesh_line(mesh, grid->shade, c, a, shade);
+        }
+        return;
     }
-    
-    /* Parse into lines */
-    UINTN line = 0;
-    UINTN col = 0;
-    for (UINTN i = 0; i < file_size / sizeof(CHAR16) && line < MAX_LINES; i++) {
-        if (file_buffer[i] == L'\r' || file_buffer[i] == L'\n') {
-            buffer[line][col] = 0;
-            if (col > 0) line++;
-            col = 0;
-        } else if (col < MAX_LINE_LENGTH - 1) {
-            buffer[line][col++] = file_buffer[i];
+    mesh->band_rows = (mesh->rows + bands - 1) / bands;
+    job_parallel_for(0, (mesh->rows + mesh->band_rows - 1) / mesh->band_rows, 1, mesh_bands, mesh);
+}
+
+/* The effects, in the order of their number keys */
+#define DEMO_EFFECTS 7
+
+DEMO_EFFECT demo_effects[DEMO_EFFECTS] = {
+    { L"Donut", L".,-~:;=!*#$@", { { 20, 30, 70 }, { 230, 120, 40 }, { 255, 245, 210 } },
+      donut_open, donut_update, donut_render, donut_close },
+    { L"Plasma", L" .:-=+*#%@", { { 40, 10, 90 }, { 220, 40, 130 }, { 255, 230, 90 } },
+      plasma_open, plasma_update, plasma_render, plasma_close },
+    { L"Fire", L" .:-=+*#%@", { { 70, 0, 0 }, { 255, 110, 0 }, { 255, 255, 200 } },
+      fire_open, fire_update, fire_render, fire_close },
+    { L"Starfield", L".:+*", { { 50, 50, 70 }, { 160, 160, 200 }, { 255, 255, 255 } },
+      starfield_open, starfield_update, starfield_render, starfield_close },
+    { L"Matrix", L".,:;-=+<>!?|/()[]{}ilftrxzcvunoeaskhdbqpwmXZKW8%&$#@", { { 0, 30, 0 }, { 20, 200, 70 }, { 220, 255, 220 } },
+      matrix_open, matrix_update, matrix_render, matrix_close },
+    { L"Mesh", L".,-~:;=!*#$@", { { 20, 30, 50 }, { 90, 150, 210 }, { 240, 248, 255 } },
+      mesh_open_filled, mesh_update, mesh_render, mesh_close },
+    { L"Wireframe", L".,-~:;=!*#$@", { { 0, 40, 40 }, { 40, 200, 200 }, { 230, 255, 255 } },
+      mesh_open_wireframe, mesh_update, mesh_render, mesh_close }
+};
+
+/*
+ * Show the frame rate and where the time goes: in the window title in
+ * text mode, on the status row in graphics mode. Render time covers the
+ * effect's update and render; present time is the host's share.
+ */
+VOID demo_status(DEMO_GRID *grid, DEMO_EFFECT *effect, FRAME_CLOCK *clock, BOOLEAN measured) {
+    CHAR16 line[96];
+    UINT32 present_tenths = clock->shown_tenths - clock->shown_render_tenths;
+
+    if (grid->gop == NULL) {
+        if (measured) {
+            SPrint(line, sizeof(line), L" %s - %d/%d fps, render %d.%d ms, present %d.%d ms ", effect->name,
+                   clock->shown_fps, clock->fps, clock->shown_render_tenths / 10, clock->shown_render_tenths % 10,
+                   present_tenths / 10, present_tenths % 10);
+        } else {
+            SPrint(line, sizeof(line), L" %s - %d fps ", effect->name, clock->fps);
         }
+        draw_window_title(5, 2, 70, line);
+        return;
     }
-    
-    if (col > 0) {
-        buffer[line][col] = 0;
-        line++;
+
+    if (measured) {
+        /* Pixels rendered per second, in tenths of a million */
+        UINT32 mpixels = (UINT32)calc_udiv64((UINT64)(grid->cols * grid->rows) * clock->shown_mfps, 100000000, NULL);
+        SPrint(line, sizeof(line), L"%s %dx%d  %d.%d/%d fps  render %d.%d ms  present %d.%d ms  %d.%d Mpixel/s",
+               effect->name, grid->cols, grid->rows, clock->shown_mfps / 1000, clock->shown_mfps % 1000 / 100,
+               clock->fps, clock->shown_render_tenths / 10, clock->shown_render_tenths % 10,
+               present_tenths / 10, present_tenths % 10, mpixels / 10, mpixels % 10);
+    } else {
+        SPrint(line, sizeof(line), L"%s %dx%d  %d fps", effect->name, grid->cols, grid->rows, clock->fps);
     }
-    
-    *num_lines = line;
-    BS->FreePool(file_buffer);
-    
-    return EFI_SUCCESS;
+    plot_line(SCREEN_HEIGHT - 2, line);
 }
 
-/* Notepad application */
-VOID app_notepad(VOID) {
-    EFI_INPUT_KEY key;
-    BOOLEAN running = TRUE;
-    
+/* Draw everything around the effect for the grid's mode; the text window starts out blank */
+VOID demo_chrome(DEMO_GRID *grid) {
+    CHAR16 help[80];
+    UINTN cpus = grid->ap_count + 1;
+
+    SPrint(help, sizeof(help), L"ESC=Exit 1-%d=Effect +/-=Rate G=%s B=Bench H=Hide (%s x%d)", DEMO_EFFECTS,
+           grid->gop == NULL ? L"Graphics" : L"Text", donut_use_sse2 ? L"SSE2" : L"fixed", cpus);
     clear_screen();
-    draw_topbar();
-    draw_window(10, 3, 60, 18, L" Notepad ");
-    
-    set_cursor(12, 20);
-    ConOut->OutputString(ConOut, L"Type text. F2=Save, ESC=Exit");
-    
-    notepad_cursor_line = 0;
-    notepad_cursor_col = 0;
-    
-    while (running) {
-        /* Display current buffer */
-        for (UINTN i = 0; i < 16 && i < notepad_lines; i++) {
-            set_cursor(12, 4 + i);
-            ConOut->OutputString(ConOut, L"                                                      ");
-            set_cursor(12, 4 + i);
-            ConOut->OutputString(ConOut, notepad_buffer[i]);
+    if (grid->gop == NULL) {
+        for (UINTN i = 0; i < grid->cols * grid->rows; i++) {
+            grid->shown[i] = L' ';
         }
-        
-        /* Show cursor */
-        set_cursor(12 + notepad_cursor_col, 4 + notepad_cursor_line);
-        
-        key = read_key();
-        
-        if (key.ScanCode == SCAN_ESC) {
-            running = FALSE;
-        } else if (key.ScanCode == SCAN_F2) {
-            /* Save to file */
-            EFI_STATUS status = save_to_file(L"\\notepad.txt", notepad_buffer, notepad_lines);
-            set_cursor(12, 20);
-            if (EFI_ERROR(status)) {
-                ConOut->OutputString(ConOut, L"Save failed (filesystem unavailable)");
-            } else {
-                ConOut->OutputString(ConOut, L"Saved to \\notepad.txt            ");
-            }
-        } else if (key.UnicodeChar == CHAR_BACKSPACE) {
-            if (notepad_cursor_col > 0) {
-                notepad_cursor_col--;
-                notepad_buffer[notepad_cursor_line][notepad_cursor_col] = 0;
-            }
-        } else if (key.UnicodeChar == CHAR_CARRIAGE_RETURN) {
-            notepad_buffer[notepad_cursor_line][notepad_cursor_col] = 0;
-            notepad_cursor_line++;
-            notepad_cursor_col = 0;
-            if (notepad_cursor_line >= MAX_LINES) notepad_cursor_line = MAX_LINES - 1;
-            if (notepad_cursor_line >= notepad_lines) notepad_lines = notepad_cursor_line + 1;
-        } else if (key.UnicodeChar >= 32 && key.UnicodeChar < 127) {
-            if (notepad_cursor_col < MAX_LINE_LENGTH - 1) {
-                notepad_buffer[notepad_cursor_line][notepad_cursor_col++] = key.UnicodeChar;
-                notepad_buffer[notepad_cursor_line][notepad_cursor_col] = 0;
-                if (notepad_cursor_line >= notepad_lines) notepad_lines = notepad_cursor_line + 1;
-            }
+        draw_topbar();
+        draw_window(5, 2, 70, 21, L" Demo Effects ");
+        set_cursor(DEMO_LEFT + 1, DEMO_TOP + DEMO_ROWS);
+        ConOut->OutputString(ConOut, help);
+    } else {
+        plot_line(SCREEN_HEIGHT - 1, help);
+    }
+}
+
+/*
+ * Draw the background window again after the focus has cleared the
+ * screen: every cell is rewritten, and the frame is drawn when none of
+ * it would land on the focus's windows.
+ */
+VOID demo_back_chrome(DEMO_GRID *grid, DEMO_EFFECT *effect) {
+    CHAR16 title[DEMO_BACK_COLS];
+    UINTN x = grid->left - 1, y = grid->top - 1;
+    UINTN width = grid->cols + 2, height = grid->rows + 2;
+    BOOLEAN clear = TRUE;
+
+    SetMem(grid->shown, grid->cols * grid->rows * sizeof(CHAR16), 0);
+    grid->generation = screen_generation;
+    for (UINTN i = 0; i < width; i++) {
+        if (task_obscured(x + i, y) || task_obscured(x + i, y + height - 1)) clear = FALSE;
+    }
+    for (UINTN i = 0; i < height; i++) {
+        if (task_obscured(x, y + i) || task_obscured(x + width - 1, y + i)) clear = FALSE;
+    }
+    if (clear) {
+        SPrint(title, sizeof(title), L" %s ", effect->name);
+        draw_window(x, y, width, height, title);
+    }
+}
+
+/*
+ * Benchmark
+ *
+ * B runs every effect, and the donut again on its slower paths, for
+ * DEMO_BENCH_FRAMES frames as fast as the CPU allows: no frame clock, a
+ * fixed dt and fixed random seeds, so one run repeats the next. A first
+ * pass only updates and renders; a second renders the same frames again
+ * and times presenting each one. Cycles come from RDTSC, whose rate is
+ * measured against Stall() to convert the medians to microseconds. The
+ * summary goes to \bench.txt on the boot volume and to the serial port,
+ * and stays on screen until a key is pressed.
+ */
+#define DEMO_BENCH_FRAMES 150
+#define DEMO_BENCH_SEED   0x2545F491
+#define DEMO_BENCH_REPORT 2048              /* Characters */
+
+typedef struct {
+    UINT64 min, median, max;            /* Cycles per frame */
+    UINT64 total;
+} DEMO_BENCH_STATS;
+
+/* Sort the samples and sum them up */
+VOID demo_bench_stats(UINT64 *samples, UINTN count, DEMO_BENCH_STATS *stats) {
+    stats->total = 0;
+    for (UINTN i = 0; i < count; i++) {
+        UINT64 value = samples[i];
+        UINTN j = i;
+
+        stats->total += value;
+        for (; j > 0 && samples[j - 1] > value; j--) {
+            samples[j] = samples[j - 1];
         }
+        samples[j] = value;
     }
+    stats->min = samples[0];
+    stats->median = samples[count / 2];
+    stats->max = samples[count - 1];
 }
 
-/* Calculator application */
-VOID app_calc(VOID) {
-    EFI_INPUT_KEY key;
-    BOOLEAN running = TRUE;
-    CHAR16 input[128];
-    UINTN input_pos = 0;
-    CHAR16 result_str[64];
-    
-    input[0] = 0;
-    
-    clear_screen();
-    draw_topbar();
-    draw_window(15, 6, 50, 12, L" Calculator ");
-    
-    set_cursor(17, 8);
-    ConOut->OutputString(ConOut, L"Enter expression (e.g., 5+3*2):");
-    
-    set_cursor(17, 15);
-    ConOut->OutputString(ConOut, L"ENTER=Calculate, ESC=Exit");
-    
-    while (running) {
-        /* Display input */
-        set_cursor(17, 10);
-        ConOut->OutputString(ConOut, L"                                              ");
-        set_cursor(17, 10);
-        ConOut->OutputString(ConOut, input);
-        
-        key = read_key();
-        
-        if (key.ScanCode == SCAN_ESC) {
-            running = FALSE;
-        } else if (key.UnicodeChar == CHAR_CARRIAGE_RETURN) {
-            /* Evaluate expression */
-            INTN result = evaluate_expression(input);
-            SPrint(result_str, sizeof(result_str), L"Result: %d", result);
-            
-            set_cursor(17, 12);
-            ConOut->OutputString(ConOut, L"                                              ");
-            set_cursor(17, 12);
-            ConOut->OutputString(ConOut, result_str);
-            
-            /* Clear input */
-            input[0] = 0;
-            input_pos = 0;
-        } else if (key.UnicodeChar == CHAR_BACKSPACE) {
-            if (input_pos > 0) {
-                input_pos--;
-                input[input_pos] = 0;
-            }
-        } else if ((key.UnicodeChar >= L'0' && key.UnicodeChar <= L'9') ||
-                   key.UnicodeChar == L'+' || key.UnicodeChar == L'-' ||
-                   key.UnicodeChar == L'*' || key.UnicodeChar == L'/') {
-            if (input_pos < 127) {
-                input[input_pos++] = key.UnicodeChar;
-                input[input_pos] = 0;
+/* Time DEMO_BENCH_FRAMES frames of one effect, rendering alone and then presenting; FALSE if it will not open */
+BOOLEAN demo_bench_effect(DEMO_GRID *grid, DEMO_EFFECT *effect, UINT64 *samples,
+                          DEMO_BENCH_STATS *compute, DEMO_BENCH_STATS *present) {
+    VOID *state;
+
+    demo_build_palette(effect);
+    for (UINTN pass = 0; pass < 2; pass++) {
+        state = effect->open(grid);
+        if (state == NULL) return FALSE;
+        for (UINTN f = 0; f < DEMO_BENCH_FRAMES; f++) {
+            UINT64 start = read_tsc();
+
+            effect->update(state, 1000 / DEMO_DEFAULT_FPS);
+            effect->render(state, grid);
+            if (pass == 1) {
+                start = read_tsc();
+                if (grid->gop != NULL) {
+                    demo_present_gop(grid);
+                } else {
+                    demo_present_text(grid);
+                }
             }
+            /* 64 bits: a slow frame on a multi-GHz TSC passes 2^32 cycles */
+            samples[f] = read_tsc() - start;
         }
+        effect->close(state);
+        demo_bench_stats(samples, DEMO_BENCH_FRAMES, pass == 0 ? compute : present);
     }
+    return TRUE;
 }
 
-/* Editor application */
-VOID app_editor(VOID) {
-    EFI_INPUT_KEY key;
-    BOOLEAN running = TRUE;
-    CHAR16 editor_buffer[MAX_LINES][MAX_LINE_LENGTH];
-    UINTN editor_lines = 1;
-    UINTN editor_cursor_line = 0;
-    UINTN editor_cursor_col = 0;
-    
-    /* Try to load sample.txt */
-    EFI_STATUS status = load_from_file(L"\\sample.txt", editor_buffer, &editor_lines);
-    
-    if (EFI_ERROR(status)) {
-        /* Create default content */
-        StrCpy(editor_buffer[0], L"This is a sample file.");
-        StrCpy(editor_buffer[1], L"Edit this text and press F2 to save.");
-        editor_lines = 2;
+/* Show a line of benchmark progress where the mode's help line goes */
+VOID demo_bench_progress(DEMO_GRID *grid, CHAR16 *text) {
+    if (grid->gop != NULL) {
+        plot_line(SCREEN_HEIGHT - 1, text);
+    } else {
+        set_cursor(DEMO_LEFT + 1, DEMO_TOP + DEMO_ROWS);
+        ConOut->OutputString(ConOut, text);
     }
-    
-    clear_screen();
-    draw_topbar();
-    draw_window(8, 2, 64, 20, L" Editor - sample.txt ");
-    
-    set_cursor(10, 21);
-    ConOut->OutputString(ConOut, L"F2=Save, F3=Reload, ESC=Exit");
-    
-    while (running) {
-        /* Display buffer */
-        for (UINTN i = 0; i < 18 && i < editor_lines; i++) {
-            set_cursor(10, 3 + i);
-            ConOut->OutputString(ConOut, L"                                                            ");
-            set_cursor(10, 3 + i);
-            ConOut->OutputString(ConOut, editor_buffer[i]);
-        }
-        
-        /* Show cursor */
-        set_cursor(10 + editor_cursor_col, 3 + editor_cursor_line);
-        
-        key = read_key();
-        
-        if (key.ScanCode == SCAN_ESC) {
-            running = FALSE;
-        } else if (key.ScanCode == SCAN_F2) {
-            /* Save file */
-            status = save_to_file(L"\\sample.txt", editor_buffer, editor_lines);
-            set_cursor(10, 21);
-            if (EFI_ERROR(status)) {
-                ConOut->OutputString(ConOut, L"Save failed (filesystem unavailable)");
+}
+
+/* Run the benchmark on the grid's mode, then show, save and send the summary */
+VOID demo_benchmark(DEMO_GRID *grid) {
+    static CHAR16 *variant_names[3] = { L"", L" fixed", L" 1 CPU" };
+    CHAR16 *report;
+    CHAR16 line[96];
+    UINT64 *samples;
+    UINTN len = 0;
+    UINT64 mhz;
+    BOOLEAN sse2 = donut_use_sse2;
+    UINTN cpus = grid->ap_count + 1;
+    EFI_STATUS saved, sent;
+
+    report = demo_alloc(DEMO_BENCH_REPORT * sizeof(CHAR16));
+    samples = demo_alloc(DEMO_BENCH_FRAMES * sizeof(UINT64));
+    if (report == NULL || samples == NULL) {
+        if (report != NULL) BS->FreePool(report);
+        if (samples != NULL) BS->FreePool(samples);
+        return;
+    }
+
+    demo_chrome(grid);
+    demo_bench_progress(grid, L"Benchmark: measuring the TSC...                ");
+    mhz = read_tsc();
+    BS->Stall(50000);
+    mhz = calc_udiv64(read_tsc() - mhz, 50000, NULL);
+    if (mhz == 0) mhz = 1;
+
+    SPrint(report, DEMO_BENCH_REPORT * sizeof(CHAR16),
+           L"ASCII-OS demo benchmark: %s %dx%d, %s, %d CPU%s, %d frames, TSC %d MHz\n"
+           L"Effect           render kcycles/frame          present kcycles/frame    median us\n"
+           L"                 min   median      max         min   median      max  render present\n",
+           grid->gop != NULL ? L"graphics" : L"text", grid->cols, grid->rows, sse2 ? L"SSE2" : L"fixed point",
+           cpus, cpus > 1 ? L"s" : L"", DEMO_BENCH_FRAMES, (UINTN)mhz);
+    len = StrLen(report);
+
+    demo_bench_seed = DEMO_BENCH_SEED;
+    for (UINTN e = 0; e < DEMO_EFFECTS; e++) {
+        /* The donut also runs without SSE2 and without the APs when it has them */
+        for (UINTN variant = 0; variant < (e == 0 ? 3 : 1); variant++) {
+            DEMO_GRID bench_grid = *grid;
+            DEMO_BENCH_STATS compute, present;
+
+            if ((variant == 1 && !sse2) || (variant == 2 && grid->ap_count == 0)) continue;
+            donut_use_sse2 = sse2 && variant != 1;
+            if (variant == 2) bench_grid.ap_count = 0;
+
+            SPrint(line, sizeof(line), L"Benchmark: %s%s...                        ",
+                   demo_effects[e].name, variant_names[variant]);
+            demo_bench_progress(grid, line);
+            if (!demo_bench_effect(&bench_grid, &demo_effects[e], samples, &compute, &present)) {
+                SPrint(line, sizeof(line), L"%s%s: not enough memory\n", demo_effects[e].name, variant_names[variant]);
             } else {
-                ConOut->OutputString(ConOut, L"Saved to \\sample.txt            ");
-            }
-        } else if (key.ScanCode == SCAN_F3) {
-            /* Reload file */
-            load_from_file(L"\\sample.txt", editor_buffer, &editor_lines);
-            editor_cursor_line = 0;
-            editor_cursor_col = 0;
-        } else if (key.UnicodeChar == CHAR_BACKSPACE) {
-            if (editor_cursor_col > 0) {
-                editor_cursor_col--;
-                editor_buffer[editor_cursor_line][editor_cursor_col] = 0;
+                SPrint(line, sizeof(line), L"%s%s", demo_effects[e].name, variant_names[variant]);
+                for (UINTN pad = StrLen(line); pad < 15; pad++) line[pad] = L' ';
+                SPrint(line + 15, sizeof(line) - 15 * sizeof(CHAR16),
+                       L"%6d %8d %8d    %8d %8d %8d  %6d %7d\n",
+                       (UINTN)calc_udiv64(compute.min, 1000, NULL), (UINTN)calc_udiv64(compute.median, 1000, NULL),
+                       (UINTN)calc_udiv64(compute.max, 1000, NULL), (UINTN)calc_udiv64(present.min, 1000, NULL),
+                       (UINTN)calc_udiv64(present.median, 1000, NULL), (UINTN)calc_udiv64(present.max, 1000, NULL),
+                       (UINTN)calc_udiv64(compute.median, mhz, NULL), (UINTN)calc_udiv64(present.median, mhz, NULL));
             }
-        } else if (key.UnicodeChar == CHAR_CARRIAGE_RETURN) {
-            editor_buffer[editor_cursor_line][editor_cursor_col] = 0;
-            editor_cursor_line++;
-            editor_cursor_col = 0;
-            if (editor_cursor_line >= MAX_LINES) editor_cursor_line = MAX_LINES - 1;
-            if (editor_cursor_line >= editor_lines) editor_lines = editor_cursor_line + 1;
-        } else if (key.UnicodeChar >= 32 && key.UnicodeChar < 127) {
-            if (editor_cursor_col < MAX_LINE_LENGTH - 1) {
-                editor_buffer[editor_cursor_line][editor_cursor_col++] = key.UnicodeChar;
-                editor_buffer[editor_cursor_line][editor_cursor_col] = 0;
-                if (editor_cursor_line >= editor_lines) editor_lines = editor_cursor_line + 1;
+            if (len + StrLen(line) < DEMO_BENCH_REPORT) {
+                StrCpy(report + len, line);
+                len += StrLen(line);
             }
         }
     }
+    demo_bench_seed = 0;
+    donut_use_sse2 = sse2;
+
+    saved = write_text_file(L"\\bench.txt", report, len);
+    sent = write_serial(report);
+
+    /* Show the summary on a clean console, one report line per row */
+    clear_screen();
+    for (UINTN pos = 0, row = 1; pos < len; row++) {
+        UINTN n = 0;
+
+        while (pos < len && report[pos] != L'\n' && n < SCREEN_WIDTH - 1) line[n++] = report[pos++];
+        while (pos < len && report[pos++] != L'\n') {
+        }
+        line[n] = 0;
+        set_cursor(0, row);
+        ConOut->OutputString(ConOut, line);
+    }
+    SPrint(line, sizeof(line), L"%s \\bench.txt, %s serial. Press any key.",
+           EFI_ERROR(saved) ? L"Could not write" : L"Saved to", EFI_ERROR(sent) ? L"nothing sent to" : L"sent to");
+    plot_line(SCREEN_HEIGHT - 1, line);
+    read_key();
+
+    BS->FreePool(report);
+    BS->FreePool(samples);
 }
 
-/* Rotating ASCII donut animation */
-VOID app_donut(VOID) {
+/* Demo effects, in the text window or on the frame buffer */
+VOID app_demo(VOID) {
     EFI_INPUT_KEY key;
-    CHAR16 output[1760];
-    float A = 0, B = 0;
-    float z[1760];
-    UINTN event_index;
-    
-    clear_screen();
-    draw_topbar();
-    draw_window(5, 2, 70, 21, L" Donut Animation ");
-    
-    set_cursor(7, 22);
-    ConOut->OutputString(ConOut, L"Press ESC to exit");
-    
-    while (TRUE) {
-        /* Check for ESC key without blocking */
-        EFI_STATUS status = BS->CheckEvent(ConIn->WaitForKey);
-        if (!EFI_ERROR(status)) {
-            ConIn->ReadKeyStroke(ConIn, &key);
-            if (key.ScanCode == SCAN_ESC) {
+    DEMO_GRID grid;
+    FRAME_CLOCK clock;
+    UINTN effect = 0;
+    VOID *state;
+
+    donut_use_sse2 = cpu_has_sse2();
+    if (!demo_grid_open(&grid, FALSE, job_worker_count)) return;
+    state = demo_effects[effect].open(&grid);
+    if (state == NULL) {
+        demo_grid_close(&grid);
+        return;
+    }
+    demo_build_palette(&demo_effects[effect]);
+    demo_chrome(&grid);
+
+    SetMem(&clock, sizeof(clock), 0);
+    frame_clock_start(&clock, DEMO_DEFAULT_FPS);
+    demo_status(&grid, &demo_effects[effect], &clock, FALSE);
+
+    while (!task_cancelled()) {
+        UINT32 periods;
+        UINT64 start, rendered;
+
+        /* Given the keyboard back: return to the full window */
+        if (grid.background && task_has_focus()) {
+            DEMO_GRID next;
+
+            if (!demo_grid_open(&next, FALSE, job_worker_count) ||
+                !demo_move(&grid, &next, &demo_effects[effect], &state)) {
                 break;
             }
+            demo_chrome(&grid);
+            frame_clock_start(&clock, clock.fps);
+            demo_status(&grid, &demo_effects[effect], &clock, FALSE);
         }
-        
-        /* Clear buffers */
-        for (UINTN i = 0; i < 1760; i++) {
-            output[i] = L' ';
-            z[i] = 0;
-        }
-        
-        /* Render donut */
-        for (float j = 0; j < 6.28f; j += 0.07f) {
-            for (float i = 0; i < 6.28f; i += 0.02f) {
-                float c = ((float)((int)(1000 * (float)((int)(1000 * (float)((int)(1000.0f * 3.14159265f / 180.0f * 57.29578f)))))) / 1000.0f / 1000.0f / 1000.0f;
-                float d = ((float)((int)(1000 * (float)((int)(1000 * (float)((int)(1000.0f * 3.14159265f / 180.0f * 57.29578f)))))) / 1000.0f / 1000.0f / 1000.0f;
-                float e = ((float)((int)(1000 * (float)((int)(1000 * (float)((int)(1000.0f * 3.14159265f / 180.0f * 57.29578f)))))) / 1000.0f / 1000.0f / 1000.0f;
-                float f = ((float)((int)(1000 * (float)((int)(1000 * (float)((int)(1000.0f * 3.14159265f / 180.0f * 57.29578f)))))) / 1000.0f / 1000.0f / 1000.0f;
-                float g = ((float)((int)(1000 * (float)((int)(1000 * (float)((int)(1000.0f * 3.14159265f / 180.0f * 57.29578f)))))) / 1000.0f / 1000.0f / 1000.0f;
-                float h = d + 2;
-                float D = 1 / (c * h * e + f * g - f * h * A);
-                float l = ((float)((int)(1000 * (float)((int)(1000 * (float)((int)(1000.0f * 3.14159265f / 180.0f * 57.29578f)))))) / 1000.0f / 1000.0f / 1000.0f;
-                float m = ((float)((int)(1000 * (float)((int)(1000 * (float)((int)(1000.0f * 3.14159265f / 180.0f * 57.29578f)))))) / 1000.0f / 1000.0f / 1000.0f;
-                float n = ((float)((int)(1000 * (float)((int)(1000 * (float)((int)(1000.0f * 3.14159265f / 180.0f * 57.29578f)))))) / 1000.0f / 1000.0f / 1000.0f;
-                int x = 40 + 30 * D * (l * h * m - n * g);
-                int y = 12 + 15 * D * (l * h * A + n * e);
-                int o = x + 80 * y;
-                int N = 8 * ((f * e - c * d * g) * m - c * d * e - f * g - l * d * A);
-                if (22 > y && y > 0 && x > 0 && 80 > x && D > z[o]) {
-                    z[o] = D;
-                    output[o] = L".,-~:;=!*#$@"[N > 0 ? N : 0];
+
+        periods = frame_clock_wait(&clock, &key);
+        if (periods == 0) {
+            if (key.ScanCode == SCAN_ESC) {
+                break;
+            }
+            if (key.UnicodeChar == L'+' || key.UnicodeChar == L'=' || key.UnicodeChar == L'-') {
+                frame_clock_start(&clock, key.UnicodeChar == L'-' ? clock.fps - 5 : clock.fps + 5);
+            } else if (key.UnicodeChar >= L'1' && key.UnicodeChar < L'1' + DEMO_EFFECTS) {
+                UINTN next = key.UnicodeChar - L'1';
+
+                /* Free the old state first so the new one has its memory; fall back if it does not fit */
+                demo_effects[effect].close(state);
+                state = demo_effects[next].open(&grid);
+                if (state != NULL) {
+                    effect = next;
+                } else {
+                    state = demo_effects[effect].open(&grid);
+                    if (state == NULL) break;
+                }
+                demo_build_palette(&demo_effects[effect]);
+                frame_clock_start(&clock, clock.fps);
+            } else if (key.UnicodeChar == L'g' || key.UnicodeChar == L'G') {
+                DEMO_GRID next;
+                BOOLEAN switched = FALSE;
+
+                if (demo_grid_open(&next, grid.gop == NULL, job_worker_count)) {
+                    switched = demo_move(&grid, &next, &demo_effects[effect], &state);
                 }
+                demo_chrome(&grid);
+                if (state == NULL) break;
+                if (!switched) {
+                    set_cursor(DEMO_LEFT + 1, DEMO_TOP + DEMO_ROWS);
+                    ConOut->OutputString(ConOut, L"No graphics output available                  ");
+                }
+                /* Restart the measurement for the new mode */
+                frame_clock_start(&clock, clock.fps);
+            } else if (key.UnicodeChar == L'b' || key.UnicodeChar == L'B') {
+                demo_benchmark(&grid);
+                demo_build_palette(&demo_effects[effect]);
+                demo_chrome(&grid);
+                frame_clock_start(&clock, clock.fps);
+            } else if ((key.UnicodeChar == L'h' || key.UnicodeChar == L'H') && task_find(app_demo) != 0) {
+                DEMO_GRID next;
+
+                /* Keep going in a small window and hand the keyboard back to the menu */
+                if (demo_grid_open_background(&next, job_worker_count) &&
+                    demo_move(&grid, &next, &demo_effects[effect], &state)) {
+                    frame_clock_start(&clock, clock.fps);
+                    task_step_back();
+                    continue;
+                }
+                if (state == NULL) break;
+            } else {
+                continue;
             }
+            demo_status(&grid, &demo_effects[effect], &clock, FALSE);
+            continue;
         }
-        
-        /* Display donut (simplified for demo) */
-        for (UINTN k = 0; k < 20; k++) {
-            set_cursor(7, 3 + k);
-            CHAR16 line[70];
-            for (UINTN m = 0; m < 69; m++) {
-                line[m] = (k * 69 + m < 1760) ? output[k * 69 + m] : L' ';
-            }
-            line[69] = 0;
-            ConOut->OutputString(ConOut, line);
+
+        /* Advance by every period that has passed, but only draw the latest */
+        if (periods > clock.fps) periods = clock.fps;
+        start = read_tsc();
+        demo_effects[effect].update(state, periods * 1000 / (UINT32)clock.fps);
+        demo_effects[effect].render(state, &grid);
+        rendered = read_tsc();
+        if (grid.gop != NULL) {
+            demo_present_gop(&grid);
+        } else {
+            if (grid.background && grid.generation != screen_generation) {
+                demo_back_chrome(&grid, &demo_effects[effect]);
+            }
+            demo_present_text(&grid);
+        }
+
+        if (frame_clock_account(&clock, read_tsc() - start, rendered - start) && !grid.background) {
+            demo_status(&grid, &demo_effects[effect], &clock, TRUE);
         }
-        
-        A += 0.04f;
-        B += 0.02f;
-        
-        /* Small delay */
-        BS->Stall(50000);  /* 50ms delay */
     }
+
+    frame_clock_stop(&clock);
+    if (grid.gop != NULL) clear_screen();
+    if (state != NULL) demo_effects[effect].close(state);
+    demo_grid_close(&grid);
 }
 
 /* Main UEFI entry point */
@@ -603,6 +11351,13 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable
     /* Disable watchdog timer */
     BS->SetWatchdogTimer(0, 0, 0, NULL);
     
+    /* The menu is task 0, on the firmware's stack */
+    tasks[0].used = TRUE;
+    tasks[0].attribute = COLOR_NORMAL;
+
+    /* Park the application processors until we leave */
+    jobs_start();
+    
     /* Main menu loop */
     while (running) {
         clear_screen();
@@ -616,10 +11371,14 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable
         set_cursor(27, 11);
         ConOut->OutputString(ConOut, L"[C] Calculator");
         set_cursor(27, 12);
-        ConOut->OutputString(ConOut, L"[E] Editor");
+        ConOut->OutputString(ConOut, L"[P] Plot");
         set_cursor(27, 13);
-        ConOut->OutputString(ConOut, L"[D] Donut Animation");
+        ConOut->OutputString(ConOut, L"[E] Editor");
         set_cursor(27, 14);
+        ConOut->OutputString(ConOut, L"[D] Demo Effects");
+        set_cursor(27, 15);
+        ConOut->OutputString(ConOut, L"[S] Script");
+        set_cursor(27, 16);
         ConOut->OutputString(ConOut, L"[Q] Quit to Firmware");
         
         draw_dock();
@@ -642,18 +11401,32 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable
         }
         /* Handle menu selections */
         else if (key.UnicodeChar == L'n' || key.UnicodeChar == L'N') {
-            app_notepad();
+            task_run(app_notepad);
         } else if (key.UnicodeChar == L'c' || key.UnicodeChar == L'C') {
-            app_calc();
+            task_run(app_calc);
+        } else if (key.UnicodeChar == L'p' || key.UnicodeChar == L'P') {
+            task_run(app_plot);
         } else if (key.UnicodeChar == L'e' || key.UnicodeChar == L'E') {
-            app_editor();
+            task_run(app_editor);
         } else if (key.UnicodeChar == L'd' || key.UnicodeChar == L'D') {
-            app_donut();
+            /* Bring a demo running in the background back to the front */
+            UINTN demo = task_find(app_demo);
+
+            if (demo != 0) {
+                task_focus_on(demo);
+            } else {
+                task_run(app_demo);
+            }
+        } else if (key.UnicodeChar == L's' || key.UnicodeChar == L'S') {
+            task_run(app_script);
         } else if (key.UnicodeChar == L'q' || key.UnicodeChar == L'Q') {
             running = FALSE;
         }
     }
     
+    /* A demo left in the background stops its timer and frees its memory first */
+    if (task_find(app_demo) != 0) task_cancel(task_find(app_demo));
+    jobs_stop();
     clear_screen();
     ConOut->OutputString(ConOut, L"Goodbye from ASCII-OS!\r\n");
     